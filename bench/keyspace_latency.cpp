@@ -0,0 +1,100 @@
+/*
+worst SET latency while the keyspace grows, with the cleanup thread
+expiring keys in the background like in the server.
+
+the keys are inserted one by one and the latency of every SET is recorded
+per window (a window ends each time the key count doubles, right where a
+resize starts). a stop-the-world resize or expiry pass shows up as a max
+that grows with the window; with incremental rehashing and sliced expiry
+it should stay flat. std::unordered_map is run over the same keys for
+comparison.
+
+    ./bench_keyspace_latency [keys] [percent with a 1s TTL]
+*/
+#include "kvstore.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using clock_type = std::chrono::steady_clock;
+
+
+struct Window {
+    size_t keys;
+    uint64_t max_ns{0};
+    std::vector<uint32_t> samples;   // every 16th latency, for the percentile
+};
+
+
+template <typename F>
+static std::vector<Window> run(size_t keys, F &&insert) {
+    std::vector<Window> windows;
+    size_t limit = 1 << 16;
+    windows.push_back({limit, 0, {}});
+
+    for (size_t i = 0; i < keys; i++) {
+        if (i == limit) {
+            limit *= 2;
+            windows.push_back({std::min(limit, keys), 0, {}});
+        }
+
+        auto start = clock_type::now();
+        insert(i);
+        uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(clock_type::now() - start).count();
+
+        Window &w = windows.back();
+        w.max_ns = std::max(w.max_ns, ns);
+        if (i % 16 == 0) w.samples.push_back(static_cast<uint32_t>(std::min<uint64_t>(ns, UINT32_MAX)));
+    }
+    return windows;
+}
+
+
+static double p999_us(std::vector<uint32_t> &samples) {
+    if (samples.empty()) return 0;
+    size_t k = samples.size() * 999 / 1000;
+    std::nth_element(samples.begin(), samples.begin() + k, samples.end());
+    return samples[k] / 1000.0;
+}
+
+
+int main(int argc, char *argv[]) {
+    size_t keys = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 4000000;
+    size_t ttl_percent = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 20;
+
+    auto key_of = [](size_t i) { return "key:" + std::to_string(i); };
+    std::string value(32, 'v');
+
+    std::vector<Window> map_windows;
+    {
+        std::unordered_map<std::string, std::string> map;
+        map_windows = run(keys, [&](size_t i) { map[key_of(i)] = value; });
+    }
+
+    std::vector<Window> store_windows;
+    {
+        KVStore store;
+        store.start_cleanup_thread();
+
+        store_windows = run(keys, [&](size_t i) {
+            std::optional<int> ttl;
+            if (i % 100 < ttl_percent) ttl = 1;
+            store.set(key_of(i), value, ttl);
+        });
+        store.stop_cleanup_thread();
+    }
+
+    std::printf("%10s %14s %14s %18s %18s\n",
+        "keys up to", "KVStore max", "p99.9", "unordered_map max", "p99.9");
+    for (size_t i = 0; i < store_windows.size(); i++) {
+        std::printf("%10zu %11.0f us %11.1f us %15.0f us %15.1f us\n",
+            store_windows[i].keys,
+            store_windows[i].max_ns / 1000.0, p999_us(store_windows[i].samples),
+            map_windows[i].max_ns / 1000.0, p999_us(map_windows[i].samples));
+    }
+    return 0;
+}
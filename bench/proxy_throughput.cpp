@@ -0,0 +1,115 @@
+/*
+throughput and latency of the same workload sent straight to a server and
+through kvstore-proxy, to see what the extra hop costs.
+
+every client thread owns one connection and keeps `pipeline` requests in
+flight (half SET, half GET over `keys` keys), waiting for the whole batch
+before sending the next one. the round trip of each batch is recorded.
+
+    ./bench_proxy_throughput <direct host:port> <proxy host:port>
+                             [clients] [seconds] [pipeline] [keys]
+
+start the server and a proxy in front of it first, e.g.
+    ./kvstore --port 8000 &
+    ./kvstore-proxy --port 9000 --backend 127.0.0.1:8000 &
+    ./bench/bench_proxy_throughput 127.0.0.1:8000 127.0.0.1:9000
+*/
+#include "client.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <future>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+using clock_type = std::chrono::steady_clock;
+
+
+struct Result {
+    double ops_per_sec;
+    double p50_us;
+    double p99_us;
+    double max_us;
+    size_t errors;
+};
+
+
+static Result run(const NodeAddress &address, size_t clients, double seconds, size_t pipeline, size_t keys) {
+    std::atomic<bool> stop{false};
+    std::atomic<uint64_t> ops{0};
+    std::atomic<size_t> errors{0};
+    std::vector<std::vector<uint32_t>> latencies(clients);
+    std::vector<std::thread> threads;
+
+    for (size_t c = 0; c < clients; c++) {
+        threads.emplace_back([&, c] {
+            Connection conn(address);
+            std::mt19937_64 rng(c);
+            auto &mine = latencies[c];
+
+            while (!stop.load(std::memory_order_relaxed)) {
+                std::vector<Connection::Request> batch;
+                std::promise<void> done;
+                std::atomic<size_t> left{pipeline};
+
+                for (size_t i = 0; i < pipeline; i++) {
+                    std::string key = "bench:" + std::to_string(rng() % keys);
+                    std::string line = i % 2 ? "GET " + key + "\n" : "SET " + key + " value-" + std::to_string(i) + "\n";
+
+                    batch.push_back({line, false, [&](std::string reply, bool failed) {
+                        if (failed || reply.rfind("ERROR", 0) == 0) errors++;
+                        if (--left == 0) done.set_value();
+                    }});
+                }
+
+                auto start = clock_type::now();
+                conn.send(std::move(batch));
+                done.get_future().wait();
+
+                mine.push_back(static_cast<uint32_t>(
+                    std::chrono::duration_cast<std::chrono::microseconds>(clock_type::now() - start).count()));
+                ops += pipeline;
+            }
+        });
+    }
+
+    std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+    stop = true;
+    for (auto &t : threads) t.join();
+
+    std::vector<uint32_t> all;
+    for (auto &l : latencies) all.insert(all.end(), l.begin(), l.end());
+    std::sort(all.begin(), all.end());
+
+    auto at = [&](double q) { return all.empty() ? 0.0 : double(all[std::min(all.size() - 1, size_t(all.size() * q))]); };
+    return {ops / seconds, at(0.5), at(0.99), all.empty() ? 0.0 : double(all.back()), errors.load()};
+}
+
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        std::fprintf(stderr, "usage: %s <direct host:port> <proxy host:port> [clients] [seconds] [pipeline] [keys]\n", argv[0]);
+        return 1;
+    }
+
+    NodeAddress direct = parse_address(argv[1]);
+    NodeAddress proxy = parse_address(argv[2]);
+    size_t clients = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 8;
+    double seconds = argc > 4 ? std::atof(argv[4]) : 5.0;
+    size_t pipeline = argc > 5 ? std::strtoul(argv[5], nullptr, 10) : 1;
+    size_t keys = argc > 6 ? std::strtoul(argv[6], nullptr, 10) : 100000;
+
+    std::printf("%zu clients, %zu requests in flight each, %.0fs per run\n", clients, pipeline, seconds);
+    std::printf("%-8s %12s %12s %12s %12s %8s\n", "", "ops/s", "p50 batch", "p99 batch", "max batch", "errors");
+
+    for (auto [name, address] : {std::make_pair("direct", direct), std::make_pair("proxy", proxy)}) {
+        Result r = run(address, clients, seconds, pipeline, keys);
+        std::printf("%-8s %12.0f %9.0f us %9.0f us %9.0f us %8zu\n",
+            name, r.ops_per_sec, r.p50_us, r.p99_us, r.max_us, r.errors);
+    }
+    return 0;
+}
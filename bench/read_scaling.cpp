@@ -0,0 +1,89 @@
+/*
+GET throughput against the number of reader threads, through the locked
+path (shared_mutex) and through the lock free read cache.
+
+every thread reads random keys out of `keys` preloaded ones for `seconds`
+per run. the shared lock writes its cache line on every GET, the read
+cache only writes the reader's own epoch slot, so only the latter should
+keep scaling with the cores.
+
+    ./bench_read_scaling [max threads] [seconds] [keys]
+*/
+#include "kvstore.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+static double run(KVStore &store, size_t threads, double seconds, size_t keys) {
+    std::atomic<bool> stop{false};
+    std::atomic<uint64_t> total{0};
+    std::vector<std::thread> workers;
+
+    for (size_t t = 0; t < threads; t++) {
+        workers.emplace_back([&, t] {
+            std::mt19937_64 rng(t);
+            std::vector<std::string> names;
+            for (size_t i = 0; i < 1024; i++) names.push_back("key:" + std::to_string(rng() % keys));
+
+            uint64_t ops = 0;
+            size_t bytes = 0;
+            while (!stop.load(std::memory_order_relaxed)) {
+                for (size_t i = 0; i < 64; i++) {
+                    store.view(names[(ops + i) & 1023], [&](std::string_view v) { bytes += v.size(); });
+                }
+                ops += 64;
+            }
+            total += ops + (bytes == 0);
+        });
+    }
+
+    std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+    stop = true;
+    for (auto &w : workers) w.join();
+
+    return total / seconds;
+}
+
+
+int main(int argc, char *argv[]) {
+    size_t max_threads = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : std::thread::hardware_concurrency();
+    double seconds = argc > 2 ? std::atof(argv[2]) : 1.0;
+    size_t keys = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 100000;
+    if (max_threads == 0) max_threads = 1;
+
+    KVStore locked, cached;
+    cached.enable_read_cache(256 << 20);
+
+    for (size_t i = 0; i < keys; i++) {
+        std::string key = "key:" + std::to_string(i);
+        std::string value(64, 'a' + i % 26);
+        locked.set(key, value);
+        cached.set(key, value);
+        cached.get(key);   // the locked path puts it in the cache
+    }
+
+    std::printf("%8s %16s %16s\n", "threads", "locked GET/s", "read cache GET/s");
+
+    // powers of two, then the full core count even if it is not one
+    std::vector<size_t> steps;
+    for (size_t threads = 1; threads < max_threads; threads *= 2) steps.push_back(threads);
+    steps.push_back(max_threads);
+
+    double base_locked = 0, base_cached = 0;
+    for (size_t threads : steps) {
+        double l = run(locked, threads, seconds, keys);
+        double c = run(cached, threads, seconds, keys);
+        if (threads == 1) {
+            base_locked = l;
+            base_cached = c;
+        }
+        std::printf("%8zu %10.0f (%4.1fx) %10.0f (%4.1fx)\n", threads, l, l / base_locked, c, c / base_cached);
+    }
+    return 0;
+}
@@ -0,0 +1,274 @@
+/*
+heap allocations, copies of the value and time per SET, the way the server
+handles one line: parse it, store the value, queue the log line.
+
+- "original" replays the SET path before it was slimmed down: a fresh
+  token vector per line, the value copied out of it, the log line encoded
+  for the AOF and again for the followers, the store copying the value.
+- "tokens" is the path that reused its token strings and a thread_local
+  log line, but still copied the value into both and the line into the
+  log queue.
+- "views" is what server.cpp does now for a SET without quotes: the value
+  stays a view of the receive buffer, the store makes its one copy and the
+  log line is encoded straight into the log queue.
+
+copies are counted, not estimated: every heap block is tracked, and a copy
+is a block that holds the value after the SET (or held it when it was
+freed during the SET). the receive buffer itself doesn't count.
+
+    ./bench_set_allocations [ops]
+*/
+#include "kvstore.hpp"
+#include "protocol.hpp"
+#include "log_queue.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+static std::atomic<size_t> allocations{0};
+
+
+/*
+every live heap block, in a fixed open addressing table (tracking must not
+allocate itself). switched on once the timings are done.
+*/
+namespace tracking {
+constexpr size_t kSlots = size_t(1) << 20;
+struct Block {
+    void *ptr;
+    size_t size;
+};
+Block *blocks = nullptr;
+bool enabled = false;
+
+// what a copy looks like and how many freed blocks held it
+std::string_view needle;
+size_t freed_copies = 0;
+
+Block *slot(void *p, bool insert) {
+    size_t i = (reinterpret_cast<uintptr_t>(p) >> 4) & (kSlots - 1);
+    for (;; i = (i + 1) & (kSlots - 1)) {
+        if (blocks[i].ptr == p) return &blocks[i];
+        if (!blocks[i].ptr) return insert ? &blocks[i] : nullptr;
+    }
+}
+
+bool holds(const Block &b) {
+    return !needle.empty() && b.size >= needle.size() &&
+        memmem(b.ptr, b.size, needle.data(), needle.size()) != nullptr;
+}
+
+void added(void *p, size_t size) {
+    if (enabled) *slot(p, true) = {p, size};
+}
+
+void removed(void *p) {
+    if (!enabled || !p) return;
+    Block *b = slot(p, false);
+    if (!b) return;
+    if (holds(*b)) freed_copies++;
+
+    // backward shift delete, so probing never stops at a hole
+    size_t i = b - blocks;
+    b->ptr = nullptr;
+    for (size_t j = (i + 1) & (kSlots - 1); blocks[j].ptr; j = (j + 1) & (kSlots - 1)) {
+        size_t home = (reinterpret_cast<uintptr_t>(blocks[j].ptr) >> 4) & (kSlots - 1);
+        if (((j - home) & (kSlots - 1)) >= ((j - i) & (kSlots - 1))) {
+            blocks[i] = blocks[j];
+            blocks[j].ptr = nullptr;
+            i = j;
+        }
+    }
+}
+}
+
+
+void* operator new(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    void *p = std::malloc(size ? size : 1);
+    if (!p) throw std::bad_alloc();
+    tracking::added(p, size);
+    return p;
+}
+
+void operator delete(void* p) noexcept {
+    tracking::removed(p);
+    std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    tracking::removed(p);
+    std::free(p);
+}
+
+
+// the three SET paths, each with its own store and log queue
+struct Original {
+    KVStore store;
+    LogQueue log{[](const std::string &) {}};
+
+    void operator()(std::string_view received) {
+        std::vector<std::string> tokens = tokenize(received);
+        std::string value = tokens[2];
+
+        std::string aof = encode_command({"SET", tokens[1], value});
+        std::string replica = encode_command({"SET", tokens[1], value});
+        store.set(tokens[1], value);
+        log.flush(log.append(aof));
+    }
+};
+
+struct Tokens {
+    KVStore store;
+    LogQueue log{[](const std::string &) {}};
+    std::vector<std::string> tokens;
+    std::string line;
+
+    void operator()(std::string_view received) {
+        tokenize(received, tokens);
+        std::string_view value = tokens[2];
+
+        line.clear();
+        append_command(line, {"SET", tokens[1], value});
+        store.set_uncompressed(tokens[1], value);
+        log.flush(log.append(line));
+    }
+};
+
+struct Views {
+    KVStore store;
+    LogQueue log{[](const std::string &) {}};
+    std::vector<std::string_view> words;
+    std::string key;
+
+    void operator()(std::string_view received) {
+        split_words(received, words);
+        key.assign(words[1]);
+
+        store.set_uncompressed(key, words[2]);
+        log.flush(log.append_command({"SET", key, words[2]}));
+    }
+};
+
+
+struct Result {
+    double allocations{0};
+    double ns{0};
+    size_t copies{0};
+};
+
+
+template <typename Path>
+static void measure_time(const std::string &line, size_t ops, Result &result) {
+    Path path;
+    // one round first, so buffers that are kept around have grown to size
+    path(line);
+
+    size_t before = allocations.load();
+    auto start = std::chrono::steady_clock::now();
+
+    for (size_t i = 0; i < ops; i++) path(line);
+
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    result.allocations = double(allocations.load() - before) / ops;
+    result.ns = double(ns) / ops;
+}
+
+
+// a new seed for every measurement: memory malloc hands out again still
+// holds the value the path measured before was given
+static unsigned shuffle_seed = 12345;
+
+
+/*
+copies of the value made by one SET, for a receive buffer that holds a
+value never seen before (so earlier rounds can't be counted). needs the
+tracking switched on before the path is created.
+*/
+template <typename Path>
+static void measure_copies(const std::string &line, Result &result) {
+    Path path;
+    // a few rounds, until the buffers that are kept around stop growing
+    for (int i = 0; i < 4; i++) path(line);
+
+    std::string buffer = line;
+    // a fresh value of the same size: the payload's bytes, shuffled
+    std::mt19937 rng(shuffle_seed++);
+    size_t value_at = line.find(' ', line.find(' ') + 1) + 1;
+    for (size_t i = buffer.size() - 1; i > value_at; i--) {
+        std::swap(buffer[i], buffer[value_at + rng() % (i - value_at + 1)]);
+    }
+
+    std::string_view value = std::string_view(buffer).substr(value_at);
+    tracking::needle = value.substr(0, std::min<size_t>(value.size(), 64));
+    tracking::freed_copies = 0;
+
+    path(std::string_view(buffer));
+
+    size_t copies = tracking::freed_copies;
+    for (size_t i = 0; i < tracking::kSlots; i++) {
+        const auto &b = tracking::blocks[i];
+        if (b.ptr && b.ptr != buffer.data() && tracking::holds(b)) copies++;
+    }
+    tracking::needle = {};
+    result.copies = copies;
+}
+
+
+struct Shape {
+    const char *name;
+    std::string line;
+    size_t ops;
+    Result original, tokens, views;
+};
+
+
+int main(int argc, char *argv[]) {
+    size_t ops = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 200000;
+
+    // random bytes as hex, so a value is nowhere else in memory by chance
+    std::mt19937_64 rng(42);
+    std::string value;
+    while (value.size() < 4096) {
+        char hex[17];
+        std::snprintf(hex, sizeof(hex), "%016llx", static_cast<unsigned long long>(rng()));
+        value += hex;
+    }
+
+    // overwriting the same key, like a hot SET workload does
+    std::vector<Shape> shapes;
+    shapes.push_back({"SET 16 byte value", "SET user:1000 " + value.substr(0, 16), ops, {}, {}, {}});
+    shapes.push_back({"SET 4KB value", "SET user:1000 " + value, ops / 10, {}, {}, {}});
+
+    // timed without the tracking, it would slow down the paths that allocate most
+    for (auto &shape : shapes) {
+        measure_time<Original>(shape.line, shape.ops, shape.original);
+        measure_time<Tokens>(shape.line, shape.ops, shape.tokens);
+        measure_time<Views>(shape.line, shape.ops, shape.views);
+    }
+
+    // from here on every block is tracked until the end
+    tracking::blocks = static_cast<tracking::Block *>(std::calloc(tracking::kSlots, sizeof(tracking::Block)));
+    tracking::enabled = true;
+
+    for (auto &shape : shapes) {
+        measure_copies<Original>(shape.line, shape.original);
+        measure_copies<Tokens>(shape.line, shape.tokens);
+        measure_copies<Views>(shape.line, shape.views);
+    }
+
+    for (const auto &shape : shapes) {
+        for (auto [path, r] : {std::pair{"original", shape.original}, {"tokens", shape.tokens}, {"views", shape.views}}) {
+            std::printf("%-20s %-9s %6.2f allocs %2zu copies %8.0f ns\n",
+                shape.name, path, r.allocations, r.copies, r.ns);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,177 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <future>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <optional>
+#include <stdexcept>
+
+/*
+kvstore-client: C++ client library for the text protocol.
+
+- Connection: one socket with any number of requests in flight. concurrent
+  callers are pipelined automatically: whoever finds the socket idle writes
+  everything that queued up meanwhile with a single send(), and the reader
+  thread hands replies back in order.
+- ConnectionPool: a few connections per node.
+- KVClient: a leader pool plus an optional follower pool. writes always go
+  to the leader, reads go to the followers when enabled and fall back to the
+  leader if the follower can't be reached. each calling thread sticks to one
+  connection per pool, so the commands of a thread are applied in the order
+  it issued them even when it doesn't wait for the replies in between.
+*/
+
+struct NodeAddress {
+    std::string host;
+    int port;
+
+    std::string to_string() const { return host + ":" + std::to_string(port); }
+};
+
+// parses "host:port", throws std::invalid_argument
+NodeAddress parse_address(const std::string &text);
+
+
+// one parsed server reply
+struct Reply {
+    bool array{false};
+    std::string value;                  // single line replies, without the '\n'
+    std::vector<std::string> elements;  // array replies
+
+    bool is_null() const { return !array && value == "NULL"; }
+    bool is_error() const;
+};
+
+// thrown through the futures of the typed KVClient calls
+class KVClientError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+
+class Connection {
+public:
+    /*
+    gets the raw reply (including the trailing '\n'). if the connection could
+    not be opened or broke before the reply came, `failed` is set and the
+    reply is an "ERROR: ..." line. runs on the reader thread, keep it short.
+    */
+    using Callback = std::function<void(std::string reply, bool failed)>;
+
+    struct Request {
+        std::string line;   // one full command line, '\n' terminated
+        bool array_reply;
+        Callback callback;
+    };
+
+    explicit Connection(NodeAddress address);
+    ~Connection();
+
+    Connection(const Connection &) = delete;
+    Connection &operator=(const Connection &) = delete;
+
+    // queues the requests back to back, they are written in one go if the socket is idle
+    void send(std::vector<Request> requests);
+    void send(std::string line, bool array_reply, Callback callback);
+
+    const NodeAddress &address() const { return address_; }
+
+private:
+    struct Pending {
+        bool array_reply;
+        Callback callback;
+    };
+
+    NodeAddress address_;
+
+    std::mutex mutex_;
+    std::condition_variable connected_cv_;
+    int fd_{-1};
+    // set by the reader when the socket failed, the next send reconnects
+    bool broken_{false};
+    // a sender is flushing `outbox_`, others just append to it
+    bool writing_{false};
+    bool stopping_{false};
+    std::string outbox_;
+    std::deque<Pending> pending_;
+
+    std::thread reader_;
+
+    void flush();
+    void reader_loop();
+    // marks the socket broken and returns everything in flight, caller holds mutex_
+    std::deque<Pending> disconnect();
+};
+
+
+class ConnectionPool {
+public:
+    ConnectionPool(const std::vector<NodeAddress> &nodes, size_t per_node);
+
+    bool empty() const { return connections_.empty(); }
+
+    // always the same connection for the same `affinity`
+    Connection &get(size_t affinity);
+
+private:
+    std::vector<std::unique_ptr<Connection>> connections_;
+};
+
+
+class KVClient {
+public:
+    struct Options {
+        NodeAddress leader;
+        std::vector<NodeAddress> followers;
+        size_t connections{2};          // per node
+        bool read_from_followers{false};
+    };
+
+    explicit KVClient(const Options &options);
+
+    const NodeAddress &leader() const { return leader_address_; }
+
+    /*
+    the connection a command goes to: a follower for reads if enabled, else
+    the leader. requests on different connections can overtake each other, so
+    callers that need their commands applied in order pass the same `affinity`.
+    */
+    Connection &connection_for(const std::string &cmd, size_t affinity);
+
+    // any command; the callback runs on a connection's reader thread
+    void command(const std::vector<std::string> &args, std::function<void(Reply)> callback);
+    std::future<Reply> command(const std::vector<std::string> &args);
+
+    // typed helpers, error replies are thrown from the future as KVClientError
+    std::future<std::optional<std::string>> get(const std::string &key);
+    std::future<void> set(
+        const std::string &key,
+        const std::string &value,
+        std::optional<int> ttl_seconds = std::nullopt
+    );
+    std::future<bool> del(const std::string &key);
+    std::future<std::vector<std::optional<std::string>>> mget(const std::vector<std::string> &keys);
+
+    /*
+    sends all the commands in one write over one connection and waits for
+    every reply. reads are sent to the leader when mixed with writes, so the
+    batch sees its own writes.
+    */
+    std::vector<Reply> batch(const std::vector<std::vector<std::string>> &commands);
+
+    // SET for every pair as one batch
+    void set_many(const std::vector<std::pair<std::string, std::string>> &items);
+
+private:
+    NodeAddress leader_address_;
+    ConnectionPool leader_;
+    ConnectionPool followers_;
+    bool read_from_followers_;
+};
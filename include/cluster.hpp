@@ -0,0 +1,134 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <array>
+#include <unordered_map>
+#include <unordered_set>
+#include <shared_mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+class KVStore;
+class PersistenceManager;
+class ReplicationManager;
+
+constexpr int kClusterSlots = 16384;
+
+// the cluster bus of a node listens on its client port + this offset
+constexpr int kClusterBusOffset = 10000;
+
+// batches in a row in which every key changed before MIGRATE gives up
+constexpr size_t kMigrateRetries = 10;
+
+/*
+CRC16 of the key modulo 16384, same mapping as redis cluster.
+if the key contains a non empty {tag} only the tag is hashed, so related
+keys like {user:1}:name and {user:1}:email end up in the same slot.
+*/
+uint16_t key_hash_slot(const std::string &key);
+
+
+/*
+ClusterManager: keeps track of which node serves which hash slot.
+
+- nodes talk over a small text "bus" (client port + 10000): every second each
+  node sends a PING with its id, address, config epoch and the slots it claims,
+  plus the nodes it knows about, and gets the same back in a PONG.
+- a slot claim wins if it comes with a higher config epoch than the current
+  owner's, so after a migration the new owner (which bumped its epoch) takes over
+  everywhere as gossip spreads.
+- commands for slots we don't serve are answered with MOVED / ASK redirections.
+- CLUSTER MIGRATE moves a slot to another node, streaming keys in batches.
+*/
+class ClusterManager {
+public:
+    struct Node {
+        std::string id;
+        std::string host;
+        int port;
+        int bus_port;
+        uint64_t config_epoch;
+        std::chrono::steady_clock::time_point last_pong;
+    };
+
+    // where a command for a key has to go
+    struct Route {
+        enum class Kind { Local, Moved, Ask, Down };
+        Kind kind;
+        uint16_t slot;
+        std::string address;  // host:port for MOVED / ASK
+    };
+
+    ClusterManager(
+        KVStore &store,
+        PersistenceManager &file,
+        ReplicationManager &replica,
+        std::atomic<bool> &running,
+        const std::string &host,
+        int port,
+        const std::string &config_file = "nodes.conf"
+    );
+
+    // start the bus listener and the gossip thread
+    void start();
+    void stop();
+
+    // `asking` is set when the client sent ASKING right before this command
+    Route route(const std::string &key, bool asking) const;
+
+    /*
+    held (shared) by a write from route() until it has been applied, so a
+    key can't be deleted here by migrate() in between and the write land
+    on a key that already moved.
+    */
+    std::shared_lock<std::shared_mutex> route_gate() const {
+        return std::shared_lock<std::shared_mutex>(route_gate_);
+    }
+
+    // handles CLUSTER <subcommand> ... and returns the reply
+    std::string command(const std::vector<std::string> &tokens);
+
+private:
+    KVStore &store_;
+    PersistenceManager &file_;
+    ReplicationManager &replica_;
+    std::atomic<bool> &running_;
+    std::string config_file_;
+
+    mutable std::shared_mutex mutex_;
+    mutable std::shared_mutex route_gate_;
+    Node myself_;
+    std::unordered_map<std::string, Node> nodes_;      // other nodes, by id
+    std::array<std::string, kClusterSlots> slots_;     // slot -> owner id ("" = unassigned)
+    std::unordered_map<uint16_t, std::string> migrating_;  // slot -> target id
+    std::unordered_map<uint16_t, std::string> importing_;  // slot -> source id
+    std::unordered_set<std::string> in_flight_;             // keys migrate() is copying right now
+
+    int bus_fd_{-1};
+    std::thread bus_thread_;
+    std::thread gossip_thread_;
+
+    void bus_loop();
+    void gossip_loop();
+
+    // one PING/PONG exchange with the node listening on host:bus_port
+    bool ping(const std::string &host, int bus_port);
+    std::string build_message(const char *type) const;
+    void handle_message(const std::vector<std::string> &lines);
+
+    const Node *find_node(const std::string &id) const;
+    std::string address_of(const std::string &id) const;
+    uint64_t max_epoch() const;
+    void bump_epoch();
+
+    std::string cluster_nodes() const;
+    std::string cluster_slots() const;
+    std::string setslot(const std::vector<std::string> &tokens);
+    std::string migrate(uint16_t slot, const std::string &target_id, size_t batch);
+
+    void save_config() const;
+    void load_config();
+};
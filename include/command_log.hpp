@@ -0,0 +1,74 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include "kvstore.hpp"
+
+/*
+the AOF and the replication stream are a sequence of protocol command lines.
+these helpers turn store contents into such lines and apply them back.
+*/
+
+// appends the command lines that recreate a snapshot item to `out`
+void encode_snapshot_item(const KVStore::SnapshotItem &item, std::string &out);
+
+/*
+the lines that bring a key to its current state (a SET, or a DELETE if it
+is gone). read-modify-write commands (INCRBY, APPEND, ...) are logged this
+way, as their result, so replaying them can't diverge. call it under the
+same batch() as the write, so the lines reach the log in write order.
+*/
+std::string encode_key_state(const KVStore &store, const std::string &key);
+
+/*
+compressed values are logged as `SETZ key raw_size dictionary_id base64`
+(plus EX ttl), so the AOF, snapshots and followers get the compressed bytes
+as they are and nobody has to compress them again.
+*/
+std::vector<std::string> compressed_set_args(
+    const std::string &key,
+    const CompressedValue &value,
+    std::optional<int> ttl_seconds
+);
+
+// the value and ttl of a SETZ line, false if it is malformed
+bool parse_compressed_set(
+    const std::vector<std::string> &tokens,
+    CompressedValue &value,
+    std::optional<int> &ttl_seconds
+);
+
+/*
+thrown for a logged record the store can't take, where skipping it would
+lose the key without a word: a SETZ whose dictionary this store does not
+have, or whose bytes don't decompress. the replay has to stop there.
+*/
+class ReplayError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+/*
+applies a write command read back from the AOF or the replication stream.
+false if it was malformed and skipped, throws ReplayError (see above).
+*/
+bool apply_logged_command(KVStore &store, const std::vector<std::string> &tokens);
+
+/*
+feeds logged command lines (AOF replay, replication stream) into the store.
+a transaction is logged as MULTI, its commands, then EXEC; those lines are
+buffered and applied together under one store lock. a block that never
+reaches EXEC (e.g. a crash mid-write) is dropped.
+*/
+class LogApplier {
+public:
+    explicit LogApplier(KVStore &store) : store_(store) {}
+
+    void feed(const std::string &line);
+
+private:
+    KVStore &store_;
+    bool in_multi_{false};
+    std::vector<std::vector<std::string>> queued_;
+};
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+
+/*
+small LZ77 block codec for large string values, using the LZ4 block format
+(token, literals, 2 byte offset, match length): greedy hash table matching,
+no entropy coding, so it decodes at memory speed.
+
+an optional dictionary is treated as data that came right before the value:
+matches may point back into its last 64 KB. small values that share a lot
+of content (JSON with the same field names) compress well that way even
+though each one alone is too short to have repeats.
+*/
+
+// a string value kept compressed in the store, the AOF and the replication stream
+struct CompressedValue {
+    std::string data;
+    uint32_t raw_size{0};
+    // dictionary_id() of the dictionary used, 0 for none
+    uint32_t dictionary_id{0};
+};
+
+std::string lz_compress(std::string_view input, std::string_view dictionary = {});
+
+// throws std::invalid_argument on corrupt input
+std::string lz_decompress(std::string_view input, size_t raw_size, std::string_view dictionary = {});
+
+// 0 for no dictionary, a non zero checksum otherwise
+uint32_t dictionary_id(std::string_view dictionary);
+
+/*
+builds a dictionary of at most `max_size` bytes out of sample values: picks
+the segments that cover the most 8 byte sequences shared between samples.
+the most useful segments end up last, closest to the compressed data.
+*/
+std::string train_dictionary(const std::vector<std::string> &samples, size_t max_size);
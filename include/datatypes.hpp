@@ -0,0 +1,248 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
+#include <variant>
+#include <optional>
+
+/*
+collections start out in a compact encoding (one contiguous buffer) and get
+converted to a real hash table / deque / set once they grow past these limits.
+same defaults as redis' *-max-listpack-entries / *-max-listpack-value.
+*/
+constexpr size_t kListpackMaxEntries = 128;
+constexpr size_t kListpackMaxValue = 64;
+
+
+/*
+Listpack: a list of strings packed into a single std::string.
+every element is stored as [varint length][bytes], so small collections cost
+one allocation instead of one per element (+ the node overhead of std containers).
+elements are addressed by their byte offset (Pos) inside the buffer.
+*/
+class Listpack {
+public:
+    using Pos = size_t;
+
+    size_t size() const { return count_; }
+    size_t bytes() const { return buf_.size(); }
+    bool empty() const { return count_ == 0; }
+
+    Pos begin() const { return 0; }
+    Pos end() const { return buf_.size(); }
+
+    std::string_view get(Pos p) const;
+    Pos next(Pos p) const;
+
+    // position of the last element (linear walk, fine for small packs)
+    Pos last() const;
+
+    // first element equal to `v`, looking only at every `step`-th element
+    Pos find(std::string_view v, size_t step = 1) const;
+
+    void push_back(std::string_view v) { insert(end(), v); }
+    void push_front(std::string_view v) { insert(begin(), v); }
+
+    // insert before position `p`
+    void insert(Pos p, std::string_view v);
+    void replace(Pos p, std::string_view v);
+
+    // erase `n` elements starting at `p`, returns `p` (now pointing at the following element)
+    Pos erase(Pos p, size_t n = 1);
+
+private:
+    std::string buf_;
+    size_t count_{0};
+
+    size_t read_header(Pos p, size_t &len) const;
+};
+
+
+class HashValue {
+public:
+    // returns true if the field was newly created
+    bool set(const std::string &field, const std::string &value);
+    std::optional<std::string> get(const std::string &field) const;
+    bool del(const std::string &field);
+    size_t size() const;
+    bool is_compact() const { return std::holds_alternative<Listpack>(data_); }
+
+    template <typename F>
+    void for_each(F &&f) const {
+        if (auto lp = std::get_if<Listpack>(&data_)) {
+            for (auto p = lp->begin(); p != lp->end();) {
+                auto v = lp->next(p);
+                f(lp->get(p), lp->get(v));
+                p = lp->next(v);
+            }
+        } else {
+            for (const auto &kv : std::get<Map>(data_)) {
+                f(std::string_view(kv.first), std::string_view(kv.second));
+            }
+        }
+    }
+
+private:
+    using Map = std::unordered_map<std::string, std::string>;
+    std::variant<Listpack, Map> data_;
+
+    void convert();
+};
+
+
+class ListValue {
+public:
+    void push_front(const std::string &value);
+    void push_back(const std::string &value);
+    std::optional<std::string> pop_front();
+    std::optional<std::string> pop_back();
+    size_t size() const;
+    bool is_compact() const { return std::holds_alternative<Listpack>(data_); }
+
+    // elements in [start, stop], negative indexes count from the tail (like redis)
+    std::vector<std::string> range(long start, long stop) const;
+
+    template <typename F>
+    void for_each(F &&f) const {
+        if (auto lp = std::get_if<Listpack>(&data_)) {
+            for (auto p = lp->begin(); p != lp->end(); p = lp->next(p)) {
+                f(lp->get(p));
+            }
+        } else {
+            for (const auto &v : std::get<Deque>(data_)) {
+                f(std::string_view(v));
+            }
+        }
+    }
+
+private:
+    using Deque = std::deque<std::string>;
+    std::variant<Listpack, Deque> data_;
+
+    void maybe_convert(const std::string &incoming);
+};
+
+
+class SetValue {
+public:
+    // returns true if the member was added
+    bool add(const std::string &member);
+    bool contains(const std::string &member) const;
+    bool remove(const std::string &member);
+    size_t size() const;
+    bool is_compact() const { return std::holds_alternative<Listpack>(data_); }
+
+    template <typename F>
+    void for_each(F &&f) const {
+        if (auto lp = std::get_if<Listpack>(&data_)) {
+            for (auto p = lp->begin(); p != lp->end(); p = lp->next(p)) {
+                f(lp->get(p));
+            }
+        } else {
+            for (const auto &v : std::get<Set>(data_)) {
+                f(std::string_view(v));
+            }
+        }
+    }
+
+private:
+    using Set = std::unordered_set<std::string>;
+    std::variant<Listpack, Set> data_;
+
+    void convert();
+};
+
+
+/*
+SkipList: ordered by (score, member), with per-level spans so a node's rank
+can be computed on the way down (O(log n) rank lookups for ZRANGE).
+the level array is allocated inline right after the node, so a lookup
+touches one allocation per node instead of a node + a separate vector.
+*/
+class SkipList {
+public:
+    static constexpr int kMaxLevel = 32;
+
+    struct Node;
+
+    struct Level {
+        Node *forward;
+        size_t span;
+    };
+
+    struct Node {
+        std::string member;
+        double score;
+        Node *backward;
+        int height;
+
+        Level *levels() { return reinterpret_cast<Level *>(this + 1); }
+        const Level *levels() const { return reinterpret_cast<const Level *>(this + 1); }
+        Node *next() const { return levels()[0].forward; }
+    };
+
+    SkipList();
+    ~SkipList();
+    SkipList(const SkipList &other);
+    SkipList &operator=(const SkipList &other);
+    SkipList(SkipList &&other);
+    SkipList &operator=(SkipList &&other) noexcept;
+
+    size_t size() const { return length_; }
+
+    // caller guarantees (score, member) is not present yet
+    void insert(double score, const std::string &member);
+    bool erase(double score, const std::string &member);
+
+    // node at 0-based rank, nullptr if out of range
+    const Node *at_rank(size_t rank) const;
+
+    // first node with score >= min (> min when exclusive), nullptr if none
+    const Node *first_in_range(double min, bool exclusive) const;
+
+    const Node *first() const { return head_->levels()[0].forward; }
+
+private:
+    Node *head_;
+    int level_;
+    size_t length_;
+
+    static Node *make_node(int height, double score, const std::string &member);
+    static void free_node(Node *node);
+    static int random_level();
+    void clear();
+    void copy_from(const SkipList &other);
+};
+
+
+// sorted set: skiplist for ordered access + hash for member -> score lookups
+class ZSetValue {
+public:
+    using Item = std::pair<std::string, double>;
+
+    // returns true if the member was newly added
+    bool add(const std::string &member, double score);
+    std::optional<double> score(const std::string &member) const;
+    bool remove(const std::string &member);
+    size_t size() const { return dict_.size(); }
+
+    // by rank in [start, stop], negative indexes count from the end
+    std::vector<Item> range_by_rank(long start, long stop) const;
+    std::vector<Item> range_by_score(double min, bool min_exclusive,
+                                     double max, bool max_exclusive) const;
+
+    template <typename F>
+    void for_each(F &&f) const {
+        for (auto node = list_.first(); node; node = node->next()) {
+            f(std::string_view(node->member), node->score);
+        }
+    }
+
+private:
+    SkipList list_;
+    std::unordered_map<std::string, double> dict_;
+};
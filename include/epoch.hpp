@@ -0,0 +1,73 @@
+#pragma once
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <cstdint>
+
+/*
+epoch based reclamation, for data structures read without any lock.
+
+readers pin() the current epoch while they look at shared nodes. writers
+unlink a node first and then retire() it; it is freed only once every
+reader that was pinned at that moment has unpinned, so a reader never sees
+freed memory. pinning writes only to the thread's own slot (one cache line
+per thread), readers don't share any written cache line with each other.
+
+one process wide domain: slots belong to threads, not to a structure, and
+are handed over to new threads when their owner exits.
+*/
+class EpochDomain {
+public:
+    static EpochDomain &global();
+
+    class Guard {
+    public:
+        explicit Guard(EpochDomain &domain) : domain_(domain) { domain_.enter(); }
+        ~Guard() { domain_.exit(); }
+
+        Guard(const Guard &) = delete;
+        Guard &operator=(const Guard &) = delete;
+
+    private:
+        EpochDomain &domain_;
+    };
+
+    Guard pin() { return Guard(*this); }
+
+    // `deleter(ptr)` runs once no reader can still hold `ptr`
+    void retire(void *ptr, void (*deleter)(void *));
+
+    // frees what no pinned reader can reach anymore
+    void reclaim();
+
+    ~EpochDomain();
+
+private:
+    struct alignas(64) Slot {
+        // epoch the owner pinned, 0 while it is not reading
+        std::atomic<uint64_t> epoch{0};
+        std::atomic<bool> in_use{false};
+    };
+
+    struct Retired {
+        void *ptr;
+        void (*deleter)(void *);
+        uint64_t epoch;
+    };
+
+    std::atomic<uint64_t> epoch_{1};
+
+    std::mutex mutex_;
+    std::deque<Slot> slots_;        // never shrinks, so slot pointers stay valid
+    std::vector<Retired> retired_;
+
+    EpochDomain() = default;
+
+    Slot *local_slot();
+    void enter();
+    void exit();
+    void reclaim_locked();
+};
@@ -0,0 +1,332 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <utility>
+#include <new>
+#include <cstdlib>
+#include <cstdint>
+
+/*
+HashTable: chained hash table keyed by std::string with a power-of-two
+bucket count. we use it for the keyspace instead of std::unordered_map
+because we need control over the bucket layout:
+
+- resizing is incremental: the new bucket array is allocated and the
+  nodes move over a few buckets at a time, on every insert / erase and in
+  rehash_step() (the store calls it when idle). while that goes on both
+  arrays are live and lookups check both, so no single call ever pays for
+  moving the whole table.
+- scan() walks the table with a reverse-binary cursor (same trick as redis'
+  dictScan), so a full iteration returns every key that existed for the
+  whole scan even if the table was resized between two calls.
+- nodes are never moved on resize (only relinked), so pointers to values
+  stay valid until the key is erased.
+*/
+template <typename V>
+class HashTable {
+public:
+    struct Node {
+        std::string key;
+        V value;
+        size_t hash;
+        Node *next;
+    };
+
+    static constexpr size_t kInitialBuckets = 16;
+
+    // buckets moved per insert / erase while a resize is in progress
+    static constexpr size_t kRehashStep = 1;
+
+    HashTable() { tables_[0] = Table::make(kInitialBuckets); }
+
+    ~HashTable() {
+        clear();
+        tables_[0].release();
+        tables_[1].release();
+    }
+
+    HashTable(const HashTable &) = delete;
+    HashTable &operator=(const HashTable &) = delete;
+
+    size_t size() const { return size_; }
+    size_t bucket_count() const { return tables_[0].size + tables_[1].size; }
+    bool rehashing() const { return tables_[1].size != 0; }
+
+    V *find(const std::string &key) {
+        Node *node = find_node(key, hash_of(key));
+        return node ? &node->value : nullptr;
+    }
+
+    const V *find(const std::string &key) const {
+        return const_cast<HashTable *>(this)->find(key);
+    }
+
+    // inserts a default constructed value if the key is missing
+    std::pair<V *, bool> try_emplace(const std::string &key) {
+        rehash_step(kRehashStep);
+        size_t h = hash_of(key);
+
+        if (Node *node = find_node(key, h)) {
+            return {&node->value, false};
+        }
+
+        if (!rehashing() && size_ >= tables_[0].size) {
+            start_resize(tables_[0].size * 2);
+        }
+
+        // new keys go straight to the table being filled
+        Table &t = tables_[rehashing() ? 1 : 0];
+        Node *node = new Node{key, V{}, h, nullptr};
+        size_t idx = h & t.mask();
+        node->next = t.buckets[idx];
+        t.buckets[idx] = node;
+        size_++;
+        return {&node->value, true};
+    }
+
+    V &operator[](const std::string &key) { return *try_emplace(key).first; }
+
+    bool erase(const std::string &key) {
+        rehash_step(kRehashStep);
+        size_t h = hash_of(key);
+
+        for (Table &t : tables_) {
+            if (!t.size) continue;
+
+            Node **link = &t.buckets[h & t.mask()];
+            while (*link) {
+                Node *node = *link;
+                if (node->hash == h && node->key == key) {
+                    *link = node->next;
+                    delete node;
+                    size_--;
+                    maybe_shrink();
+                    return true;
+                }
+                link = &node->next;
+            }
+        }
+        return false;
+    }
+
+    // erase every entry for which pred(key, value) returns true
+    template <typename F>
+    size_t erase_if(F &&pred) {
+        size_t removed = 0;
+
+        for (Table &t : tables_) {
+            for (size_t i = 0; i < t.size; i++) {
+                Node **link = &t.buckets[i];
+                while (*link) {
+                    Node *node = *link;
+                    if (pred(node->key, node->value)) {
+                        *link = node->next;
+                        delete node;
+                        removed++;
+                    } else {
+                        link = &node->next;
+                    }
+                }
+            }
+        }
+        size_ -= removed;
+        maybe_shrink();
+        return removed;
+    }
+
+    template <typename F>
+    void for_each(F &&f) const {
+        for (const Table &t : tables_) {
+            for (size_t i = 0; i < t.size; i++) {
+                for (const Node *node = t.buckets[i]; node; node = node->next) {
+                    f(node->key, node->value);
+                }
+            }
+        }
+    }
+
+    /*
+    visits one bucket and returns the cursor of the next one (0 when done).
+    the cursor is incremented on its reversed bits: growing the table only
+    splits buckets we have not visited yet into higher bits, and shrinking
+    merges buckets whose low bits we already covered, so nothing present
+    for the whole iteration is ever skipped (some keys may be seen twice).
+
+    during a resize the cursor's bucket in the smaller array is visited
+    together with every bucket it splits into in the larger one.
+    */
+    template <typename F>
+    uint64_t scan(uint64_t cursor, F &&f) const {
+        if (size_ == 0) return 0;
+
+        auto visit = [&](const Table &t) {
+            for (const Node *node = t.buckets[cursor & t.mask()]; node; node = node->next) {
+                f(node->key, node->value);
+            }
+        };
+
+        if (!rehashing()) {
+            visit(tables_[0]);
+            return next_cursor(cursor, tables_[0].mask());
+        }
+
+        const Table *small = &tables_[0];
+        const Table *large = &tables_[1];
+        if (small->size > large->size) std::swap(small, large);
+
+        uint64_t m0 = small->mask();
+        uint64_t m1 = large->mask();
+
+        visit(*small);
+        do {
+            visit(*large);
+            cursor = next_cursor(cursor, m1);
+        } while (cursor & (m0 ^ m1));
+
+        return cursor;
+    }
+
+    // same walk, for callers that update values in place (never insert or erase from `f`)
+    template <typename F>
+    uint64_t scan(uint64_t cursor, F &&f) {
+        return static_cast<const HashTable *>(this)->scan(cursor, [&](const std::string &key, const V &value) {
+            f(key, const_cast<V &>(value));
+        });
+    }
+
+    /*
+    moves up to `buckets` buckets of a resize in progress (and looks at no
+    more than 10x as many empty ones). returns true while there is more to
+    move.
+    */
+    bool rehash_step(size_t buckets) {
+        if (!rehashing()) return false;
+
+        Table &from = tables_[0];
+        Table &to = tables_[1];
+        size_t empty_visits = buckets * 10;
+
+        while (buckets > 0 && rehash_pos_ < from.size) {
+            Node *head = from.buckets[rehash_pos_];
+
+            if (!head) {
+                rehash_pos_++;
+                if (--empty_visits == 0) break;
+                continue;
+            }
+
+            while (head) {
+                Node *next = head->next;
+                size_t idx = head->hash & to.mask();
+                head->next = to.buckets[idx];
+                to.buckets[idx] = head;
+                head = next;
+            }
+            from.buckets[rehash_pos_++] = nullptr;
+            buckets--;
+        }
+
+        if (rehash_pos_ < from.size) return true;
+
+        // done, the new array takes over
+        from.release();
+        from = to;
+        to = Table{};
+        rehash_pos_ = 0;
+        return false;
+    }
+
+    void clear() {
+        for (Table &t : tables_) {
+            for (size_t i = 0; i < t.size; i++) {
+                Node *head = t.buckets[i];
+                while (head) {
+                    Node *next = head->next;
+                    delete head;
+                    head = next;
+                }
+                t.buckets[i] = nullptr;
+            }
+        }
+        size_ = 0;
+    }
+
+private:
+    /*
+    calloc'd: a big bucket array comes straight from fresh zero pages, so
+    starting a resize doesn't have to write the whole thing first.
+    */
+    struct Table {
+        Node **buckets{nullptr};
+        size_t size{0};
+
+        size_t mask() const { return size - 1; }
+
+        static Table make(size_t size) {
+            void *memory = std::calloc(size, sizeof(Node *));
+            if (!memory) throw std::bad_alloc();
+            return Table{static_cast<Node **>(memory), size};
+        }
+
+        void release() {
+            std::free(buckets);
+            buckets = nullptr;
+            size = 0;
+        }
+    };
+
+    // [0] is the current array; [1] the one being filled during a resize
+    Table tables_[2];
+    // next bucket of tables_[0] to move
+    size_t rehash_pos_{0};
+    size_t size_{0};
+
+    static size_t hash_of(const std::string &key) {
+        return std::hash<std::string>{}(key);
+    }
+
+    Node *find_node(const std::string &key, size_t h) const {
+        for (const Table &t : tables_) {
+            if (!t.size) continue;
+
+            for (Node *node = t.buckets[h & t.mask()]; node; node = node->next) {
+                if (node->hash == h && node->key == key) {
+                    return node;
+                }
+            }
+        }
+        return nullptr;
+    }
+
+    void maybe_shrink() {
+        // shrink below 1/8 load, never under the initial size
+        if (!rehashing() && tables_[0].size > kInitialBuckets && size_ < tables_[0].size / 8) {
+            size_t target = kInitialBuckets;
+            while (target < size_ * 2) target *= 2;
+            start_resize(target);
+        }
+    }
+
+    void start_resize(size_t new_size) {
+        tables_[1] = Table::make(new_size);
+        rehash_pos_ = 0;
+    }
+
+    static uint64_t next_cursor(uint64_t cursor, uint64_t mask) {
+        cursor |= ~mask;
+        cursor = reverse_bits(cursor);
+        cursor++;
+        return reverse_bits(cursor);
+    }
+
+    static uint64_t reverse_bits(uint64_t v) {
+        v = ((v >> 1) & 0x5555555555555555ULL) | ((v & 0x5555555555555555ULL) << 1);
+        v = ((v >> 2) & 0x3333333333333333ULL) | ((v & 0x3333333333333333ULL) << 2);
+        v = ((v >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((v & 0x0F0F0F0F0F0F0F0FULL) << 4);
+        v = ((v >> 8) & 0x00FF00FF00FF00FFULL) | ((v & 0x00FF00FF00FF00FFULL) << 8);
+        v = ((v >> 16) & 0x0000FFFF0000FFFFULL) | ((v & 0x0000FFFF0000FFFFULL) << 16);
+        return (v >> 32) | (v << 32);
+    }
+};
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <cstdint>
+
+/*
+HotKeys: always-on tracker of the most accessed keys.
+
+one access in `sample_rate` is counted, in a Count-Min sketch (4 rows of
+atomic counters, the estimate of a key is its smallest counter, it can only
+overcount). a sampled key whose estimate reaches the smallest count of the
+current top-k takes a mutex and enters the top-k list; every other sample
+is a hash and four relaxed increments.
+
+decay() halves every counter, the store calls it once a second from tick(),
+so the counts follow the recent traffic: a key read at a steady r ops/s
+settles around 2 * r / sample_rate, which rate() turns back into ops/s.
+*/
+class HotKeys {
+public:
+    struct Item {
+        std::string key;
+        // approximate accesses per second
+        uint64_t rate;
+    };
+
+    explicit HotKeys(size_t k = 32, uint32_t sample_rate = 16);
+
+    HotKeys(const HotKeys &) = delete;
+    HotKeys &operator=(const HotKeys &) = delete;
+
+    void record(const std::string &key) {
+        // per thread, so the fast path doesn't share a cache line
+        static thread_local uint32_t ticks = 0;
+        if (++ticks % sample_rate_) return;
+        sample(key);
+    }
+
+    // the hottest keys, hottest first
+    std::vector<Item> top(size_t count) const;
+
+    // lock free: is the key as hot as the coldest one in the top-k
+    bool is_hot(const std::string &key) const;
+
+    void decay();
+
+private:
+    static constexpr size_t kDepth = 4;
+    static constexpr size_t kWidth = 1024;
+
+    struct Entry {
+        std::string key;
+        uint32_t count;
+    };
+
+    size_t k_;
+    uint32_t sample_rate_;
+    std::unique_ptr<std::atomic<uint32_t>[]> counters_;
+
+    // a key needs this estimate to enter the top-k, raised to its minimum once full
+    std::atomic<uint32_t> threshold_;
+
+    mutable std::mutex mutex_;
+    std::vector<Entry> top_;
+
+    void sample(const std::string &key);
+    uint32_t estimate(const std::string &key) const;
+    // caller holds mutex_
+    void update_threshold();
+};
@@ -2,12 +2,34 @@
 
 #include <string>
 #include <unordered_map>
+#include <set>
+#include <unordered_set>
 #include <optional>
 #include <shared_mutex>
 #include <mutex>
 #include <thread>
 #include <atomic>
 #include <vector>
+#include <variant>
+#include <chrono>
+#include <stdexcept>
+#include <string_view>
+#include "datatypes.hpp"
+#include "hashtable.hpp"
+#include "compression.hpp"
+#include "value_log.hpp"
+#include "read_cache.hpp"
+#include "hotkeys.hpp"
+#include "latency.hpp"
+#include <memory>
+#include <functional>
+
+// thrown when a command is run against a key holding another kind of value
+class WrongTypeError : public std::runtime_error {
+public:
+    WrongTypeError()
+        : std::runtime_error("WRONGTYPE Operation against a key holding the wrong kind of value") {}
+};
 
 class KVStore {
 public:
@@ -15,52 +37,447 @@ public:
     KVStore(size_t max_key_len = 1024,
             size_t max_value_len = 1 << 20);
 
+    /*
+    a key holds either a plain string or one of the collection types. large
+    strings are kept as CompressedValue when compression is enabled, cold
+    strings as SpilledValue when tiering is enabled, strings holding a
+    canonical integer ("42", "-7", not "007") as int64_t; reads see all of
+    them as plain strings.
+    */
+    using Value = std::variant<std::string, HashValue, ListValue, SetValue, ZSetValue, CompressedValue, SpilledValue, int64_t>;
+
     // Store a key-value pair
     struct Entry {
-        std::string value;
+        Value value;
         std::optional<std::chrono::steady_clock::time_point> expires_at; 
+        // bumped on every write, WATCH compares it to detect concurrent changes
+        uint64_t version{0};
+        // set on write and access, the tiering CLOCK hand spares entries that have it
+        bool referenced{false};
+        // the snapshot that has this key already (see begin_snapshot), set under the store lock
+        mutable uint32_t snapshot_epoch{0};
     };
 
+    // the value is copied once, straight into the entry
     bool set(
         const std::string &key,
-        const std::string &value,
+        std::string_view value,
         std::optional<int> ttl_seconds = std::nullopt
     );
 
+    /*
+    string values of at least `threshold` bytes are compressed from now on,
+    using `dictionary` if not empty. call before the store is shared between
+    threads (the AOF replay included, it may contain compressed values).
+    */
+    void enable_compression(size_t threshold, std::string dictionary = {});
+
+    // the compressed form of `value`, nullopt if it is not worth compressing
+    std::optional<CompressedValue> compress(std::string_view value) const;
+
+    // dictionary_id() of the compression dictionary, 0 for none
+    uint32_t compression_dictionary_id() const { return dictionary_id_; }
+
+    // like set(), but never compresses: for callers that already got nullopt from compress()
+    bool set_uncompressed(
+        const std::string &key,
+        std::string_view value,
+        std::optional<int> ttl_seconds = std::nullopt
+    );
+
+    /*
+    stores an already compressed value as is, for the AOF, replication and
+    callers that log the compressed bytes. throws std::invalid_argument if it
+    was compressed with a dictionary this store does not have.
+    */
+    bool set_compressed(
+        const std::string &key,
+        CompressedValue value,
+        std::optional<int> ttl_seconds = std::nullopt
+    );
+
+    /*
+    true if `value` fits the size limit, uses a dictionary this store has and
+    really decompresses to raw_size bytes. set_compressed() trusts its input,
+    so check compressed bytes that come from clients with this first.
+    */
+    bool check_compressed(const CompressedValue &value) const;
+
+    /*
+    tiered storage: once the string values held in memory exceed
+    `memory_budget` bytes, the least recently used ones are moved to
+    append-only segment files in `dir` and read back with pread on access,
+    through an LRU cache of `cache_bytes`. keys and collections always stay
+    in memory. call before the store is shared between threads.
+    */
+    void enable_tiering(const std::string &dir, size_t memory_budget, size_t cache_bytes);
+
+    /*
+    lock free GETs: string values read through the locked path are copied
+    into a ReadCache of `capacity_bytes`, later reads of the same key skip
+    the store lock entirely. with `hot_only` only the keys the hot key
+    tracker currently flags are admitted, so a small cache holds just the
+    few keys that would otherwise hammer the lock.
+    call before the store is shared between threads.
+    */
+    void enable_read_cache(size_t capacity_bytes, bool hot_only = false);
+
+    /*
+    keyspace notifications: called with the event and the key after every
+    write that creates, changes or removes a key: "set", "incrby",
+    "append", "hset", "hdel", "lpush", "rpop", "sadd", "zadd", "zrem",
+    "del" (also when the last element of a collection goes) and "expired".
+    writes that change nothing (SADD of members already there) send none.
+    it runs under the store lock, so it has to be quick and must not call
+    back into the store. call before the store is shared between threads.
+    */
+    using EventListener = std::function<void(const char *event, const std::string &key)>;
+    void set_event_listener(EventListener listener);
+
+    // the most accessed keys lately (sampled from get / set), hottest first
+    std::vector<HotKeys::Item> hotkeys(size_t count) const;
+
+    // up to `count` string values, as training samples for a dictionary
+    std::vector<std::string> sample_values(size_t count) const;
+
     // Retrieve a value by key
     std::optional<std::string> get(const std::string &key);
 
+    // several keys under one lock, nullopt for missing keys and non-strings
+    std::vector<std::optional<std::string>> mget(const std::vector<std::string> &keys);
+
+    /*
+    calls f(std::string_view) with the value of a string key while it can't
+    change (store lock held, or pinned in the read cache), so embedders can
+    copy it straight into their own buffer.
+    returns false if the key does not exist, throws WrongTypeError otherwise.
+    */
+    template <typename F>
+    bool view(const std::string &key, F &&f) {
+        hotkeys_.record(key);
+
+        if (read_cache_ && read_cache_->view(key, f)) {
+            return true;
+        }
+
+        auto lock = write_lock();
+
+        Entry* entry = find_live(key);
+        if (!entry) {
+            return false;
+        }
+
+        if (auto packed = std::get_if<CompressedValue>(&entry->value)) {
+            f(std::string_view(decompress(*packed)));
+            return true;
+        }
+        if (auto spilled = std::get_if<SpilledValue>(&entry->value)) {
+            f(std::string_view(load_spilled(*spilled)));
+            return true;
+        }
+        if (auto number = std::get_if<int64_t>(&entry->value)) {
+            std::string text = std::to_string(*number);
+            if (cache_admits(key)) read_cache_->put(key, text, entry->expires_at);
+            f(std::string_view(text));
+            return true;
+        }
+
+        auto value = std::get_if<std::string>(&entry->value);
+        if (!value) {
+            throw WrongTypeError();
+        }
+        if (cache_admits(key)) read_cache_->put(key, *value, entry->expires_at);
+        f(std::string_view(*value));
+        return true;
+    }
+
     // Delete a key
     bool del(const std::string &key);
 
+    /*
+    read-modify-write on string keys, each under a single lock acquisition.
+    they throw WrongTypeError on collections, std::length_error past the
+    size limits and std::invalid_argument as noted.
+    */
+    // adds `delta` (missing keys start at 0) and returns the result, the TTL is kept.
+    // throws std::invalid_argument if the value is not an integer or the result overflows
+    int64_t incrby(const std::string &key, int64_t delta);
+    // returns the new length, the TTL is kept
+    size_t append(const std::string &key, const std::string &suffix);
+    // sets `value` without a TTL, returns the previous value
+    std::optional<std::string> getset(const std::string &key, const std::string &value);
+    std::optional<std::string> getdel(const std::string &key);
+    /*
+    sets `value` only if the key's version() is still `expected` (0: the
+    key must not exist). returns the new version, 0 if it did not match.
+    */
+    uint64_t cas(
+        const std::string &key,
+        uint64_t expected,
+        const std::string &value,
+        std::optional<int> ttl_seconds = std::nullopt
+    );
+
+    // Hashes
+    size_t hset(
+        const std::string &key,
+        const std::vector<std::pair<std::string, std::string>> &fields
+    );
+    std::optional<std::string> hget(const std::string &key, const std::string &field);
+    size_t hdel(const std::string &key, const std::vector<std::string> &fields);
+
+    // Lists
+    size_t lpush(const std::string &key, const std::vector<std::string> &values);
+    std::optional<std::string> rpop(const std::string &key);
+    std::vector<std::string> lrange(const std::string &key, long start, long stop);
+
+    // Sets
+    size_t sadd(const std::string &key, const std::vector<std::string> &members);
+    bool sismember(const std::string &key, const std::string &member);
+    std::vector<std::string> smembers(const std::string &key);
+
+    // Sorted sets
+    size_t zadd(const std::string &key, const std::vector<std::pair<double, std::string>> &items);
+    std::optional<double> zscore(const std::string &key, const std::string &member);
+    size_t zrem(const std::string &key, const std::vector<std::string> &members);
+    std::vector<ZSetValue::Item> zrange(const std::string &key, long start, long stop);
+    std::vector<ZSetValue::Item> zrangebyscore(
+        const std::string &key,
+        double min, bool min_exclusive,
+        double max, bool max_exclusive
+    );
+
+    // current version of a key, 0 if it does not exist
+    uint64_t version(const std::string &key) const;
+
+    /*
+    for WATCH: changes with every write to the key, deletes included. a
+    missing key gets the version of the last delete of any key sharing its
+    tombstone slot, so a key created and deleted again since WATCH (or a
+    slot neighbour deleted, a harmless false alarm) never looks unchanged.
+    */
+    uint64_t watch_version(const std::string &key) const;
+
+    /*
+    runs `f` while holding the exclusive lock once. calls into the store made
+    from `f` (on this thread) skip their own locking, so a whole MULTI/EXEC
+    block is applied atomically without re-acquiring the lock per command.
+    */
+    template <typename F>
+    auto batch(F &&f) {
+        auto lock = write_lock();
+        const KVStore* previous = batch_owner_;
+        batch_owner_ = this;
+
+        struct Restore {
+            const KVStore* previous;
+            ~Restore() { batch_owner_ = previous; }
+        } restore{previous};
+
+        return f();
+    }
+
     // Number of stored keys
     size_t size() const;
 
-    std::unordered_map<std::string, Entry> current_state() const;
+    /*
+    cursor based iteration: visits a few buckets per call under the lock and
+    returns the cursor to continue from (0 once the whole table was covered).
+    keys present for the whole scan are returned at least once.
+    */
+    uint64_t scan(uint64_t cursor, size_t count, std::vector<std::string> &keys) const;
+
+    /*
+    ordered secondary index over the keys, off by default because it keeps a
+    second copy of every key. when enabled, scan_prefix() returns up to `count`
+    keys starting with `prefix` that sort after `after`, in order.
+    returns true if there may be more keys to fetch.
+    */
+    void enable_ordered_index();
+    bool has_ordered_index() const;
+    bool scan_prefix(
+        const std::string &prefix,
+        const std::string &after,
+        size_t count,
+        std::vector<std::string> &keys
+    ) const;
 
     void start_cleanup_thread();
 
+    // one round of the cleanup thread's work: expiry, value log compaction, hot key decay
+    void tick();
+
+    /*
+    for a store owned by a single thread (the --cores mode): every lock
+    becomes a no-op. the owner must not start the cleanup thread and must
+    call tick() itself.
+    */
+    void disable_locking();
+
     void stop_cleanup_thread();
+
+    /*
+    acquisitions of the store lock that had to wait, and how long they
+    waited in total. each wait is also added to the current RequestTrace.
+    */
+    struct LockStats {
+        uint64_t contended;
+        uint64_t wait_ns;
+    };
+    LockStats lock_stats() const;
+
+    // moves on with every write, the AOF rewrite uses it to tell whether anything changed
+    uint64_t write_version() const;
     
     struct SnapshotItem {
         std::string key;
-        std::string value;
+        Value value;
         std::optional<int> ttl_seconds;
     };
     
     std::vector<SnapshotItem> current_state_leader() const;
 
+    /*
+    copy-on-write snapshot, for the AOF rewrite: begin_snapshot() only marks
+    the point in time, read_snapshot() then hands out the keyspace as it was
+    at that point, a few buckets per call under the store lock. a write in
+    between saves the old state of a key first, if the snapshot has not got
+    to it yet. one snapshot at a time.
+    */
+    void begin_snapshot() const;
+    // appends up to about `count` items, false once the snapshot is complete (and over)
+    bool read_snapshot(size_t count, std::vector<SnapshotItem> &items) const;
+
+    // a single key in snapshot form, nullopt if it does not exist
+    std::optional<SnapshotItem> snapshot_key(const std::string &key) const;
+
+    /*
+    cluster mode: index keys by hash slot so a slot can be migrated
+    without walking the whole keyspace.
+    */
+    void enable_slot_index();
+    size_t count_keys_in_slot(uint16_t slot) const;
+    std::vector<std::string> keys_in_slot(uint16_t slot, size_t count) const;
+
 
 private:
-    std::unordered_map<std::string, Entry> data_;
+    HashTable<Entry> data_;
     mutable std::shared_mutex mutex_;
 
+    // seeded from the clock, so versions handed to CAS clients are not reused after a restart
+    uint64_t next_version_;
+
+    // version of the last delete per slot (hash of the key), see watch_version()
+    static constexpr size_t kTombstoneSlots = 4096;
+    std::vector<uint64_t> tombstones_;
+    uint64_t &tombstone(const std::string &key) {
+        return tombstones_[std::hash<std::string>{}(key) & (kTombstoneSlots - 1)];
+    }
+
+    /*
+    the snapshot being read, if active. keys are either handed out by the
+    cursor, which marks them with `epoch`, or saved here by the first write
+    since the snapshot began (nullopt: the key did not exist).
+    */
+    struct SnapshotState {
+        bool active{false};
+        uint32_t epoch{0};
+        uint64_t cursor{0};
+        std::chrono::steady_clock::time_point started;
+        std::unordered_map<std::string, std::optional<SnapshotItem>> saved;
+    };
+    mutable SnapshotState snapshot_;
+
+    // `entry` as of the snapshot's start, nullopt if it had expired by then
+    std::optional<SnapshotItem> snapshot_item(const std::string &key, const Entry &entry) const;
+    // called before every write to `key` (null `entry`: it does not exist), caller holds the lock
+    void keep_for_snapshot(const std::string &key, const Entry *entry);
+
+    // store whose batch() is running on this thread, its lock is already held
+    static thread_local const KVStore* batch_owner_;
+    bool locking_{true};
+    std::unique_lock<std::shared_mutex> write_lock() const;
+    std::shared_lock<std::shared_mutex> read_lock() const;
+
+    mutable std::atomic<uint64_t> lock_contended_{0};
+    mutable std::atomic<uint64_t> lock_wait_ns_{0};
+    void note_lock_wait(uint64_t ns) const;
+
+    bool ordered_index_{false};
+    std::set<std::string> ordered_keys_;
+
+    // empty unless cluster mode is on, then one set of keys per hash slot
+    std::vector<std::unordered_set<std::string>> slot_keys_;
+
     size_t max_key_len_;
     size_t max_value_len_;
 
+    // 0 while compression is off
+    size_t compress_threshold_{0};
+    std::string dictionary_;
+    uint32_t dictionary_id_{0};
+
+    std::string decompress(const CompressedValue &value) const;
+
+    // int64_t for canonical integers, compressed if worth it, the string otherwise
+    Value encode_string(std::string_view value) const;
+    // the same without trying to compress
+    Value encode_plain(std::string_view value) const;
+    // set(), set_uncompressed() and set_compressed() once the value is encoded
+    bool store_string(const std::string &key, Value value, std::optional<int> ttl_seconds);
+    // the value of a string key in any of its forms, throws WrongTypeError for collections
+    std::string read_string(const Entry &entry) const;
+    // replaces the value of a key (created if needed), caller holds the lock
+    Entry &store_entry(const std::string &key, Value value, std::optional<std::chrono::steady_clock::time_point> expires_at);
+
+    // off while null. every write to a key invalidates it under the exclusive lock
+    std::unique_ptr<ReadCache> read_cache_;
+    bool hot_read_cache_{false};
+
+    HotKeys hotkeys_;
+
+    EventListener listener_;
+
+    void notify(const char *event, const std::string &key) const {
+        if (listener_) listener_(event, key);
+    }
+
+    bool cache_admits(const std::string &key) const {
+        return read_cache_ && (!hot_read_cache_ || hotkeys_.is_hot(key));
+    }
+
+    // tiering, off while value_log_ is null
+    std::unique_ptr<ValueLog> value_log_;
+    std::unique_ptr<ValueCache> value_cache_;
+    size_t memory_budget_{0};
+    // bytes of string values held in memory
+    size_t resident_bytes_{0};
+    uint64_t clock_cursor_{0};
+
+    std::string load_spilled(const SpilledValue &value) const;
+    // keep resident_bytes_ and the value log in sync, caller holds the lock
+    void account_value(const Entry &entry);
+    void forget_value(const Entry &entry);
+    void evict_cold();
+    void compact_tier();
+    void compact_segments();
+
     std::thread cleaner_thread_;
     std::atomic<bool> stop_cleaner_{false};
 
     bool is_expired(const Entry& entry) const;
+    // bounded slices of active expiry, resumed from expire_cursor_ every tick
     void cleanup_expired();
+    uint64_t expire_cursor_{0};
+    // moves a resize of data_ along for a moment while the store is idle
+    void rehash_idle();
+
+    // lookup helpers, caller must hold the exclusive lock
+    Entry& insert_entry(const std::string &key);
+    bool erase_entry(const std::string &key);
+    Entry* find_live(const std::string &key);
+    template <typename T> T* find_typed(const std::string &key);
+    template <typename T> T* find_for_write(const std::string &key);
+    template <typename T> T& find_or_create(const std::string &key);
+    void check_element(const std::string &key, const std::string &element) const;
 };
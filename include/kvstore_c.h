@@ -0,0 +1,151 @@
+#ifndef KVSTORE_C_H
+#define KVSTORE_C_H
+
+/*
+C API of libkvstore, for embedding the store in another process.
+
+all calls are thread safe. keys and values are byte strings passed as
+pointer + length, they don't need to be NUL terminated. any bytes (empty,
+line breaks, NULs) come back the same from the AOF and on followers, the
+log lines quote and escape them. a store opened with
+a replication port acts as a leader: kvstore followers can connect to it
+and get every write made through this API.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct kvstore kvstore_t;
+typedef struct kvstore_iter kvstore_iter_t;
+
+/* return / status codes */
+#define KVSTORE_OK                    0
+#define KVSTORE_NOT_FOUND             1
+#define KVSTORE_ERR_INVALID          -1  /* bad argument, key or value over the limit */
+#define KVSTORE_ERR_WRONGTYPE        -2  /* the key holds a hash, list, set or sorted set */
+#define KVSTORE_ERR_BUFFER_TOO_SMALL -3  /* the needed size is stored in *value_len */
+#define KVSTORE_ERR_INTERNAL         -4
+#define KVSTORE_ERR_CORRUPT          -5  /* kvstore_open: the AOF holds a record that can't be applied (see stderr) */
+
+typedef struct kvstore_options {
+    const char *aof_path;   /* append only file, replayed on open. NULL: in memory only */
+    int replication_port;   /* > 0: accept followers on this port */
+    size_t max_key_len;     /* 0: default (1 KB) */
+    size_t max_value_len;   /* 0: default (1 MB) */
+
+    /*
+    values of at least compress_threshold bytes are stored, logged and
+    replicated compressed (0: off). the optional dictionary must be the same
+    on the followers and on every later open of the same AOF.
+    */
+    size_t compress_threshold;
+    const char *compress_dictionary;
+    size_t compress_dictionary_len;
+
+    /*
+    tiered storage: with tier_dir set, string values beyond tier_memory bytes
+    (0: 1 GB) are moved to segment files in that directory, least recently
+    used first, and read back through a cache of tier_cache bytes (0: 64 MB).
+    */
+    const char *tier_dir;
+    size_t tier_memory;
+    size_t tier_cache;
+
+    /* > 0: cache this many bytes of string values for lock free reads */
+    size_t read_cache;
+    /* non-zero: the read cache only admits the keys currently tracked as hot */
+    int hot_read_cache;
+} kvstore_options_t;
+
+/* options may be NULL for an in memory store with default limits */
+int kvstore_open(const kvstore_options_t *options, kvstore_t **out);
+void kvstore_close(kvstore_t *kv);
+
+/* ttl_seconds <= 0 means no expiry */
+int kvstore_set(kvstore_t *kv,
+                const char *key, size_t key_len,
+                const char *value, size_t value_len,
+                int ttl_seconds);
+
+/*
+copies the value into buf. on KVSTORE_OK and KVSTORE_ERR_BUFFER_TOO_SMALL
+*value_len holds the size of the value.
+*/
+int kvstore_get(kvstore_t *kv,
+                const char *key, size_t key_len,
+                char *buf, size_t buf_len, size_t *value_len);
+
+/* KVSTORE_OK if the key was deleted, KVSTORE_NOT_FOUND if it did not exist */
+int kvstore_del(kvstore_t *kv, const char *key, size_t key_len);
+
+/*
+atomically adds delta to an integer value (a missing key counts as 0) and
+stores the result in *result. KVSTORE_ERR_INVALID if the value is not an
+integer or the result would overflow.
+*/
+int kvstore_incrby(kvstore_t *kv, const char *key, size_t key_len,
+                   int64_t delta, int64_t *result);
+
+
+/* ---------------- batches ---------------- */
+
+typedef enum {
+    KVSTORE_OP_SET = 0,
+    KVSTORE_OP_DEL = 1
+} kvstore_op_type_t;
+
+typedef struct kvstore_op {
+    kvstore_op_type_t type;
+    const char *key;
+    size_t key_len;
+    const char *value;      /* SET only */
+    size_t value_len;
+    int ttl_seconds;        /* SET only, <= 0 for no expiry */
+} kvstore_op_t;
+
+/*
+applies all the operations atomically under one lock, they are logged and
+replicated as one MULTI/EXEC block. if an operation is invalid nothing is applied.
+*/
+int kvstore_write_batch(kvstore_t *kv, const kvstore_op_t *ops, size_t count);
+
+/*
+reads `count` keys under one lock. for each key i the value goes to bufs[i]
+(capacity buf_lens[i]), its size to value_lens[i] and its status (OK,
+NOT_FOUND, ERR_WRONGTYPE, ERR_BUFFER_TOO_SMALL) to statuses[i].
+*/
+int kvstore_mget(kvstore_t *kv, size_t count,
+                 const char *const *keys, const size_t *key_lens,
+                 char **bufs, const size_t *buf_lens,
+                 size_t *value_lens, int *statuses);
+
+
+/* ---------------- iteration ---------------- */
+
+/*
+walks the string keys matching a glob pattern (NULL: all keys) with a
+cursor scan, without blocking writers for the whole iteration. keys that
+exist for the whole iteration are returned at least once, keys added or
+removed meanwhile may or may not be.
+*/
+kvstore_iter_t *kvstore_iter_new(kvstore_t *kv, const char *pattern);
+
+/*
+KVSTORE_OK and the next key/value, or KVSTORE_NOT_FOUND at the end.
+the pointers stay valid until the next call on this iterator.
+*/
+int kvstore_iter_next(kvstore_iter_t *it,
+                      const char **key, size_t *key_len,
+                      const char **value, size_t *value_len);
+
+void kvstore_iter_free(kvstore_iter_t *it);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* KVSTORE_C_H */
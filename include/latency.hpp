@@ -0,0 +1,141 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <chrono>
+#include <cstdint>
+
+/*
+per request latency breakdown.
+
+the server opens a RequestTrace for every command on the thread that runs
+it; the code on the way adds the time it spends to its stage (StageTimer
+for the AOF write, the replication send...; the store adds the time it
+waited for its lock). when the command is done, LatencyMonitor folds the
+trace into one histogram per stage and keeps it in the slow log if it took
+long enough.
+
+timestamps come from steady_clock (a vDSO call, ~20ns), a traced command
+costs a handful of them.
+*/
+enum class Stage {
+    Parse,      // tokenize
+    LockWait,   // blocked on the store lock
+    Execute,    // running the command, minus the other stages
+    Aof,        // writing the AOF
+    Replicate,  // sending to the followers
+    Send,       // sending the reply
+    Total,
+};
+
+constexpr size_t kStageCount = static_cast<size_t>(Stage::Total) + 1;
+
+const char *stage_name(Stage stage);
+
+
+struct RequestTrace {
+    std::array<uint64_t, kStageCount> ns{};
+};
+
+// the trace of the command running on this thread, null outside of one
+RequestTrace *&current_trace();
+
+inline uint64_t elapsed_ns(std::chrono::steady_clock::time_point since) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - since).count();
+}
+
+// adds the lifetime of the timer to a stage of the current trace, if any
+class StageTimer {
+public:
+    explicit StageTimer(Stage stage) : stage_(stage), trace_(current_trace()) {
+        if (trace_) start_ = std::chrono::steady_clock::now();
+    }
+    ~StageTimer() {
+        if (trace_) trace_->ns[static_cast<size_t>(stage_)] += elapsed_ns(start_);
+    }
+
+    StageTimer(const StageTimer &) = delete;
+    StageTimer &operator=(const StageTimer &) = delete;
+
+private:
+    Stage stage_;
+    RequestTrace *trace_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+
+/*
+lock free log-linear histogram of nanosecond values: 8 sub-buckets per
+power of two, so percentiles are within ~12% of the real value.
+*/
+class LatencyHistogram {
+public:
+    LatencyHistogram();
+
+    void record(uint64_t ns);
+    void reset();
+
+    uint64_t count() const;
+    uint64_t max() const { return max_.load(std::memory_order_relaxed); }
+    // upper bound of the bucket holding the p-th percentile (0 < p <= 1)
+    uint64_t percentile(double p) const;
+
+private:
+    static constexpr size_t kSubBits = 3;
+    static constexpr size_t kBuckets = 64 << kSubBits;
+
+    std::unique_ptr<std::atomic<uint64_t>[]> buckets_;
+    std::atomic<uint64_t> max_{0};
+
+    static size_t bucket_of(uint64_t ns);
+    static uint64_t bucket_limit(size_t bucket);
+};
+
+
+class LatencyMonitor {
+public:
+    struct SlowEntry {
+        uint64_t id;
+        // unix time in seconds
+        int64_t time;
+        RequestTrace trace;
+        // the command, arguments cut to a few bytes
+        std::string command;
+    };
+
+    // commands taking at least `slow_threshold_us` go to the slow log, which keeps the last `slow_max` of them
+    explicit LatencyMonitor(uint64_t slow_threshold_us = 10000, size_t slow_max = 128);
+
+    void record(const RequestTrace &trace, const std::vector<std::string> &tokens);
+
+    // newest first
+    std::vector<SlowEntry> slowlog(size_t count) const;
+    size_t slowlog_len() const;
+    void slowlog_reset();
+
+    const LatencyHistogram &histogram(Stage stage) const { return histograms_[static_cast<size_t>(stage)]; }
+    void reset();
+
+    void configure_slowlog(uint64_t threshold_us, size_t max_len);
+
+private:
+    std::array<LatencyHistogram, kStageCount> histograms_;
+
+    std::atomic<uint64_t> slow_threshold_ns_;
+    size_t slow_max_;
+    mutable std::mutex slow_mutex_;
+    std::deque<SlowEntry> slow_;
+    uint64_t next_slow_id_{0};
+};
+
+// nanoseconds as microseconds with one decimal, "12.3us"
+std::string format_us(uint64_t ns);
+
+// "parse=1.2us lock=0.0us ..." for SLOWLOG replies
+std::string format_breakdown(const RequestTrace &trace);
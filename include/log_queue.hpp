@@ -0,0 +1,49 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <initializer_list>
+#include <cstdint>
+
+/*
+keeps the log in write order without doing its I/O under the store lock. a
+write appends its lines while it still holds the lock (just a memory copy,
+so the queue order is the apply order) and gets a sequence number back;
+once the lock is released it calls flush() with that number. one thread at
+a time hands everything queued so far to the sink (the AOF and the
+followers), so concurrent writers share one write and none returns before
+its own lines went out.
+*/
+class LogQueue {
+public:
+    using Sink = std::function<void(const std::string &lines)>;
+
+    explicit LogQueue(Sink sink) : sink_(std::move(sink)) {}
+
+    LogQueue(const LogQueue &) = delete;
+    LogQueue &operator=(const LogQueue &) = delete;
+
+    // call under the store lock of the write the lines belong to
+    uint64_t append(std::string_view lines);
+
+    // same for one command, encoded straight into the queue (see ::append_command)
+    uint64_t append_command(std::initializer_list<std::string_view> args);
+
+    // returns once every line up to `seq` reached the sink (0: nothing to wait for). call without the store lock
+    void flush(uint64_t seq);
+
+private:
+    Sink sink_;
+
+    std::mutex queue_mutex_;
+    std::string queue_;
+    uint64_t appended_{0};
+
+    // held while the sink runs, so flushes go out one after the other, in order
+    std::mutex flush_mutex_;
+    std::string writing_;
+    std::atomic<uint64_t> written_{0};
+};
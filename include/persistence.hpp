@@ -4,6 +4,12 @@
 #include <optional>
 #include <thread>
 #include <atomic>
+#include <vector>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cstdint>
 
 /*
 this is a forward declaration:
@@ -12,12 +18,39 @@ we do this to avoid heavy headers in .hpp (#include <kvstore.hpp>) - at least th
 */
 class KVStore;
 
+/*
+the AOF is split in parts, named after `filename`:
+    data.aof.manifest   which parts make up the log, in replay order
+    data.aof.base.<n>   a snapshot written by the last rewrite
+    data.aof.incr.<n>   the commands appended since (one or more)
+
+a rewrite switches the appends over to a new incr part, snapshots the
+store, writes the snapshot as the new base and then swaps the manifest,
+so appends never wait for the rewrite and never end up in a file that is
+about to be replaced. a plain data.aof from before is replayed as the
+base and goes away with the first rewrite.
+*/
 class PersistenceManager {
     public:
+        /*
+        the AOF is rewritten once the incr parts hold at least `min_size`
+        bytes and `growth_percent` % of the base. the base is written at
+        `rate_mb` MB/s at most (0 = no limit).
+        */
+        struct RewritePolicy {
+                size_t min_size{64 << 20};
+                unsigned growth_percent{100};
+                size_t rate_mb{0};
+        };
+
         PersistenceManager(
             const KVStore &store, 
             const std::string& filename = "data.aof"
         );
+        ~PersistenceManager();
+
+        PersistenceManager(const PersistenceManager &) = delete;
+        PersistenceManager &operator=(const PersistenceManager &) = delete;
 
         void append_set(
             const std::string& key,
@@ -26,19 +59,90 @@ class PersistenceManager {
         );
         
         void append_del(const std::string& key);
+
+        // log any other write command as a single line
+        void append_command(const std::vector<std::string>& args);
+
+        // append already encoded command lines in one write (MULTI ... EXEC blocks)
+        void append_raw(const std::string& lines);
+
+        /*
+        held (shared) by a writer from logging a command until the store has
+        applied it. a rewrite takes it exclusively to switch parts and mark
+        the snapshot point, so every command is either in the snapshot or
+        after it.
+        */
+        std::shared_lock<std::shared_mutex> write_gate() {
+                return std::shared_lock<std::shared_mutex>(gate_);
+        }
         
         // replay the commands in the file
         void replay(KVStore& store);
+
+        void set_rewrite_policy(const RewritePolicy &policy) { policy_ = policy; }
         
-        
+        // checks every second whether a rewrite is due (see rewrite_needed)
         void start_save_state_thread();
         void stop_save_state_thread();
+
+        /*
+        true when the incr parts grew past the policy. a node that logs
+        nothing itself (a follower) is rewritten when its store changed,
+        at most every 15s.
+        */
+        bool rewrite_needed() const;
+
+        // rewrites the AOF from the store right away (at full speed if not `throttled`)
+        void save_state(bool throttled = true);
+
+        /*
+        for a store without locking (--cores): the snapshot is taken on the
+        calling thread, which owns the store, and the base is written out by
+        a background thread. false if the last one is still running.
+        */
+        bool save_state_in_background();
         
         private:
         std:: string filename_;
         const KVStore &store_;
+        RewritePolicy policy_;
+
+        std::shared_mutex gate_;
+
+        // guards the manifest fields and the open incr part
+        std::mutex append_mutex_;
+        int incr_fd_{-1};
+        std::string base_;
+        std::vector<std::string> incrs_;
+        uint64_t next_part_{1};
+        std::atomic<size_t> base_bytes_{0};
+        std::atomic<size_t> incr_bytes_{0};
+
+        // one rewrite at a time
+        std::mutex rewrite_mutex_;
+        std::atomic<uint64_t> saved_version_{0};
+        std::atomic<int64_t> last_rewrite_ms_{0};
+
         std::thread save_state_thread_;
+        std::thread background_thread_;
+        std::atomic<bool> background_running_{false};
+        // an unthrottled save_state() is waiting for the background rewrite
+        std::atomic<bool> full_speed_{false};
         std::atomic<bool> thread_should_stop_{false};
-        
-        void save_state();
-};
\ No newline at end of file
+        // wakes the save thread up early on stop
+        std::mutex stop_mutex_;
+        std::condition_variable stop_cv_;
+
+        std::string manifest_path() const { return filename_ + ".manifest"; }
+        std::string part_path(const char *kind, uint64_t n) const;
+        // start appending to a new incr part (caller holds append_mutex_)
+        bool open_new_incr();
+        // write the manifest atomically (caller holds append_mutex_)
+        void write_manifest();
+
+        // the two halves of a rewrite: snapshot the store, then write it as the new base
+        struct Rewrite;
+        bool snapshot(Rewrite& rewrite);
+        void write_base(Rewrite& rewrite, bool throttled);
+        void join_background();
+};
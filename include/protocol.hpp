@@ -0,0 +1,75 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <string_view>
+#include <initializer_list>
+
+/*
+helpers for the text protocol shared by the server, the AOF and the
+replication stream: every write ends up as one command line, so the same
+encoder/parser is used on all three paths. nothing here depends on the
+store, so the proxy links it on its own.
+*/
+
+/*
+tokenizes a command line, respecting quoted strings with spaces and escape
+sequences (\\, \", \n and \r). "" is an empty token. returns a vector of
+parsed tokens suitable for command processing.
+*/
+std::vector<std::string> tokenize(std::string_view line);
+
+/*
+same, into `tokens`: the strings already in there are reused, so a
+connection that keeps its vector around tokenizes without allocating once
+its strings have grown to size.
+*/
+void tokenize(std::string_view line, std::vector<std::string> &tokens);
+
+/*
+splits a line without quotes on spaces into views of it, no copies. such a
+line tokenizes to exactly these words. returns false (and leaves `words`
+alone) if the line has quotes, those need tokenize().
+*/
+bool split_words(std::string_view line, std::vector<std::string_view> &words);
+
+/*
+appends one token to a command line, quoted and escaped if needed. any
+byte string survives a round trip through tokenize(): empty tokens and the
+EX keyword are always quoted, line breaks are escaped.
+*/
+void append_token(std::string &out, std::string_view token);
+
+// joins arguments into one command line (with trailing '\n'), quoting where needed
+std::string encode_command(const std::vector<std::string> &args);
+
+// same, appended to `out`, for hot paths that have the arguments at hand as views
+void append_command(std::string &out, std::initializer_list<std::string_view> args);
+
+// commands answered with an array reply (see encode_array)
+bool has_array_reply(const std::string &cmd);
+
+// commands that never modify the store, so a follower can answer them
+bool is_read_command(const std::string &cmd);
+
+// array replies are sent as "*<count>\n" followed by one line per element
+std::string encode_array(const std::vector<std::string> &items);
+
+// shortest representation of a score that parses back to the same double
+std::string format_score(double score);
+
+// parses a score, throws std::invalid_argument on garbage / NaN
+double parse_score(const std::string &s);
+
+// parses a ZRANGEBYSCORE bound: "1.5", "(1.5" (exclusive), "-inf", "+inf"
+double parse_score_bound(const std::string &s, bool &exclusive);
+
+/*
+base64 for binary payloads (compressed values) that have to fit on one
+command line. decode throws std::invalid_argument on malformed input.
+*/
+std::string base64_encode(std::string_view data);
+std::string base64_decode(std::string_view text);
+
+// redis style glob matching: *, ?, [abc], [a-z], [^abc] and \ escapes
+bool glob_match(const std::string &pattern, const std::string &str);
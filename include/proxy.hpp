@@ -0,0 +1,67 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <functional>
+#include <atomic>
+#include <cstdint>
+#include "client.hpp"
+
+/*
+kvstore-proxy: speaks the normal text protocol to clients and spreads the
+keys over several independent leaders, for clients that know nothing about
+cluster mode.
+
+- keys are placed with a consistent hash ring (virtual nodes), so adding a
+  backend only moves about 1/N of the keys. a {tag} inside the key is hashed
+  instead of the whole key, like in cluster mode.
+- every backend is a KVClient with a few long lived connections; requests
+  from all the clients are pipelined over them.
+- MGET is split into one MGET per backend and the replies are merged.
+- reads can go to a backend's followers instead of its leader.
+*/
+
+// consistent hash ring, maps a key to a backend index
+class HashRing {
+public:
+    static constexpr int kVirtualNodes = 160;
+
+    void add(size_t backend, const std::string &name);
+    size_t lookup(const std::string &key) const;
+
+private:
+    std::map<uint64_t, size_t> ring_;
+};
+
+
+class ProxyServer {
+public:
+    struct Options {
+        int port{9000};
+        size_t connections_per_backend{2};
+        bool read_from_followers{false};
+    };
+
+    // each element: the leader followed by its followers
+    ProxyServer(const Options &options, const std::vector<std::vector<NodeAddress>> &shards);
+
+    // accept clients until `running` turns false (blocking)
+    void start(std::atomic<bool> &running);
+
+private:
+    Options options_;
+    std::vector<std::unique_ptr<KVClient>> backends_;
+    HashRing ring_;
+
+    void handle_client(int client_fd);
+
+    /*
+    starts one command; the returned function waits for and returns its reply.
+    a client always uses the same backend connections (picked by `client_id`)
+    so its commands reach each backend in the order it sent them.
+    */
+    std::function<std::string()> forward(const std::string &line, size_t client_id);
+    std::function<std::string()> forward_mget(const std::vector<std::string> &tokens, size_t client_id);
+};
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <set>
+#include <map>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <atomic>
+
+/*
+one subscribed connection. publishers only ever push onto its queue, the
+connection's own thread writes the queue out to the socket, so a slow
+reader never blocks a publisher.
+
+the queue is bounded in bytes: a subscriber that falls further behind is
+disconnected (its socket is shut down, which wakes its thread up to clean
+up), the publisher drops it from the fan-out and moves on.
+*/
+class Subscriber {
+public:
+    Subscriber(int fd, size_t max_pending_bytes);
+    ~Subscriber();
+
+    Subscriber(const Subscriber &) = delete;
+    Subscriber &operator=(const Subscriber &) = delete;
+
+    // readable when there is something to flush()
+    int event_fd() const { return event_fd_; }
+
+    // publisher side, false if the subscriber went over its limit
+    bool push(const std::shared_ptr<const std::string> &message);
+
+    // connection thread: sends what is queued, false if the connection must be closed
+    bool flush();
+
+    /*
+    channels and patterns. changed under the PubSub lock, and only from the
+    connection's own thread, so that thread can read them without it.
+    */
+    std::set<std::string> channels;
+    std::set<std::string> patterns;
+
+    size_t subscriptions() const { return channels.size() + patterns.size(); }
+
+private:
+    int fd_;
+    int event_fd_;
+    size_t max_pending_;
+
+    std::mutex mutex_;
+    std::deque<std::shared_ptr<const std::string>> queue_;
+    size_t pending_bytes_{0};
+    bool overflowed_{false};
+};
+
+
+/*
+PubSub: channel and pattern subscriptions of one server.
+
+PUBLISH encodes the message once into a shared buffer, every receiver's
+queue just takes another reference to it. publishers share the lock, only
+(un)subscribing takes it exclusively.
+
+messages are array replies: "*3\nmessage\n<channel>\n<payload>\n", or
+"*4\npmessage\n<pattern>\n<channel>\n<payload>\n" for pattern matches.
+*/
+class PubSub {
+public:
+    explicit PubSub(size_t max_pending_bytes = 32 << 20);
+
+    // output buffer limit of subscribers created from now on
+    void set_max_pending(size_t bytes) { max_pending_ = bytes; }
+
+    std::shared_ptr<Subscriber> make_subscriber(int fd) const;
+
+    // these return the number of channels + patterns the subscriber is left with
+    size_t subscribe(const std::shared_ptr<Subscriber> &sub, const std::string &channel);
+    size_t unsubscribe(const std::shared_ptr<Subscriber> &sub, const std::string &channel);
+    size_t psubscribe(const std::shared_ptr<Subscriber> &sub, const std::string &pattern);
+    size_t punsubscribe(const std::shared_ptr<Subscriber> &sub, const std::string &pattern);
+    void unsubscribe_all(const std::shared_ptr<Subscriber> &sub);
+
+    // returns the number of subscribers that got the message
+    size_t publish(const std::string &channel, const std::string &message);
+
+    bool has_subscribers() const { return subscriptions_.load(std::memory_order_relaxed) > 0; }
+
+    /*
+    keyspace notifications: publishes `event` on "__keyspace__:<key>" and
+    `key` on "__keyevent__:<event>". free while nobody is subscribed.
+    */
+    void notify(const char *event, const std::string &key);
+
+private:
+    size_t max_pending_;
+
+    mutable std::shared_mutex mutex_;
+    std::unordered_map<std::string, std::vector<std::shared_ptr<Subscriber>>> channels_;
+    std::map<std::string, std::vector<std::shared_ptr<Subscriber>>> patterns_;
+    std::atomic<size_t> subscriptions_{0};
+
+    // removes `sub` from the list under `name`, caller holds the lock exclusively
+    template <typename Map>
+    bool remove(Map &map, const std::string &name, const std::shared_ptr<Subscriber> &sub);
+};
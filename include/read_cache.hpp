@@ -0,0 +1,82 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <atomic>
+#include <memory>
+#include <optional>
+#include <chrono>
+#include <cstdint>
+#include "epoch.hpp"
+
+/*
+ReadCache: copies of string values that GET can read without taking the
+store lock.
+
+readers walk the buckets under an epoch pin; nodes are immutable once
+published. writers (serialized by the store's exclusive lock) prepend new
+nodes with a single atomic store, and remove one by publishing a copy of
+the nodes in front of it, retiring the originals to the epoch domain.
+
+the store keeps it exact: every write to a key invalidates it before the
+lock is released, so a hit always returns the current value (or one that
+was current while the GET ran). misses fall back to the locked path, which
+puts plain strings back in.
+*/
+class ReadCache {
+public:
+    using TimePoint = std::chrono::steady_clock::time_point;
+
+    explicit ReadCache(size_t capacity_bytes);
+    ~ReadCache();
+
+    ReadCache(const ReadCache &) = delete;
+    ReadCache &operator=(const ReadCache &) = delete;
+
+    // lock free. calls f(std::string_view) while the value is pinned, false on a miss
+    template <typename F>
+    bool view(const std::string &key, F &&f) const {
+        auto guard = EpochDomain::global().pin();
+
+        const Node *node = find(key, hash_of(key));
+        if (!node || (node->expires_at && *node->expires_at <= std::chrono::steady_clock::now())) {
+            return false;
+        }
+
+        // tested first so hits on a hot key don't keep writing its cache line
+        if (!node->referenced.load(std::memory_order_relaxed)) {
+            node->referenced.store(true, std::memory_order_relaxed);
+        }
+        f(std::string_view(node->value));
+        return true;
+    }
+
+    // writers, the caller serializes them
+    void put(const std::string &key, std::string_view value, std::optional<TimePoint> expires_at);
+    void invalidate(const std::string &key);
+
+private:
+    struct Node {
+        std::string key;
+        std::string value;
+        std::optional<TimePoint> expires_at;
+        size_t hash;
+        const Node *next;
+        // set by readers, entries read since the last sweep survive eviction
+        mutable std::atomic<bool> referenced{false};
+    };
+
+    size_t capacity_;
+    size_t size_{0};
+    size_t mask_;
+    std::unique_ptr<std::atomic<const Node *>[]> buckets_;
+    size_t hand_{0};
+
+    static size_t hash_of(const std::string &key) { return std::hash<std::string>{}(key); }
+    static size_t node_size(const Node &node) { return sizeof(Node) + node.key.size() + node.value.size(); }
+
+    const Node *find(const std::string &key, size_t hash) const;
+    // republishes bucket `b` without the nodes `drop` says no to
+    template <typename P> void rebuild_bucket(size_t b, P &&drop);
+    void evict();
+};
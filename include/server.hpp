@@ -1,14 +1,23 @@
 #pragma once
 
 #include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
 #include <thread>
 #include <atomic>
+#include <memory>
 #include <netinet/in.h>
+#include "latency.hpp"
+#include "pubsub.hpp"
+#include "log_queue.hpp"
 
 enum class NodeRole;
 class KVStore;
 class PersistenceManager;
 class ReplicationManager;
+class ClusterManager;
 
 class TCPServer {
 public:
@@ -18,7 +27,8 @@ public:
         KVStore &store, 
         PersistenceManager &file,
         NodeRole role,
-        ReplicationManager &replica
+        ReplicationManager &replica,
+        ClusterManager *cluster = nullptr
         );
 
     // Start accepting clients (blocking)
@@ -26,11 +36,80 @@ public:
 
     // Handle one connected client
     void handle_client(int client_fd);
-    
-    
+
+    /*
+    runs one tokenized command (no transactions, no cluster redirects) and
+    returns the reply, errors included. the --cores mode uses a TCPServer
+    per core this way, without ever calling start().
+    */
+    std::string execute(const std::vector<std::string> &tokens);
+
+    // per stage latency histograms and the slow log (LATENCY / SLOWLOG)
+    LatencyMonitor &latency() { return latency_; }
+
+    // channel subscriptions (SUBSCRIBE / PUBLISH), keyspace notifications go through it too
+    PubSub &pubsub() { return pubsub_; }
+
+    // print every received command line (debugging only, it serializes all clients on stdout)
+    void set_log_commands(bool enabled) { log_commands_ = enabled; }
     
     private:
-    void handle_command(int client_fd, const std::string& line);
+    // per connection state, only touched by the connection's own thread
+    struct ClientState {
+        int fd;
+        bool in_multi{false};
+        std::vector<std::vector<std::string>> queued;
+        // key -> watch_version() seen at WATCH time
+        std::unordered_map<std::string, uint64_t> watched;
+        // cluster mode: the next command may touch a slot being imported
+        bool asking{false};
+        // set once the connection subscribes to something
+        std::shared_ptr<Subscriber> subscriber;
+        // the current command, its strings are reused from one command to the next
+        std::vector<std::string> tokens;
+        // the same as views of the receive buffer, for lines without quotes
+        std::vector<std::string_view> words;
+    };
+
+    void handle_command(ClientState &client, std::string_view line);
+
+    // runs one tokenized command and returns the response line(s)
+    std::string dispatch(const std::vector<std::string> &tokens);
+
+    /*
+    SET key value [EX ttl]. the arguments may be views of the receive
+    buffer: the value is copied once into the store and encoded once into
+    the log queue, nowhere else.
+    */
+    std::string set_command(const std::vector<std::string_view> &args);
+    // execute() for a SET split by split_words()
+    std::string execute_set(const std::vector<std::string_view> &args);
+
+    // MULTI / EXEC / DISCARD / WATCH / UNWATCH
+    std::string transaction_command(ClientState &client, const std::vector<std::string> &tokens);
+    std::string exec_transaction(ClientState &client);
+
+    // cluster mode: MOVED / ASK reply if the command's keys live elsewhere, "" otherwise
+    std::string redirect(const ClientState &client, const std::vector<std::string> &tokens);
+
+    std::string scan_command(const std::vector<std::string> &tokens);
+    std::string slowlog_command(const std::vector<std::string> &tokens);
+    std::string latency_command(const std::vector<std::string> &tokens);
+    // SUBSCRIBE / UNSUBSCRIBE / PSUBSCRIBE / PUNSUBSCRIBE
+    std::string pubsub_command(ClientState &client, const std::vector<std::string> &tokens);
+
+    // send a write to the followers and the AOF
+    void propagate(const std::vector<std::string> &args);
+    // same for the current state of a key (a SET or a DELETE)
+    void propagate_state(const std::string &key);
+    // same for already encoded command lines
+    void propagate_lines(const std::string &lines);
+    // same, encoded straight into the log queue
+    void propagate_command(std::initializer_list<std::string_view> args);
+    // writes whatever this thread queued in log_, once the store lock is released
+    void flush_log();
+    // the sink of log_: the followers, then the AOF
+    void write_log(const std::string &lines);
 
     PersistenceManager &file_;
     int port_;
@@ -38,6 +117,12 @@ public:
     KVStore &store_;
     NodeRole role_;
     ReplicationManager &replica_;
+    ClusterManager *cluster_;
+    LatencyMonitor latency_;
+    PubSub pubsub_;
+    // writes queue their lines here under the store lock, the I/O happens after it
+    LogQueue log_;
+    bool log_commands_{false};
     // i am leaving it for now
     std::atomic<bool> running_;
 };
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <functional>
+#include <cstdint>
+#include "spsc_queue.hpp"
+#include "persistence.hpp"
+
+class KVStore;
+
+/*
+--cores mode: shared nothing, one thread per core.
+
+the keyspace is split into `cores` partitions by hash slot (slot % cores,
+so keys sharing a {hashtag} stay together). each worker owns one partition
+outright: its own KVStore with locking disabled, its own AOF
+(data-<core>.aof), its own listening socket on the common port
+(SO_REUSEPORT, the kernel spreads the connections) and an epoll loop.
+
+a command for a key owned by another worker is forwarded through a lock
+free SPSC queue (one per pair of workers) and the reply comes back the
+same way. replies on a connection are always sent in request order, MGET
+is split per key and merged.
+
+not available in this mode: transactions, WATCH, SCAN, replication and
+cluster mode.
+*/
+class ShardedServer {
+public:
+    struct Options {
+        int port{8000};
+        size_t cores{1};
+        // worker i writes <aof_prefix>-<i>.aof
+        std::string aof_prefix{"data"};
+        PersistenceManager::RewritePolicy aof_rewrite;
+        bool pin_threads{true};
+    };
+
+    // applied to each partition before its AOF is replayed
+    using Configure = std::function<void(KVStore &store, size_t core)>;
+
+    ShardedServer(const Options &options, Configure configure);
+    ~ShardedServer();
+
+    ShardedServer(const ShardedServer &) = delete;
+    ShardedServer &operator=(const ShardedServer &) = delete;
+
+    // runs the workers until `running` turns false (blocking)
+    void start(std::atomic<bool> &running);
+
+private:
+    struct Message;
+    struct Worker;
+
+    Options options_;
+    std::vector<std::unique_ptr<Worker>> workers_;
+    // queues_[from * cores + to]
+    std::vector<std::unique_ptr<SpscQueue<Message *>>> queues_;
+
+    SpscQueue<Message *> &queue(size_t from, size_t to) { return *queues_[from * options_.cores + to]; }
+
+    size_t owner(const std::string &key) const;
+
+    void run(Worker &worker, std::atomic<bool> &running);
+    void handle_line(Worker &worker, uint64_t conn_id, const std::string &line);
+    void route(Worker &worker, uint64_t conn_id, uint64_t seq, size_t part, std::vector<std::string> tokens);
+    void deliver(Worker &worker, uint64_t conn_id, uint64_t seq, size_t part, std::string reply);
+    void forward(Worker &worker, size_t to, Message *message);
+    void drain_inbound(Worker &worker);
+    void flush_outbound(Worker &worker);
+
+    void accept_clients(Worker &worker);
+    void read_client(Worker &worker, uint64_t conn_id);
+    void write_client(Worker &worker, uint64_t conn_id);
+    void close_client(Worker &worker, uint64_t conn_id);
+};
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <cstddef>
+
+/*
+bounded single producer / single consumer ring buffer. one thread pushes,
+one thread pops, neither ever takes a lock. head and tail live on their
+own cache lines, and each side caches the other's index so it only reads
+the shared one when the queue looks full (or empty).
+*/
+template <typename T>
+class SpscQueue {
+public:
+    // capacity is rounded up to a power of two
+    explicit SpscQueue(size_t capacity) {
+        size_t size = 2;
+        while (size < capacity) size *= 2;
+
+        mask_ = size - 1;
+        slots_ = std::make_unique<T[]>(size);
+    }
+
+    SpscQueue(const SpscQueue &) = delete;
+    SpscQueue &operator=(const SpscQueue &) = delete;
+
+    // producer side, false if the queue is full
+    bool try_push(T value) {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+
+        if (tail - cached_head_ > mask_) {
+            cached_head_ = head_.load(std::memory_order_acquire);
+            if (tail - cached_head_ > mask_) return false;
+        }
+
+        slots_[tail & mask_] = std::move(value);
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // consumer side, false if the queue is empty
+    bool try_pop(T &out) {
+        size_t head = head_.load(std::memory_order_relaxed);
+
+        if (head == cached_tail_) {
+            cached_tail_ = tail_.load(std::memory_order_acquire);
+            if (head == cached_tail_) return false;
+        }
+
+        out = std::move(slots_[head & mask_]);
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    size_t mask_;
+    std::unique_ptr<T[]> slots_;
+
+    // written by the consumer
+    alignas(64) std::atomic<size_t> head_{0};
+    size_t cached_tail_{0};
+
+    // written by the producer
+    alignas(64) std::atomic<size_t> tail_{0};
+    size_t cached_head_{0};
+};
@@ -0,0 +1,150 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <cstdint>
+
+/*
+on-disk tier for cold string values.
+
+values evicted from memory are appended to segment files in a directory
+(segment-<id>.dat), the key stays in the keyspace with a SpilledValue that
+points at the bytes. overwriting or deleting a spilled key only marks its
+bytes dead; segments that are mostly dead get compacted by copying their
+live records to the active segment and removing the file.
+
+the directory is scratch space: the AOF is still the source of truth, so
+whatever is in it is wiped on startup.
+*/
+
+// one segment file, closed once the last value pointing into it is gone
+class Segment {
+public:
+    Segment(uint32_t id, int fd, std::string path) : id_(id), fd_(fd), path_(std::move(path)) {}
+    ~Segment();
+
+    Segment(const Segment &) = delete;
+    Segment &operator=(const Segment &) = delete;
+
+    uint32_t id() const { return id_; }
+    const std::string &path() const { return path_; }
+
+    // pread of `length` bytes, throws std::runtime_error on I/O errors
+    std::string read(uint64_t offset, uint32_t length) const;
+
+private:
+    uint32_t id_;
+    int fd_;
+    std::string path_;
+};
+
+
+// a value living on disk. holding it keeps the segment readable, even
+// after compaction removed the file from the directory
+struct SpilledValue {
+    std::shared_ptr<const Segment> segment;
+    uint64_t offset{0};
+    uint32_t length{0};
+
+    // a CompressedValue is spilled as is, these describe how to inflate it
+    bool compressed{false};
+    uint32_t raw_size{0};
+    uint32_t dictionary_id{0};
+
+    // the bytes as written (still compressed if `compressed`)
+    std::string read() const { return segment->read(offset, length); }
+};
+
+
+class ValueLog {
+public:
+    // records: key length, value length (u32 each), key, value
+    struct Record {
+        std::string key;
+        uint64_t offset;    // of the value
+        std::string value;
+    };
+
+    explicit ValueLog(std::string dir, uint64_t segment_size = 64ull << 20);
+    // removes the segment files, they mean nothing without the keyspace
+    ~ValueLog();
+
+    ValueLog(const ValueLog &) = delete;
+    ValueLog &operator=(const ValueLog &) = delete;
+
+    // appends a value, rolling over to a new segment when the active one is full
+    SpilledValue append(const std::string &key, std::string_view bytes);
+
+    // the value at `value` is no longer referenced by the keyspace
+    void release(const SpilledValue &value);
+
+    // sealed segments with less than `live_ratio` of their bytes still live
+    std::vector<std::shared_ptr<const Segment>> compaction_candidates(double live_ratio);
+
+    /*
+    the records of a sealed segment from `offset` on, dead ones included,
+    read about `max_bytes` at a time (a bigger record comes alone). advances
+    `offset` past them, an empty result means the end of the segment.
+    */
+    std::vector<Record> records(const Segment &segment, uint64_t &offset, size_t max_bytes) const;
+
+    // forgets a compacted segment and unlinks its file
+    void retire(const std::shared_ptr<const Segment> &segment);
+
+    uint64_t disk_bytes() const;
+    uint64_t live_bytes() const;
+
+private:
+    struct SegmentInfo {
+        std::shared_ptr<const Segment> segment;
+        uint64_t written{0};
+        uint64_t live{0};
+    };
+
+    std::string dir_;
+    uint64_t segment_size_;
+
+    mutable std::mutex mutex_;
+    std::unordered_map<uint32_t, SegmentInfo> segments_;
+    uint32_t next_id_{0};
+
+    // the segment being appended to, its fd is shared with the Segment
+    uint32_t active_id_{0};
+    int active_fd_{-1};
+    uint64_t active_size_{0};
+
+    void open_segment();
+};
+
+
+/*
+LRU cache of values read back from disk, so a cold key that turns hot is
+not read from the segment on every GET. keyed by segment and offset, which
+are never reused, so entries can't go stale.
+*/
+class ValueCache {
+public:
+    explicit ValueCache(size_t capacity) : capacity_(capacity) {}
+
+    bool get(const SpilledValue &value, std::string &out);
+    void put(const SpilledValue &value, const std::string &bytes);
+
+private:
+    using Key = std::pair<uint32_t, uint64_t>;
+
+    struct KeyHash {
+        size_t operator()(const Key &k) const { return std::hash<uint64_t>()(k.second * 31 + k.first); }
+    };
+
+    size_t capacity_;
+    size_t size_{0};
+
+    std::mutex mutex_;
+    std::list<std::pair<Key, std::string>> lru_;   // most recent first
+    std::unordered_map<Key, std::list<std::pair<Key, std::string>>::iterator, KeyHash> index_;
+};
@@ -0,0 +1,477 @@
+#include "client.hpp"
+#include "protocol.hpp"
+#include <cstring>
+#include <type_traits>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+
+/* ---------------- small socket helpers ---------------- */
+
+static int connect_to(const NodeAddress &address) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+
+    // bounds connect() and send(), replies are waited for by the reader thread
+    timeval timeout{};
+    timeout.tv_sec = 2;
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    // pipelined requests are small, don't let nagle hold them back
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr(address.host.c_str());
+    addr.sin_port = htons(address.port);
+
+    if (connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
+static bool send_all(int fd, const std::string &data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0) return false;
+        sent += n;
+    }
+    return true;
+}
+
+
+NodeAddress parse_address(const std::string &text) {
+    size_t colon = text.rfind(':');
+    if (colon == std::string::npos || colon == 0 || colon + 1 == text.size()) {
+        throw std::invalid_argument("expected host:port, got '" + text + "'");
+    }
+    return {text.substr(0, colon), std::stoi(text.substr(colon + 1))};
+}
+
+
+/*
+returns the size of the complete reply starting at `offset` in `buffer`, 0 if
+it is not all there yet. array replies are "*<count>" plus count lines; an
+array command can still answer with a single error line.
+*/
+static size_t reply_length(const std::string &buffer, size_t offset, bool array_reply) {
+    size_t end = buffer.find('\n', offset);
+    if (end == std::string::npos) return 0;
+
+    if (array_reply && buffer[offset] == '*') {
+        long count = std::strtol(buffer.c_str() + offset + 1, nullptr, 10);
+        for (long i = 0; i < count; i++) {
+            end = buffer.find('\n', end + 1);
+            if (end == std::string::npos) return 0;
+        }
+    }
+    return end + 1 - offset;
+}
+
+
+static Reply parse_reply(const std::string &raw, bool array_reply) {
+    Reply reply;
+    size_t end = raw.find('\n');
+    std::string first = raw.substr(0, end);
+
+    if (!array_reply || first.empty() || first[0] != '*') {
+        reply.value = std::move(first);
+        return reply;
+    }
+
+    reply.array = true;
+    size_t pos = end + 1;
+    while (pos < raw.size()) {
+        end = raw.find('\n', pos);
+        reply.elements.push_back(raw.substr(pos, end - pos));
+        pos = end + 1;
+    }
+    return reply;
+}
+
+
+bool Reply::is_error() const {
+    return !array && (value.rfind("ERROR", 0) == 0 || value.rfind("WRONGTYPE", 0) == 0);
+}
+
+
+/* ---------------- connection ---------------- */
+
+Connection::Connection(NodeAddress address)
+    : address_(std::move(address)) {
+    reader_ = std::thread(&Connection::reader_loop, this);
+}
+
+
+Connection::~Connection() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+        if (fd_ >= 0) shutdown(fd_, SHUT_RDWR);
+    }
+    connected_cv_.notify_one();
+    reader_.join();
+
+    if (fd_ >= 0) close(fd_);
+}
+
+
+void Connection::send(std::string line, bool array_reply, Callback callback) {
+    std::vector<Request> requests;
+    requests.push_back({std::move(line), array_reply, std::move(callback)});
+    send(std::move(requests));
+}
+
+
+void Connection::send(std::vector<Request> requests) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        // the reader gave up on the old socket, nobody else touches it once the writer is done
+        if (broken_ && !writing_) {
+            close(fd_);
+            fd_ = -1;
+            broken_ = false;
+        }
+
+        if (fd_ < 0) {
+            fd_ = connect_to(address_);
+            if (fd_ >= 0) connected_cv_.notify_one();
+        }
+
+        if (fd_ >= 0 && !broken_) {
+            for (auto &r : requests) {
+                outbox_ += r.line;
+                pending_.push_back({r.array_reply, std::move(r.callback)});
+            }
+
+            // the thread already writing picks our requests up with its next send()
+            if (writing_) return;
+            writing_ = true;
+            requests.clear();
+        }
+    }
+
+    if (!requests.empty()) {
+        std::string error = "ERROR: can't connect to " + address_.to_string() + "\n";
+        for (auto &r : requests) {
+            r.callback(error, true);
+        }
+        return;
+    }
+
+    flush();
+}
+
+
+void Connection::flush() {
+    std::string data;
+
+    while (true) {
+        int fd;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (outbox_.empty() || broken_) {
+                outbox_.clear();
+                writing_ = false;
+                return;
+            }
+            data.swap(outbox_);
+            fd = fd_;
+        }
+
+        // a failed write is cleaned up by the reader, which sees the socket die too
+        if (!send_all(fd, data)) {
+            shutdown(fd, SHUT_RDWR);
+        }
+        data.clear();
+    }
+}
+
+
+std::deque<Connection::Pending> Connection::disconnect() {
+    shutdown(fd_, SHUT_RDWR);
+    broken_ = true;
+    outbox_.clear();
+
+    std::deque<Pending> lost;
+    lost.swap(pending_);
+    return lost;
+}
+
+
+void Connection::reader_loop() {
+    std::string buffer;
+    char chunk[16384];
+    std::vector<std::pair<Callback, std::string>> done;
+
+    while (true) {
+        int fd;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            connected_cv_.wait(lock, [&] { return stopping_ || (fd_ >= 0 && !broken_); });
+            if (stopping_) return;
+            fd = fd_;
+        }
+
+        buffer.clear();
+        bool failed = false;
+
+        while (!failed) {
+            ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+            if (n <= 0) break;
+            buffer.append(chunk, n);
+
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                size_t offset = 0;
+
+                while (offset < buffer.size()) {
+                    if (pending_.empty()) {
+                        // a reply nobody asked for, we lost track of the stream
+                        failed = true;
+                        break;
+                    }
+
+                    size_t len = reply_length(buffer, offset, pending_.front().array_reply);
+                    if (len == 0) break;
+
+                    done.emplace_back(std::move(pending_.front().callback), buffer.substr(offset, len));
+                    pending_.pop_front();
+                    offset += len;
+                }
+                buffer.erase(0, offset);
+            }
+
+            // callbacks may send again, so they run without the lock
+            for (auto &d : done) {
+                d.first(std::move(d.second), false);
+            }
+            done.clear();
+        }
+
+        std::deque<Pending> lost;
+        bool stopping;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping = stopping_;
+            lost = disconnect();
+        }
+
+        std::string error = "ERROR: lost connection to " + address_.to_string() + "\n";
+        for (auto &p : lost) {
+            p.callback(error, true);
+        }
+        if (stopping) return;
+    }
+}
+
+
+ConnectionPool::ConnectionPool(const std::vector<NodeAddress> &nodes, size_t per_node) {
+    for (size_t i = 0; i < per_node; i++) {
+        for (const auto &node : nodes) {
+            connections_.push_back(std::make_unique<Connection>(node));
+        }
+    }
+}
+
+
+Connection &ConnectionPool::get(size_t affinity) {
+    return *connections_[affinity % connections_.size()];
+}
+
+
+/* ---------------- client ---------------- */
+
+// small per thread number, spreads the calling threads over the pool connections
+static size_t thread_affinity() {
+    static std::atomic<size_t> next_id{0};
+    thread_local size_t id = next_id++;
+    return id;
+}
+
+
+KVClient::KVClient(const Options &options)
+    : leader_address_(options.leader),
+    leader_({options.leader}, std::max<size_t>(options.connections, 1)),
+    followers_(options.followers, std::max<size_t>(options.connections, 1)),
+    read_from_followers_(options.read_from_followers && !options.followers.empty()) {}
+
+
+Connection &KVClient::connection_for(const std::string &cmd, size_t affinity) {
+    if (read_from_followers_ && is_read_command(cmd)) {
+        return followers_.get(affinity);
+    }
+    return leader_.get(affinity);
+}
+
+
+void KVClient::command(const std::vector<std::string> &args, std::function<void(Reply)> callback) {
+    if (args.empty()) {
+        throw std::invalid_argument("empty command");
+    }
+
+    bool array_reply = has_array_reply(args[0]);
+    bool to_follower = read_from_followers_ && is_read_command(args[0]);
+    std::string line = encode_command(args);
+    size_t affinity = thread_affinity();
+
+    connection_for(args[0], affinity).send(line, array_reply,
+        [this, line, array_reply, to_follower, affinity, callback](std::string raw, bool failed) {
+            if (failed && to_follower) {
+                // the follower is gone, the leader can answer the read too
+                leader_.get(affinity).send(line, array_reply, [array_reply, callback](std::string raw, bool) {
+                    callback(parse_reply(raw, array_reply));
+                });
+                return;
+            }
+            callback(parse_reply(raw, array_reply));
+        });
+}
+
+
+std::future<Reply> KVClient::command(const std::vector<std::string> &args) {
+    auto promise = std::make_shared<std::promise<Reply>>();
+    auto future = promise->get_future();
+
+    command(args, [promise](Reply reply) { promise->set_value(std::move(reply)); });
+    return future;
+}
+
+
+// runs `args` and fulfills the future with convert(reply), error replies become KVClientError
+template <typename T, typename F>
+static std::future<T> typed_command(KVClient &client, const std::vector<std::string> &args, F convert) {
+    auto promise = std::make_shared<std::promise<T>>();
+    auto future = promise->get_future();
+
+    client.command(args, [promise, convert](Reply reply) {
+        if (reply.is_error()) {
+            promise->set_exception(std::make_exception_ptr(KVClientError(reply.value)));
+            return;
+        }
+
+        try {
+            if constexpr (std::is_void_v<T>) {
+                convert(reply);
+                promise->set_value();
+            } else {
+                promise->set_value(convert(reply));
+            }
+        } catch (...) {
+            promise->set_exception(std::current_exception());
+        }
+    });
+    return future;
+}
+
+
+std::future<std::optional<std::string>> KVClient::get(const std::string &key) {
+    return typed_command<std::optional<std::string>>(*this, {"GET", key}, [](Reply &reply) {
+        return reply.is_null() ? std::nullopt : std::optional<std::string>(std::move(reply.value));
+    });
+}
+
+
+std::future<void> KVClient::set(
+    const std::string &key,
+    const std::string &value,
+    std::optional<int> ttl_seconds
+) {
+    std::vector<std::string> args{"SET", key, value};
+    if (ttl_seconds) {
+        args.push_back("EX");
+        args.push_back(std::to_string(*ttl_seconds));
+    }
+
+    return typed_command<void>(*this, args, [](Reply &reply) {
+        if (reply.value != "OK") throw KVClientError("unexpected reply: " + reply.value);
+    });
+}
+
+
+std::future<bool> KVClient::del(const std::string &key) {
+    return typed_command<bool>(*this, {"DELETE", key}, [](Reply &reply) {
+        return reply.value == "OK";
+    });
+}
+
+
+std::future<std::vector<std::optional<std::string>>> KVClient::mget(const std::vector<std::string> &keys) {
+    std::vector<std::string> args{"MGET"};
+    args.insert(args.end(), keys.begin(), keys.end());
+
+    return typed_command<std::vector<std::optional<std::string>>>(*this, args, [](Reply &reply) {
+        std::vector<std::optional<std::string>> values;
+        values.reserve(reply.elements.size());
+
+        for (auto &e : reply.elements) {
+            if (e == "NULL") {
+                values.emplace_back(std::nullopt);
+            } else {
+                values.emplace_back(std::move(e));
+            }
+        }
+        return values;
+    });
+}
+
+
+std::vector<Reply> KVClient::batch(const std::vector<std::vector<std::string>> &commands) {
+    bool read_only = true;
+    for (const auto &args : commands) {
+        if (args.empty()) throw std::invalid_argument("empty command");
+        if (!is_read_command(args[0])) read_only = false;
+    }
+
+    std::vector<std::promise<Reply>> promises(commands.size());
+    std::vector<Connection::Request> requests;
+    requests.reserve(commands.size());
+
+    for (size_t i = 0; i < commands.size(); i++) {
+        bool array_reply = has_array_reply(commands[i][0]);
+        std::promise<Reply> *promise = &promises[i];
+
+        requests.push_back({encode_command(commands[i]), array_reply,
+            [promise, array_reply](std::string raw, bool) {
+                promise->set_value(parse_reply(raw, array_reply));
+            }});
+    }
+
+    size_t affinity = thread_affinity();
+    Connection &connection = (read_only && read_from_followers_) ?
+        followers_.get(affinity) : leader_.get(affinity);
+    connection.send(std::move(requests));
+
+    std::vector<Reply> replies;
+    replies.reserve(commands.size());
+    for (auto &p : promises) {
+        replies.push_back(p.get_future().get());
+    }
+    return replies;
+}
+
+
+void KVClient::set_many(const std::vector<std::pair<std::string, std::string>> &items) {
+    std::vector<std::vector<std::string>> commands;
+    commands.reserve(items.size());
+
+    for (const auto &item : items) {
+        commands.push_back({"SET", item.first, item.second});
+    }
+
+    for (const auto &reply : batch(commands)) {
+        if (reply.is_error()) {
+            throw KVClientError(reply.value);
+        }
+    }
+}
@@ -0,0 +1,916 @@
+#include "cluster.hpp"
+#include "kvstore.hpp"
+#include "persistence.hpp"
+#include "replication.hpp"
+#include "protocol.hpp"
+#include "command_log.hpp"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <random>
+#include <cstring>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+
+/* ---------------- hash slots ---------------- */
+
+// CRC16-CCITT (XMODEM), the variant redis cluster uses
+static constexpr std::array<uint16_t, 256> make_crc16_table() {
+    std::array<uint16_t, 256> table{};
+
+    for (int i = 0; i < 256; i++) {
+        uint16_t crc = static_cast<uint16_t>(i << 8);
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x8000) ? static_cast<uint16_t>((crc << 1) ^ 0x1021)
+                                 : static_cast<uint16_t>(crc << 1);
+        }
+        table[i] = crc;
+    }
+    return table;
+}
+
+static constexpr auto kCrc16Table = make_crc16_table();
+
+
+static uint16_t crc16(const char *buf, size_t len) {
+    uint16_t crc = 0;
+    for (size_t i = 0; i < len; i++) {
+        crc = static_cast<uint16_t>((crc << 8) ^ kCrc16Table[((crc >> 8) ^ static_cast<uint8_t>(buf[i])) & 0xff]);
+    }
+    return crc;
+}
+
+
+uint16_t key_hash_slot(const std::string &key) {
+    size_t open = key.find('{');
+
+    if (open != std::string::npos) {
+        size_t close = key.find('}', open + 1);
+        if (close != std::string::npos && close != open + 1) {
+            return crc16(key.data() + open + 1, close - open - 1) & (kClusterSlots - 1);
+        }
+    }
+    return crc16(key.data(), key.size()) & (kClusterSlots - 1);
+}
+
+
+/* ---------------- small socket helpers ---------------- */
+
+static int connect_to(const std::string &host, int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+
+    // nobody on the bus should be able to hang us for long
+    timeval timeout{};
+    timeout.tv_sec = 2;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr(host.c_str());
+    addr.sin_port = htons(port);
+
+    if (connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
+static bool send_all(int fd, const std::string &data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0) return false;
+        sent += n;
+    }
+    return true;
+}
+
+
+// reads one '\n' terminated line, `buffer` keeps whatever came after it
+static bool read_line(int fd, std::string &buffer, std::string &line) {
+    size_t pos;
+    while ((pos = buffer.find('\n')) == std::string::npos) {
+        char chunk[4096];
+        ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+        if (n <= 0) return false;
+        buffer.append(chunk, n);
+    }
+
+    line = buffer.substr(0, pos);
+    buffer.erase(0, pos + 1);
+    return true;
+}
+
+
+static std::string random_node_id() {
+    static const char hex[] = "0123456789abcdef";
+    std::random_device rd;
+    std::string id(40, '0');
+
+    for (auto &c : id) {
+        c = hex[rd() & 0xf];
+    }
+    return id;
+}
+
+
+// "0-5460,5462" for the slots owned by `id`, "-" if none
+static std::string slot_ranges(const std::array<std::string, kClusterSlots> &slots, const std::string &id) {
+    std::string out;
+
+    for (int s = 0; s < kClusterSlots; s++) {
+        if (slots[s] != id) continue;
+
+        int e = s;
+        while (e + 1 < kClusterSlots && slots[e + 1] == id) e++;
+
+        if (!out.empty()) out += ',';
+        out += std::to_string(s);
+        if (e != s) out += "-" + std::to_string(e);
+        s = e;
+    }
+    return out.empty() ? "-" : out;
+}
+
+
+template <typename F>
+static void for_each_slot(const std::string &ranges, F &&f) {
+    if (ranges == "-") return;
+
+    std::istringstream iss(ranges);
+    std::string range;
+
+    while (std::getline(iss, range, ',')) {
+        size_t dash = range.find('-');
+        int start = std::stoi(range.substr(0, dash));
+        int end = (dash == std::string::npos) ? start : std::stoi(range.substr(dash + 1));
+
+        for (int s = start; s <= end && s < kClusterSlots; s++) {
+            if (s >= 0) f(static_cast<uint16_t>(s));
+        }
+    }
+}
+
+
+/* ---------------- ClusterManager ---------------- */
+
+ClusterManager::ClusterManager(
+    KVStore &store,
+    PersistenceManager &file,
+    ReplicationManager &replica,
+    std::atomic<bool> &running,
+    const std::string &host,
+    int port,
+    const std::string &config_file
+)
+    : store_(store),
+    file_(file),
+    replica_(replica),
+    running_(running),
+    config_file_(config_file) {
+
+    myself_.id = random_node_id();
+    myself_.config_epoch = 0;
+    load_config();
+
+    // the address always comes from the command line, not from the saved config
+    myself_.host = host;
+    myself_.port = port;
+    myself_.bus_port = port + kClusterBusOffset;
+}
+
+
+void ClusterManager::start() {
+    bus_thread_ = std::thread(&ClusterManager::bus_loop, this);
+    gossip_thread_ = std::thread(&ClusterManager::gossip_loop, this);
+}
+
+
+void ClusterManager::stop() {
+    if (bus_thread_.joinable()) {
+        bus_thread_.join();
+    }
+    if (gossip_thread_.joinable()) {
+        gossip_thread_.join();
+        std::cout << "stopped cluster threads\n";
+    }
+}
+
+
+const ClusterManager::Node *ClusterManager::find_node(const std::string &id) const {
+    if (id == myself_.id) return &myself_;
+
+    auto it = nodes_.find(id);
+    return it == nodes_.end() ? nullptr : &it->second;
+}
+
+
+std::string ClusterManager::address_of(const std::string &id) const {
+    const Node *node = find_node(id);
+    return node ? node->host + ":" + std::to_string(node->port) : "?";
+}
+
+
+uint64_t ClusterManager::max_epoch() const {
+    uint64_t epoch = myself_.config_epoch;
+    for (const auto &n : nodes_) {
+        epoch = std::max(epoch, n.second.config_epoch);
+    }
+    return epoch;
+}
+
+
+// caller holds the exclusive lock
+void ClusterManager::bump_epoch() {
+    myself_.config_epoch = max_epoch() + 1;
+}
+
+
+ClusterManager::Route ClusterManager::route(const std::string &key, bool asking) const {
+    uint16_t slot = key_hash_slot(key);
+
+    std::shared_lock lock(mutex_);
+
+    const std::string &owner = slots_[slot];
+
+    if (owner.empty()) {
+        return {Route::Kind::Down, slot, ""};
+    }
+
+    if (owner == myself_.id) {
+        // keys already moved to the importing node are looked up there,
+        // keys being copied right now stay here until migrate() settles them
+        auto m = migrating_.find(slot);
+        if (m != migrating_.end() && !in_flight_.count(key) && store_.version(key) == 0) {
+            return {Route::Kind::Ask, slot, address_of(m->second)};
+        }
+        return {Route::Kind::Local, slot, ""};
+    }
+
+    if (asking && importing_.count(slot)) {
+        return {Route::Kind::Local, slot, ""};
+    }
+    return {Route::Kind::Moved, slot, address_of(owner)};
+}
+
+
+/* ---------------- bus ---------------- */
+
+/*
+bus messages are a few lines of text:
+    PING|PONG <id> <host> <port> <bus_port> <epoch> <slot ranges>
+    NODE <id> <host> <port> <bus_port> <epoch>      (one per other known node)
+    END
+*/
+std::string ClusterManager::build_message(const char *type) const {
+    std::shared_lock lock(mutex_);
+
+    std::string msg = std::string(type) + " " + myself_.id + " " + myself_.host + " " +
+        std::to_string(myself_.port) + " " + std::to_string(myself_.bus_port) + " " +
+        std::to_string(myself_.config_epoch) + " " + slot_ranges(slots_, myself_.id) + "\n";
+
+    for (const auto &n : nodes_) {
+        msg += "NODE " + n.second.id + " " + n.second.host + " " +
+            std::to_string(n.second.port) + " " + std::to_string(n.second.bus_port) + " " +
+            std::to_string(n.second.config_epoch) + "\n";
+    }
+    msg += "END\n";
+    return msg;
+}
+
+
+void ClusterManager::handle_message(const std::vector<std::string> &lines) {
+    if (lines.empty()) return;
+
+    std::istringstream header(lines[0]);
+    std::string type, ranges;
+    Node sender;
+
+    header >> type >> sender.id >> sender.host >> sender.port >> sender.bus_port
+           >> sender.config_epoch >> ranges;
+
+    if (!header || sender.id == myself_.id) return;
+
+    sender.last_pong = std::chrono::steady_clock::now();
+
+    std::unique_lock lock(mutex_);
+
+    bool changed = !nodes_.count(sender.id);
+    nodes_[sender.id] = sender;
+
+    // two nodes claiming with the same epoch: the smaller id moves on
+    if (sender.config_epoch == myself_.config_epoch && myself_.id < sender.id &&
+        slot_ranges(slots_, myself_.id) != "-") {
+        bump_epoch();
+        changed = true;
+    }
+
+    // a claim wins over the current owner only with a newer config epoch
+    for_each_slot(ranges, [&](uint16_t slot) {
+        std::string &owner = slots_[slot];
+        if (owner == sender.id) return;
+
+        const Node *current = owner.empty() ? nullptr : find_node(owner);
+        if (!current || current->config_epoch < sender.config_epoch) {
+            owner = sender.id;
+            migrating_.erase(slot);
+            importing_.erase(slot);
+            changed = true;
+        }
+    });
+
+    // learn about nodes we have not met yet, they will be pinged next round
+    for (size_t i = 1; i < lines.size(); i++) {
+        std::istringstream iss(lines[i]);
+        std::string tag;
+        Node node;
+
+        iss >> tag >> node.id >> node.host >> node.port >> node.bus_port >> node.config_epoch;
+
+        if (!iss || tag != "NODE" || node.id == myself_.id || nodes_.count(node.id)) {
+            continue;
+        }
+        nodes_[node.id] = node;
+        changed = true;
+    }
+
+    if (changed) {
+        lock.unlock();
+        save_config();
+    }
+}
+
+
+bool ClusterManager::ping(const std::string &host, int bus_port) {
+    int fd = connect_to(host, bus_port);
+    if (fd < 0) return false;
+
+    bool ok = send_all(fd, build_message("PING"));
+
+    std::vector<std::string> lines;
+    std::string buffer, line;
+
+    while (ok && (ok = read_line(fd, buffer, line)) && line != "END") {
+        lines.push_back(line);
+    }
+    close(fd);
+
+    if (ok) {
+        handle_message(lines);
+    }
+    return ok;
+}
+
+
+void ClusterManager::bus_loop() {
+    bus_fd_ = socket(AF_INET, SOCK_STREAM, 0);
+    if (bus_fd_ < 0) {
+        perror("cluster bus socket");
+        return;
+    }
+
+    int yes = 1;
+    setsockopt(bus_fd_, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(myself_.bus_port);
+
+    if (bind(bus_fd_, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(bus_fd_, 16) < 0) {
+        perror("cluster bus bind");
+        close(bus_fd_);
+        bus_fd_ = -1;
+        return;
+    }
+
+    std::cout << "[CLUSTER] bus listening on port " << myself_.bus_port << std::endl;
+
+    while (running_) {
+        fd_set read_fds;
+        FD_ZERO(&read_fds);
+        FD_SET(bus_fd_, &read_fds);
+
+        timeval timeout{};
+        timeout.tv_sec = 1;
+
+        if (select(bus_fd_ + 1, &read_fds, nullptr, nullptr, &timeout) <= 0) {
+            continue;
+        }
+
+        int fd = accept(bus_fd_, nullptr, nullptr);
+        if (fd < 0) continue;
+
+        timeval io_timeout{};
+        io_timeout.tv_sec = 2;
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &io_timeout, sizeof(io_timeout));
+
+        // exchanges are tiny, handle them inline
+        std::vector<std::string> lines;
+        std::string buffer, line;
+        bool ok;
+
+        while ((ok = read_line(fd, buffer, line)) && line != "END") {
+            lines.push_back(line);
+        }
+
+        if (ok) {
+            handle_message(lines);
+            send_all(fd, build_message("PONG"));
+        }
+        close(fd);
+    }
+
+    close(bus_fd_);
+    bus_fd_ = -1;
+}
+
+
+void ClusterManager::gossip_loop() {
+    while (running_) {
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+
+        std::vector<std::pair<std::string, int>> peers;
+        {
+            std::shared_lock lock(mutex_);
+            for (const auto &n : nodes_) {
+                peers.emplace_back(n.second.host, n.second.bus_port);
+            }
+        }
+
+        for (const auto &p : peers) {
+            if (!running_) break;
+            ping(p.first, p.second);
+        }
+    }
+}
+
+
+/* ---------------- CLUSTER command ---------------- */
+
+std::string ClusterManager::command(const std::vector<std::string> &tokens) {
+    if (tokens.size() < 2) {
+        return "ERROR: CLUSTER requires a subcommand\n";
+    }
+
+    const std::string &sub = tokens[1];
+
+    if (sub == "MYID") {
+        std::shared_lock lock(mutex_);
+        return myself_.id + "\n";
+    }
+
+    if (sub == "KEYSLOT" && tokens.size() >= 3) {
+        return std::to_string(key_hash_slot(tokens[2])) + "\n";
+    }
+
+    if (sub == "NODES") {
+        return cluster_nodes();
+    }
+
+    if (sub == "SLOTS") {
+        return cluster_slots();
+    }
+
+    if (sub == "INFO") {
+        std::shared_lock lock(mutex_);
+
+        size_t assigned = 0;
+        for (const auto &owner : slots_) {
+            if (!owner.empty()) assigned++;
+        }
+
+        return encode_array({
+            std::string("cluster_state:") + (assigned == kClusterSlots ? "ok" : "fail"),
+            "cluster_slots_assigned:" + std::to_string(assigned),
+            "cluster_known_nodes:" + std::to_string(nodes_.size() + 1),
+            "cluster_current_epoch:" + std::to_string(max_epoch()),
+            "cluster_my_epoch:" + std::to_string(myself_.config_epoch),
+        });
+    }
+
+    if (sub == "MEET" && tokens.size() >= 4) {
+        int port = std::stoi(tokens[3]);
+        if (!ping(tokens[2], port + kClusterBusOffset)) {
+            return "ERROR: could not reach " + tokens[2] + ":" + tokens[3] + "\n";
+        }
+        return "OK\n";
+    }
+
+    if ((sub == "ADDSLOTS" && tokens.size() >= 3) ||
+        (sub == "ADDSLOTSRANGE" && tokens.size() == 4)) {
+
+        std::vector<int> wanted;
+        if (sub == "ADDSLOTS") {
+            for (size_t i = 2; i < tokens.size(); i++) wanted.push_back(std::stoi(tokens[i]));
+        } else {
+            for (int s = std::stoi(tokens[2]); s <= std::stoi(tokens[3]); s++) wanted.push_back(s);
+        }
+
+        {
+            std::unique_lock lock(mutex_);
+
+            for (int s : wanted) {
+                if (s < 0 || s >= kClusterSlots) {
+                    return "ERROR: invalid slot " + std::to_string(s) + "\n";
+                }
+                if (!slots_[s].empty() && slots_[s] != myself_.id) {
+                    return "ERROR: slot " + std::to_string(s) + " is already busy\n";
+                }
+            }
+
+            for (int s : wanted) {
+                slots_[s] = myself_.id;
+            }
+            bump_epoch();
+        }
+        save_config();
+        return "OK\n";
+    }
+
+    if (sub == "COUNTKEYSINSLOT" && tokens.size() >= 3) {
+        return std::to_string(store_.count_keys_in_slot(std::stoi(tokens[2]))) + "\n";
+    }
+
+    if (sub == "GETKEYSINSLOT" && tokens.size() >= 4) {
+        return encode_array(store_.keys_in_slot(std::stoi(tokens[2]), std::stoul(tokens[3])));
+    }
+
+    if (sub == "SETSLOT") {
+        return setslot(tokens);
+    }
+
+    if (sub == "MIGRATE" && tokens.size() >= 4) {
+        int slot = std::stoi(tokens[2]);
+        size_t batch = tokens.size() >= 5 ? std::stoul(tokens[4]) : 100;
+
+        if (slot < 0 || slot >= kClusterSlots || batch == 0) {
+            return "ERROR: invalid slot or batch size\n";
+        }
+        return migrate(static_cast<uint16_t>(slot), tokens[3], batch);
+    }
+
+    return "ERROR: unknown CLUSTER subcommand\n";
+}
+
+
+// <id> <host>:<port>@<bus> <flags> <epoch> <slots>
+std::string ClusterManager::cluster_nodes() const {
+    std::shared_lock lock(mutex_);
+
+    std::vector<std::string> lines;
+    auto now = std::chrono::steady_clock::now();
+
+    auto describe = [&](const Node &n, bool me) {
+        std::string flags = me ? "myself" : "node";
+        if (!me && now - n.last_pong > std::chrono::seconds(5)) {
+            flags += ",pfail";
+        }
+        lines.push_back(n.id + " " + n.host + ":" + std::to_string(n.port) + "@" +
+            std::to_string(n.bus_port) + " " + flags + " " +
+            std::to_string(n.config_epoch) + " " + slot_ranges(slots_, n.id));
+    };
+
+    describe(myself_, true);
+    for (const auto &n : nodes_) {
+        describe(n.second, false);
+    }
+    return encode_array(lines);
+}
+
+
+// one line per contiguous slot range: <start> <end> <host>:<port> <id>
+std::string ClusterManager::cluster_slots() const {
+    std::shared_lock lock(mutex_);
+
+    std::vector<std::string> lines;
+
+    for (int s = 0; s < kClusterSlots; s++) {
+        if (slots_[s].empty()) continue;
+
+        int e = s;
+        while (e + 1 < kClusterSlots && slots_[e + 1] == slots_[s]) e++;
+
+        lines.push_back(std::to_string(s) + " " + std::to_string(e) + " " +
+            address_of(slots_[s]) + " " + slots_[s]);
+        s = e;
+    }
+    return encode_array(lines);
+}
+
+
+// CLUSTER SETSLOT <slot> IMPORTING <id> | MIGRATING <id> | NODE <id> | STABLE
+std::string ClusterManager::setslot(const std::vector<std::string> &tokens) {
+    if (tokens.size() < 4) {
+        return "ERROR: CLUSTER SETSLOT requires a slot and an action\n";
+    }
+
+    int s = std::stoi(tokens[2]);
+    const std::string &action = tokens[3];
+
+    if (s < 0 || s >= kClusterSlots) {
+        return "ERROR: invalid slot\n";
+    }
+
+    uint16_t slot = static_cast<uint16_t>(s);
+
+    {
+        std::unique_lock lock(mutex_);
+
+        if (action == "STABLE") {
+            migrating_.erase(slot);
+            importing_.erase(slot);
+            return "OK\n";
+        }
+
+        if (tokens.size() < 5) {
+            return "ERROR: CLUSTER SETSLOT " + action + " requires a node id\n";
+        }
+
+        const std::string &id = tokens[4];
+        if (!find_node(id)) {
+            return "ERROR: unknown node " + id + "\n";
+        }
+
+        if (action == "IMPORTING") {
+            importing_[slot] = id;
+            return "OK\n";
+        }
+
+        if (action == "MIGRATING") {
+            if (slots_[slot] != myself_.id) {
+                return "ERROR: I'm not the owner of hash slot " + tokens[2] + "\n";
+            }
+            migrating_[slot] = id;
+            return "OK\n";
+        }
+
+        if (action != "NODE") {
+            return "ERROR: invalid CLUSTER SETSLOT action\n";
+        }
+
+        slots_[slot] = id;
+        migrating_.erase(slot);
+        importing_.erase(slot);
+
+        // taking over a slot needs a newer epoch than the previous owner's
+        if (id == myself_.id) {
+            bump_epoch();
+        }
+    }
+    save_config();
+    return "OK\n";
+}
+
+
+/*
+moves every key of `slot` to the target node:
+1. the target marks the slot IMPORTING and we mark it MIGRATING, so clients
+   asking for keys that already moved are sent there with ASK.
+2. keys are sent in batches of `batch`: each key is snapshotted under the
+   store lock, serialized with the same commands used for snapshots and sent
+   prefixed with ASKING with no lock held. once the target acknowledged, the
+   key is deleted here only if its version did not change in the meantime.
+   the target's copy of a key written to meanwhile is deleted again, the key
+   stays here and a later batch copies it. keys in flight are never
+   redirected with ASK, so nobody sees the target's copy before it is settled.
+3. the target takes the slot with a bumped config epoch (SETSLOT NODE) and
+   gossip propagates the new owner.
+*/
+std::string ClusterManager::migrate(uint16_t slot, const std::string &target_id, size_t batch) {
+    Node target;
+    std::string my_id;
+    {
+        std::shared_lock lock(mutex_);
+
+        if (slots_[slot] != myself_.id) {
+            return "ERROR: I'm not the owner of hash slot " + std::to_string(slot) + "\n";
+        }
+        auto it = nodes_.find(target_id);
+        if (it == nodes_.end()) {
+            return "ERROR: unknown node " + target_id + "\n";
+        }
+        target = it->second;
+        my_id = myself_.id;
+    }
+
+    int fd = connect_to(target.host, target.port);
+    if (fd < 0) {
+        return "ERROR: could not connect to target node\n";
+    }
+
+    std::string buffer, reply;
+
+    if (!send_all(fd, encode_command({"CLUSTER", "SETSLOT", std::to_string(slot), "IMPORTING", my_id})) ||
+        !read_line(fd, buffer, reply) || reply != "OK") {
+        close(fd);
+        return "ERROR: target refused to import the slot: " + reply + "\n";
+    }
+
+    {
+        std::unique_lock lock(mutex_);
+        migrating_[slot] = target_id;
+    }
+
+    // sends `payload` and checks the `replies` acknowledgements, "" on success
+    auto exchange = [&](const std::string &payload, size_t replies) -> std::string {
+        if (!send_all(fd, payload)) {
+            return "lost connection to target node";
+        }
+        for (size_t i = 0; i < replies; i++) {
+            if (!read_line(fd, buffer, reply)) {
+                return "lost connection to target node";
+            }
+            if (reply.rfind("ERROR", 0) == 0 || reply.rfind("WRONGTYPE", 0) == 0 ||
+                reply.rfind("MOVED", 0) == 0 || reply.rfind("ASK", 0) == 0) {
+                return "target rejected a key: " + reply;
+            }
+        }
+        return "";
+    };
+
+    size_t moved = 0;
+    size_t stalled = 0;
+    std::string error;
+
+    while (error.empty()) {
+        auto keys = store_.keys_in_slot(slot, batch);
+        if (keys.empty()) break;
+
+        // taken before the store lock, route() locks in the other order
+        {
+            std::unique_lock lock(mutex_);
+            in_flight_.insert(keys.begin(), keys.end());
+        }
+
+        std::string payload;
+        size_t replies = 0;
+        std::vector<std::pair<std::string, uint64_t>> sent;   // key, version it was copied at
+
+        store_.batch([&] {
+            for (const auto &key : keys) {
+                auto item = store_.snapshot_key(key);
+                if (!item) continue;
+
+                std::string lines = encode_command({"DELETE", key});
+                encode_snapshot_item(*item, lines);
+
+                // every command needs its own ASKING, the flag is one-shot
+                size_t start = 0, end;
+                while ((end = lines.find('\n', start)) != std::string::npos) {
+                    payload += "ASKING\n";
+                    payload.append(lines, start, end - start + 1);
+                    replies += 2;
+                    start = end + 1;
+                }
+                sent.emplace_back(key, store_.version(key));
+            }
+        });
+
+        error = exchange(payload, replies);
+
+        std::vector<std::string> settled, stale;
+
+        if (error.empty()) {
+            // no write between its route() and the store, see route_gate()
+            auto aof_gate = file_.write_gate();
+            std::unique_lock<std::shared_mutex> gate(route_gate_);
+
+            std::string log;
+            store_.batch([&] {
+                for (const auto &[key, version] : sent) {
+                    uint64_t now = store_.version(key);
+
+                    if (now == version) {
+                        store_.del(key);
+                        log += encode_command({"DELETE", key});
+                        settled.push_back(key);
+                    } else {
+                        stale.push_back(key);
+                    }
+                }
+            });
+
+            // written after the store lock, the gates still keep every other write out
+            if (!log.empty()) {
+                file_.append_raw(log);
+                replica_.replicate_command(log);
+            }
+
+            // still under the gate: from here on writes to them are sent with ASK
+            std::unique_lock lock(mutex_);
+            for (const auto &key : settled) in_flight_.erase(key);
+        }
+
+        if (error.empty() && !stale.empty()) {
+            // written to or deleted while it was copied, drop the target's copy
+            payload.clear();
+            for (const auto &key : stale) {
+                payload += "ASKING\n" + encode_command({"DELETE", key});
+            }
+            error = exchange(payload, stale.size() * 2);
+        }
+
+        {
+            std::unique_lock lock(mutex_);
+            for (const auto &key : keys) in_flight_.erase(key);
+        }
+
+        moved += settled.size();
+
+        // a few keys rewritten faster than they can be copied
+        if (settled.empty() && !sent.empty()) {
+            if (++stalled >= kMigrateRetries && error.empty()) {
+                error = "keys kept changing while they were copied";
+            }
+        } else {
+            stalled = 0;
+        }
+    }
+
+    if (error.empty() &&
+        (!send_all(fd, encode_command({"CLUSTER", "SETSLOT", std::to_string(slot), "NODE", target_id})) ||
+         !read_line(fd, buffer, reply) || reply != "OK")) {
+        error = "target did not take over the slot: " + reply;
+    }
+    close(fd);
+
+    if (!error.empty()) {
+        // keys moved so far stay reachable through ASK until someone retries
+        return "ERROR: " + error + " (" + std::to_string(moved) + " keys moved)\n";
+    }
+
+    {
+        std::unique_lock lock(mutex_);
+        slots_[slot] = target_id;
+        migrating_.erase(slot);
+    }
+    save_config();
+
+    return "OK " + std::to_string(moved) + "\n";
+}
+
+
+/* ---------------- nodes.conf ---------------- */
+
+void ClusterManager::save_config() const {
+    std::shared_lock lock(mutex_);
+
+    std::string temp_file = config_file_ + ".temp";
+    std::ofstream file(temp_file, std::ios::trunc);
+
+    if (!file.is_open()) {
+        std::cerr << "failed to write cluster config\n";
+        return;
+    }
+
+    file << "myself " << myself_.id << " " << myself_.config_epoch << "\n";
+    file << "slots " << myself_.id << " " << slot_ranges(slots_, myself_.id) << "\n";
+
+    for (const auto &n : nodes_) {
+        file << "node " << n.second.id << " " << n.second.host << " " << n.second.port
+             << " " << n.second.bus_port << " " << n.second.config_epoch << "\n";
+        file << "slots " << n.second.id << " " << slot_ranges(slots_, n.second.id) << "\n";
+    }
+
+    file.close();
+    std::rename(temp_file.c_str(), config_file_.c_str());
+}
+
+
+void ClusterManager::load_config() {
+    std::ifstream file(config_file_);
+
+    if (!file.is_open()) {
+        return;
+    }
+
+    std::string line;
+
+    while (std::getline(file, line)) {
+        std::istringstream iss(line);
+        std::string tag;
+        iss >> tag;
+
+        if (tag == "myself") {
+            iss >> myself_.id >> myself_.config_epoch;
+        } else if (tag == "node") {
+            Node node;
+            iss >> node.id >> node.host >> node.port >> node.bus_port >> node.config_epoch;
+            if (iss) nodes_[node.id] = node;
+        } else if (tag == "slots") {
+            std::string id, ranges;
+            iss >> id >> ranges;
+            for_each_slot(ranges, [&](uint16_t slot) { slots_[slot] = id; });
+        }
+    }
+
+    std::cout << "[CLUSTER] loaded " << config_file_ << " (node " << myself_.id << ")\n";
+}
@@ -0,0 +1,285 @@
+#include "command_log.hpp"
+#include "protocol.hpp"
+#include <string_view>
+
+// collections are written back as several commands of at most this many elements
+static constexpr size_t kSnapshotChunk = 64;
+
+
+// writes `cmd key` followed by the elements in chunks of kSnapshotChunk
+static void encode_chunked(
+    const char *cmd,
+    const std::string &key,
+    const std::vector<std::string_view> &elements,
+    size_t per_item,
+    std::string &out
+) {
+    for (size_t i = 0; i < elements.size();) {
+        out += cmd;
+        out += ' ';
+        append_token(out, key);
+
+        for (size_t n = 0; n < kSnapshotChunk * per_item && i < elements.size(); n++, i++) {
+            out += ' ';
+            append_token(out, elements[i]);
+        }
+        out += '\n';
+    }
+}
+
+
+std::vector<std::string> compressed_set_args(
+    const std::string &key,
+    const CompressedValue &value,
+    std::optional<int> ttl_seconds
+) {
+    std::vector<std::string> args = {
+        "SETZ", key,
+        std::to_string(value.raw_size),
+        std::to_string(value.dictionary_id),
+        base64_encode(value.data)
+    };
+
+    if (ttl_seconds) {
+        args.push_back("EX");
+        args.push_back(std::to_string(*ttl_seconds));
+    }
+    return args;
+}
+
+
+void encode_snapshot_item(const KVStore::SnapshotItem &item, std::string &out) {
+    std::vector<std::string_view> elements;
+
+    if (auto str = std::get_if<std::string>(&item.value)) {
+        out += "SET ";
+        append_token(out, item.key);
+        out += ' ';
+        append_token(out, *str);
+
+        if (item.ttl_seconds) {
+            out += " EX " + std::to_string(*item.ttl_seconds);
+        }
+        out += '\n';
+
+    } else if (auto number = std::get_if<int64_t>(&item.value)) {
+        encode_snapshot_item({item.key, std::to_string(*number), item.ttl_seconds}, out);
+
+    } else if (auto packed = std::get_if<CompressedValue>(&item.value)) {
+        out += encode_command(compressed_set_args(item.key, *packed, item.ttl_seconds));
+
+    } else if (auto spilled = std::get_if<SpilledValue>(&item.value)) {
+        // read back from the value log only now, a snapshot doesn't pull the disk tier into memory
+        if (spilled->compressed) {
+            CompressedValue value{spilled->read(), spilled->raw_size, spilled->dictionary_id};
+            out += encode_command(compressed_set_args(item.key, value, item.ttl_seconds));
+        } else {
+            encode_snapshot_item({item.key, spilled->read(), item.ttl_seconds}, out);
+        }
+
+    } else if (auto hash = std::get_if<HashValue>(&item.value)) {
+        hash->for_each([&](std::string_view f, std::string_view v) {
+            elements.push_back(f);
+            elements.push_back(v);
+        });
+        encode_chunked("HSET", item.key, elements, 2, out);
+
+    } else if (auto list = std::get_if<ListValue>(&item.value)) {
+        // LPUSH prepends, so push from the tail to get the original order back
+        list->for_each([&](std::string_view v) { elements.push_back(v); });
+        std::vector<std::string_view> reversed(elements.rbegin(), elements.rend());
+        encode_chunked("LPUSH", item.key, reversed, 1, out);
+
+    } else if (auto set = std::get_if<SetValue>(&item.value)) {
+        set->for_each([&](std::string_view m) { elements.push_back(m); });
+        encode_chunked("SADD", item.key, elements, 1, out);
+
+    } else if (auto zset = std::get_if<ZSetValue>(&item.value)) {
+        // reserved up front so the views into `scores` stay valid
+        std::vector<std::string> scores;
+        scores.reserve(zset->size());
+
+        zset->for_each([&](std::string_view member, double score) {
+            scores.push_back(format_score(score));
+            elements.push_back(scores.back());
+            elements.push_back(member);
+        });
+        encode_chunked("ZADD", item.key, elements, 2, out);
+    }
+}
+
+
+std::string encode_key_state(const KVStore &store, const std::string &key) {
+    std::string out;
+
+    if (auto item = store.snapshot_key(key)) {
+        encode_snapshot_item(*item, out);
+    } else {
+        out = encode_command({"DELETE", key});
+    }
+    return out;
+}
+
+
+bool parse_compressed_set(
+    const std::vector<std::string> &tokens,
+    CompressedValue &value,
+    std::optional<int> &ttl_seconds
+) {
+    if (tokens.size() != 5 && tokens.size() != 7) return false;
+
+    try {
+        value.raw_size = static_cast<uint32_t>(std::stoul(tokens[2]));
+        value.dictionary_id = static_cast<uint32_t>(std::stoul(tokens[3]));
+        value.data = base64_decode(tokens[4]);
+
+        if (tokens.size() == 7) {
+            if (tokens[5] != "EX") return false;
+            ttl_seconds = std::stoi(tokens[6]);
+        }
+    } catch (const std::exception &) {
+        return false;
+    }
+    return true;
+}
+
+
+bool apply_logged_command(KVStore &store, const std::vector<std::string> &tokens) {
+    if (tokens.size() < 2) return false;
+
+    const std::string &cmd = tokens[0];
+    const std::string &key = tokens[1];
+
+    if (cmd == "SET") {
+        if (tokens.size() < 3) return false;
+
+        std::optional<int> ttl;
+
+        // logged as SET key value [EX ttl], the value is always one token (maybe "" or "EX")
+        if (tokens.size() == 3 || (tokens.size() == 5 && tokens[3] == "EX")) {
+            if (tokens.size() == 5) {
+                try {
+                    ttl = std::stoi(tokens[4]);
+                } catch (...) {
+                    return false;
+                }
+            }
+            return store.set(key, tokens[2], ttl);
+        }
+
+        // older logs wrote multi word values unquoted
+        std::string value;
+        size_t i = 2;
+
+        for (; i < tokens.size(); i++) {
+            if (tokens[i] == "EX") break;
+            if (!value.empty()) value += " ";
+            value += tokens[i];
+        }
+
+        if (i < tokens.size() && i + 1 < tokens.size()) {
+            try {
+                ttl = std::stoi(tokens[i + 1]);
+            } catch (...) {
+                return false;
+            }
+        }
+        return store.set(key, value, ttl);
+    }
+
+    if (cmd == "DELETE") {
+        store.del(key);
+        return true;
+    }
+
+    if (cmd == "SETZ") {
+        CompressedValue value;
+        std::optional<int> ttl;
+
+        if (!parse_compressed_set(tokens, value, ttl)) {
+            throw ReplayError("malformed SETZ record for key \"" + key + "\"");
+        }
+        if (value.dictionary_id != 0 && value.dictionary_id != store.compression_dictionary_id()) {
+            throw ReplayError("key \"" + key + "\" was compressed with dictionary " +
+                std::to_string(value.dictionary_id) + ", this store has " +
+                (store.compression_dictionary_id() ? std::to_string(store.compression_dictionary_id()) : "none") +
+                " (start with the --compress-dict it was written with)");
+        }
+        if (!store.check_compressed(value)) {
+            throw ReplayError("the compressed value of key \"" + key +
+                "\" does not decompress (corrupt, or over this store's value size limit)");
+        }
+        return store.set_compressed(key, std::move(value), ttl);
+    }
+
+    std::vector<std::string> args(tokens.begin() + 2, tokens.end());
+
+    try {
+        if (cmd == "HSET") {
+            if (args.empty() || args.size() % 2 != 0) return false;
+
+            std::vector<std::pair<std::string, std::string>> fields;
+            for (size_t i = 0; i < args.size(); i += 2) {
+                fields.emplace_back(args[i], args[i + 1]);
+            }
+            store.hset(key, fields);
+        } else if (cmd == "HDEL") {
+            store.hdel(key, args);
+        } else if (cmd == "LPUSH") {
+            store.lpush(key, args);
+        } else if (cmd == "RPOP") {
+            store.rpop(key);
+        } else if (cmd == "SADD") {
+            store.sadd(key, args);
+        } else if (cmd == "ZADD") {
+            if (args.empty() || args.size() % 2 != 0) return false;
+
+            std::vector<std::pair<double, std::string>> items;
+            for (size_t i = 0; i < args.size(); i += 2) {
+                items.emplace_back(parse_score(args[i]), args[i + 1]);
+            }
+            store.zadd(key, items);
+        } else if (cmd == "ZREM") {
+            store.zrem(key, args);
+        } else {
+            return false;
+        }
+    } catch (const std::exception &) {
+        return false;
+    }
+    return true;
+}
+
+
+void LogApplier::feed(const std::string &line) {
+    auto tokens = tokenize(line);
+
+    if (tokens.empty()) {
+        return;
+    }
+
+    if (tokens[0] == "MULTI") {
+        in_multi_ = true;
+        queued_.clear();
+        return;
+    }
+
+    if (tokens[0] == "EXEC") {
+        if (!in_multi_) return;
+
+        store_.batch([&] {
+            for (const auto &cmd : queued_) {
+                apply_logged_command(store_, cmd);
+            }
+        });
+        in_multi_ = false;
+        queued_.clear();
+        return;
+    }
+
+    if (in_multi_) {
+        queued_.push_back(std::move(tokens));
+    } else {
+        apply_logged_command(store_, tokens);
+    }
+}
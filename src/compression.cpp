@@ -0,0 +1,332 @@
+#include "compression.hpp"
+#include <cstring>
+#include <stdexcept>
+#include <algorithm>
+#include <queue>
+#include <unordered_map>
+#include <unordered_set>
+
+static constexpr size_t kMinMatch = 4;
+static constexpr size_t kMaxOffset = 65535;
+static constexpr int kHashLog = 16;
+// the format wants the last 5 bytes as literals and no match starting in the last 12
+static constexpr size_t kLastLiterals = 5;
+static constexpr size_t kMatchSearchLimit = 12;
+
+
+static uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+
+static uint32_t hash4(const uint8_t *p) {
+    return (read32(p) * 2654435761U) >> (32 - kHashLog);
+}
+
+
+static void append_length(std::string &out, size_t len) {
+    while (len >= 255) {
+        out += static_cast<char>(255);
+        len -= 255;
+    }
+    out += static_cast<char>(len);
+}
+
+
+// one sequence: literals followed by a match (match_len 0 for the final literals)
+static void emit_sequence(std::string &out, const uint8_t *literals, size_t literal_len,
+                          size_t offset, size_t match_len) {
+    size_t ml = match_len ? match_len - kMinMatch : 0;
+
+    uint8_t token = static_cast<uint8_t>((std::min<size_t>(literal_len, 15) << 4) | std::min<size_t>(ml, 15));
+    out += static_cast<char>(token);
+
+    if (literal_len >= 15) append_length(out, literal_len - 15);
+    out.append(reinterpret_cast<const char *>(literals), literal_len);
+
+    if (!match_len) return;
+
+    out += static_cast<char>(offset & 0xff);
+    out += static_cast<char>(offset >> 8);
+    if (ml >= 15) append_length(out, ml - 15);
+}
+
+
+/*
+positions run over the dictionary followed by the input, without copying
+them into one buffer: p < dict.size() is in the dictionary, the rest in the
+input. only a match that starts in the dictionary ever reads across.
+*/
+namespace {
+struct Window {
+    const uint8_t *dict;
+    const uint8_t *input;
+    size_t start;
+
+    uint8_t at(size_t p) const {
+        return p < start ? dict[p] : input[p - start];
+    }
+
+    uint32_t word(size_t p) const {
+        if (p >= start) return read32(input + p - start);
+        if (p + 4 <= start) return read32(dict + p);
+
+        uint8_t bytes[4] = {at(p), at(p + 1), at(p + 2), at(p + 3)};
+        return read32(bytes);
+    }
+};
+}
+
+
+std::string lz_compress(std::string_view input, std::string_view dictionary) {
+    if (dictionary.size() > kMaxOffset) {
+        dictionary.remove_prefix(dictionary.size() - kMaxOffset);
+    }
+
+    Window w{
+        reinterpret_cast<const uint8_t *>(dictionary.data()),
+        reinterpret_cast<const uint8_t *>(input.data()),
+        dictionary.size()
+    };
+    const uint8_t *in = w.input;
+    size_t start = w.start;
+    size_t end = start + input.size();
+
+    /*
+    kept per thread and never cleared: an entry left over from an earlier
+    call is just a bad guess. one that isn't behind ip is skipped, and the
+    bytes are compared before a match is taken anyway.
+    */
+    static thread_local std::vector<int32_t> table(size_t(1) << kHashLog, -1);
+
+    for (size_t p = 0; p + kMinMatch <= start; p++) {
+        table[hash4(w.dict + p)] = static_cast<int32_t>(p);
+    }
+
+    std::string out;
+    out.reserve(input.size() / 2 + 16);
+
+    size_t anchor = start;
+    size_t ip = start;
+
+    if (end - start > kMatchSearchLimit) {
+        size_t limit = end - kMatchSearchLimit;
+
+        while (ip < limit) {
+            const uint8_t *cur = in + (ip - start);
+            uint32_t h = hash4(cur);
+            int32_t ref = table[h];
+            table[h] = static_cast<int32_t>(ip);
+
+            if (ref < 0 || size_t(ref) >= ip || ip - ref > kMaxOffset || w.word(ref) != read32(cur)) {
+                // skip faster through data that doesn't compress
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+
+            size_t match = ref;
+            while (ip > anchor && match > 0 && w.at(ip - 1) == w.at(match - 1)) {
+                ip--;
+                match--;
+            }
+
+            size_t len = kMinMatch;
+            size_t max_len = end - kLastLiterals - ip;
+            if (match >= start) {
+                const uint8_t *a = in + (match - start);
+                const uint8_t *b = in + (ip - start);
+                while (len < max_len && a[len] == b[len]) len++;
+            } else {
+                while (len < max_len && w.at(match + len) == w.at(ip + len)) len++;
+            }
+
+            emit_sequence(out, in + (anchor - start), ip - anchor, ip - match, len);
+            ip += len;
+            anchor = ip;
+
+            if (ip < limit) {
+                table[hash4(in + (ip - 2 - start))] = static_cast<int32_t>(ip - 2);
+            }
+        }
+    }
+
+    emit_sequence(out, in + (anchor - start), end - anchor, 0, 0);
+    return out;
+}
+
+
+std::string lz_decompress(std::string_view input, size_t raw_size, std::string_view dictionary) {
+    if (dictionary.size() > kMaxOffset) {
+        dictionary.remove_prefix(dictionary.size() - kMaxOffset);
+    }
+
+    // dictionary followed by the output, so matches can reach back into it
+    std::string out(dictionary.size() + raw_size, '\0');
+    std::memcpy(out.data(), dictionary.data(), dictionary.size());
+
+    char *op = out.data() + dictionary.size();
+    char *out_end = out.data() + out.size();
+
+    const uint8_t *p = reinterpret_cast<const uint8_t *>(input.data());
+    const uint8_t *end = p + input.size();
+
+    auto corrupt = [] { return std::invalid_argument("corrupt compressed value"); };
+
+    auto read_length = [&](size_t len) {
+        if (len != 15) return len;
+        uint8_t b;
+        do {
+            if (p == end) throw corrupt();
+            b = *p++;
+            len += b;
+        } while (b == 255);
+        return len;
+    };
+
+    while (p < end) {
+        uint8_t token = *p++;
+
+        size_t literal_len = read_length(token >> 4);
+        if (literal_len > size_t(end - p) || literal_len > size_t(out_end - op)) throw corrupt();
+        std::memcpy(op, p, literal_len);
+        op += literal_len;
+        p += literal_len;
+
+        // the last sequence has no match
+        if (p == end) break;
+
+        if (end - p < 2) throw corrupt();
+        size_t offset = p[0] | (size_t(p[1]) << 8);
+        p += 2;
+
+        size_t match_len = read_length(token & 15) + kMinMatch;
+        if (offset == 0 || offset > size_t(op - out.data()) || match_len > size_t(out_end - op)) throw corrupt();
+
+        const char *match = op - offset;
+        if (offset >= match_len) {
+            std::memcpy(op, match, match_len);
+            op += match_len;
+        } else {
+            // overlapping match repeats the last `offset` bytes
+            for (size_t i = 0; i < match_len; i++) *op++ = match[i];
+        }
+    }
+
+    if (op != out_end) throw corrupt();
+
+    out.erase(0, dictionary.size());
+    return out;
+}
+
+
+uint32_t dictionary_id(std::string_view dictionary) {
+    if (dictionary.empty()) return 0;
+
+    uint32_t h = 2166136261u;
+    for (unsigned char c : dictionary) {
+        h ^= c;
+        h *= 16777619u;
+    }
+    return h ? h : 1;
+}
+
+
+/* ---------------- dictionary training ---------------- */
+
+static constexpr size_t kDmer = 8;
+static constexpr size_t kSegment = 256;
+static constexpr size_t kSegmentStride = 64;
+
+
+static uint64_t dmer_hash(const char *p) {
+    uint64_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v * 0x9E3779B97F4A7C15ULL;
+}
+
+
+std::string train_dictionary(const std::vector<std::string> &samples, size_t max_size) {
+    // in how many samples each 8 byte sequence shows up
+    std::unordered_map<uint64_t, uint32_t> frequency;
+
+    for (const auto &s : samples) {
+        std::unordered_set<uint64_t> seen;
+        for (size_t i = 0; i + kDmer <= s.size(); i++) {
+            if (seen.insert(dmer_hash(s.data() + i)).second) {
+                frequency[dmer_hash(s.data() + i)]++;
+            }
+        }
+    }
+
+    struct Segment {
+        const std::string *sample;
+        size_t pos;
+        size_t len;
+    };
+    std::vector<Segment> segments;
+
+    for (const auto &s : samples) {
+        for (size_t pos = 0; pos + kDmer <= s.size(); pos += kSegmentStride) {
+            segments.push_back({&s, pos, std::min(kSegment, s.size() - pos)});
+            if (pos + kSegment >= s.size()) break;
+        }
+    }
+
+    // what a segment adds: the frequency of the sequences in it not covered yet
+    auto score = [&](const Segment &seg) {
+        uint64_t total = 0;
+        std::unordered_set<uint64_t> counted;
+
+        for (size_t i = seg.pos; i + kDmer <= seg.pos + seg.len; i++) {
+            uint64_t h = dmer_hash(seg.sample->data() + i);
+            auto it = frequency.find(h);
+            if (it != frequency.end() && it->second > 1 && counted.insert(h).second) {
+                total += it->second;
+            }
+        }
+        return total;
+    };
+
+    // lazy greedy: a segment's score only goes down as others get picked
+    std::priority_queue<std::pair<uint64_t, size_t>> heap;
+    for (size_t i = 0; i < segments.size(); i++) {
+        heap.emplace(score(segments[i]), i);
+    }
+
+    std::vector<const Segment *> picked;
+    size_t size = 0;
+
+    while (!heap.empty() && size < max_size) {
+        auto [old_score, index] = heap.top();
+        heap.pop();
+
+        uint64_t current = score(segments[index]);
+        if (current == 0) break;
+
+        if (!heap.empty() && current < heap.top().first) {
+            heap.emplace(current, index);
+            continue;
+        }
+
+        const Segment &seg = segments[index];
+        picked.push_back(&seg);
+        size += seg.len;
+
+        for (size_t i = seg.pos; i + kDmer <= seg.pos + seg.len; i++) {
+            frequency.erase(dmer_hash(seg.sample->data() + i));
+        }
+    }
+
+    // best segments last, they get the shortest offsets
+    std::string dictionary;
+    for (auto it = picked.rbegin(); it != picked.rend(); ++it) {
+        dictionary.append(*(*it)->sample, (*it)->pos, (*it)->len);
+    }
+
+    if (dictionary.size() > max_size) {
+        dictionary.erase(0, dictionary.size() - max_size);
+    }
+    return dictionary;
+}
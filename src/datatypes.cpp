@@ -0,0 +1,646 @@
+#include "datatypes.hpp"
+#include <random>
+#include <new>
+
+
+/* ---------------- Listpack ---------------- */
+
+// decodes the length header at `p`, returns how many bytes the header takes
+size_t Listpack::read_header(Pos p, size_t &len) const {
+    len = 0;
+    size_t shift = 0;
+    size_t i = p;
+
+    while (true) {
+        unsigned char b = static_cast<unsigned char>(buf_[i++]);
+        len |= static_cast<size_t>(b & 0x7f) << shift;
+        if (!(b & 0x80)) break;
+        shift += 7;
+    }
+    return i - p;
+}
+
+
+std::string_view Listpack::get(Pos p) const {
+    size_t len;
+    size_t h = read_header(p, len);
+    return std::string_view(buf_.data() + p + h, len);
+}
+
+
+Listpack::Pos Listpack::next(Pos p) const {
+    size_t len;
+    size_t h = read_header(p, len);
+    return p + h + len;
+}
+
+
+Listpack::Pos Listpack::last() const {
+    if (count_ == 0) return end();
+
+    Pos p = begin();
+    for (size_t i = 1; i < count_; i++) {
+        p = next(p);
+    }
+    return p;
+}
+
+
+Listpack::Pos Listpack::find(std::string_view v, size_t step) const {
+    size_t idx = 0;
+    for (Pos p = begin(); p != end(); p = next(p), idx++) {
+        if (idx % step == 0 && get(p) == v) {
+            return p;
+        }
+    }
+    return end();
+}
+
+
+void Listpack::insert(Pos p, std::string_view v) {
+    char header[10];
+    size_t h = 0;
+    size_t len = v.size();
+
+    do {
+        unsigned char b = len & 0x7f;
+        len >>= 7;
+        if (len) b |= 0x80;
+        header[h++] = static_cast<char>(b);
+    } while (len);
+
+    buf_.insert(p, header, h);
+    buf_.insert(p + h, v.data(), v.size());
+    count_++;
+}
+
+
+void Listpack::replace(Pos p, std::string_view v) {
+    size_t len;
+    size_t h = read_header(p, len);
+
+    // same encoded size: overwrite in place without shifting the tail
+    if (len == v.size()) {
+        buf_.replace(p + h, len, v.data(), v.size());
+        return;
+    }
+
+    buf_.erase(p, h + len);
+    count_--;
+    insert(p, v);
+}
+
+
+Listpack::Pos Listpack::erase(Pos p, size_t n) {
+    Pos e = p;
+    for (size_t i = 0; i < n && e != end(); i++) {
+        e = next(e);
+        count_--;
+    }
+    buf_.erase(p, e - p);
+    return p;
+}
+
+
+/* ---------------- HashValue ---------------- */
+
+void HashValue::convert() {
+    Map map;
+    const auto &lp = std::get<Listpack>(data_);
+
+    map.reserve(lp.size() / 2 + 1);
+    for (auto p = lp.begin(); p != lp.end();) {
+        auto v = lp.next(p);
+        map.emplace(std::string(lp.get(p)), std::string(lp.get(v)));
+        p = lp.next(v);
+    }
+    data_ = std::move(map);
+}
+
+
+bool HashValue::set(const std::string &field, const std::string &value) {
+    if (auto lp = std::get_if<Listpack>(&data_)) {
+        auto p = lp->find(field, 2);
+
+        if (p != lp->end()) {
+            if (value.size() <= kListpackMaxValue) {
+                lp->replace(lp->next(p), value);
+                return false;
+            }
+        } else if (field.size() <= kListpackMaxValue &&
+                   value.size() <= kListpackMaxValue &&
+                   lp->size() / 2 < kListpackMaxEntries) {
+            lp->push_back(field);
+            lp->push_back(value);
+            return true;
+        }
+        convert();
+    }
+
+    auto &map = std::get<Map>(data_);
+    auto [it, inserted] = map.try_emplace(field, value);
+    if (!inserted) {
+        it->second = value;
+    }
+    return inserted;
+}
+
+
+std::optional<std::string> HashValue::get(const std::string &field) const {
+    if (auto lp = std::get_if<Listpack>(&data_)) {
+        auto p = lp->find(field, 2);
+        if (p == lp->end()) return std::nullopt;
+        return std::string(lp->get(lp->next(p)));
+    }
+
+    const auto &map = std::get<Map>(data_);
+    auto it = map.find(field);
+    if (it == map.end()) return std::nullopt;
+    return it->second;
+}
+
+
+bool HashValue::del(const std::string &field) {
+    if (auto lp = std::get_if<Listpack>(&data_)) {
+        auto p = lp->find(field, 2);
+        if (p == lp->end()) return false;
+        lp->erase(p, 2);
+        return true;
+    }
+    return std::get<Map>(data_).erase(field) > 0;
+}
+
+
+size_t HashValue::size() const {
+    if (auto lp = std::get_if<Listpack>(&data_)) {
+        return lp->size() / 2;
+    }
+    return std::get<Map>(data_).size();
+}
+
+
+/* ---------------- ListValue ---------------- */
+
+void ListValue::maybe_convert(const std::string &incoming) {
+    auto lp = std::get_if<Listpack>(&data_);
+
+    if (!lp) return;
+    if (lp->size() < kListpackMaxEntries && incoming.size() <= kListpackMaxValue) return;
+
+    Deque deque;
+    for (auto p = lp->begin(); p != lp->end(); p = lp->next(p)) {
+        deque.emplace_back(lp->get(p));
+    }
+    data_ = std::move(deque);
+}
+
+
+void ListValue::push_front(const std::string &value) {
+    maybe_convert(value);
+
+    if (auto lp = std::get_if<Listpack>(&data_)) {
+        lp->push_front(value);
+    } else {
+        std::get<Deque>(data_).push_front(value);
+    }
+}
+
+
+void ListValue::push_back(const std::string &value) {
+    maybe_convert(value);
+
+    if (auto lp = std::get_if<Listpack>(&data_)) {
+        lp->push_back(value);
+    } else {
+        std::get<Deque>(data_).push_back(value);
+    }
+}
+
+
+std::optional<std::string> ListValue::pop_front() {
+    if (auto lp = std::get_if<Listpack>(&data_)) {
+        if (lp->empty()) return std::nullopt;
+        std::string v(lp->get(lp->begin()));
+        lp->erase(lp->begin());
+        return v;
+    }
+
+    auto &deque = std::get<Deque>(data_);
+    if (deque.empty()) return std::nullopt;
+    std::string v = std::move(deque.front());
+    deque.pop_front();
+    return v;
+}
+
+
+std::optional<std::string> ListValue::pop_back() {
+    if (auto lp = std::get_if<Listpack>(&data_)) {
+        if (lp->empty()) return std::nullopt;
+        auto p = lp->last();
+        std::string v(lp->get(p));
+        lp->erase(p);
+        return v;
+    }
+
+    auto &deque = std::get<Deque>(data_);
+    if (deque.empty()) return std::nullopt;
+    std::string v = std::move(deque.back());
+    deque.pop_back();
+    return v;
+}
+
+
+size_t ListValue::size() const {
+    if (auto lp = std::get_if<Listpack>(&data_)) {
+        return lp->size();
+    }
+    return std::get<Deque>(data_).size();
+}
+
+
+std::vector<std::string> ListValue::range(long start, long stop) const {
+    long n = static_cast<long>(size());
+    std::vector<std::string> out;
+
+    if (start < 0) start += n;
+    if (stop < 0) stop += n;
+    if (start < 0) start = 0;
+    if (stop >= n) stop = n - 1;
+
+    if (start > stop || start >= n) {
+        return out;
+    }
+
+    out.reserve(stop - start + 1);
+
+    if (auto lp = std::get_if<Listpack>(&data_)) {
+        long idx = 0;
+        for (auto p = lp->begin(); p != lp->end() && idx <= stop; p = lp->next(p), idx++) {
+            if (idx >= start) out.emplace_back(lp->get(p));
+        }
+    } else {
+        const auto &deque = std::get<Deque>(data_);
+        for (long i = start; i <= stop; i++) {
+            out.push_back(deque[i]);
+        }
+    }
+    return out;
+}
+
+
+/* ---------------- SetValue ---------------- */
+
+void SetValue::convert() {
+    Set set;
+    const auto &lp = std::get<Listpack>(data_);
+
+    set.reserve(lp.size() + 1);
+    for (auto p = lp.begin(); p != lp.end(); p = lp.next(p)) {
+        set.emplace(lp.get(p));
+    }
+    data_ = std::move(set);
+}
+
+
+bool SetValue::add(const std::string &member) {
+    if (auto lp = std::get_if<Listpack>(&data_)) {
+        if (lp->find(member) != lp->end()) {
+            return false;
+        }
+        if (member.size() <= kListpackMaxValue && lp->size() < kListpackMaxEntries) {
+            lp->push_back(member);
+            return true;
+        }
+        convert();
+    }
+    return std::get<Set>(data_).insert(member).second;
+}
+
+
+bool SetValue::contains(const std::string &member) const {
+    if (auto lp = std::get_if<Listpack>(&data_)) {
+        return lp->find(member) != lp->end();
+    }
+    return std::get<Set>(data_).count(member) > 0;
+}
+
+
+bool SetValue::remove(const std::string &member) {
+    if (auto lp = std::get_if<Listpack>(&data_)) {
+        auto p = lp->find(member);
+        if (p == lp->end()) return false;
+        lp->erase(p);
+        return true;
+    }
+    return std::get<Set>(data_).erase(member) > 0;
+}
+
+
+size_t SetValue::size() const {
+    if (auto lp = std::get_if<Listpack>(&data_)) {
+        return lp->size();
+    }
+    return std::get<Set>(data_).size();
+}
+
+
+/* ---------------- SkipList ---------------- */
+
+SkipList::Node *SkipList::make_node(int height, double score, const std::string &member) {
+    void *mem = ::operator new(sizeof(Node) + height * sizeof(Level));
+    Node *node = new (mem) Node{member, score, nullptr, height};
+
+    for (int i = 0; i < height; i++) {
+        node->levels()[i] = Level{nullptr, 0};
+    }
+    return node;
+}
+
+
+void SkipList::free_node(Node *node) {
+    node->~Node();
+    ::operator delete(node);
+}
+
+
+// same distribution as redis: every level up has a 1 in 4 chance
+int SkipList::random_level() {
+    thread_local std::mt19937 rng{std::random_device{}()};
+
+    int level = 1;
+    while (level < kMaxLevel && (rng() & 0xFFFF) < (0xFFFF / 4)) {
+        level++;
+    }
+    return level;
+}
+
+
+SkipList::SkipList()
+    : head_(make_node(kMaxLevel, 0, std::string())),
+    level_(1),
+    length_(0) {}
+
+
+SkipList::~SkipList() {
+    clear();
+    free_node(head_);
+}
+
+
+void SkipList::clear() {
+    Node *node = head_->levels()[0].forward;
+
+    while (node) {
+        Node *next = node->next();
+        free_node(node);
+        node = next;
+    }
+
+    for (int i = 0; i < kMaxLevel; i++) {
+        head_->levels()[i] = Level{nullptr, 0};
+    }
+    level_ = 1;
+    length_ = 0;
+}
+
+
+void SkipList::copy_from(const SkipList &other) {
+    for (auto node = other.first(); node; node = node->next()) {
+        insert(node->score, node->member);
+    }
+}
+
+
+SkipList::SkipList(const SkipList &other) : SkipList() {
+    copy_from(other);
+}
+
+
+SkipList &SkipList::operator=(const SkipList &other) {
+    if (this != &other) {
+        clear();
+        copy_from(other);
+    }
+    return *this;
+}
+
+
+// the moved-from list keeps a valid (empty) head so it can still be reused
+SkipList::SkipList(SkipList &&other) : SkipList() {
+    std::swap(head_, other.head_);
+    std::swap(level_, other.level_);
+    std::swap(length_, other.length_);
+}
+
+
+SkipList &SkipList::operator=(SkipList &&other) noexcept {
+    if (this != &other) {
+        std::swap(head_, other.head_);
+        std::swap(level_, other.level_);
+        std::swap(length_, other.length_);
+    }
+    return *this;
+}
+
+
+static bool node_before(const SkipList::Node *node, double score, const std::string &member) {
+    return node->score < score || (node->score == score && node->member < member);
+}
+
+
+void SkipList::insert(double score, const std::string &member) {
+    Node *update[kMaxLevel];
+    size_t rank[kMaxLevel];
+    Node *x = head_;
+
+    // find the insert position on every level, remembering the rank we crossed
+    for (int i = level_ - 1; i >= 0; i--) {
+        rank[i] = (i == level_ - 1) ? 0 : rank[i + 1];
+
+        while (x->levels()[i].forward && node_before(x->levels()[i].forward, score, member)) {
+            rank[i] += x->levels()[i].span;
+            x = x->levels()[i].forward;
+        }
+        update[i] = x;
+    }
+
+    int height = random_level();
+    if (height > level_) {
+        for (int i = level_; i < height; i++) {
+            rank[i] = 0;
+            update[i] = head_;
+            update[i]->levels()[i].span = length_;
+        }
+        level_ = height;
+    }
+
+    Node *node = make_node(height, score, member);
+
+    for (int i = 0; i < height; i++) {
+        node->levels()[i].forward = update[i]->levels()[i].forward;
+        update[i]->levels()[i].forward = node;
+
+        node->levels()[i].span = update[i]->levels()[i].span - (rank[0] - rank[i]);
+        update[i]->levels()[i].span = (rank[0] - rank[i]) + 1;
+    }
+
+    // levels above the new node now span one more element
+    for (int i = height; i < level_; i++) {
+        update[i]->levels()[i].span++;
+    }
+
+    node->backward = (update[0] == head_) ? nullptr : update[0];
+    if (node->next()) {
+        node->next()->backward = node;
+    }
+    length_++;
+}
+
+
+bool SkipList::erase(double score, const std::string &member) {
+    Node *update[kMaxLevel];
+    Node *x = head_;
+
+    for (int i = level_ - 1; i >= 0; i--) {
+        while (x->levels()[i].forward && node_before(x->levels()[i].forward, score, member)) {
+            x = x->levels()[i].forward;
+        }
+        update[i] = x;
+    }
+
+    x = x->next();
+    if (!x || x->score != score || x->member != member) {
+        return false;
+    }
+
+    for (int i = 0; i < level_; i++) {
+        if (update[i]->levels()[i].forward == x) {
+            update[i]->levels()[i].span += x->levels()[i].span - 1;
+            update[i]->levels()[i].forward = x->levels()[i].forward;
+        } else {
+            update[i]->levels()[i].span--;
+        }
+    }
+
+    if (x->next()) {
+        x->next()->backward = x->backward;
+    }
+
+    while (level_ > 1 && head_->levels()[level_ - 1].forward == nullptr) {
+        level_--;
+    }
+
+    free_node(x);
+    length_--;
+    return true;
+}
+
+
+const SkipList::Node *SkipList::at_rank(size_t rank) const {
+    if (rank >= length_) return nullptr;
+
+    // spans are 1-based: the first element sits at distance 1 from the head
+    size_t target = rank + 1;
+    size_t traversed = 0;
+    const Node *x = head_;
+
+    for (int i = level_ - 1; i >= 0; i--) {
+        while (x->levels()[i].forward && traversed + x->levels()[i].span <= target) {
+            traversed += x->levels()[i].span;
+            x = x->levels()[i].forward;
+        }
+        if (traversed == target) {
+            return x;
+        }
+    }
+    return nullptr;
+}
+
+
+const SkipList::Node *SkipList::first_in_range(double min, bool exclusive) const {
+    const Node *x = head_;
+
+    for (int i = level_ - 1; i >= 0; i--) {
+        while (x->levels()[i].forward) {
+            double s = x->levels()[i].forward->score;
+            bool below = exclusive ? s <= min : s < min;
+            if (!below) break;
+            x = x->levels()[i].forward;
+        }
+    }
+    return x->next();
+}
+
+
+/* ---------------- ZSetValue ---------------- */
+
+bool ZSetValue::add(const std::string &member, double score) {
+    auto it = dict_.find(member);
+
+    if (it != dict_.end()) {
+        if (it->second != score) {
+            list_.erase(it->second, member);
+            list_.insert(score, member);
+            it->second = score;
+        }
+        return false;
+    }
+
+    dict_.emplace(member, score);
+    list_.insert(score, member);
+    return true;
+}
+
+
+std::optional<double> ZSetValue::score(const std::string &member) const {
+    auto it = dict_.find(member);
+    if (it == dict_.end()) return std::nullopt;
+    return it->second;
+}
+
+
+bool ZSetValue::remove(const std::string &member) {
+    auto it = dict_.find(member);
+    if (it == dict_.end()) return false;
+
+    list_.erase(it->second, member);
+    dict_.erase(it);
+    return true;
+}
+
+
+std::vector<ZSetValue::Item> ZSetValue::range_by_rank(long start, long stop) const {
+    long n = static_cast<long>(size());
+    std::vector<Item> out;
+
+    if (start < 0) start += n;
+    if (stop < 0) stop += n;
+    if (start < 0) start = 0;
+    if (stop >= n) stop = n - 1;
+
+    if (start > stop || start >= n) {
+        return out;
+    }
+
+    out.reserve(stop - start + 1);
+
+    auto node = list_.at_rank(start);
+    for (long i = start; node && i <= stop; i++, node = node->next()) {
+        out.emplace_back(node->member, node->score);
+    }
+    return out;
+}
+
+
+std::vector<ZSetValue::Item> ZSetValue::range_by_score(
+    double min, bool min_exclusive,
+    double max, bool max_exclusive
+) const {
+    std::vector<Item> out;
+
+    for (auto node = list_.first_in_range(min, min_exclusive); node; node = node->next()) {
+        if (max_exclusive ? node->score >= max : node->score > max) break;
+        out.emplace_back(node->member, node->score);
+    }
+    return out;
+}
@@ -0,0 +1,120 @@
+#include "epoch.hpp"
+
+// retired nodes pile up to this many before a writer frees them
+static constexpr size_t kReclaimBatch = 128;
+
+
+namespace {
+
+// the slot of this thread, given back when the thread exits
+struct LocalSlot {
+    std::atomic<bool> *in_use{nullptr};
+    void *slot{nullptr};
+    unsigned depth{0};
+
+    ~LocalSlot() {
+        if (in_use) in_use->store(false, std::memory_order_release);
+    }
+};
+
+thread_local LocalSlot local;
+
+}
+
+
+EpochDomain &EpochDomain::global() {
+    // never destroyed: threads may still unpin while the process exits
+    static EpochDomain *domain = new EpochDomain();
+    return *domain;
+}
+
+
+EpochDomain::~EpochDomain() {
+    for (auto &r : retired_) {
+        r.deleter(r.ptr);
+    }
+}
+
+
+EpochDomain::Slot *EpochDomain::local_slot() {
+    if (local.slot) {
+        return static_cast<Slot *>(local.slot);
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    Slot *slot = nullptr;
+    for (auto &s : slots_) {
+        bool expected = false;
+        if (s.in_use.compare_exchange_strong(expected, true)) {
+            slot = &s;
+            break;
+        }
+    }
+
+    if (!slot) {
+        slot = &slots_.emplace_back();
+        slot->in_use = true;
+    }
+
+    local.slot = slot;
+    local.in_use = &slot->in_use;
+    return slot;
+}
+
+
+void EpochDomain::enter() {
+    Slot *slot = local_slot();
+    if (local.depth++) return;
+
+    slot->epoch.store(epoch_.load(std::memory_order_acquire), std::memory_order_relaxed);
+    // the announcement must be visible before we load any shared pointer
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+
+void EpochDomain::exit() {
+    if (--local.depth) return;
+    static_cast<Slot *>(local.slot)->epoch.store(0, std::memory_order_release);
+}
+
+
+void EpochDomain::retire(void *ptr, void (*deleter)(void *)) {
+    // readers pinned from now on can't reach `ptr` anymore, it was unlinked before
+    uint64_t epoch = epoch_.fetch_add(1, std::memory_order_seq_cst) + 1;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    retired_.push_back({ptr, deleter, epoch});
+
+    if (retired_.size() >= kReclaimBatch) {
+        reclaim_locked();
+    }
+}
+
+
+void EpochDomain::reclaim() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    reclaim_locked();
+}
+
+
+void EpochDomain::reclaim_locked() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    uint64_t oldest = UINT64_MAX;
+    for (const auto &slot : slots_) {
+        uint64_t e = slot.epoch.load(std::memory_order_acquire);
+        if (e && e < oldest) oldest = e;
+    }
+
+    // a reader pinned at `oldest` entered after everything retired up to that epoch was unlinked
+    size_t kept = 0;
+    for (auto &r : retired_) {
+        if (r.epoch <= oldest) {
+            r.deleter(r.ptr);
+        } else {
+            retired_[kept++] = r;
+        }
+    }
+    retired_.resize(kept);
+}
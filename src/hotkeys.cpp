@@ -0,0 +1,119 @@
+#include "hotkeys.hpp"
+#include <algorithm>
+#include <functional>
+
+// samples a key needs before it shows up at all, keeps a cold keyspace off the mutex
+static constexpr uint32_t kMinSamples = 4;
+
+
+HotKeys::HotKeys(size_t k, uint32_t sample_rate)
+    : k_(k ? k : 1),
+    sample_rate_(sample_rate ? sample_rate : 1),
+    counters_(std::make_unique<std::atomic<uint32_t>[]>(kDepth * kWidth)),
+    threshold_(kMinSamples) {
+
+    for (size_t i = 0; i < kDepth * kWidth; i++) {
+        counters_[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+
+// row d uses h1 + d * h2 (Kirsch-Mitzenmacher), one string hash per key
+static size_t column(uint64_t hash, size_t row, size_t width) {
+    uint64_t h1 = hash;
+    uint64_t h2 = (hash >> 32) | 1;
+    return (h1 + row * h2) & (width - 1);
+}
+
+
+void HotKeys::sample(const std::string &key) {
+    size_t hash = std::hash<std::string>{}(key);
+
+    uint32_t count = UINT32_MAX;
+    for (size_t row = 0; row < kDepth; row++) {
+        auto &counter = counters_[row * kWidth + column(hash, row, kWidth)];
+        count = std::min(count, counter.fetch_add(1, std::memory_order_relaxed) + 1);
+    }
+
+    if (count < threshold_.load(std::memory_order_relaxed)) return;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    auto it = std::find_if(top_.begin(), top_.end(), [&](const Entry &e) { return e.key == key; });
+    if (it != top_.end()) {
+        it->count = count;
+    } else if (top_.size() < k_) {
+        top_.push_back({key, count});
+    } else {
+        auto coldest = std::min_element(top_.begin(), top_.end(),
+            [](const Entry &a, const Entry &b) { return a.count < b.count; });
+        if (coldest->count >= count) return;
+        *coldest = {key, count};
+    }
+    update_threshold();
+}
+
+
+uint32_t HotKeys::estimate(const std::string &key) const {
+    size_t hash = std::hash<std::string>{}(key);
+
+    uint32_t count = UINT32_MAX;
+    for (size_t row = 0; row < kDepth; row++) {
+        count = std::min(count, counters_[row * kWidth + column(hash, row, kWidth)].load(std::memory_order_relaxed));
+    }
+    return count;
+}
+
+
+bool HotKeys::is_hot(const std::string &key) const {
+    return estimate(key) >= threshold_.load(std::memory_order_relaxed);
+}
+
+
+std::vector<HotKeys::Item> HotKeys::top(size_t count) const {
+    std::vector<Entry> entries;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        entries = top_;
+    }
+
+    std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) { return a.count > b.count; });
+    if (entries.size() > count) entries.resize(count);
+
+    std::vector<Item> items;
+    items.reserve(entries.size());
+    for (auto &e : entries) {
+        items.push_back({std::move(e.key), uint64_t(e.count) * sample_rate_ / 2});
+    }
+    return items;
+}
+
+
+void HotKeys::decay() {
+    // fetch_sub, so increments racing with us are not lost
+    for (size_t i = 0; i < kDepth * kWidth; i++) {
+        uint32_t v = counters_[i].load(std::memory_order_relaxed);
+        if (v) counters_[i].fetch_sub(v - v / 2, std::memory_order_relaxed);
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    for (auto &e : top_) e.count /= 2;
+    top_.erase(std::remove_if(top_.begin(), top_.end(),
+        [](const Entry &e) { return e.count < kMinSamples; }), top_.end());
+    update_threshold();
+}
+
+
+void HotKeys::update_threshold() {
+    uint32_t threshold = kMinSamples;
+
+    if (top_.size() >= k_) {
+        uint32_t coldest = UINT32_MAX;
+        for (const auto &e : top_) {
+            coldest = std::min(coldest, e.count);
+        }
+        threshold = std::max(threshold, coldest);
+    }
+    threshold_.store(threshold, std::memory_order_relaxed);
+}
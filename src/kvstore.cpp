@@ -1,67 +1,1065 @@
 #include "kvstore.hpp"
+#include "cluster.hpp"
 #include <iostream>
+#include <charconv>
 
+thread_local const KVStore* KVStore::batch_owner_ = nullptr;
 
 
 KVStore::KVStore(size_t max_key_len, size_t max_value_len)
-    : max_key_len_(max_key_len),
-    max_value_len_(max_value_len){}
+    : tombstones_(kTombstoneSlots, 0),
+    max_key_len_(max_key_len),
+    max_value_len_(max_value_len) {
 
+    // microseconds with room for 1024 writes each
+    next_version_ = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count() << 10;
+}
+
+
+bool KVStore::set(
+    const std::string &key,
+    std::string_view value,
+    std::optional<int> ttl_seconds
+) {
+    // size check
+    if (key.size() > max_key_len_ || value.size() > max_value_len_)
+        return false;
+
+    // compressed before taking the lock
+    return store_string(key, encode_string(value), ttl_seconds);
+}
+
+
+bool KVStore::set_uncompressed(
+    const std::string &key,
+    std::string_view value,
+    std::optional<int> ttl_seconds
+) {
+    if (key.size() > max_key_len_ || value.size() > max_value_len_)
+        return false;
+
+    return store_string(key, encode_plain(value), ttl_seconds);
+}
+
+
+bool KVStore::store_string(
+    const std::string &key,
+    Value value,
+    std::optional<int> ttl_seconds
+) {
+    hotkeys_.record(key);
+
+    Entry entry;
+    entry.value = std::move(value);
+    // a fresh value gets one pass of the CLOCK hand before it can be spilled
+    entry.referenced = true;
+
+    if (ttl_seconds) {
+        entry.expires_at = 
+            std::chrono::steady_clock::now() +
+            std::chrono::seconds(*ttl_seconds);
+    }
+    auto lock = write_lock();
+
+    entry.version = ++next_version_;
+    Entry &slot = insert_entry(key);
+    forget_value(slot);
+    entry.snapshot_epoch = slot.snapshot_epoch;
+    slot = std::move(entry);
+    account_value(slot);
+    evict_cold();
+    notify("set", key);
+    return true;
+}
+
+
+void KVStore::enable_compression(size_t threshold, std::string dictionary) {
+    compress_threshold_ = threshold;
+    dictionary_id_ = dictionary_id(dictionary);
+    dictionary_ = std::move(dictionary);
+}
+
+
+std::optional<CompressedValue> KVStore::compress(std::string_view value) const {
+    if (!compress_threshold_ || value.size() < compress_threshold_) {
+        return std::nullopt;
+    }
+
+    CompressedValue packed;
+    packed.data = lz_compress(value, dictionary_);
+    packed.raw_size = static_cast<uint32_t>(value.size());
+    packed.dictionary_id = dictionary_id_;
+
+    // not worth the decompression on every read if it saves less than 1/8
+    if (packed.data.size() > value.size() - value.size() / 8) {
+        return std::nullopt;
+    }
+    return packed;
+}
+
+
+std::string KVStore::decompress(const CompressedValue &value) const {
+    return lz_decompress(value.data, value.raw_size, value.dictionary_id ? dictionary_ : std::string_view());
+}
+
+
+bool KVStore::set_compressed(
+    const std::string &key,
+    CompressedValue value,
+    std::optional<int> ttl_seconds
+) {
+    if (key.size() > max_key_len_ || value.raw_size > max_value_len_)
+        return false;
+
+    if (value.dictionary_id && value.dictionary_id != dictionary_id_) {
+        throw std::invalid_argument("value was compressed with an unknown dictionary");
+    }
+
+    return store_string(key, std::move(value), ttl_seconds);
+}
+
+
+bool KVStore::check_compressed(const CompressedValue &value) const {
+    if (value.raw_size > max_value_len_) return false;
+    if (value.dictionary_id && value.dictionary_id != dictionary_id_) return false;
+
+    try {
+        decompress(value);
+    } catch (const std::invalid_argument &) {
+        return false;
+    }
+    return true;
+}
+
+
+void KVStore::set_event_listener(EventListener listener) {
+    listener_ = std::move(listener);
+}
+
+
+void KVStore::enable_read_cache(size_t capacity_bytes, bool hot_only) {
+    read_cache_ = std::make_unique<ReadCache>(capacity_bytes);
+    hot_read_cache_ = hot_only;
+}
+
+
+std::vector<HotKeys::Item> KVStore::hotkeys(size_t count) const {
+    return hotkeys_.top(count);
+}
+
+
+void KVStore::enable_tiering(const std::string &dir, size_t memory_budget, size_t cache_bytes) {
+    value_log_ = std::make_unique<ValueLog>(dir);
+    value_cache_ = std::make_unique<ValueCache>(cache_bytes);
+    memory_budget_ = memory_budget;
+    resident_bytes_ = 0;
+
+    data_.for_each([&](const std::string &, const Entry &entry) { account_value(entry); });
+}
+
+
+static size_t resident_size(const KVStore::Value &value) {
+    if (auto str = std::get_if<std::string>(&value)) return str->size();
+    if (auto packed = std::get_if<CompressedValue>(&value)) return packed->data.size();
+    return 0;
+}
+
+
+void KVStore::account_value(const Entry &entry) {
+    if (value_log_) resident_bytes_ += resident_size(entry.value);
+}
+
+
+void KVStore::forget_value(const Entry &entry) {
+    if (!value_log_) return;
+
+    if (auto spilled = std::get_if<SpilledValue>(&entry.value)) {
+        value_log_->release(*spilled);
+    } else {
+        resident_bytes_ -= resident_size(entry.value);
+    }
+}
+
+
+// spilling a value smaller than its SpilledValue would not free anything
+static constexpr size_t kMinSpillSize = 64;
+// buckets the CLOCK hand may visit per write, so a write never stalls for long
+static constexpr size_t kEvictBuckets = 256;
+
+
+void KVStore::evict_cold() {
+    if (!value_log_ || resident_bytes_ <= memory_budget_) return;
+
+    /*
+    CLOCK: the hand sweeps the table with a scan cursor. an entry used since
+    the last sweep loses its referenced bit and stays, the others go to disk.
+    */
+    for (size_t n = 0; n < kEvictBuckets && resident_bytes_ > memory_budget_; n++) {
+        clock_cursor_ = data_.scan(clock_cursor_, [&](const std::string &key, Entry &entry) {
+            if (entry.referenced) {
+                entry.referenced = false;
+                return;
+            }
+
+            size_t size = resident_size(entry.value);
+            if (size < kMinSpillSize || resident_bytes_ <= memory_budget_) return;
+
+            SpilledValue spilled;
+            if (auto packed = std::get_if<CompressedValue>(&entry.value)) {
+                spilled = value_log_->append(key, packed->data);
+                spilled.compressed = true;
+                spilled.raw_size = packed->raw_size;
+                spilled.dictionary_id = packed->dictionary_id;
+            } else {
+                spilled = value_log_->append(key, std::get<std::string>(entry.value));
+            }
+
+            entry.value = std::move(spilled);
+            resident_bytes_ -= size;
+        });
+    }
+}
+
+
+std::string KVStore::load_spilled(const SpilledValue &value) const {
+    std::string bytes;
+
+    if (!value_cache_->get(value, bytes)) {
+        bytes = value.read();
+        value_cache_->put(value, bytes);
+    }
+
+    if (!value.compressed) {
+        return bytes;
+    }
+    return decompress(CompressedValue{std::move(bytes), value.raw_size, value.dictionary_id});
+}
+
+
+// segments with less than this share of live bytes get compacted
+static constexpr double kCompactLiveRatio = 0.5;
+// records moved per lock acquisition during compaction
+static constexpr size_t kCompactBatch = 64;
+// bytes of a segment read at a time, so compacting never loads a whole one
+static constexpr size_t kCompactChunk = 1 << 20;
+
+
+void KVStore::compact_tier() {
+    if (!value_log_) return;
+
+    try {
+        compact_segments();
+    } catch (const std::exception &e) {
+        // keep the old segments, the next round tries again
+        std::cerr << "value log compaction failed: " << e.what() << "\n";
+    }
+}
+
+
+void KVStore::compact_segments() {
+    for (const auto &segment : value_log_->compaction_candidates(kCompactLiveRatio)) {
+        uint64_t offset = 0;
+
+        for (;;) {
+            // read without the lock, only the still current records are copied under it
+            auto records = value_log_->records(*segment, offset, kCompactChunk);
+            if (records.empty()) break;
+
+            for (size_t i = 0; i < records.size(); i += kCompactBatch) {
+                auto lock = write_lock();
+
+                for (size_t j = i; j < records.size() && j < i + kCompactBatch; j++) {
+                    const auto &record = records[j];
+
+                    Entry* entry = data_.find(record.key);
+                    auto spilled = entry ? std::get_if<SpilledValue>(&entry->value) : nullptr;
+                    if (!spilled || spilled->segment != segment || spilled->offset != record.offset) {
+                        continue;
+                    }
+
+                    SpilledValue moved = value_log_->append(record.key, record.value);
+                    moved.compressed = spilled->compressed;
+                    moved.raw_size = spilled->raw_size;
+                    moved.dictionary_id = spilled->dictionary_id;
+
+                    value_log_->release(*spilled);
+                    *spilled = std::move(moved);
+                }
+            }
+        }
+
+        value_log_->retire(segment);
+    }
+}
+
+
+std::vector<std::string> KVStore::sample_values(size_t count) const {
+    std::vector<std::string> samples;
+    auto lock = read_lock();
+
+    uint64_t cursor = 0;
+    do {
+        cursor = data_.scan(cursor, [&](const std::string &, const Entry &entry) {
+            if (samples.size() >= count || is_expired(entry)) return;
+
+            if (auto str = std::get_if<std::string>(&entry.value)) {
+                samples.push_back(*str);
+            } else if (auto packed = std::get_if<CompressedValue>(&entry.value)) {
+                samples.push_back(decompress(*packed));
+            }
+            // spilled values are skipped, the resident ones are the hot part anyway
+        });
+    } while (cursor != 0 && samples.size() < count);
+
+    return samples;
+}
+
+
+
+std::optional<std::string> KVStore::get(const std::string &key) {
+    hotkeys_.record(key);
+
+    if (read_cache_) {
+        std::optional<std::string> cached;
+        read_cache_->view(key, [&](std::string_view v) { cached.emplace(v); });
+        if (cached) return cached;
+    }
+
+    auto lock = write_lock();
+
+    Entry* entry = find_live(key);
+
+    if (!entry) {
+        return std::nullopt;
+    }
+
+    // decompressed outside the lock (unless a batch holds it anyway)
+    if (auto packed = std::get_if<CompressedValue>(&entry->value)) {
+        CompressedValue copy = *packed;
+        if (lock.owns_lock()) lock.unlock();
+        return decompress(copy);
+    }
+
+    // same for values on disk, the copy keeps the segment open meanwhile
+    if (auto spilled = std::get_if<SpilledValue>(&entry->value)) {
+        SpilledValue copy = *spilled;
+        if (lock.owns_lock()) lock.unlock();
+        return load_spilled(copy);
+    }
+
+    if (auto number = std::get_if<int64_t>(&entry->value)) {
+        std::string text = std::to_string(*number);
+        if (cache_admits(key)) read_cache_->put(key, text, entry->expires_at);
+        return text;
+    }
+
+    auto value = std::get_if<std::string>(&entry->value);
+    if (!value) {
+        throw WrongTypeError();
+    }
+
+    if (cache_admits(key)) read_cache_->put(key, *value, entry->expires_at);
+    return *value;
+}
+
+
+std::vector<std::optional<std::string>> KVStore::mget(const std::vector<std::string> &keys) {
+    std::vector<std::optional<std::string>> values;
+    values.reserve(keys.size());
+
+    for (const auto &key : keys) {
+        hotkeys_.record(key);
+    }
+
+    std::vector<std::pair<size_t, CompressedValue>> packed_values;
+    std::vector<std::pair<size_t, SpilledValue>> spilled_values;
+
+    {
+        auto lock = write_lock();
+
+        for (const auto &key : keys) {
+            Entry* entry = find_live(key);
+            auto value = entry ? std::get_if<std::string>(&entry->value) : nullptr;
+
+            if (value) {
+                values.emplace_back(*value);
+            } else if (auto number = entry ? std::get_if<int64_t>(&entry->value) : nullptr) {
+                values.emplace_back(std::to_string(*number));
+            } else {
+                if (auto packed = entry ? std::get_if<CompressedValue>(&entry->value) : nullptr) {
+                    packed_values.emplace_back(values.size(), *packed);
+                } else if (auto spilled = entry ? std::get_if<SpilledValue>(&entry->value) : nullptr) {
+                    spilled_values.emplace_back(values.size(), *spilled);
+                }
+                values.emplace_back(std::nullopt);
+            }
+        }
+    }
+
+    for (auto &[index, packed] : packed_values) {
+        values[index] = decompress(packed);
+    }
+    for (auto &[index, spilled] : spilled_values) {
+        values[index] = load_spilled(spilled);
+    }
+    return values;
+}
+
+
+bool KVStore::del(const std::string &key){
+
+    auto lock = write_lock();
+
+    if (!erase_entry(key)) {
+        return false;
+    }
+    notify("del", key);
+    return true;
+}
+
+
+// canonical decimal int64 only, so printing it back gives the same string
+static std::optional<int64_t> parse_integer(std::string_view s) {
+    if (s.empty() || s.size() > 20) return std::nullopt;
+    if (s[0] == '0' && s.size() > 1) return std::nullopt;
+    if (s[0] == '-' && (s.size() == 1 || s[1] == '0')) return std::nullopt;
+
+    int64_t value;
+    auto [end, ec] = std::from_chars(s.data(), s.data() + s.size(), value);
+    if (ec != std::errc() || end != s.data() + s.size()) return std::nullopt;
+    return value;
+}
+
+
+KVStore::Value KVStore::encode_plain(std::string_view value) const {
+    if (auto number = parse_integer(value)) return *number;
+    return std::string(value);
+}
+
+
+KVStore::Value KVStore::encode_string(std::string_view value) const {
+    if (auto number = parse_integer(value)) return *number;
+    if (auto packed = compress(value)) return std::move(*packed);
+    return std::string(value);
+}
+
+
+std::string KVStore::read_string(const Entry &entry) const {
+    if (auto str = std::get_if<std::string>(&entry.value)) return *str;
+    if (auto number = std::get_if<int64_t>(&entry.value)) return std::to_string(*number);
+    if (auto packed = std::get_if<CompressedValue>(&entry.value)) return decompress(*packed);
+    if (auto spilled = std::get_if<SpilledValue>(&entry.value)) return load_spilled(*spilled);
+    throw WrongTypeError();
+}
+
+
+KVStore::Entry &KVStore::store_entry(
+    const std::string &key,
+    Value value,
+    std::optional<std::chrono::steady_clock::time_point> expires_at
+) {
+    Entry &slot = insert_entry(key);
+    forget_value(slot);
+    slot.value = std::move(value);
+    slot.expires_at = expires_at;
+    slot.version = ++next_version_;
+    slot.referenced = true;
+    account_value(slot);
+    return slot;
+}
+
+
+int64_t KVStore::incrby(const std::string &key, int64_t delta) {
+    if (key.size() > max_key_len_) {
+        throw std::length_error("key exceeds the configured limit");
+    }
+
+    auto lock = write_lock();
+
+    Entry* entry = find_live(key);
+    int64_t current = 0;
+
+    if (entry) {
+        if (auto number = std::get_if<int64_t>(&entry->value)) {
+            current = *number;
+        } else {
+            auto parsed = parse_integer(read_string(*entry));
+            if (!parsed) {
+                throw std::invalid_argument("value is not an integer or out of range");
+            }
+            current = *parsed;
+        }
+    }
+
+    int64_t result;
+    if (__builtin_add_overflow(current, delta, &result)) {
+        throw std::invalid_argument("increment or decrement would overflow");
+    }
+
+    // the usual case, a counter that is already an integer is updated in place
+    if (auto number = entry ? std::get_if<int64_t>(&entry->value) : nullptr) {
+        keep_for_snapshot(key, entry);
+        *number = result;
+        entry->version = ++next_version_;
+        if (read_cache_) read_cache_->invalidate(key);
+        notify("incrby", key);
+        return result;
+    }
+
+    std::optional<std::chrono::steady_clock::time_point> expires_at;
+    if (entry) expires_at = entry->expires_at;
+
+    store_entry(key, result, expires_at);
+    evict_cold();
+    notify("incrby", key);
+    return result;
+}
+
+
+size_t KVStore::append(const std::string &key, const std::string &suffix) {
+    check_element(key, suffix);
+
+    auto lock = write_lock();
+
+    Entry* entry = find_live(key);
+    if (!entry) {
+        store_entry(key, suffix, std::nullopt);
+        evict_cold();
+        notify("append", key);
+        return suffix.size();
+    }
+
+    auto str = std::get_if<std::string>(&entry->value);
+    if (!str) {
+        // integers, compressed and spilled values turn into a plain string first
+        std::string current = read_string(*entry);
+        forget_value(*entry);
+        entry->value = std::move(current);
+        account_value(*entry);
+        str = &std::get<std::string>(entry->value);
+    }
+
+    size_t length = str->size() + suffix.size();
+    if (length > max_value_len_) {
+        throw std::length_error("value exceeds the configured limit");
+    }
+
+    keep_for_snapshot(key, entry);
+
+    // grown geometrically, so appending n bytes in small pieces costs O(n) copies
+    if (length > str->capacity()) {
+        str->reserve(std::max(length, str->capacity() * 2));
+    }
+    str->append(suffix);
+
+    if (value_log_) resident_bytes_ += suffix.size();
+    if (read_cache_) read_cache_->invalidate(key);
+    entry->version = ++next_version_;
+
+    evict_cold();
+    notify("append", key);
+    return length;
+}
+
+
+std::optional<std::string> KVStore::getset(const std::string &key, const std::string &value) {
+    check_element(key, value);
+    Value encoded = encode_string(value);
+
+    auto lock = write_lock();
+
+    std::optional<std::string> previous;
+    if (Entry* entry = find_live(key)) {
+        previous = read_string(*entry);
+    }
+
+    store_entry(key, std::move(encoded), std::nullopt);
+    evict_cold();
+    notify("set", key);
+    return previous;
+}
+
+
+std::optional<std::string> KVStore::getdel(const std::string &key) {
+    auto lock = write_lock();
+
+    Entry* entry = find_live(key);
+    if (!entry) {
+        return std::nullopt;
+    }
+
+    std::string previous = read_string(*entry);
+    erase_entry(key);
+    notify("del", key);
+    return previous;
+}
+
+
+uint64_t KVStore::cas(
+    const std::string &key,
+    uint64_t expected,
+    const std::string &value,
+    std::optional<int> ttl_seconds
+) {
+    check_element(key, value);
+    Value encoded = encode_string(value);
+
+    std::optional<std::chrono::steady_clock::time_point> expires_at;
+    if (ttl_seconds) {
+        expires_at = std::chrono::steady_clock::now() + std::chrono::seconds(*ttl_seconds);
+    }
+
+    auto lock = write_lock();
+
+    Entry* entry = find_live(key);
+    if ((entry ? entry->version : 0) != expected) {
+        return 0;
+    }
+
+    uint64_t version = store_entry(key, std::move(encoded), expires_at).version;
+    evict_cold();
+    notify("set", key);
+    return version;
+}
+
+
+KVStore::Entry& KVStore::insert_entry(const std::string &key) {
+    if (read_cache_) read_cache_->invalidate(key);
+
+    auto [entry, inserted] = data_.try_emplace(key);
+
+    if (inserted) {
+        keep_for_snapshot(key, nullptr);
+        // written after the snapshot began, the cursor must not hand it out
+        entry->snapshot_epoch = snapshot_.epoch;
+    } else {
+        keep_for_snapshot(key, entry);
+    }
+
+    if (inserted && ordered_index_) {
+        ordered_keys_.insert(key);
+    }
+    if (inserted && !slot_keys_.empty()) {
+        slot_keys_[key_hash_slot(key)].insert(key);
+    }
+    return *entry;
+}
+
+
+bool KVStore::erase_entry(const std::string &key) {
+    if (read_cache_) read_cache_->invalidate(key);
+
+    if (Entry* entry = data_.find(key)) {
+        keep_for_snapshot(key, entry);
+        if (value_log_) forget_value(*entry);
+    }
+
+    if (!data_.erase(key)) {
+        return false;
+    }
+    // a delete is a write too: WATCH sees it and write_version() moves on
+    tombstone(key) = ++next_version_;
+
+    if (ordered_index_) {
+        ordered_keys_.erase(key);
+    }
+    if (!slot_keys_.empty()) {
+        slot_keys_[key_hash_slot(key)].erase(key);
+    }
+    return true;
+}
+
+
+KVStore::Entry* KVStore::find_live(const std::string &key) {
+    Entry* entry = data_.find(key);
+
+    if (!entry) {
+        return nullptr;
+    }
+
+    if (is_expired(*entry)) {
+        erase_entry(key);
+        notify("expired", key);
+        return nullptr;
+    }
+
+    entry->referenced = true;
+    return entry;
+}
+
+
+template <typename T>
+T* KVStore::find_typed(const std::string &key) {
+    Entry* entry = find_live(key);
+
+    if (!entry) {
+        return nullptr;
+    }
+
+    auto value = std::get_if<T>(&entry->value);
+    if (!value) {
+        throw WrongTypeError();
+    }
+    return value;
+}
+
+
+template <typename T>
+T* KVStore::find_for_write(const std::string &key) {
+    Entry* entry = find_live(key);
+
+    if (!entry) {
+        return nullptr;
+    }
+
+    auto value = std::get_if<T>(&entry->value);
+    if (!value) {
+        throw WrongTypeError();
+    }
+
+    keep_for_snapshot(key, entry);
+    if (read_cache_) read_cache_->invalidate(key);
+    entry->version = ++next_version_;
+    return value;
+}
+
+
+template <typename T>
+T& KVStore::find_or_create(const std::string &key) {
+    if (T* value = find_for_write<T>(key)) {
+        return *value;
+    }
+
+    Entry &entry = insert_entry(key);
+    entry.value = T{};
+    entry.version = ++next_version_;
+    return std::get<T>(entry.value);
+}
+
+
+void KVStore::check_element(const std::string &key, const std::string &element) const {
+    if (key.size() > max_key_len_ || element.size() > max_value_len_) {
+        throw std::length_error("key or value exceeds the configured limit");
+    }
+}
+
+
+size_t KVStore::hset(
+    const std::string &key,
+    const std::vector<std::pair<std::string, std::string>> &fields
+) {
+    for (const auto &f : fields) {
+        check_element(key, f.first);
+        check_element(key, f.second);
+    }
+
+    auto lock = write_lock();
+
+    auto &hash = find_or_create<HashValue>(key);
+    size_t added = 0;
+
+    for (const auto &f : fields) {
+        if (hash.set(f.first, f.second)) added++;
+    }
+    // fields that existed were overwritten, so there is always a change
+    notify("hset", key);
+    return added;
+}
+
+
+std::optional<std::string> KVStore::hget(const std::string &key, const std::string &field) {
+
+    auto lock = write_lock();
+
+    auto hash = find_typed<HashValue>(key);
+    if (!hash) {
+        return std::nullopt;
+    }
+    return hash->get(field);
+}
+
+
+size_t KVStore::hdel(const std::string &key, const std::vector<std::string> &fields) {
+
+    auto lock = write_lock();
+
+    auto hash = find_for_write<HashValue>(key);
+    if (!hash) {
+        return 0;
+    }
 
-bool KVStore::set(
+    size_t removed = 0;
+    for (const auto &f : fields) {
+        if (hash->del(f)) removed++;
+    }
+    if (removed) notify("hdel", key);
+
+    // empty collections do not exist
+    if (hash->size() == 0) {
+        erase_entry(key);
+        notify("del", key);
+    }
+    return removed;
+}
+
+
+size_t KVStore::lpush(const std::string &key, const std::vector<std::string> &values) {
+    for (const auto &v : values) {
+        check_element(key, v);
+    }
+
+    auto lock = write_lock();
+
+    auto &list = find_or_create<ListValue>(key);
+
+    for (const auto &v : values) {
+        list.push_front(v);
+    }
+    if (!values.empty()) notify("lpush", key);
+    return list.size();
+}
+
+
+std::optional<std::string> KVStore::rpop(const std::string &key) {
+
+    auto lock = write_lock();
+
+    auto list = find_for_write<ListValue>(key);
+    if (!list) {
+        return std::nullopt;
+    }
+
+    auto value = list->pop_back();
+    if (value) notify("rpop", key);
+
+    if (list->size() == 0) {
+        erase_entry(key);
+        notify("del", key);
+    }
+    return value;
+}
+
+
+std::vector<std::string> KVStore::lrange(const std::string &key, long start, long stop) {
+
+    auto lock = write_lock();
+
+    auto list = find_typed<ListValue>(key);
+    if (!list) {
+        return {};
+    }
+    return list->range(start, stop);
+}
+
+
+size_t KVStore::sadd(const std::string &key, const std::vector<std::string> &members) {
+    for (const auto &m : members) {
+        check_element(key, m);
+    }
+
+    auto lock = write_lock();
+
+    auto &set = find_or_create<SetValue>(key);
+    size_t added = 0;
+
+    for (const auto &m : members) {
+        if (set.add(m)) added++;
+    }
+    if (added) notify("sadd", key);
+    return added;
+}
+
+
+bool KVStore::sismember(const std::string &key, const std::string &member) {
+
+    auto lock = write_lock();
+
+    auto set = find_typed<SetValue>(key);
+    return set && set->contains(member);
+}
+
+
+std::vector<std::string> KVStore::smembers(const std::string &key) {
+
+    auto lock = write_lock();
+
+    std::vector<std::string> members;
+    auto set = find_typed<SetValue>(key);
+
+    if (set) {
+        members.reserve(set->size());
+        set->for_each([&](std::string_view m) { members.emplace_back(m); });
+    }
+    return members;
+}
+
+
+size_t KVStore::zadd(
     const std::string &key,
-    const std::string &value,
-    std::optional<int> ttl_seconds
+    const std::vector<std::pair<double, std::string>> &items
 ) {
-    // size check
-    Entry entry;
-    entry.value = value;
+    for (const auto &item : items) {
+        check_element(key, item.second);
+    }
 
-    if (key.size() > max_key_len_ || value.size() > max_value_len_)
-        return false;
+    auto lock = write_lock();
 
-    if (ttl_seconds) {
-        entry.expires_at = 
-            std::chrono::steady_clock::now() +
-            std::chrono::seconds(*ttl_seconds);
+    auto &zset = find_or_create<ZSetValue>(key);
+    size_t added = 0;
+
+    for (const auto &item : items) {
+        if (zset.add(item.second, item.first)) added++;
+    }
+    // a score update is a change as well
+    if (!items.empty()) notify("zadd", key);
+    return added;
+}
+
+
+std::optional<double> KVStore::zscore(const std::string &key, const std::string &member) {
+
+    auto lock = write_lock();
+
+    auto zset = find_typed<ZSetValue>(key);
+    if (!zset) {
+        return std::nullopt;
     }
-    std::unique_lock lock(mutex_);
+    return zset->score(member);
+}
 
-    data_[key] = entry;
-    return true;
+
+size_t KVStore::zrem(const std::string &key, const std::vector<std::string> &members) {
+
+    auto lock = write_lock();
+
+    auto zset = find_for_write<ZSetValue>(key);
+    if (!zset) {
+        return 0;
+    }
+
+    size_t removed = 0;
+    for (const auto &m : members) {
+        if (zset->remove(m)) removed++;
+    }
+    if (removed) notify("zrem", key);
+
+    if (zset->size() == 0) {
+        erase_entry(key);
+        notify("del", key);
+    }
+    return removed;
 }
 
 
+std::vector<ZSetValue::Item> KVStore::zrange(const std::string &key, long start, long stop) {
 
-std::optional<std::string> KVStore::get(const std::string &key) {
+    auto lock = write_lock();
 
-    std::unique_lock lock(mutex_);
+    auto zset = find_typed<ZSetValue>(key);
+    if (!zset) {
+        return {};
+    }
+    return zset->range_by_rank(start, stop);
+}
 
-    auto it = data_.find(key);
-    
-    if (it == data_.end()){
-        return std::nullopt;
+
+std::vector<ZSetValue::Item> KVStore::zrangebyscore(
+    const std::string &key,
+    double min, bool min_exclusive,
+    double max, bool max_exclusive
+) {
+    auto lock = write_lock();
+
+    auto zset = find_typed<ZSetValue>(key);
+    if (!zset) {
+        return {};
     }
-    
-    if (is_expired(it -> second)) {
-        data_.erase(it);
-        return std::nullopt;
+    return zset->range_by_score(min, min_exclusive, max, max_exclusive);
+}
+
+
+uint64_t KVStore::version(const std::string &key) const {
+
+    auto lock = read_lock();
+
+    const Entry* entry = data_.find(key);
+
+    if (!entry || is_expired(*entry)) {
+        return 0;
     }
-    return it->second.value;
+    return entry->version;
 }
 
 
-bool KVStore::del(const std::string &key){
+uint64_t KVStore::watch_version(const std::string &key) const {
+
+    auto lock = read_lock();
+
+    const Entry* entry = data_.find(key);
+
+    if (!entry || is_expired(*entry)) {
+        return tombstones_[std::hash<std::string>{}(key) & (kTombstoneSlots - 1)];
+    }
+    return entry->version;
+}
+
+
+// the clock is only read when the lock is taken already
+std::unique_lock<std::shared_mutex> KVStore::write_lock() const {
+    if (batch_owner_ == this || !locking_) {
+        return {};
+    }
+
+    std::unique_lock<std::shared_mutex> lock(mutex_, std::try_to_lock);
+    if (!lock.owns_lock()) {
+        auto start = std::chrono::steady_clock::now();
+        lock.lock();
+        note_lock_wait(elapsed_ns(start));
+    }
+    return lock;
+}
+
+
+std::shared_lock<std::shared_mutex> KVStore::read_lock() const {
+    if (batch_owner_ == this || !locking_) {
+        return {};
+    }
+
+    std::shared_lock<std::shared_mutex> lock(mutex_, std::try_to_lock);
+    if (!lock.owns_lock()) {
+        auto start = std::chrono::steady_clock::now();
+        lock.lock();
+        note_lock_wait(elapsed_ns(start));
+    }
+    return lock;
+}
+
+
+void KVStore::note_lock_wait(uint64_t ns) const {
+    lock_contended_.fetch_add(1, std::memory_order_relaxed);
+    lock_wait_ns_.fetch_add(ns, std::memory_order_relaxed);
+
+    if (RequestTrace *trace = current_trace()) {
+        trace->ns[static_cast<size_t>(Stage::LockWait)] += ns;
+    }
+}
 
-    std::unique_lock lock(mutex_);
 
-    return data_.erase(key) > 0;
+KVStore::LockStats KVStore::lock_stats() const {
+    return {lock_contended_.load(std::memory_order_relaxed), lock_wait_ns_.load(std::memory_order_relaxed)};
+}
+
+
+uint64_t KVStore::write_version() const {
+    auto lock = read_lock();
+    return next_version_;
 }
 
 
 size_t KVStore::size() const {
     
-    std::shared_lock lock(mutex_);
+    auto lock = read_lock();
 
     return data_.size();
 }
@@ -75,17 +1073,54 @@ bool KVStore::is_expired(const Entry& entry) const {
 }
 
 
+// active expiry: a slice holds the lock this long at most, a tick runs slices for this long at most
+static constexpr auto kExpireSliceTime = std::chrono::milliseconds(1);
+static constexpr auto kExpireTickTime = std::chrono::milliseconds(25);
+// buckets visited between two looks at the clock
+static constexpr size_t kExpireBatch = 32;
+
+
+/*
+active expiry, the way redis does it: the scan cursor walks the keyspace a
+slice at a time and drops the expired keys it comes across. another slice
+follows (after letting the waiting writers in) while the last one found a
+lot to expire, at least 1/4 of the keys it looked at, up to 25ms per tick.
+keys the cursor has not reached yet are already missing for every read.
+*/
 void KVStore::cleanup_expired() {
-    std:: unique_lock lock(mutex_);
+    auto tick_end = std::chrono::steady_clock::now() + kExpireTickTime;
 
-    auto now = std::chrono::steady_clock::now();
+    while (true) {
+        size_t seen = 0;
+        std::vector<std::string> expired;
+        {
+            auto lock = write_lock();
 
-    for (auto it = data_.begin(); it != data_.end();) {
-        if (it ->second.expires_at && now >= *it ->second.expires_at) {
-            it = data_.erase(it);
+            auto now = std::chrono::steady_clock::now();
+            auto slice_end = now + kExpireSliceTime;
 
-        } else {
-            ++it;
+            do {
+                for (size_t i = 0; i < kExpireBatch; i++) {
+                    expire_cursor_ = data_.scan(expire_cursor_, [&](const std::string &key, const Entry &entry) {
+                        seen++;
+                        if (entry.expires_at && now >= *entry.expires_at) {
+                            expired.push_back(key);
+                        }
+                    });
+                    if (expire_cursor_ == 0) break;
+                }
+            } while (expire_cursor_ != 0 && std::chrono::steady_clock::now() < slice_end);
+
+            for (const auto &key : expired) {
+                erase_entry(key);
+                notify("expired", key);
+            }
+        }
+
+        // a full pass is done, or there is not much left to find
+        if (expire_cursor_ == 0 || expired.size() * 4 < seen ||
+            std::chrono::steady_clock::now() >= tick_end) {
+            break;
         }
     }
 }
@@ -97,12 +1132,40 @@ void KVStore::start_cleanup_thread() {
     cleaner_thread_ = std::thread([this]() {
         while (!stop_cleaner_) {
             std::this_thread::sleep_for(std::chrono::seconds(1));
-            cleanup_expired();
+            tick();
         }
     });
 }
 
 
+void KVStore::tick() {
+    cleanup_expired();
+    rehash_idle();
+    compact_tier();
+    hotkeys_.decay();
+    // nodes the read cache retired while no writes came along
+    EpochDomain::global().reclaim();
+}
+
+
+// time and batch size for moving a resize along from tick()
+static constexpr auto kRehashIdleTime = std::chrono::milliseconds(1);
+static constexpr size_t kRehashIdleBatch = 100;
+
+
+void KVStore::rehash_idle() {
+    auto lock = write_lock();
+    auto until = std::chrono::steady_clock::now() + kRehashIdleTime;
+
+    while (data_.rehash_step(kRehashIdleBatch) && std::chrono::steady_clock::now() < until) {}
+}
+
+
+void KVStore::disable_locking() {
+    locking_ = false;
+}
+
+
 void KVStore::stop_cleanup_thread() {
     stop_cleaner_ = true;
 
@@ -112,32 +1175,29 @@ void KVStore::stop_cleanup_thread() {
     }
 }
 
-std::unordered_map<std::string, KVStore::Entry> KVStore::current_state() const{
-    return data_;
-}
-
-
 std::vector<KVStore::SnapshotItem> KVStore::current_state_leader() const {
 
-    std::shared_lock lock(mutex_);
+    auto lock = read_lock();
 
     std::vector<SnapshotItem> snapshot;
     auto now = std::chrono::steady_clock::now();
 
 
-    for (const auto& e: data_) {
+    snapshot.reserve(data_.size());
 
-        if (e.second.expires_at && *e.second.expires_at <= now) {
-            continue;
+    data_.for_each([&](const std::string &key, const Entry &e) {
+
+        if (e.expires_at && *e.expires_at <= now) {
+            return;
         }
 
         SnapshotItem item;
-        item.key = e.first;
-        item.value = e.second.value;
+        item.key = key;
+        item.value = e.value;
 
-        if (e.second.expires_at) {
+        if (e.expires_at) {
             int ttl = std::chrono::duration_cast<std::chrono::seconds>(
-                *e.second.expires_at - now
+                *e.expires_at - now
             ).count();
 
             if (ttl > 0) {
@@ -145,8 +1205,245 @@ std::vector<KVStore::SnapshotItem> KVStore::current_state_leader() const {
             }
         }
 
-        snapshot.emplace_back(item);
-    }
+        snapshot.emplace_back(std::move(item));
+    });
 
     return snapshot;
 }
+
+
+std::optional<KVStore::SnapshotItem> KVStore::snapshot_item(const std::string &key, const Entry &entry) const {
+    auto started = snapshot_.started;
+
+    if (entry.expires_at && *entry.expires_at <= started) {
+        return std::nullopt;
+    }
+
+    SnapshotItem item;
+    item.key = key;
+
+    // read back now, the value log may compact it away before the base is written
+    if (auto spilled = std::get_if<SpilledValue>(&entry.value)) {
+        item.value = load_spilled(*spilled);
+    } else {
+        item.value = entry.value;
+    }
+
+    if (entry.expires_at) {
+        int ttl = std::chrono::duration_cast<std::chrono::seconds>(
+            *entry.expires_at - started
+        ).count();
+
+        item.ttl_seconds = ttl > 0 ? ttl : 1;
+    }
+    return item;
+}
+
+
+void KVStore::keep_for_snapshot(const std::string &key, const Entry *entry) {
+    if (!snapshot_.active) return;
+
+    if (entry) {
+        // handed out or saved already
+        if (entry->snapshot_epoch == snapshot_.epoch) return;
+        entry->snapshot_epoch = snapshot_.epoch;
+        snapshot_.saved.try_emplace(key, snapshot_item(key, *entry));
+    } else {
+        // the first state recorded for a key wins, a later create changes nothing
+        snapshot_.saved.try_emplace(key, std::nullopt);
+    }
+}
+
+
+void KVStore::begin_snapshot() const {
+
+    auto lock = write_lock();
+
+    // every key present now has an older epoch, so the cursor hands it out once
+    snapshot_.active = true;
+    snapshot_.epoch++;
+    snapshot_.cursor = 0;
+    snapshot_.started = std::chrono::steady_clock::now();
+    snapshot_.saved.clear();
+}
+
+
+bool KVStore::read_snapshot(size_t count, std::vector<SnapshotItem> &items) const {
+
+    auto lock = write_lock();
+
+    if (!snapshot_.active) return false;
+
+    size_t wanted = items.size() + count;
+    // bound the buckets visited per call so a sparse table can't hold the lock for long
+    size_t max_buckets = count * 10;
+
+    do {
+        snapshot_.cursor = data_.scan(snapshot_.cursor, [&](const std::string &key, const Entry &e) {
+            // a rehash can bring a bucket round twice, and saved keys come at the end
+            if (e.snapshot_epoch == snapshot_.epoch) return;
+            e.snapshot_epoch = snapshot_.epoch;
+
+            if (auto item = snapshot_item(key, e)) {
+                items.push_back(std::move(*item));
+            }
+        });
+    } while (snapshot_.cursor && --max_buckets && items.size() < wanted);
+
+    if (snapshot_.cursor) return true;
+
+    // the whole table was covered, what the writes saved is all that is missing
+    for (auto &[key, item] : snapshot_.saved) {
+        if (item) items.push_back(std::move(*item));
+    }
+    snapshot_.saved.clear();
+    snapshot_.active = false;
+    return false;
+}
+
+
+uint64_t KVStore::scan(uint64_t cursor, size_t count, std::vector<std::string> &keys) const {
+
+    auto lock = read_lock();
+
+    auto now = std::chrono::steady_clock::now();
+
+    // bound the buckets visited per call so a sparse table can't hold the lock for long
+    size_t max_buckets = count * 10;
+
+    do {
+        cursor = data_.scan(cursor, [&](const std::string &key, const Entry &e) {
+            if (!e.expires_at || *e.expires_at > now) {
+                keys.push_back(key);
+            }
+        });
+    } while (cursor && --max_buckets && keys.size() < count);
+
+    return cursor;
+}
+
+
+void KVStore::enable_ordered_index() {
+
+    auto lock = write_lock();
+
+    if (ordered_index_) return;
+
+    data_.for_each([&](const std::string &key, const Entry &) {
+        ordered_keys_.insert(key);
+    });
+    ordered_index_ = true;
+}
+
+
+bool KVStore::has_ordered_index() const {
+
+    auto lock = read_lock();
+
+    return ordered_index_;
+}
+
+
+bool KVStore::scan_prefix(
+    const std::string &prefix,
+    const std::string &after,
+    size_t count,
+    std::vector<std::string> &keys
+) const {
+
+    auto lock = read_lock();
+
+    auto now = std::chrono::steady_clock::now();
+    auto it = ordered_keys_.lower_bound(prefix);
+
+    if (!after.empty() && after >= prefix) {
+        it = ordered_keys_.upper_bound(after);
+    }
+
+    for (; it != ordered_keys_.end() && it->compare(0, prefix.size(), prefix) == 0; ++it) {
+        if (keys.size() >= count) {
+            return true;
+        }
+
+        const Entry* entry = data_.find(*it);
+        if (entry && (!entry->expires_at || *entry->expires_at > now)) {
+            keys.push_back(*it);
+        }
+    }
+    return false;
+}
+
+
+std::optional<KVStore::SnapshotItem> KVStore::snapshot_key(const std::string &key) const {
+
+    auto lock = read_lock();
+
+    const Entry* entry = data_.find(key);
+    auto now = std::chrono::steady_clock::now();
+
+    if (!entry || (entry->expires_at && *entry->expires_at <= now)) {
+        return std::nullopt;
+    }
+
+    SnapshotItem item;
+    item.key = key;
+    item.value = entry->value;
+
+    if (entry->expires_at) {
+        int ttl = std::chrono::duration_cast<std::chrono::seconds>(
+            *entry->expires_at - now
+        ).count();
+
+        // round up so a key about to expire does not lose its TTL
+        item.ttl_seconds = ttl > 0 ? ttl : 1;
+    }
+    return item;
+}
+
+
+void KVStore::enable_slot_index() {
+
+    auto lock = write_lock();
+
+    if (!slot_keys_.empty()) return;
+
+    slot_keys_.resize(kClusterSlots);
+    data_.for_each([&](const std::string &key, const Entry &) {
+        slot_keys_[key_hash_slot(key)].insert(key);
+    });
+}
+
+
+size_t KVStore::count_keys_in_slot(uint16_t slot) const {
+
+    auto lock = read_lock();
+
+    if (slot >= slot_keys_.size()) {
+        return 0;
+    }
+    return slot_keys_[slot].size();
+}
+
+
+std::vector<std::string> KVStore::keys_in_slot(uint16_t slot, size_t count) const {
+
+    auto lock = read_lock();
+
+    std::vector<std::string> keys;
+    auto now = std::chrono::steady_clock::now();
+
+    if (slot >= slot_keys_.size()) {
+        return keys;
+    }
+
+    for (const auto &key : slot_keys_[slot]) {
+        if (keys.size() >= count) break;
+
+        // skip keys that expired but were not cleaned up yet
+        const Entry* entry = data_.find(key);
+        if (entry && (!entry->expires_at || *entry->expires_at > now)) {
+            keys.push_back(key);
+        }
+    }
+    return keys;
+}
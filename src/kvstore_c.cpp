@@ -0,0 +1,397 @@
+#include "kvstore_c.h"
+#include "kvstore.hpp"
+#include "persistence.hpp"
+#include "replication.hpp"
+#include "protocol.hpp"
+#include "command_log.hpp"
+#include "log_queue.hpp"
+#include <memory>
+#include <cstring>
+#include <new>
+
+
+struct kvstore {
+    size_t max_key_len;
+    size_t max_value_len;
+
+    KVStore store;
+    std::atomic<bool> running{true};
+    ReplicationManager replica;
+    std::unique_ptr<PersistenceManager> file;
+    bool leader{false};
+
+    /*
+    same as the server: every write goes to the followers and the AOF. the
+    lines are queued under the store lock and written by flush() after it.
+    */
+    LogQueue log{[this](const std::string &lines) {
+        if (leader) replica.replicate_command(lines);
+        if (file) file->append_raw(lines);
+    }};
+
+    kvstore(size_t max_key, size_t max_value)
+        : max_key_len(max_key),
+        max_value_len(max_value),
+        store(max_key, max_value),
+        replica(store, running) {}
+};
+
+
+struct kvstore_iter {
+    kvstore_t *kv;
+    std::string pattern;
+    uint64_t cursor{0};
+    bool done{false};
+    std::vector<std::string> keys;
+    size_t pos{0};
+    // what the last kvstore_iter_next() handed out
+    std::string key;
+    std::string value;
+};
+
+
+// runs `f`, turning exceptions into status codes so nothing unwinds into C
+template <typename F>
+static int guarded(F &&f) {
+    try {
+        return f();
+    } catch (const WrongTypeError &) {
+        return KVSTORE_ERR_WRONGTYPE;
+    } catch (const std::length_error &) {
+        return KVSTORE_ERR_INVALID;
+    } catch (const std::invalid_argument &) {
+        return KVSTORE_ERR_INVALID;
+    } catch (const ReplayError &) {
+        return KVSTORE_ERR_CORRUPT;
+    } catch (...) {
+        return KVSTORE_ERR_INTERNAL;
+    }
+}
+
+
+// copies `value` into the caller's buffer, reporting its size either way
+static int copy_out(std::string_view value, char *buf, size_t buf_len, size_t *value_len) {
+    if (value_len) *value_len = value.size();
+
+    if (value.size() > buf_len) {
+        return KVSTORE_ERR_BUFFER_TOO_SMALL;
+    }
+    if (!value.empty()) std::memcpy(buf, value.data(), value.size());
+    return KVSTORE_OK;
+}
+
+
+static std::string set_line(std::string_view key, std::string_view value, int ttl_seconds) {
+    std::string line;
+    if (ttl_seconds > 0) {
+        append_command(line, {"SET", key, value, "EX", std::to_string(ttl_seconds)});
+    } else {
+        append_command(line, {"SET", key, value});
+    }
+    return line;
+}
+
+
+extern "C" {
+
+int kvstore_open(const kvstore_options_t *options, kvstore_t **out) {
+    if (!out) return KVSTORE_ERR_INVALID;
+    *out = nullptr;
+
+    kvstore_options_t defaults{};
+    if (!options) options = &defaults;
+
+    return guarded([&] {
+        auto kv = std::make_unique<kvstore>(
+            options->max_key_len ? options->max_key_len : 1024,
+            options->max_value_len ? options->max_value_len : (1 << 20)
+        );
+
+        if (options->compress_threshold) {
+            std::string dictionary;
+            if (options->compress_dictionary) {
+                dictionary.assign(options->compress_dictionary, options->compress_dictionary_len);
+            }
+            kv->store.enable_compression(options->compress_threshold, std::move(dictionary));
+        }
+
+        if (options->read_cache) {
+            kv->store.enable_read_cache(options->read_cache, options->hot_read_cache != 0);
+        }
+
+        if (options->tier_dir) {
+            kv->store.enable_tiering(
+                options->tier_dir,
+                options->tier_memory ? options->tier_memory : (size_t(1) << 30),
+                options->tier_cache ? options->tier_cache : (size_t(64) << 20)
+            );
+        }
+
+        if (options->aof_path) {
+            kv->file = std::make_unique<PersistenceManager>(kv->store, options->aof_path);
+            kv->file->replay(kv->store);
+            kv->file->start_save_state_thread();
+        }
+
+        if (options->replication_port > 0) {
+            kv->leader = true;
+            kv->replica.start_leader(options->replication_port);
+        }
+
+        kv->store.start_cleanup_thread();
+        *out = kv.release();
+        return KVSTORE_OK;
+    });
+}
+
+
+void kvstore_close(kvstore_t *kv) {
+    if (!kv) return;
+
+    kv->store.stop_cleanup_thread();
+    if (kv->file) kv->file->stop_save_state_thread();
+    kv->replica.stop();
+    delete kv;
+}
+
+
+int kvstore_set(kvstore_t *kv,
+                const char *key, size_t key_len,
+                const char *value, size_t value_len,
+                int ttl_seconds) {
+    if (!kv || !key || (!value && value_len)) return KVSTORE_ERR_INVALID;
+
+    return guarded([&] {
+        std::string k(key, key_len);
+        std::string_view v(value ? value : "", value_len);
+        std::optional<int> ttl;
+        if (ttl_seconds > 0) ttl = ttl_seconds;
+
+        // compressed and encoded before the lock, applied and queued for the log under it
+        uint64_t seq;
+        if (auto packed = kv->store.compress(v)) {
+            std::string line = encode_command(compressed_set_args(k, *packed, ttl));
+            seq = kv->store.batch([&]() -> uint64_t {
+                if (!kv->store.set_compressed(k, std::move(*packed), ttl)) return 0;
+                return kv->log.append(line);
+            });
+        } else {
+            std::string line = set_line(k, v, ttl_seconds);
+            seq = kv->store.batch([&]() -> uint64_t {
+                if (!kv->store.set_uncompressed(k, v, ttl)) return 0;
+                return kv->log.append(line);
+            });
+        }
+
+        if (!seq) return KVSTORE_ERR_INVALID;
+        kv->log.flush(seq);
+        return KVSTORE_OK;
+    });
+}
+
+
+int kvstore_get(kvstore_t *kv,
+                const char *key, size_t key_len,
+                char *buf, size_t buf_len, size_t *value_len) {
+    if (!kv || !key || (!buf && buf_len)) return KVSTORE_ERR_INVALID;
+
+    return guarded([&] {
+        int status = KVSTORE_OK;
+
+        bool found = kv->store.view(std::string(key, key_len), [&](std::string_view value) {
+            status = copy_out(value, buf, buf_len, value_len);
+        });
+        return found ? status : KVSTORE_NOT_FOUND;
+    });
+}
+
+
+int kvstore_del(kvstore_t *kv, const char *key, size_t key_len) {
+    if (!kv || !key) return KVSTORE_ERR_INVALID;
+
+    return guarded([&] {
+        std::string k(key, key_len);
+
+        std::string line = encode_command({"DELETE", k});
+        uint64_t seq = kv->store.batch([&]() -> uint64_t {
+            if (!kv->store.del(k)) return 0;
+            return kv->log.append(line);
+        });
+
+        if (!seq) return KVSTORE_NOT_FOUND;
+        kv->log.flush(seq);
+        return KVSTORE_OK;
+    });
+}
+
+
+int kvstore_incrby(kvstore_t *kv, const char *key, size_t key_len,
+                   int64_t delta, int64_t *result) {
+    if (!kv || !key) return KVSTORE_ERR_INVALID;
+
+    return guarded([&] {
+        std::string k(key, key_len);
+
+        // queued as the resulting value, under the same lock as the write
+        uint64_t seq = 0;
+        int64_t value = kv->store.batch([&] {
+            int64_t v = kv->store.incrby(k, delta);
+            seq = kv->log.append(encode_key_state(kv->store, k));
+            return v;
+        });
+        kv->log.flush(seq);
+
+        if (result) *result = value;
+        return KVSTORE_OK;
+    });
+}
+
+
+int kvstore_write_batch(kvstore_t *kv, const kvstore_op_t *ops, size_t count) {
+    if (!kv || (!ops && count)) return KVSTORE_ERR_INVALID;
+
+    // validate everything first, a batch is applied completely or not at all
+    for (size_t i = 0; i < count; i++) {
+        const kvstore_op_t &op = ops[i];
+
+        if (!op.key || op.key_len > kv->max_key_len) return KVSTORE_ERR_INVALID;
+        if (op.type == KVSTORE_OP_SET) {
+            if ((!op.value && op.value_len) || op.value_len > kv->max_value_len) {
+                return KVSTORE_ERR_INVALID;
+            }
+        } else if (op.type != KVSTORE_OP_DEL) {
+            return KVSTORE_ERR_INVALID;
+        }
+    }
+
+    return guarded([&] {
+        // compressed up front, the batch lock is held for the stores only
+        std::vector<std::optional<CompressedValue>> packed(count);
+        for (size_t i = 0; i < count; i++) {
+            if (ops[i].type == KVSTORE_OP_SET) {
+                packed[i] = kv->store.compress(std::string_view(ops[i].value ? ops[i].value : "", ops[i].value_len));
+            }
+        }
+
+        uint64_t seq = 0;
+        kv->store.batch([&] {
+            std::string log;
+
+            for (size_t i = 0; i < count; i++) {
+                const kvstore_op_t &op = ops[i];
+                std::string key(op.key, op.key_len);
+
+                if (op.type == KVSTORE_OP_SET) {
+                    std::optional<int> ttl;
+                    if (op.ttl_seconds > 0) ttl = op.ttl_seconds;
+
+                    if (packed[i]) {
+                        log += encode_command(compressed_set_args(key, *packed[i], ttl));
+                        kv->store.set_compressed(key, std::move(*packed[i]), ttl);
+                        continue;
+                    }
+
+                    std::string_view value(op.value ? op.value : "", op.value_len);
+                    kv->store.set_uncompressed(key, value, ttl);
+                    log += set_line(key, value, op.ttl_seconds);
+                } else if (kv->store.del(key)) {
+                    log += encode_command({"DELETE", key});
+                }
+            }
+
+            // queued while the lock is still held, like EXEC in the server
+            if (!log.empty()) {
+                seq = kv->log.append("MULTI\n" + log + "EXEC\n");
+            }
+        });
+
+        kv->log.flush(seq);
+        return KVSTORE_OK;
+    });
+}
+
+
+int kvstore_mget(kvstore_t *kv, size_t count,
+                 const char *const *keys, const size_t *key_lens,
+                 char **bufs, const size_t *buf_lens,
+                 size_t *value_lens, int *statuses) {
+    if (!kv || (count && (!keys || !key_lens || !bufs || !buf_lens || !value_lens || !statuses))) {
+        return KVSTORE_ERR_INVALID;
+    }
+
+    return guarded([&] {
+        kv->store.batch([&] {
+            for (size_t i = 0; i < count; i++) {
+                statuses[i] = guarded([&] {
+                    int status = KVSTORE_OK;
+
+                    bool found = kv->store.view(std::string(keys[i], key_lens[i]), [&](std::string_view value) {
+                        status = copy_out(value, bufs[i], buf_lens[i], &value_lens[i]);
+                    });
+                    return found ? status : KVSTORE_NOT_FOUND;
+                });
+            }
+        });
+        return KVSTORE_OK;
+    });
+}
+
+
+kvstore_iter_t *kvstore_iter_new(kvstore_t *kv, const char *pattern) {
+    if (!kv) return nullptr;
+
+    auto it = new (std::nothrow) kvstore_iter();
+    if (!it) return nullptr;
+
+    it->kv = kv;
+    if (pattern) it->pattern = pattern;
+    return it;
+}
+
+
+int kvstore_iter_next(kvstore_iter_t *it,
+                      const char **key, size_t *key_len,
+                      const char **value, size_t *value_len) {
+    if (!it) return KVSTORE_ERR_INVALID;
+
+    return guarded([&] {
+        while (true) {
+            if (it->pos == it->keys.size()) {
+                if (it->done) return KVSTORE_NOT_FOUND;
+
+                it->keys.clear();
+                it->pos = 0;
+                it->cursor = it->kv->store.scan(it->cursor, 64, it->keys);
+                it->done = (it->cursor == 0);
+                continue;
+            }
+
+            it->key = std::move(it->keys[it->pos++]);
+            if (!it->pattern.empty() && !glob_match(it->pattern, it->key)) {
+                continue;
+            }
+
+            // skip keys deleted since the scan and keys holding collections
+            bool found;
+            try {
+                found = it->kv->store.view(it->key, [&](std::string_view v) { it->value.assign(v); });
+            } catch (const WrongTypeError &) {
+                found = false;
+            }
+            if (!found) continue;
+
+            if (key) *key = it->key.data();
+            if (key_len) *key_len = it->key.size();
+            if (value) *value = it->value.data();
+            if (value_len) *value_len = it->value.size();
+            return KVSTORE_OK;
+        }
+    });
+}
+
+
+void kvstore_iter_free(kvstore_iter_t *it) {
+    delete it;
+}
+
+}  // extern "C"
@@ -0,0 +1,183 @@
+#include "latency.hpp"
+#include <algorithm>
+
+
+const char *stage_name(Stage stage) {
+    switch (stage) {
+    case Stage::Parse: return "parse";
+    case Stage::LockWait: return "lock";
+    case Stage::Execute: return "exec";
+    case Stage::Aof: return "aof";
+    case Stage::Replicate: return "repl";
+    case Stage::Send: return "send";
+    case Stage::Total: return "total";
+    }
+    return "?";
+}
+
+
+RequestTrace *&current_trace() {
+    static thread_local RequestTrace *trace = nullptr;
+    return trace;
+}
+
+
+LatencyHistogram::LatencyHistogram() : buckets_(std::make_unique<std::atomic<uint64_t>[]>(kBuckets)) {
+    reset();
+}
+
+
+size_t LatencyHistogram::bucket_of(uint64_t ns) {
+    if (ns < (1u << kSubBits)) return ns;
+
+    size_t msb = 63 - __builtin_clzll(ns);
+    size_t shift = msb - kSubBits;
+    size_t sub = (ns >> shift) & ((1u << kSubBits) - 1);
+    return ((shift + 1) << kSubBits) + sub;
+}
+
+
+uint64_t LatencyHistogram::bucket_limit(size_t bucket) {
+    if (bucket < (1u << kSubBits)) return bucket;
+
+    size_t shift = (bucket >> kSubBits) - 1;
+    uint64_t sub = bucket & ((1u << kSubBits) - 1);
+    uint64_t lower = ((uint64_t(1) << kSubBits) + sub) << shift;
+    return lower + (uint64_t(1) << shift) - 1;
+}
+
+
+void LatencyHistogram::record(uint64_t ns) {
+    buckets_[bucket_of(ns)].fetch_add(1, std::memory_order_relaxed);
+
+    uint64_t seen = max_.load(std::memory_order_relaxed);
+    while (ns > seen && !max_.compare_exchange_weak(seen, ns, std::memory_order_relaxed)) {}
+}
+
+
+void LatencyHistogram::reset() {
+    for (size_t i = 0; i < kBuckets; i++) {
+        buckets_[i].store(0, std::memory_order_relaxed);
+    }
+    max_.store(0, std::memory_order_relaxed);
+}
+
+
+uint64_t LatencyHistogram::count() const {
+    uint64_t total = 0;
+    for (size_t i = 0; i < kBuckets; i++) {
+        total += buckets_[i].load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+
+uint64_t LatencyHistogram::percentile(double p) const {
+    uint64_t total = count();
+    if (!total) return 0;
+
+    uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(p * total + 0.5));
+    uint64_t seen = 0;
+
+    for (size_t i = 0; i < kBuckets; i++) {
+        seen += buckets_[i].load(std::memory_order_relaxed);
+        if (seen >= rank) return std::min(bucket_limit(i), max());
+    }
+    return max();
+}
+
+
+LatencyMonitor::LatencyMonitor(uint64_t slow_threshold_us, size_t slow_max)
+    : slow_threshold_ns_(slow_threshold_us * 1000),
+    slow_max_(slow_max) {}
+
+
+void LatencyMonitor::configure_slowlog(uint64_t threshold_us, size_t max_len) {
+    std::lock_guard<std::mutex> lock(slow_mutex_);
+    slow_threshold_ns_.store(threshold_us * 1000, std::memory_order_relaxed);
+    slow_max_ = max_len;
+
+    while (slow_.size() > slow_max_) slow_.pop_back();
+}
+
+
+// the slow log only keeps the start of long arguments
+static constexpr size_t kMaxLoggedArg = 32;
+static constexpr size_t kMaxLoggedArgs = 8;
+
+
+void LatencyMonitor::record(const RequestTrace &trace, const std::vector<std::string> &tokens) {
+    for (size_t i = 0; i < kStageCount; i++) {
+        histograms_[i].record(trace.ns[i]);
+    }
+
+    if (trace.ns[static_cast<size_t>(Stage::Total)] < slow_threshold_ns_.load(std::memory_order_relaxed)) {
+        return;
+    }
+
+    SlowEntry entry;
+    entry.time = std::chrono::duration_cast<std::chrono::seconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    entry.trace = trace;
+
+    for (size_t i = 0; i < tokens.size() && i < kMaxLoggedArgs; i++) {
+        if (i) entry.command += ' ';
+        if (tokens[i].size() > kMaxLoggedArg) {
+            entry.command += tokens[i].substr(0, kMaxLoggedArg) + "...(" + std::to_string(tokens[i].size()) + " bytes)";
+        } else {
+            entry.command += tokens[i];
+        }
+    }
+    if (tokens.size() > kMaxLoggedArgs) {
+        entry.command += " ...(" + std::to_string(tokens.size() - kMaxLoggedArgs) + " more)";
+    }
+
+    std::lock_guard<std::mutex> lock(slow_mutex_);
+    if (!slow_max_) return;
+
+    entry.id = next_slow_id_++;
+    slow_.push_front(std::move(entry));
+    if (slow_.size() > slow_max_) slow_.pop_back();
+}
+
+
+std::vector<LatencyMonitor::SlowEntry> LatencyMonitor::slowlog(size_t count) const {
+    std::lock_guard<std::mutex> lock(slow_mutex_);
+    count = std::min(count, slow_.size());
+    return std::vector<SlowEntry>(slow_.begin(), slow_.begin() + count);
+}
+
+
+size_t LatencyMonitor::slowlog_len() const {
+    std::lock_guard<std::mutex> lock(slow_mutex_);
+    return slow_.size();
+}
+
+
+void LatencyMonitor::slowlog_reset() {
+    std::lock_guard<std::mutex> lock(slow_mutex_);
+    slow_.clear();
+}
+
+
+void LatencyMonitor::reset() {
+    for (auto &h : histograms_) h.reset();
+}
+
+
+std::string format_us(uint64_t ns) {
+    return std::to_string(ns / 1000) + "." + std::to_string(ns % 1000 / 100) + "us";
+}
+
+
+std::string format_breakdown(const RequestTrace &trace) {
+    std::string out;
+
+    for (size_t i = 0; i < kStageCount; i++) {
+        if (i) out += ' ';
+        out += stage_name(static_cast<Stage>(i));
+        out += '=';
+        out += format_us(trace.ns[i]);
+    }
+    return out;
+}
@@ -0,0 +1,37 @@
+#include "log_queue.hpp"
+#include "protocol.hpp"
+
+
+uint64_t LogQueue::append(std::string_view lines) {
+    std::lock_guard<std::mutex> lock(queue_mutex_);
+    queue_ += lines;
+    return ++appended_;
+}
+
+
+uint64_t LogQueue::append_command(std::initializer_list<std::string_view> args) {
+    std::lock_guard<std::mutex> lock(queue_mutex_);
+    ::append_command(queue_, args);
+    return ++appended_;
+}
+
+
+void LogQueue::flush(uint64_t seq) {
+    if (written_.load(std::memory_order_acquire) >= seq) return;
+
+    std::lock_guard<std::mutex> lock(flush_mutex_);
+    // the flush we waited for may have taken our lines along
+    if (written_.load(std::memory_order_relaxed) >= seq) return;
+
+    uint64_t last;
+    {
+        std::lock_guard<std::mutex> queue_lock(queue_mutex_);
+        // the buffer just written goes back as the (empty) queue, its capacity is reused
+        writing_.swap(queue_);
+        last = appended_;
+    }
+
+    sink_(writing_);
+    writing_.clear();
+    written_.store(last, std::memory_order_release);
+}
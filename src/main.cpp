@@ -2,8 +2,16 @@
 #include "server.hpp"
 #include "persistence.hpp"
 #include <csignal>
+#include <memory>
+#include <fstream>
+#include <iostream>
+#include <iterator>
 #include <node_role.hpp>
 #include <replication.hpp>
+#include "cluster.hpp"
+#include "sharded_server.hpp"
+#include "command_log.hpp"
+#include <algorithm>
 
 std::atomic<bool> running(true);
 
@@ -15,34 +23,230 @@ void handle_signal(int) {
 int main(int argc, char* argv[]) {
     
     KVStore store;
+
+    bool follower = false;
+    int port = 0;
+    int repl_port = 8001;
+    std::string leader_ip = "127.0.0.1";
+    int leader_port = 8001;
+    bool cluster_mode = false;
+    std::string announce_ip = "127.0.0.1";
+    size_t compress_threshold = 0;
+    std::string dict_path;
+    std::string tier_dir;
+    size_t tier_memory_mb = 1024;
+    size_t tier_cache_mb = 64;
+    bool ordered_index = false;
+    size_t read_cache_mb = 0;
+    size_t hot_cache_mb = 0;
+    size_t cores = 0;
+    uint64_t slowlog_us = 10000;
+    size_t slowlog_len = 128;
+    bool keyspace_events = false;
+    bool log_commands = false;
+    size_t pubsub_buffer_mb = 32;
+    PersistenceManager::RewritePolicy aof_rewrite;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+
+        /*
+        --follower [ip [port]]: the leader's address may follow the flag
+        (the old form), as long as those are not flags themselves.
+        --leader-ip / --leader-port set it anywhere on the line.
+        */
+        if (arg == "--follower") {
+            follower = true;
+            if (i + 1 < argc && std::string(argv[i + 1]).rfind("--", 0) != 0) {
+                leader_ip = argv[++i];
+                if (i + 1 < argc && std::string(argv[i + 1]).rfind("--", 0) != 0) {
+                    leader_port = std::stoi(argv[++i]);
+                }
+            }
+        } else if (arg == "--leader-ip" && has_value) {
+            leader_ip = argv[++i];
+        } else if (arg == "--leader-port" && has_value) {
+            leader_port = std::stoi(argv[++i]);
+        } else if (arg == "--ordered-index") {
+            ordered_index = true;
+        } else if (arg == "--cluster") {
+            cluster_mode = true;
+        } else if (arg == "--port" && has_value) {
+            port = std::stoi(argv[++i]);
+        } else if (arg == "--repl-port" && has_value) {
+            repl_port = std::stoi(argv[++i]);
+        } else if (arg == "--announce-ip" && has_value) {
+            announce_ip = argv[++i];
+        } else if (arg == "--compress-threshold" && has_value) {
+            compress_threshold = std::stoul(argv[++i]);
+        } else if (arg == "--compress-dict" && has_value) {
+            dict_path = argv[++i];
+        } else if (arg == "--read-cache-mb" && has_value) {
+            read_cache_mb = std::stoul(argv[++i]);
+        } else if (arg == "--hot-cache-mb" && has_value) {
+            hot_cache_mb = std::stoul(argv[++i]);
+        } else if (arg == "--tier-dir" && has_value) {
+            tier_dir = argv[++i];
+        } else if (arg == "--tier-memory-mb" && has_value) {
+            tier_memory_mb = std::stoul(argv[++i]);
+        } else if (arg == "--tier-cache-mb" && has_value) {
+            tier_cache_mb = std::stoul(argv[++i]);
+        } else if (arg == "--cores" && has_value) {
+            cores = std::stoul(argv[++i]);
+        } else if (arg == "--slowlog-us" && has_value) {
+            slowlog_us = std::stoull(argv[++i]);
+        } else if (arg == "--slowlog-len" && has_value) {
+            slowlog_len = std::stoul(argv[++i]);
+        } else if (arg == "--notify-keyspace-events") {
+            keyspace_events = true;
+        } else if (arg == "--log-commands") {
+            log_commands = true;
+        } else if (arg == "--pubsub-buffer-mb" && has_value) {
+            pubsub_buffer_mb = std::stoul(argv[++i]);
+        } else if (arg == "--aof-rewrite-min-mb" && has_value) {
+            aof_rewrite.min_size = std::stoul(argv[++i]) << 20;
+        } else if (arg == "--aof-rewrite-percent" && has_value) {
+            aof_rewrite.growth_percent = std::stoul(argv[++i]);
+        } else if (arg == "--aof-rewrite-mbps" && has_value) {
+            aof_rewrite.rate_mb = std::stoul(argv[++i]);
+        }
+    }
+
+    if (!port) {
+        port = follower ? 7000 : 8000;
+    }
+
+    /*
+    the dictionary must be the same on every node that exchanges compressed
+    values. a leader without one trains it from its data after the AOF replay
+    and saves it, copy that file to the followers.
+    */
+    std::string dictionary;
+    bool train_dict = false;
+    if (compress_threshold && !dict_path.empty()) {
+        std::ifstream in(dict_path, std::ios::binary);
+        if (in) {
+            dictionary.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        } else {
+            train_dict = !follower && !cores;
+        }
+    }
+
+    // applied to the store, or to every partition in --cores mode
+    auto configure = [&](KVStore &s, const std::string &tier_subdir) {
+        if (ordered_index) s.enable_ordered_index();
+        if (read_cache_mb) {
+            s.enable_read_cache(read_cache_mb << 20);
+        } else if (hot_cache_mb) {
+            // only the keys the hot key tracker flags get in
+            s.enable_read_cache(hot_cache_mb << 20, true);
+        }
+        if (compress_threshold) s.enable_compression(compress_threshold, dictionary);
+
+        // before the replay, so a dataset larger than memory can be loaded
+        if (!tier_dir.empty()) {
+            s.enable_tiering(tier_dir + tier_subdir, tier_memory_mb << 20, tier_cache_mb << 20);
+        }
+    };
+
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+
+    if (cores) {
+        if (follower || cluster_mode) {
+            std::cerr << "--cores can not be combined with --follower or --cluster\n";
+            return 1;
+        }
+
+        ShardedServer::Options options;
+        options.port = port;
+        options.cores = cores;
+        options.aof_rewrite = aof_rewrite;
+
+        // every core gets its share of the tiering budget
+        tier_memory_mb = std::max<size_t>(1, tier_memory_mb / cores);
+        tier_cache_mb = std::max<size_t>(1, tier_cache_mb / cores);
+
+        std::unique_ptr<ShardedServer> server;
+        try {
+            server = std::make_unique<ShardedServer>(options, [&](KVStore &s, size_t core) {
+                configure(s, "/core-" + std::to_string(core));
+            });
+        } catch (const ReplayError &) {
+            // the replay said where, serving only part of the AOF is not an option
+            return 1;
+        }
+        server->start(running);
+        return 0;
+    }
+
+    configure(store, "");
+
     ReplicationManager replica(store, running);
-    NodeRole role = NodeRole::Leader;
-    if (argc >= 2 && std::string(argv[1]) == "--follower") {
-        role = NodeRole::Follower;
-        std::string leader_ip = (argc >= 3) ? argv[2] : "127.0.0.1";
-        int leader_port = (argc >= 4) ? std::stoi(argv[3]) : 8001;
+    NodeRole role = follower ? NodeRole::Follower : NodeRole::Leader;
+
+    PersistenceManager file(store, "data.aof");
+    file.set_rewrite_policy(aof_rewrite);
+
+    std::unique_ptr<ClusterManager> cluster;
+    if (cluster_mode) {
+        store.enable_slot_index();
+        cluster = std::make_unique<ClusterManager>(
+            store, file, replica, running, announce_ip, port
+        );
+    }
+
+    TCPServer server(port, store, file, role, replica, cluster.get());
+    server.latency().configure_slowlog(slowlog_us, slowlog_len);
+    server.pubsub().set_max_pending(pubsub_buffer_mb << 20);
+    server.set_log_commands(log_commands);
+
+    // before anything else (the replication stream) writes to the store
+    if (keyspace_events) {
+        store.set_event_listener([&server](const char *event, const std::string &key) {
+            server.pubsub().notify(event, key);
+        });
+    }
+
+    // the AOF first, the leader's stream is newer than anything in it
+    try {
+        file.replay(store);
+    } catch (const ReplayError &) {
+        return 1;
+    }
+
+    if (follower) {
         replica.start_follower(leader_ip, leader_port);
     }
-    
-    int port = (role == NodeRole::Leader)? 8000: 7000;
 
-    PersistenceManager file(store, "data.aof");
-    TCPServer server(port, store, file, role, replica);
-    file.replay(store);
+    if (train_dict) {
+        auto samples = store.sample_values(1000);
 
+        // too little data to learn anything from, try again on the next start
+        if (samples.size() >= 16) {
+            std::string dictionary = train_dictionary(samples, 32 * 1024);
+            std::ofstream(dict_path, std::ios::binary) << dictionary;
+            std::cout << "trained a " << dictionary.size() << " byte compression dictionary into " << dict_path << "\n";
+            store.enable_compression(compress_threshold, std::move(dictionary));
+        }
+    }
 
     if (role == NodeRole::Leader) {
-        replica.start_leader(8001);
+        replica.start_leader(repl_port);
     }
 
-    
-    signal(SIGINT, handle_signal);
-    signal(SIGTERM, handle_signal);
+    if (cluster) {
+        cluster->start();
+    }
 
     
     file.start_save_state_thread();
     store.start_cleanup_thread();
     server.start(running);
+    if (cluster) {
+        cluster->stop();
+    }
     store.stop_cleanup_thread();
     file.stop_save_state_thread();
     replica.stop();
@@ -1,13 +1,147 @@
 #include "persistence.hpp"
 #include "kvstore.hpp"
+#include "protocol.hpp"
+#include "command_log.hpp"
 #include <fstream>
 #include <vector>
 #include <sstream>
+#include <algorithm>
+#include <charconv>
+#include <cerrno>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+
+// the rewrite hands the base to the kernel in chunks this big (and throttles per chunk)
+static constexpr size_t kRewriteChunk = 256 * 1024;
+
+// keys copied per store lock acquisition while the rewrite snapshots the store
+static constexpr size_t kSnapshotChunk = 1024;
+
+// a node that logs nothing itself is rewritten at most this often
+static constexpr int64_t kIdleRewriteMs = 15000;
+
+
+static int64_t now_ms() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+static size_t file_size(const std::string& path) {
+        struct stat st;
+        return stat(path.c_str(), &st) == 0 ? st.st_size : 0;
+}
+
+
+static bool write_all(int fd, const char* data, size_t size) {
+        while (size > 0) {
+                ssize_t n = write(fd, data, size);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) return false;
+                data += n;
+                size -= n;
+        }
+        return true;
+}
 
 
 PersistenceManager::PersistenceManager(const KVStore &store, const std::string& filename)
         : store_(store),
-          filename_(filename) {}
+          filename_(filename) {
+
+        std::lock_guard<std::mutex> lock(append_mutex_);
+
+        std::ifstream manifest(manifest_path());
+        std::string line;
+
+        while (std::getline(manifest, line)) {
+                size_t space = line.find(' ');
+                if (space == std::string::npos) continue;
+
+                std::string kind = line.substr(0, space);
+                std::string path = line.substr(space + 1);
+
+                if (kind == "base") base_ = path;
+                else if (kind == "incr") incrs_.push_back(path);
+                else continue;
+
+                // part numbers keep counting up across restarts
+                uint64_t n = 0;
+                size_t dot = path.rfind('.');
+                if (dot != std::string::npos &&
+                    std::from_chars(path.data() + dot + 1, path.data() + path.size(), n).ec == std::errc()) {
+                        next_part_ = std::max(next_part_, n + 1);
+                }
+        }
+
+        // a single file AOF from before the manifest: it becomes the base
+        if (!manifest.is_open() && file_size(filename_) > 0) {
+                base_ = filename_;
+        }
+
+        if (!base_.empty()) base_bytes_ = file_size(base_);
+        for (const auto& incr : incrs_) incr_bytes_ += file_size(incr);
+
+        // keep appending to the last incr part
+        if (!incrs_.empty()) {
+                incr_fd_ = open(incrs_.back().c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        }
+        if (incr_fd_ < 0) {
+                open_new_incr();
+        }
+        write_manifest();
+
+        last_rewrite_ms_ = now_ms();
+}
+
+
+PersistenceManager::~PersistenceManager() {
+        stop_save_state_thread();
+        join_background();
+        if (incr_fd_ >= 0) close(incr_fd_);
+}
+
+
+std::string PersistenceManager::part_path(const char* kind, uint64_t n) const {
+        return filename_ + "." + kind + "." + std::to_string(n);
+}
+
+
+bool PersistenceManager::open_new_incr() {
+        std::string path = part_path("incr", next_part_++);
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+
+        if (fd < 0) {
+                perror("open AOF incr part");
+                return false;
+        }
+
+        if (incr_fd_ >= 0) close(incr_fd_);
+        incr_fd_ = fd;
+        incrs_.push_back(path);
+        return true;
+}
+
+
+void PersistenceManager::write_manifest() {
+        std::string text;
+        if (!base_.empty()) text += "base " + base_ + "\n";
+        for (const auto& incr : incrs_) text += "incr " + incr + "\n";
+
+        // written aside and renamed over, so there is always a complete manifest
+        std::string temp_file = manifest_path() + ".temp";
+        int fd = open(temp_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+        bool ok = fd >= 0 && write_all(fd, text.data(), text.size()) && fsync(fd) == 0;
+        if (fd >= 0) close(fd);
+
+        if (!ok || std::rename(temp_file.c_str(), manifest_path().c_str()) != 0) {
+                std::cerr << "failed to write the AOF manifest\n";
+        }
+}
 
 
 void PersistenceManager::append_set(
@@ -15,161 +149,289 @@ void PersistenceManager::append_set(
         const std::string& value,
         std::optional<int> ttl
 ){
-        std::ofstream file(filename_, std::ios::app);
-        
-        if (!file.is_open()) {
-                std::cerr << "failed to open AOF fle for writing \n";
-
-                return;
+        if (ttl) {
+                append_command({"SET", key, value, "EX", std::to_string(*ttl)});
+        } else {
+                append_command({"SET", key, value});
         }
+}
 
-        file << "SET " << key << " " << value;
 
-        if(ttl){
-                file << " EX " << *ttl;
-        }
+void PersistenceManager::append_del(const std::string& key) {
+        append_command({"DELETE", key});
+}
 
-        file << "\n";
+
+void PersistenceManager::append_command(const std::vector<std::string>& args) {
+        append_raw(encode_command(args));
 }
 
 
-void PersistenceManager::append_del(const std::string& key) {
-        std::ofstream file(filename_, std::ios::app);
+void PersistenceManager::append_raw(const std::string& lines) {
+        std::lock_guard<std::mutex> lock(append_mutex_);
 
-        if (!file.is_open()) {
-                std::cerr << "Failed to open data.aof file for writing\n";
+        if (incr_fd_ < 0 || !write_all(incr_fd_, lines.data(), lines.size())) {
+                std::cerr << "failed to write to the AOF\n";
                 return;
         }
 
-        file << "DELETE " << key << "\n";
+        incr_bytes_ += lines.size();
 }
 
 
 
 void PersistenceManager::replay(KVStore& store) {
 
-        std::ifstream file(filename_);
+        std::vector<std::string> parts;
+        {
+                std::lock_guard<std::mutex> lock(append_mutex_);
+                if (!base_.empty()) parts.push_back(base_);
+                parts.insert(parts.end(), incrs_.begin(), incrs_.end());
+        }
 
-        if (!file.is_open()) {
+        if (base_bytes_ + incr_bytes_ == 0) {
                 std::cout << "nothing saved in KVS, proceeding...\n";
+                saved_version_ = store_.write_version();
                 return;
         }
 
         std::string line;
+        LogApplier applier(store);
 
-        while(std::getline(file, line)) {
-                if(line.empty()) continue;
+        for (const auto& part : parts) {
+                std::ifstream file(part);
 
-                std::istringstream iss(line);
-                std::vector<std::string> tokens;
-                std::string token;
+                if (!file.is_open()) {
+                        std::cerr << "AOF part " << part << " is missing\n";
+                        continue;
+                }
 
-                while (iss >> token) {
-                        tokens.emplace_back(token);
+                size_t line_no = 0;
+                while(std::getline(file, line)) {
+                        line_no++;
+                        if(line.empty()) continue;
+
+                        try {
+                                applier.feed(line);
+                        } catch (const ReplayError& e) {
+                                // going on without the record would lose it for good with the next rewrite
+                                std::cerr << "AOF replay stopped at " << part << ":" << line_no
+                                        << ": " << e.what() << "\n";
+                                throw;
+                        }
                 }
+        }
 
-                if (tokens.empty()) continue;
+        saved_version_ = store_.write_version();
+}
 
-                const std::string& cmd = tokens[0];
 
-                if ( cmd == "SET") {
-                        if (tokens.size() < 3) continue;
-                        std::string key = tokens[1];
-                        std::string value;
-                        std::optional<int> ttl;
+bool PersistenceManager::rewrite_needed() const {
+        size_t incr = incr_bytes_;
+        size_t base = base_bytes_;
 
-                        size_t i = 2;
+        if (incr > 0 && incr >= policy_.min_size && incr * 100 >= base * policy_.growth_percent) {
+                return true;
+        }
 
-                        for (; i < tokens.size(); i++) {
-                                if(tokens[i] == "EX") break;
-                                if(!value.empty()) value += " ";
-                                value += tokens[i];
-                        }
+        // nothing is appended here (a follower), so go by the store
+        return incr == 0 &&
+                now_ms() - last_rewrite_ms_ >= kIdleRewriteMs &&
+                store_.write_version() != saved_version_;
+}
 
-                        if (i < tokens.size() && tokens[i] == "EX" && i + 1 < tokens.size()) {
-                                try {
-                                        ttl = std::stoi(tokens[i + 1]);
-                                } catch (...) {
-                                        continue;
-                                }
-                        }
 
-                        store.set(key, value, ttl);
+struct PersistenceManager::Rewrite {
+        std::chrono::steady_clock::time_point started;
+        std::vector<KVStore::SnapshotItem> data;
+        size_t rotated_bytes;
+        uint64_t version;
+        uint64_t n;
+};
+
+
+// caller holds rewrite_mutex_
+bool PersistenceManager::snapshot(Rewrite& rewrite) {
+        rewrite.started = std::chrono::steady_clock::now();
+        {
+                /*
+                no write sits between its log line and the store while this
+                is held. only the point in time is taken here, the copy
+                follows once the writers are let in again.
+                */
+                std::unique_lock<std::shared_mutex> gate(gate_);
+                {
+                        std::lock_guard<std::mutex> lock(append_mutex_);
+                        if (!open_new_incr()) return false;
+                        write_manifest();
+                        rewrite.rotated_bytes = incr_bytes_;
                 }
-
-                else if (cmd == "DELETE") {
-                        if (tokens.size() >= 2) {
-                                store.del(tokens[1]);
-                        }
-                }       
+                rewrite.version = store_.write_version();
+                store_.begin_snapshot();
         }
-}
 
+        // a chunk at a time, each one under the store lock for a moment
+        while (store_.read_snapshot(kSnapshotChunk, rewrite.data)) {}
+
+        std::lock_guard<std::mutex> lock(append_mutex_);
+        rewrite.n = next_part_++;
+        return true;
+}
 
-void PersistenceManager::save_state() {
 
-        std::string temp_file = filename_ + ".temp";
-        std::ofstream file(temp_file, std::ios::trunc);
+// caller holds rewrite_mutex_, the store isn't touched from here on
+void PersistenceManager::write_base(Rewrite& rewrite, bool throttled) {
+        /*
+        the appends go to the new incr part meanwhile, the old parts stay
+        in the manifest until the new base is complete
+        */
+        std::string base = part_path("base", rewrite.n);
+        int fd = open(base.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
 
-        if (!file.is_open()) {
-                std::cerr << "Failed to open data.aof.temp for writing\n";
+        if (fd < 0) {
+                perror("open AOF base");
                 return;
         }
 
-        const auto& data = store_.current_state();
+        size_t written = 0;
+        std::string out;
+        bool ok = true;
+
+        auto flush = [&] {
+                // throttled, unless we are shutting down
+                if (throttled && policy_.rate_mb && !thread_should_stop_ && !full_speed_) {
+                        auto due = rewrite.started + std::chrono::microseconds(
+                                written * 1000000 / (policy_.rate_mb << 20));
+                        std::this_thread::sleep_until(due);
+                }
+
+                ok = ok && write_all(fd, out.data(), out.size());
+                written += out.size();
+                out.clear();
+        };
+
+        for (const auto& item: rewrite.data) {
+                encode_snapshot_item(item, out);
+                if (out.size() >= kRewriteChunk) flush();
+        }
+        flush();
+        rewrite.data = {};
+
+        ok = ok && fsync(fd) == 0;
+        close(fd);
 
-        if (data.empty()) {
-                std::cout << "no data to store in .temp file";
+        if (!ok) {
+                std::cerr << "failed to write " << base << "\n";
+                unlink(base.c_str());
                 return;
         }
-        
-        for (const auto & pair: data) {
-                file << "SET " << pair.first << " " << pair.second.value;
-                
-                if (pair.second.expires_at) {
-                        auto now = std::chrono::steady_clock::now();
-                        auto ttl = std::chrono::duration_cast<std::chrono::seconds>(
-                                *pair.second.expires_at - now
-                        ).count();
-                        
-                        if (ttl > 0) {
-                                file << " EX " << ttl;
-                        }
-                }
 
-                file << "\n";
+        // switch the manifest over, then drop what it no longer lists
+        std::vector<std::string> old;
+        {
+                std::lock_guard<std::mutex> lock(append_mutex_);
+
+                if (!base_.empty()) old.push_back(base_);
+                old.insert(old.end(), incrs_.begin(), incrs_.end() - 1);
+                incrs_.erase(incrs_.begin(), incrs_.end() - 1);
+                base_ = base;
+                write_manifest();
+
+                base_bytes_ = written;
+                incr_bytes_ -= rewrite.rotated_bytes;
         }
 
-        file.close();
+        for (const auto& path : old) {
+                unlink(path.c_str());
+        }
+
+        saved_version_ = rewrite.version;
+        last_rewrite_ms_ = now_ms();
+
+        std::cout << "rewrote the AOF: " << written << " bytes in "
+                << std::chrono::duration_cast<std::chrono::milliseconds>(
+                        std::chrono::steady_clock::now() - rewrite.started).count()
+                << "ms" << std::endl;
+}
+
+
+void PersistenceManager::save_state(bool throttled) {
+
+        // a rewrite still running in the background is done at our speed
+        if (!throttled) full_speed_ = true;
+        join_background();
+        full_speed_ = false;
+
+        std::lock_guard<std::mutex> rewriting(rewrite_mutex_);
+
+        Rewrite rewrite;
+        if (snapshot(rewrite)) {
+                write_base(rewrite, throttled);
+        }
+}
+
+
+bool PersistenceManager::save_state_in_background() {
+
+        if (background_running_) return false;
+        join_background();
 
-        std::rename(temp_file.c_str(), filename_.c_str());
+        auto rewrite = std::make_shared<Rewrite>();
+        {
+                std::lock_guard<std::mutex> rewriting(rewrite_mutex_);
+                if (!snapshot(*rewrite)) return false;
+        }
+
+        background_running_ = true;
+        background_thread_ = std::thread([this, rewrite] {
+                {
+                        std::lock_guard<std::mutex> rewriting(rewrite_mutex_);
+                        write_base(*rewrite, true);
+                }
+                background_running_ = false;
+        });
+        return true;
+}
+
+
+void PersistenceManager::join_background() {
+        if (background_thread_.joinable()) {
+                background_thread_.join();
+        }
 }
 
 
 void PersistenceManager::start_save_state_thread() {
 
         thread_should_stop_ = false;
-        /* 
-        will work on it later - the idea is to check the file size
-        and other things to decide if rewriting is worth it
-        */
-        // std::fstream file(filename_, std::ios::ate);
 
         save_state_thread_ = std::thread([this]() {
                 while(!thread_should_stop_) {
-                        std::this_thread::sleep_for(std::chrono::seconds(15));
-                        PersistenceManager::save_state();
+                        {
+                                std::unique_lock<std::mutex> lock(stop_mutex_);
+                                if (stop_cv_.wait_for(lock, std::chrono::seconds(1),
+                                        [this] { return thread_should_stop_.load(); })) {
+                                        break;
+                                }
+                        }
+                        if (rewrite_needed()) {
+                                PersistenceManager::save_state();
+                        }
                 }
         });
 }
 
 
 void PersistenceManager::stop_save_state_thread() {
-        thread_should_stop_ = true;
+        {
+                std::lock_guard<std::mutex> lock(stop_mutex_);
+                thread_should_stop_ = true;
+        }
+        stop_cv_.notify_all();
 
         if (save_state_thread_.joinable()) {
                 save_state_thread_.join();
                 std::cout << "Stopped save_state thread\n";
 
         }
-}
\ No newline at end of file
+}
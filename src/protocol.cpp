@@ -0,0 +1,331 @@
+#include "protocol.hpp"
+#include <string_view>
+#include <charconv>
+#include <cmath>
+#include <stdexcept>
+#include <cstdint>
+
+void tokenize(std::string_view line, std::vector<std::string> &tokens) {
+    size_t count = 0;
+    size_t i = 0;
+
+    // the next token, reusing the string left there by the previous line
+    auto next = [&]() -> std::string & {
+        if (count == tokens.size()) tokens.emplace_back();
+        std::string &token = tokens[count++];
+        token.clear();
+        return token;
+    };
+
+    while (i < line.size()) {
+        if (line[i] == ' ') {
+            i++;
+            continue;
+        }
+
+        std::string &current = next();
+        bool in_quotes = false;
+
+        // copy runs of plain characters in one go, not char by char
+        while (i < line.size()) {
+            size_t run = line.find_first_of(in_quotes ? "\\\"" : " \"", i);
+            if (run == std::string_view::npos) run = line.size();
+            current.append(line.data() + i, run - i);
+            i = run;
+
+            if (i == line.size() || (line[i] == ' ' && !in_quotes)) break;
+
+            // handle escape inside quotes: \n and \r are line breaks, anything else stands for itself
+            if (line[i] == '\\') {
+                if (i + 1 < line.size()) {
+                    char c = line[i + 1];
+                    current += c == 'n' ? '\n' : c == 'r' ? '\r' : c;
+                    i += 2;
+                } else {
+                    current += line[i++];
+                }
+            } else {
+                in_quotes = !in_quotes;
+                i++;
+            }
+        }
+    }
+
+    tokens.resize(count);
+}
+
+
+bool split_words(std::string_view line, std::vector<std::string_view> &words) {
+    if (line.find('"') != std::string_view::npos) return false;
+
+    words.clear();
+    size_t i = 0;
+    while (i < line.size()) {
+        if (line[i] == ' ') {
+            i++;
+            continue;
+        }
+
+        size_t end = line.find(' ', i);
+        if (end == std::string_view::npos) end = line.size();
+        words.push_back(line.substr(i, end - i));
+        i = end;
+    }
+    return true;
+}
+
+
+std::vector<std::string> tokenize(std::string_view line) {
+    std::vector<std::string> tokens;
+    tokenize(line, tokens);
+    return tokens;
+}
+
+
+void append_token(std::string &out, std::string_view token) {
+    // empty tokens, keywords and anything a reader could split on go in quotes
+    static constexpr std::string_view kSpecial(" \"\\\n\r", 5);
+
+    if (!token.empty() && token != "EX" && token.find_first_of(kSpecial) == std::string_view::npos) {
+        out += token;
+        return;
+    }
+
+    out += '"';
+    for (char c : token) {
+        if (c == '\n') {
+            out += "\\n";
+        } else if (c == '\r') {
+            out += "\\r";
+        } else {
+            if (c == '"' || c == '\\') out += '\\';
+            out += c;
+        }
+    }
+    out += '"';
+}
+
+
+void append_command(std::string &out, std::initializer_list<std::string_view> args) {
+    bool first = true;
+
+    for (std::string_view arg : args) {
+        if (!first) out += ' ';
+        append_token(out, arg);
+        first = false;
+    }
+    out += '\n';
+}
+
+
+std::string encode_command(const std::vector<std::string> &args) {
+    std::string out;
+
+    for (size_t i = 0; i < args.size(); i++) {
+        if (i) out += ' ';
+        append_token(out, args[i]);
+    }
+    out += '\n';
+    return out;
+}
+
+
+bool has_array_reply(const std::string &cmd) {
+    return cmd == "MGET" || cmd == "LRANGE" || cmd == "SMEMBERS" ||
+           cmd == "ZRANGE" || cmd == "ZRANGEBYSCORE" || cmd == "SCAN" ||
+           cmd == "HOTKEYS" || cmd == "SLOWLOG" || cmd == "LATENCY";
+}
+
+
+bool is_read_command(const std::string &cmd) {
+    return cmd == "GET" || cmd == "MGET" ||
+           cmd == "HGET" ||
+           cmd == "LRANGE" ||
+           cmd == "SISMEMBER" || cmd == "SMEMBERS" ||
+           cmd == "ZSCORE" || cmd == "ZRANGE" || cmd == "ZRANGEBYSCORE" ||
+           cmd == "SCAN" || cmd == "HOTKEYS";
+}
+
+
+std::string encode_array(const std::vector<std::string> &items) {
+    std::string out = "*" + std::to_string(items.size()) + "\n";
+
+    for (const auto &item : items) {
+        out += item;
+        out += '\n';
+    }
+    return out;
+}
+
+
+std::string format_score(double score) {
+    char buf[64];
+    auto res = std::to_chars(buf, buf + sizeof(buf), score);
+    return std::string(buf, res.ptr);
+}
+
+
+double parse_score(const std::string &s) {
+    size_t pos = 0;
+    double score;
+
+    try {
+        score = std::stod(s, &pos);
+    } catch (...) {
+        throw std::invalid_argument("value is not a valid float");
+    }
+
+    if (pos != s.size() || std::isnan(score)) {
+        throw std::invalid_argument("value is not a valid float");
+    }
+    return score;
+}
+
+
+double parse_score_bound(const std::string &s, bool &exclusive) {
+    exclusive = !s.empty() && s[0] == '(';
+    return parse_score(exclusive ? s.substr(1) : s);
+}
+
+
+static const char kBase64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+
+std::string base64_encode(std::string_view data) {
+    std::string out;
+    out.reserve((data.size() + 2) / 3 * 4);
+
+    size_t i = 0;
+    for (; i + 3 <= data.size(); i += 3) {
+        uint32_t n = (uint8_t(data[i]) << 16) | (uint8_t(data[i + 1]) << 8) | uint8_t(data[i + 2]);
+        out += kBase64[n >> 18];
+        out += kBase64[(n >> 12) & 63];
+        out += kBase64[(n >> 6) & 63];
+        out += kBase64[n & 63];
+    }
+
+    size_t rest = data.size() - i;
+    if (rest) {
+        uint32_t n = uint8_t(data[i]) << 16;
+        if (rest == 2) n |= uint8_t(data[i + 1]) << 8;
+
+        out += kBase64[n >> 18];
+        out += kBase64[(n >> 12) & 63];
+        out += rest == 2 ? kBase64[(n >> 6) & 63] : '=';
+        out += '=';
+    }
+    return out;
+}
+
+
+std::string base64_decode(std::string_view text) {
+    if (text.size() % 4 != 0) {
+        throw std::invalid_argument("invalid base64 payload");
+    }
+
+    auto digit = [](char c) -> int {
+        if (c >= 'A' && c <= 'Z') return c - 'A';
+        if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+        if (c >= '0' && c <= '9') return c - '0' + 52;
+        if (c == '+') return 62;
+        if (c == '/') return 63;
+        return -1;
+    };
+
+    std::string out;
+    out.reserve(text.size() / 4 * 3);
+
+    for (size_t i = 0; i < text.size(); i += 4) {
+        bool last = i + 4 == text.size();
+        size_t padding = 0;
+        if (last && text[i + 3] == '=') padding = (text[i + 2] == '=') ? 2 : 1;
+
+        uint32_t n = 0;
+        for (size_t j = 0; j < 4; j++) {
+            int d = (j >= 4 - padding) ? 0 : digit(text[i + j]);
+            if (d < 0) throw std::invalid_argument("invalid base64 payload");
+            n = (n << 6) | d;
+        }
+
+        out += char(n >> 16);
+        if (padding < 2) out += char((n >> 8) & 0xff);
+        if (padding < 1) out += char(n & 0xff);
+    }
+    return out;
+}
+
+
+// matches one [...] class starting at pattern[p] (just after '['), advances p past ']'
+static bool match_class(const std::string &pattern, size_t &p, char c) {
+    bool negate = p < pattern.size() && pattern[p] == '^';
+    bool matched = false;
+
+    if (negate) p++;
+
+    while (p < pattern.size() && pattern[p] != ']') {
+        if (pattern[p] == '\\' && p + 1 < pattern.size()) {
+            p++;
+            if (pattern[p] == c) matched = true;
+        } else if (p + 2 < pattern.size() && pattern[p + 1] == '-' && pattern[p + 2] != ']') {
+            char lo = pattern[p], hi = pattern[p + 2];
+            if (lo > hi) std::swap(lo, hi);
+            if (c >= lo && c <= hi) matched = true;
+            p += 2;
+        } else if (pattern[p] == c) {
+            matched = true;
+        }
+        p++;
+    }
+
+    if (p < pattern.size()) p++;  // skip ']'
+    return negate ? !matched : matched;
+}
+
+
+bool glob_match(const std::string &pattern, const std::string &str) {
+    size_t p = 0, s = 0;
+    // position to retry from after the last '*'
+    size_t star_p = std::string::npos, star_s = 0;
+
+    while (s < str.size()) {
+        if (p < pattern.size()) {
+            char pc = pattern[p];
+
+            if (pc == '*') {
+                star_p = ++p;
+                star_s = s;
+                continue;
+            }
+
+            if (pc == '?') {
+                p++;
+                s++;
+                continue;
+            }
+
+            if (pc == '[') {
+                size_t next = p + 1;
+                if (match_class(pattern, next, str[s])) {
+                    p = next;
+                    s++;
+                    continue;
+                }
+            } else {
+                if (pc == '\\' && p + 1 < pattern.size()) pc = pattern[++p];
+                if (pc == str[s]) {
+                    p++;
+                    s++;
+                    continue;
+                }
+            }
+        }
+
+        // mismatch: let the last '*' swallow one more character
+        if (star_p == std::string::npos) return false;
+        p = star_p;
+        s = ++star_s;
+    }
+
+    while (p < pattern.size() && pattern[p] == '*') p++;
+    return p == pattern.size();
+}
@@ -0,0 +1,302 @@
+#include "proxy.hpp"
+#include "protocol.hpp"
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <future>
+#include <unordered_map>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+
+/* ---------------- small socket helpers ---------------- */
+
+static bool send_all(int fd, const std::string &data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0) return false;
+        sent += n;
+    }
+    return true;
+}
+
+
+/* ---------------- hash ring ---------------- */
+
+// 64 bit FNV-1a with a final mix so nearby keys spread over the whole ring
+static uint64_t ring_hash(const char *data, size_t len) {
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= static_cast<uint8_t>(data[i]);
+        h *= 1099511628211ULL;
+    }
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+
+void HashRing::add(size_t backend, const std::string &name) {
+    for (int i = 0; i < kVirtualNodes; i++) {
+        std::string point = name + "#" + std::to_string(i);
+        ring_[ring_hash(point.data(), point.size())] = backend;
+    }
+}
+
+
+size_t HashRing::lookup(const std::string &key) const {
+    const char *data = key.data();
+    size_t len = key.size();
+
+    // same {tag} rule as cluster mode, so related keys stay on one backend
+    size_t open = key.find('{');
+    if (open != std::string::npos) {
+        size_t close = key.find('}', open + 1);
+        if (close != std::string::npos && close != open + 1) {
+            data += open + 1;
+            len = close - open - 1;
+        }
+    }
+
+    auto it = ring_.lower_bound(ring_hash(data, len));
+    if (it == ring_.end()) it = ring_.begin();
+    return it->second;
+}
+
+
+/* ---------------- proxy server ---------------- */
+
+// commands that would need every backend, or state kept across commands
+static bool is_unsupported(const std::string &cmd) {
+    return cmd == "MULTI" || cmd == "EXEC" || cmd == "DISCARD" ||
+           cmd == "WATCH" || cmd == "UNWATCH" ||
+           cmd == "SCAN" || cmd == "CLUSTER" || cmd == "ASKING" ||
+           cmd == "HOTKEYS" || cmd == "SLOWLOG" || cmd == "LATENCY" ||
+           cmd == "SUBSCRIBE" || cmd == "UNSUBSCRIBE" || cmd == "PSUBSCRIBE" ||
+           cmd == "PUNSUBSCRIBE" || cmd == "PUBLISH";
+}
+
+
+ProxyServer::ProxyServer(const Options &options, const std::vector<std::vector<NodeAddress>> &shards)
+    : options_(options) {
+
+    for (const auto &shard : shards) {
+        KVClient::Options client;
+        client.leader = shard[0];
+        client.connections = options_.connections_per_backend;
+        client.read_from_followers = options_.read_from_followers;
+
+        if (options_.read_from_followers) {
+            client.followers.assign(shard.begin() + 1, shard.end());
+        }
+
+        backends_.push_back(std::make_unique<KVClient>(client));
+        ring_.add(backends_.size() - 1, backends_.back()->leader().to_string());
+    }
+}
+
+
+// forwards an already encoded line as is, the raw reply is passed back untouched
+static std::shared_future<std::string> send_line(
+    KVClient &backend,
+    const std::string &cmd,
+    std::string line,
+    size_t client_id
+) {
+    auto reply = std::make_shared<std::promise<std::string>>();
+    auto future = reply->get_future().share();
+
+    backend.connection_for(cmd, client_id).send(std::move(line), has_array_reply(cmd),
+        [reply](std::string raw, bool) { reply->set_value(std::move(raw)); });
+    return future;
+}
+
+
+std::function<std::string()> ProxyServer::forward(const std::string &line, size_t client_id) {
+    auto tokens = tokenize(line);
+
+    if (tokens.empty()) {
+        return nullptr;
+    }
+
+    const std::string &cmd = tokens[0];
+
+    if (is_unsupported(cmd)) {
+        std::string reply = "ERROR: " + cmd + " is not supported by the proxy\n";
+        return [reply] { return reply; };
+    }
+
+    if (cmd == "MGET" && tokens.size() > 2) {
+        return forward_mget(tokens, client_id);
+    }
+
+    // keyless commands go to the first backend, which produces the usual error
+    size_t backend = tokens.size() > 1 ? ring_.lookup(tokens[1]) : 0;
+
+    auto reply = send_line(*backends_[backend], cmd, line + "\n", client_id);
+    return [reply] { return reply.get(); };
+}
+
+
+/*
+sends one MGET per backend with the keys it owns, then puts the values back
+in the order the client asked for them.
+*/
+std::function<std::string()> ProxyServer::forward_mget(const std::vector<std::string> &tokens, size_t client_id) {
+    struct Part {
+        std::vector<std::string> args{"MGET"};
+        std::vector<size_t> positions;
+        std::shared_future<std::string> reply;
+    };
+
+    std::unordered_map<size_t, Part> parts;
+
+    for (size_t i = 1; i < tokens.size(); i++) {
+        Part &part = parts[ring_.lookup(tokens[i])];
+        part.args.push_back(tokens[i]);
+        part.positions.push_back(i - 1);
+    }
+
+    for (auto &[backend, part] : parts) {
+        part.reply = send_line(*backends_[backend], "MGET", encode_command(part.args), client_id);
+    }
+
+    size_t count = tokens.size() - 1;
+
+    return [parts = std::move(parts), count]() -> std::string {
+        std::vector<std::string> values(count);
+
+        for (const auto &entry : parts) {
+            const Part &part = entry.second;
+            const std::string &reply = part.reply.get();
+
+            if (reply.empty() || reply[0] != '*') {
+                return reply;  // error from that backend
+            }
+
+            size_t pos = reply.find('\n') + 1;
+            for (size_t index : part.positions) {
+                size_t end = reply.find('\n', pos);
+                if (end == std::string::npos) {
+                    return "ERROR: malformed MGET reply from backend\n";
+                }
+                values[index] = reply.substr(pos, end - pos);
+                pos = end + 1;
+            }
+        }
+        return encode_array(values);
+    };
+}
+
+
+void ProxyServer::handle_client(int client_fd) {
+    char recv_buffer[16384];
+    std::string data_buffer;
+
+    while (true) {
+        ssize_t bytes = recv(client_fd, recv_buffer, sizeof(recv_buffer), 0);
+
+        if (bytes <= 0) {
+            break;
+        }
+
+        data_buffer.append(recv_buffer, bytes);
+
+        /*
+        start every complete command first and only then wait for the replies,
+        so a client that pipelines gets all its commands in flight at once.
+        */
+        std::vector<std::function<std::string()>> replies;
+        size_t start = 0, pos;
+
+        while ((pos = data_buffer.find('\n', start)) != std::string::npos) {
+            if (auto reply = forward(data_buffer.substr(start, pos - start), client_fd)) {
+                replies.push_back(std::move(reply));
+            }
+            start = pos + 1;
+        }
+        data_buffer.erase(0, start);
+
+        std::string out;
+        for (auto &reply : replies) {
+            out += reply();
+        }
+
+        if (!out.empty() && !send_all(client_fd, out)) {
+            break;
+        }
+    }
+
+    close(client_fd);
+}
+
+
+void ProxyServer::start(std::atomic<bool> &running) {
+    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (server_fd < 0) {
+        perror("socket");
+        return;
+    }
+
+    int one = 1;
+    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(options_.port);
+
+    if (bind(server_fd, (sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("bind");
+        close(server_fd);
+        return;
+    }
+
+    if (listen(server_fd, 128) < 0) {
+        perror("listen");
+        close(server_fd);
+        return;
+    }
+
+    std::cout << "proxy listening on port " << options_.port
+              << " with " << backends_.size() << " backend(s)" << std::endl;
+
+    while (running) {
+        // select with timeout to check the running flag once a second
+        fd_set read_fds;
+        FD_ZERO(&read_fds);
+        FD_SET(server_fd, &read_fds);
+
+        timeval timeout{};
+        timeout.tv_sec = 1;
+
+        int result = select(server_fd + 1, &read_fds, nullptr, nullptr, &timeout);
+
+        if (result < 0) {
+            if (errno == EINTR) continue;
+            perror("select");
+            break;
+        }
+
+        if (result == 0) {
+            continue;
+        }
+
+        int client_fd = accept(server_fd, nullptr, nullptr);
+        if (client_fd < 0) {
+            perror("accept");
+            continue;
+        }
+
+        int nodelay = 1;
+        setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+        std::thread(&ProxyServer::handle_client, this, client_fd).detach();
+    }
+    close(server_fd);
+}
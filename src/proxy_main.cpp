@@ -0,0 +1,69 @@
+#include "proxy.hpp"
+#include <iostream>
+#include <sstream>
+#include <csignal>
+#include <algorithm>
+
+std::atomic<bool> running(true);
+
+void handle_signal(int) {
+    running = false;
+}
+
+
+static void usage() {
+    std::cerr << "usage: kvstore-proxy --backend leader[,follower...] [--backend ...]\n"
+                 "                     [--port N] [--connections N] [--read-from-followers]\n"
+                 "addresses are host:port, e.g. --backend 127.0.0.1:8000,127.0.0.1:7000\n";
+}
+
+
+int main(int argc, char* argv[]) {
+
+    ProxyServer::Options options;
+    std::vector<std::vector<NodeAddress>> shards;
+
+    try {
+        for (int i = 1; i < argc; i++) {
+            std::string arg = argv[i];
+            bool has_value = i + 1 < argc;
+
+            if (arg == "--backend" && has_value) {
+                std::vector<NodeAddress> shard;
+                std::stringstream ss(argv[++i]);
+                std::string address;
+
+                while (std::getline(ss, address, ',')) {
+                    shard.push_back(parse_address(address));
+                }
+                shards.push_back(shard);
+            } else if (arg == "--port" && has_value) {
+                options.port = std::stoi(argv[++i]);
+            } else if (arg == "--connections" && has_value) {
+                options.connections_per_backend = std::max(1, std::stoi(argv[++i]));
+            } else if (arg == "--read-from-followers") {
+                options.read_from_followers = true;
+            } else {
+                usage();
+                return 1;
+            }
+        }
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        usage();
+        return 1;
+    }
+
+    if (shards.empty()) {
+        usage();
+        return 1;
+    }
+
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+
+    ProxyServer proxy(options, shards);
+    proxy.start(running);
+
+    return 0;
+}
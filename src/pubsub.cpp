@@ -0,0 +1,188 @@
+#include "pubsub.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include "protocol.hpp"
+
+
+Subscriber::Subscriber(int fd, size_t max_pending_bytes)
+    : fd_(fd),
+    event_fd_(eventfd(0, EFD_NONBLOCK)),
+    max_pending_(max_pending_bytes) {}
+
+
+Subscriber::~Subscriber() {
+    if (event_fd_ >= 0) close(event_fd_);
+}
+
+
+bool Subscriber::push(const std::shared_ptr<const std::string> &message) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    if (overflowed_) return false;
+
+    if (pending_bytes_ + message->size() > max_pending_) {
+        // too slow: drop everything and hang up, its thread unsubscribes it
+        overflowed_ = true;
+        queue_.clear();
+        pending_bytes_ = 0;
+        shutdown(fd_, SHUT_RDWR);
+        return false;
+    }
+
+    bool wake = queue_.empty();
+    queue_.push_back(message);
+    pending_bytes_ += message->size();
+
+    if (wake) {
+        uint64_t one = 1;
+        ssize_t ignored = write(event_fd_, &one, sizeof(one));
+        (void)ignored;
+    }
+    return true;
+}
+
+
+bool Subscriber::flush() {
+    std::deque<std::shared_ptr<const std::string>> batch;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (overflowed_) return false;
+
+        uint64_t count;
+        ssize_t ignored = read(event_fd_, &count, sizeof(count));
+        (void)ignored;
+
+        batch.swap(queue_);
+        pending_bytes_ = 0;
+    }
+
+    // blocking sends are fine here, this is the subscriber's own thread
+    for (const auto &message : batch) {
+        size_t sent = 0;
+        while (sent < message->size()) {
+            ssize_t n = send(fd_, message->data() + sent, message->size() - sent, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            sent += n;
+        }
+    }
+    return true;
+}
+
+
+PubSub::PubSub(size_t max_pending_bytes) : max_pending_(max_pending_bytes) {}
+
+
+std::shared_ptr<Subscriber> PubSub::make_subscriber(int fd) const {
+    return std::make_shared<Subscriber>(fd, max_pending_);
+}
+
+
+size_t PubSub::subscribe(const std::shared_ptr<Subscriber> &sub, const std::string &channel) {
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+
+    if (sub->channels.insert(channel).second) {
+        channels_[channel].push_back(sub);
+        subscriptions_++;
+    }
+    return sub->subscriptions();
+}
+
+
+size_t PubSub::psubscribe(const std::shared_ptr<Subscriber> &sub, const std::string &pattern) {
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+
+    if (sub->patterns.insert(pattern).second) {
+        patterns_[pattern].push_back(sub);
+        subscriptions_++;
+    }
+    return sub->subscriptions();
+}
+
+
+template <typename Map>
+bool PubSub::remove(Map &map, const std::string &name, const std::shared_ptr<Subscriber> &sub) {
+    auto it = map.find(name);
+    if (it == map.end()) return false;
+
+    auto &subs = it->second;
+    auto pos = std::find(subs.begin(), subs.end(), sub);
+    if (pos == subs.end()) return false;
+
+    // order doesn't matter, swap with the last one
+    *pos = std::move(subs.back());
+    subs.pop_back();
+    if (subs.empty()) map.erase(it);
+
+    subscriptions_--;
+    return true;
+}
+
+
+size_t PubSub::unsubscribe(const std::shared_ptr<Subscriber> &sub, const std::string &channel) {
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+
+    if (sub->channels.erase(channel)) {
+        remove(channels_, channel, sub);
+    }
+    return sub->subscriptions();
+}
+
+
+size_t PubSub::punsubscribe(const std::shared_ptr<Subscriber> &sub, const std::string &pattern) {
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+
+    if (sub->patterns.erase(pattern)) {
+        remove(patterns_, pattern, sub);
+    }
+    return sub->subscriptions();
+}
+
+
+void PubSub::unsubscribe_all(const std::shared_ptr<Subscriber> &sub) {
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+
+    for (const auto &channel : sub->channels) remove(channels_, channel, sub);
+    for (const auto &pattern : sub->patterns) remove(patterns_, pattern, sub);
+    sub->channels.clear();
+    sub->patterns.clear();
+}
+
+
+size_t PubSub::publish(const std::string &channel, const std::string &message) {
+    if (!has_subscribers()) return 0;
+
+    size_t receivers = 0;
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+
+    auto it = channels_.find(channel);
+    if (it != channels_.end()) {
+        // encoded once, every queue holds a reference to the same buffer
+        auto payload = std::make_shared<const std::string>(encode_array({"message", channel, message}));
+
+        for (const auto &sub : it->second) {
+            if (sub->push(payload)) receivers++;
+        }
+    }
+
+    for (const auto &[pattern, subs] : patterns_) {
+        if (!glob_match(pattern, channel)) continue;
+
+        auto payload = std::make_shared<const std::string>(encode_array({"pmessage", pattern, channel, message}));
+        for (const auto &sub : subs) {
+            if (sub->push(payload)) receivers++;
+        }
+    }
+    return receivers;
+}
+
+
+void PubSub::notify(const char *event, const std::string &key) {
+    if (!has_subscribers()) return;
+
+    publish("__keyspace__:" + key, event);
+    publish(std::string("__keyevent__:") + event, key);
+}
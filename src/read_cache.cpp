@@ -0,0 +1,131 @@
+#include "read_cache.hpp"
+#include <vector>
+
+// roughly the smallest entry we expect, sizes the bucket array
+static constexpr size_t kBytesPerBucket = 128;
+// values bigger than this share of the cache are not worth a slot
+static constexpr size_t kMaxValueShare = 16;
+
+
+ReadCache::ReadCache(size_t capacity_bytes) : capacity_(capacity_bytes) {
+    size_t buckets = 16;
+    while (buckets < capacity_bytes / kBytesPerBucket) buckets *= 2;
+
+    mask_ = buckets - 1;
+    buckets_ = std::make_unique<std::atomic<const Node *>[]>(buckets);
+    for (size_t i = 0; i < buckets; i++) {
+        buckets_[i].store(nullptr, std::memory_order_relaxed);
+    }
+}
+
+
+ReadCache::~ReadCache() {
+    // no reader can be left once the store goes away
+    for (size_t i = 0; i <= mask_; i++) {
+        const Node *node = buckets_[i].load(std::memory_order_relaxed);
+        while (node) {
+            const Node *next = node->next;
+            delete node;
+            node = next;
+        }
+    }
+}
+
+
+const ReadCache::Node *ReadCache::find(const std::string &key, size_t hash) const {
+    const Node *node = buckets_[hash & mask_].load(std::memory_order_acquire);
+
+    for (; node; node = node->next) {
+        if (node->hash == hash && node->key == key) {
+            return node;
+        }
+    }
+    return nullptr;
+}
+
+
+template <typename P>
+void ReadCache::rebuild_bucket(size_t b, P &&drop) {
+    const Node *head = buckets_[b].load(std::memory_order_relaxed);
+
+    // nodes are immutable: copy the kept ones into a new chain, then swap it in
+    std::vector<const Node *> old;
+    for (const Node *node = head; node; node = node->next) {
+        old.push_back(node);
+    }
+
+    const Node *chain = nullptr;
+    for (auto it = old.rbegin(); it != old.rend(); ++it) {
+        const Node *node = *it;
+
+        if (drop(*node)) {
+            size_ -= node_size(*node);
+            continue;
+        }
+
+        auto copy = new Node{node->key, node->value, node->expires_at, node->hash, chain};
+        chain = copy;
+    }
+
+    buckets_[b].store(chain, std::memory_order_release);
+
+    for (const Node *node : old) {
+        EpochDomain::global().retire(const_cast<Node *>(node), [](void *p) {
+            delete static_cast<Node *>(p);
+        });
+    }
+}
+
+
+void ReadCache::put(const std::string &key, std::string_view value, std::optional<TimePoint> expires_at) {
+    if (value.size() > capacity_ / kMaxValueShare) return;
+
+    size_t hash = hash_of(key);
+    if (find(key, hash)) return;
+
+    auto &bucket = buckets_[hash & mask_];
+    auto node = new Node{key, std::string(value), expires_at, hash, bucket.load(std::memory_order_relaxed)};
+
+    size_ += node_size(*node);
+    bucket.store(node, std::memory_order_release);
+
+    if (size_ > capacity_) {
+        evict();
+    }
+}
+
+
+void ReadCache::invalidate(const std::string &key) {
+    size_t hash = hash_of(key);
+    if (!find(key, hash)) return;
+
+    rebuild_bucket(hash & mask_, [&](const Node &node) {
+        return node.hash == hash && node.key == key;
+    });
+}
+
+
+void ReadCache::evict() {
+    // CLOCK over the buckets: drop what was not read since the hand last passed
+    for (size_t n = 0; n <= mask_ && size_ > capacity_; n++) {
+        size_t b = hand_;
+        hand_ = (hand_ + 1) & mask_;
+
+        const Node *head = buckets_[b].load(std::memory_order_relaxed);
+        if (!head) continue;
+
+        bool any_cold = false;
+        for (const Node *node = head; node; node = node->next) {
+            if (!node->referenced.load(std::memory_order_relaxed)) any_cold = true;
+        }
+
+        if (any_cold) {
+            // the copies of the kept nodes start unreferenced
+            rebuild_bucket(b, [](const Node &node) { return !node.referenced.load(std::memory_order_relaxed); });
+        } else {
+            for (const Node *node = head; node; node = node->next) {
+                node->referenced.store(false, std::memory_order_relaxed);
+            }
+        }
+    }
+}
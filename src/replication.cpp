@@ -1,5 +1,7 @@
 #include <replication.hpp>
 #include <kvstore.hpp>
+#include "protocol.hpp"
+#include "command_log.hpp"
 #include <sys/socket.h>
 #include <iostream>
 #include <unistd.h>
@@ -73,15 +75,12 @@ void ReplicationManager::leader_accept_loop(int port) {
 
         send(follower_fd, "SNAPSHOT_BEGIN\n", 15, 0);
     
-        for (const auto& e : snapshot) {
-            std::string cmd = "SET " + e.key + " " + e.value;
-        
-            if (e.ttl_seconds) {
-                cmd += (" EX " + std::to_string(*e.ttl_seconds));
-            }
+        std::string cmd;
 
-            cmd += ("\n");
+        for (const auto& e : snapshot) {
+            encode_snapshot_item(e, cmd);
             send(follower_fd, cmd.c_str(), cmd.size(), 0);
+            cmd.clear();
         }
     
         send(follower_fd, "SNAPSHOT_END\n", 13, 0);
@@ -130,31 +129,13 @@ void ReplicationManager::start_leader(int port) {
 
 void ReplicationManager::apply_replicate_command(const std::string& command) {
 
-    std::istringstream iss(command);
-    std::string cmd, key;
-
-    iss >> cmd;
-
-    if (cmd == "SET") {
-        iss >> key;
-
-        std::string value, ex_keyword;
-        iss >> value;
-        iss >> ex_keyword;
+    auto tokens = tokenize(command);
 
-        // Check if TTL is present
-        if (ex_keyword == "EX") {
-            int ttl;
-            iss >> ttl;
-            store_.set(key, value, ttl);
-        } else {
-            store_.set(key, value);
-        }
-    } else if (cmd == "DELETE") {
-        iss >> key;
-
-        store_.del(key);
+    if (tokens.empty()) {
+        return;
     }
+
+    apply_logged_command(store_, tokens);
 }
 
 
@@ -183,21 +164,25 @@ void ReplicationManager::follower_receive_loop(const std::string& leader_ip, int
         std::cout << "client connected to leader\n";
 
         bool syncing = true;
+        // commands can be split across recv() calls, keep the partial line around
+        std::string pending;
+        LogApplier applier(store_);
 
         while (running_) {
             char buffer[1024];
             ssize_t bytes = recv(follower_fd_, buffer, sizeof(buffer), 0);
 
-            if (bytes < 0) {
+            if (bytes <= 0) {
                 std::cout << "[REPL] connection lost\n";
                 break;
             }
 
-            std::string command(buffer, bytes);
-            std::istringstream stream(command);
-            std::string line;
+            pending.append(buffer, bytes);
 
-            while (std::getline(stream, line)) {
+            size_t pos;
+            while ((pos = pending.find('\n')) != std::string::npos) {
+                std::string line = pending.substr(0, pos);
+                pending.erase(0, pos + 1);
 
                 if (line == "SNAPSHOT_BEGIN") {
                     syncing = true;
@@ -210,7 +195,15 @@ void ReplicationManager::follower_receive_loop(const std::string& leader_ip, int
                     continue;
                 }
 
-                apply_replicate_command(command);
+                try {
+                    applier.feed(line);
+                } catch (const ReplayError &e) {
+                    // every later write may build on this one, following on would only diverge
+                    std::cerr << "[REPL] can't apply the leader's stream, stopped following: " << e.what() << "\n";
+                    close(follower_fd_);
+                    follower_fd_ = -1;
+                    return;
+                }
             }
         }
 
@@ -1,14 +1,22 @@
 #include "server.hpp"
 #include <iostream>
 #include <cstring>
+#include <cerrno>
 #include <unistd.h>
+#include <poll.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <vector>
 #include <sstream>
+#include <algorithm>
 #include <persistence.hpp>
 #include "kvstore.hpp"
 #include <node_role.hpp>
 #include <replication.hpp>
+#include "protocol.hpp"
+#include "command_log.hpp"
+#include "cluster.hpp"
 
 // initialize the class variables
 TCPServer::TCPServer(
@@ -16,7 +24,8 @@ TCPServer::TCPServer(
     KVStore &store,
     PersistenceManager &file,
     NodeRole role,
-    ReplicationManager &replica
+    ReplicationManager &replica,
+    ClusterManager *cluster
     )
     : port_(port),
     server_fd_(-1),
@@ -24,6 +33,8 @@ TCPServer::TCPServer(
     file_(file),
     role_(role),
     replica_(replica),
+    cluster_(cluster),
+    log_([this](const std::string &lines) { write_log(lines); }),
     running_(false) {}
 
 
@@ -100,6 +111,10 @@ void TCPServer::start(std::atomic<bool> &running){
             continue;
         }
 
+        // every reply is its own send(), don't let Nagle hold pipelined replies back
+        int nodelay = 1;
+        setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
         std::thread(
             &TCPServer::handle_client,
             this,
@@ -109,30 +124,63 @@ void TCPServer::start(std::atomic<bool> &running){
     close(server_fd_);
 }
 
+static bool is_write_command(const std::string &cmd);
+
+
+// bytes asked from the socket per recv()
+static constexpr size_t kRecvChunk = 16 * 1024;
+
+
 void TCPServer::handle_client(int client_fd) {
     std::cout << "Client connected (fd=" << client_fd << ")" << std::endl;
 
 
-    char recv_buffer[1024];
     std::string data_buffer;
+    ClientState client;
+    client.fd = client_fd;
 
     while(true){
-        ssize_t bytes = recv(client_fd, recv_buffer, sizeof(recv_buffer), 0);
+        if (client.subscriber) {
+            // subscribed: wait for either a command or messages to forward
+            pollfd fds[2] = {
+                {client_fd, POLLIN, 0},
+                {client.subscriber->event_fd(), POLLIN, 0},
+            };
+            if (poll(fds, 2, -1) < 0) {
+                if (errno == EINTR) continue;
+                break;
+            }
+            if ((fds[1].revents & POLLIN) && !client.subscriber->flush()) {
+                break;
+            }
+            if (!(fds[0].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            }
+        }
+
+        // receive straight into the tail of the buffer, its capacity is kept between reads
+        size_t filled = data_buffer.size();
+        data_buffer.resize(filled + kRecvChunk);
+        ssize_t bytes = recv(client_fd, &data_buffer[filled], kRecvChunk, 0);
 
         if(bytes <= 0){
             break;
         }
+        data_buffer.resize(filled + bytes);
 
-        data_buffer.append(recv_buffer, bytes);
-
-        // process full line
+        // process full lines in place, then drop them all at once
+        size_t start = 0;
         size_t pos;
-        while((pos = data_buffer.find('\n')) != std::string::npos){
-            std::string line = data_buffer.substr(0, pos);
-            data_buffer.erase(0, pos + 1);
-
-            handle_command(client_fd, line);
+        while((pos = data_buffer.find('\n', start)) != std::string::npos){
+            handle_command(client, std::string_view(data_buffer).substr(start, pos - start));
+            start = pos + 1;
         }
+        data_buffer.erase(0, start);
+    }
+
+    // before the close, so no publisher can touch the fd after that
+    if (client.subscriber) {
+        pubsub_.unsubscribe_all(client.subscriber);
     }
 
     std::cout << "Client disconnected (fd=" << client_fd << ")" << std::endl;
@@ -140,108 +188,430 @@ void TCPServer::handle_client(int client_fd) {
 }
 
 
+void TCPServer::handle_command(ClientState &client, std::string_view line) {
+    if (log_commands_) {
+        std::cout << "Received: [" << line << "]" << std::endl;
+    }
+
+    RequestTrace trace;
+    auto start = std::chrono::steady_clock::now();
+
+    /*
+    a SET without quotes runs straight from views of the receive buffer, so
+    its value is not copied into a token first. `tokens` then only holds the
+    command and the key, which is all the checks below look at.
+    */
+    auto &tokens = client.tokens;
+    auto &words = client.words;
+    bool plain_set = !client.in_multi && role_ == NodeRole::Leader &&
+        split_words(line, words) && words.size() >= 3 && words[0] == "SET";
+
+    if (plain_set) {
+        tokens.resize(2);
+        tokens[0].assign(words[0]);
+        tokens[1].assign(words[1]);
+    } else {
+        tokenize(line, tokens);
+    }
+
+    trace.ns[static_cast<size_t>(Stage::Parse)] = elapsed_ns(start);
+
+    if (tokens.empty()) {   
+        return;
+    }
+
+    const std::string &cmd = tokens[0];
+    std::string response;
+
+    if (cmd == "ASKING") {
+        client.asking = true;
+        response = "OK\n";
+        send(client.fd, response.c_str(), response.size(), 0);
+        return;
+    }
+
+    // lock waits, AOF and replication time add themselves to it from here on
+    current_trace() = &trace;
+
+    // a write is logged and applied under the AOF gate, a rewrite never cuts in between
+    std::shared_lock<std::shared_mutex> gate, route_gate;
+    if (cmd == "EXEC" || (!client.in_multi && is_write_command(cmd))) {
+        gate = file_.write_gate();
+        if (cluster_) route_gate = cluster_->route_gate();
+    }
+
+    std::string redirection = cluster_ ? redirect(client, tokens) : "";
+    client.asking = false;
+
+    if (!redirection.empty()) {
+        response = redirection;
+    } else if (cmd == "CLUSTER") {
+        response = cluster_ ? cluster_->command(tokens) : "ERROR: cluster support is disabled\n";
+    } else if (cmd == "SUBSCRIBE" || cmd == "UNSUBSCRIBE" ||
+        cmd == "PSUBSCRIBE" || cmd == "PUNSUBSCRIBE") {
+        response = pubsub_command(client, tokens);
+    } else if (client.subscriber && client.subscriber->subscriptions()) {
+        response = "ERROR: only (P)SUBSCRIBE / (P)UNSUBSCRIBE are allowed while subscribed\n";
+    } else if (cmd == "MULTI" || cmd == "EXEC" || cmd == "DISCARD" ||
+        cmd == "WATCH" || cmd == "UNWATCH") {
+        response = transaction_command(client, tokens);
+    } else if (client.in_multi) {
+        client.queued.push_back(tokens);
+        response = "QUEUED\n";
+    } else if (plain_set) {
+        response = execute_set(words);
+    } else {
+        response = execute(tokens);
+    }
+
+    if (route_gate) route_gate.unlock();
+    if (gate) gate.unlock();
+
+    {
+        StageTimer timer(Stage::Send);
+        send(client.fd, response.c_str(), response.size(), 0);
+    }
+    current_trace() = nullptr;
+
+    // whatever no other stage claimed was spent running the command
+    auto &ns = trace.ns;
+    ns[static_cast<size_t>(Stage::Total)] = elapsed_ns(start);
+
+    uint64_t claimed = 0;
+    for (size_t i = 0; i < static_cast<size_t>(Stage::Total); i++) {
+        if (i != static_cast<size_t>(Stage::Execute)) claimed += ns[i];
+    }
+    uint64_t total = ns[static_cast<size_t>(Stage::Total)];
+    ns[static_cast<size_t>(Stage::Execute)] = total > claimed ? total - claimed : 0;
+
+    latency_.record(trace, tokens);
+}
+
+
+// set while EXEC runs: writes are collected here and logged as one MULTI/EXEC block
+static thread_local std::string* tx_log = nullptr;
+// the log_ sequence number of the last lines this thread queued, 0 once they are written
+static thread_local uint64_t log_seq = 0;
+
+
+// runs a command, errors become the reply
+template <typename F>
+static std::string reply_of(F &&run) {
+    try {
+        return run();
+    } catch (const WrongTypeError &e) {
+        return std::string(e.what()) + "\n";
+    } catch (const std::exception &e) {
+        return std::string("ERROR: ") + e.what() + "\n";
+    }
+}
+
+
+std::string TCPServer::execute(const std::vector<std::string> &tokens) {
+    std::string response = reply_of([&] { return dispatch(tokens); });
+
+    // inside EXEC the block is written once the whole transaction is applied
+    if (!tx_log) flush_log();
+    return response;
+}
+
+
+std::string TCPServer::execute_set(const std::vector<std::string_view> &args) {
+    std::string response = reply_of([&] { return set_command(args); });
+    flush_log();
+    return response;
+}
+
+
+std::string TCPServer::redirect(const ClientState &client, const std::vector<std::string> &tokens) {
+    const std::string &cmd = tokens[0];
+
+    if (tokens.size() < 2 || cmd == "SCAN" || cmd == "CLUSTER" || cmd == "HOTKEYS" ||
+        cmd == "SLOWLOG" || cmd == "LATENCY" || cmd == "PUBLISH" ||
+        cmd == "SUBSCRIBE" || cmd == "UNSUBSCRIBE" || cmd == "PSUBSCRIBE" || cmd == "PUNSUBSCRIBE" ||
+        cmd == "MULTI" || cmd == "EXEC" || cmd == "DISCARD" || cmd == "UNWATCH") {
+        return "";
+    }
+
+    // WATCH and MGET take only keys, every other command has its key first
+    size_t last = (cmd == "WATCH" || cmd == "MGET") ? tokens.size() - 1 : 1;
+
+    for (size_t i = 1; i <= last; i++) {
+        auto route = cluster_->route(tokens[i], client.asking);
+
+        switch (route.kind) {
+        case ClusterManager::Route::Kind::Local:
+            break;
+        case ClusterManager::Route::Kind::Moved:
+            return "MOVED " + std::to_string(route.slot) + " " + route.address + "\n";
+        case ClusterManager::Route::Kind::Ask:
+            return "ASK " + std::to_string(route.slot) + " " + route.address + "\n";
+        case ClusterManager::Route::Kind::Down:
+            return "ERROR: CLUSTERDOWN hash slot " + std::to_string(route.slot) + " is not served\n";
+        }
+    }
+    return "";
+}
+
+
+void TCPServer::propagate(const std::vector<std::string> &args) {
+    propagate_lines(encode_command(args));
+}
+
+
+// called under the store lock, which orders the lines; the I/O waits for flush_log()
+void TCPServer::propagate_lines(const std::string &lines) {
+    if (tx_log) {
+        *tx_log += lines;
+        return;
+    }
+    log_seq = log_.append(lines);
+}
+
+
+void TCPServer::propagate_command(std::initializer_list<std::string_view> args) {
+    if (tx_log) {
+        append_command(*tx_log, args);
+        return;
+    }
+    log_seq = log_.append_command(args);
+}
+
+
+void TCPServer::flush_log() {
+    if (!log_seq) return;
+    log_.flush(log_seq);
+    log_seq = 0;
+}
+
+
+void TCPServer::write_log(const std::string &lines) {
+    {
+        StageTimer timer(Stage::Replicate);
+        replica_.replicate_command(lines);
+    }
+    StageTimer timer(Stage::Aof);
+    file_.append_raw(lines);
+}
+
+
+// logs a key as its resulting value, for the read-modify-write commands (called under the store lock)
+void TCPServer::propagate_state(const std::string &key) {
+    propagate_lines(encode_key_state(store_, key));
+}
+
+
+std::string TCPServer::transaction_command(ClientState &client, const std::vector<std::string> &tokens) {
+    const std::string &cmd = tokens[0];
+
+    if (cmd == "MULTI") {
+        if (client.in_multi) {
+            return "ERROR: MULTI calls can not be nested\n";
+        }
+        client.in_multi = true;
+        return "OK\n";
+    }
+
+    if (cmd == "EXEC") {
+        if (!client.in_multi) {
+            return "ERROR: EXEC without MULTI\n";
+        }
+        return exec_transaction(client);
+    }
+
+    if (cmd == "DISCARD") {
+        if (!client.in_multi) {
+            return "ERROR: DISCARD without MULTI\n";
+        }
+        client.in_multi = false;
+        client.queued.clear();
+        client.watched.clear();
+        return "OK\n";
+    }
+
+    if (cmd == "WATCH") {
+        if (client.in_multi) {
+            return "ERROR: WATCH inside MULTI is not allowed\n";
+        }
+        if (tokens.size() < 2) {
+            return "ERROR: WATCH requires at least one key\n";
+        }
+        for (size_t i = 1; i < tokens.size(); i++) {
+            // keep the first version seen if a key is watched twice
+            client.watched.emplace(tokens[i], store_.watch_version(tokens[i]));
+        }
+        return "OK\n";
+    }
+
+    // UNWATCH
+    client.watched.clear();
+    return "OK\n";
+}
+
+
 /*
-tokenizes a command line, respecting quoted strings with spaces and escape 
-sequences (\\ and \"). returns a vector of parsed tokens suitable
-for command processing.
+runs the queued commands under a single store lock. if any watched key changed
+since WATCH the transaction is aborted and NULL is returned. otherwise the reply
+is "*<count>" followed by each command's own reply, and all the writes are
+logged to the AOF and sent to the followers as one MULTI ... EXEC block.
 */
-static std::vector<std::string> tokenize(const std::string &line) {
-    
-    std::vector<std::string> tokens;
-    std::string current;
-    bool in_quotes = false;
-
-    for(size_t i = 0; i < line.size(); i++){
-
-        char c = line[i];
-
-        // handle escape inside quotes
-        if(c == '\\' && in_quotes && i + 1 < line.size()) {
-            current += line[i + 1];
-            i++;
-        } else if(c == '"') {
-            in_quotes = !in_quotes;
-        } else if(c == ' ' && !in_quotes) {
-            if(!current.empty()) {
-                tokens.push_back(current);
-                current.clear();
+std::string TCPServer::exec_transaction(ClientState &client) {
+    std::string replies;
+    std::string log;
+    bool aborted = false;
+
+    store_.batch([&] {
+        for (const auto &w : client.watched) {
+            if (store_.watch_version(w.first) != w.second) {
+                aborted = true;
+                return;
             }
-        } else {
-            current += c;
         }
-    }
 
-    if(!current.empty()) {
-        tokens.push_back(current);
+        tx_log = &log;
+        for (const auto &cmd : client.queued) {
+            replies += execute(cmd);
+        }
+        tx_log = nullptr;
+
+        // queued under the lock, so blocks reach the log in the order they were applied
+        if (!log.empty()) {
+            propagate_lines("MULTI\n" + log + "EXEC\n");
+        }
+    });
+    flush_log();
+
+    size_t count = client.queued.size();
+
+    client.in_multi = false;
+    client.queued.clear();
+    client.watched.clear();
+
+    if (aborted) {
+        return "NULL\n";
     }
+    return "*" + std::to_string(count) + "\n" + replies;
+}
+
 
-    return tokens;
+static bool is_write_command(const std::string &cmd) {
+    return cmd == "SET" || cmd == "SETZ" || cmd == "DELETE" ||
+           cmd == "HSET" || cmd == "HDEL" ||
+           cmd == "LPUSH" || cmd == "RPOP" ||
+           cmd == "SADD" ||
+           cmd == "ZADD" || cmd == "ZREM" ||
+           cmd == "INCR" || cmd == "DECR" || cmd == "INCRBY" || cmd == "DECRBY" ||
+           cmd == "APPEND" || cmd == "GETSET" || cmd == "GETDEL" || cmd == "CAS";
 }
 
 
-void TCPServer::handle_command(int client_fd, const std::string& line) {
-    std::cout << "Received: [" << line << "]" << std::endl;
+// the words from tokens[from] up to (not including) tokens[to], joined like SET does
+template <typename Token>
+static std::string join_value(const std::vector<Token> &tokens, size_t from, size_t to) {
+    std::string value;
+    for (size_t i = from; i < to; i++) {
+        if (i > from) value += " ";
+        value += tokens[i];
+    }
+    return value;
+}
 
-    auto tokens = tokenize(line);
-    std::string token;
 
+std::string TCPServer::set_command(const std::vector<std::string_view> &args) {
+    if (args.size() < 3) {
+        return "ERROR: SET requires a key and a value\n";
+    }
 
-    if (tokens.empty()) {   
-        return;
+    std::string key(args[1]);
+    std::optional<int> ttl;
+
+    size_t i = 2;
+    while (i < args.size() && args[i] != "EX") i++;
+
+    // a one word value is used where it is, only several words get joined
+    std::string joined;
+    std::string_view value;
+    if (i == 3) {
+        value = args[2];
+    } else if (i > 3) {
+        joined = join_value(args, 2, i);
+        value = joined;
+    }
+
+    // parse TTL if present
+    if (i < args.size()) {
+        if (args[i] == "EX" && i + 1 < args.size()) {
+            ttl = std::stoi(std::string(args[i + 1]));
+        } else {
+            return "ERROR: invalid EX usage\n";
+        }
     }
 
-    std::string cmd = tokens[0];
-    std::string response;
-    
     /*
-    check whether the commad is SET / GET / DELETE.
-    if not any of them return an error to the sender
+    compressed (once) before taking the lock, then applied and queued for
+    the log under it (written once the lock is released). large values are
+    logged and replicated in their compressed form.
     */
-    if (cmd == "SET") {
-        if (role_ != NodeRole::Leader) {
-            response = "ERROR: read-only replica\n";
-            send(client_fd, response.c_str(), response.size(), 0);
-            return;
-        }
-        if (tokens.size() < 3) {
-            response = "ERROR: SET requires a key and a value\n";
+    if (auto packed = store_.compress(value)) {
+        std::string line = encode_command(compressed_set_args(key, *packed, ttl));
+        store_.batch([&] {
+            if (store_.set_compressed(key, std::move(*packed), ttl)) propagate_lines(line);
+        });
+        return "OK\n";
+    }
+
+    std::string seconds = ttl ? std::to_string(*ttl) : std::string();
+    store_.batch([&] {
+        // the value's one copy into the store, then encoded into the log queue
+        if (!store_.set_uncompressed(key, value, ttl)) return;
+
+        if (ttl) {
+            propagate_command({"SET", key, value, "EX", seconds});
         } else {
-            std::string key = tokens[1];
+            propagate_command({"SET", key, value});
+        }
+    });
+    return "OK\n";
+}
 
-            std::string value;
-            std::optional<int> ttl;
 
-            size_t i = 2;
+std::string TCPServer::dispatch(const std::vector<std::string> &tokens) {
+    const std::string &cmd = tokens[0];
+    std::string response;
 
-            // rebuild value until EX
-            for (; i < tokens.size(); i++) {
-                if (tokens[i] == "EX") {
-                    break;
-                }
-                if (!value.empty()) value += " ";
-                value += tokens[i];
-            }
+    if (is_write_command(cmd) && role_ != NodeRole::Leader) {
+        return "ERROR: read-only replica\n";
+    }
 
-            // parse TTL if present
-            if (i < tokens.size()) {
-                if (tokens[i] == "EX" && i + 1 < tokens.size()) {
-                    ttl = std::stoi(tokens[i + 1]);
-                } else {
-                response = "ERROR: invalid EX usage\n";
-                send(client_fd, response.c_str(), response.size(), 0);
-                return;
-                }
-            }
+    /*
+    check which command was sent.
+    if it is not a known one return an error to the sender
+    */
+    if (cmd == "SET") {
+        // slow path of SET (quoted arguments, MULTI, --cores): the same handler over views of the tokens
+        static thread_local std::vector<std::string_view> args;
+        args.assign(tokens.begin(), tokens.end());
+        response = set_command(args);
 
-            replica_.replicate_command(ttl ? 
-                "SET " + key + " " + value + " EX " + std::to_string(*ttl) + "\n" : 
-                "SET " + key + " " + value + "\n");
+    } else if (cmd == "SETZ") {
+        // already compressed value, sent by CLUSTER MIGRATE from another node
+        CompressedValue value;
+        std::optional<int> ttl;
 
-            file_.append_set(key, value, ttl);
-            store_.set(key, value, ttl);
-            response = "OK\n";
+        if (tokens.size() != 5 && tokens.size() != 7) {
+            response = "ERROR: SETZ requires a key, raw size, dictionary id and payload\n";
+        } else if (!parse_compressed_set(tokens, value, ttl) || !store_.check_compressed(value)) {
+            // decompressed once here, outside the lock, so a bad payload never gets stored
+            response = "ERROR: invalid compressed value or unknown dictionary\n";
+        } else {
+            bool stored = false;
+            store_.batch([&] {
+                stored = store_.set_compressed(tokens[1], std::move(value), ttl);
+                if (stored) propagate(tokens);
+            });
+            response = stored ? "OK\n" : "ERROR: key or value too long\n";
         }
-        
+
     } else if(cmd == "GET"){
         if(tokens.size() < 2) {
             response = "ERROR: GET requires a key\n";
@@ -253,27 +623,474 @@ void TCPServer::handle_command(int client_fd, const std::string& line) {
                 response = "NULL\n";
             }
         }
-    } else if(cmd == "DELETE") {
-        if (role_ != NodeRole::Leader) {
-            response = "ERROR: read-only replica\n";
-            send(client_fd, response.c_str(), response.size(), 0);
-            return;
+    } else if (cmd == "MGET") {
+        if (tokens.size() < 2) {
+            response = "ERROR: MGET requires at least one key\n";
+        } else {
+            std::vector<std::string> keys(tokens.begin() + 1, tokens.end());
+            std::vector<std::string> out;
+            out.reserve(keys.size());
+
+            for (auto &value : store_.mget(keys)) {
+                out.push_back(value ? std::move(*value) : "NULL");
+            }
+            response = encode_array(out);
         }
+    } else if(cmd == "DELETE") {
         if(tokens.size() < 2) {
             response = "ERROR: DELETE requires a key\n";
         } else {
-            bool deleted = store_.del(tokens[1]);
+            bool deleted = store_.batch([&] {
+                bool removed = store_.del(tokens[1]);
+                if (removed) propagate({"DELETE", tokens[1]});
+                return removed;
+            });
             if (deleted) {
-                replica_.replicate_command("DELETE " + tokens[1] + "\n");
-                file_.append_del(tokens[1]);
                 response = "OK\n";
             } else {
                 response = "NOT_FOUND\n";
             }
         }
+    } else if (cmd == "INCR" || cmd == "DECR" || cmd == "INCRBY" || cmd == "DECRBY") {
+        bool by = cmd == "INCRBY" || cmd == "DECRBY";
+
+        if (tokens.size() != (by ? 3u : 2u)) {
+            response = "ERROR: " + cmd + (by ? " requires a key and an increment\n" : " requires a key\n");
+        } else {
+            int64_t delta = by ? std::stoll(tokens[2]) : 1;
+            if (cmd == "DECR" || cmd == "DECRBY") {
+                if (delta == INT64_MIN) {
+                    return "ERROR: decrement is out of range\n";
+                }
+                delta = -delta;
+            }
+
+            // queued for the log under the same lock, as the resulting value
+            int64_t result = store_.batch([&] {
+                int64_t value = store_.incrby(tokens[1], delta);
+                propagate_state(tokens[1]);
+                return value;
+            });
+            response = std::to_string(result) + "\n";
+        }
+    } else if (cmd == "APPEND") {
+        if (tokens.size() < 3) {
+            response = "ERROR: APPEND requires a key and a value\n";
+        } else {
+            size_t length = store_.batch([&] {
+                size_t n = store_.append(tokens[1], join_value(tokens, 2, tokens.size()));
+                propagate_state(tokens[1]);
+                return n;
+            });
+            response = std::to_string(length) + "\n";
+        }
+    } else if (cmd == "GETSET") {
+        if (tokens.size() < 3) {
+            response = "ERROR: GETSET requires a key and a value\n";
+        } else {
+            auto previous = store_.batch([&] {
+                auto old = store_.getset(tokens[1], join_value(tokens, 2, tokens.size()));
+                propagate_state(tokens[1]);
+                return old;
+            });
+            response = previous ? *previous + "\n" : "NULL\n";
+        }
+    } else if (cmd == "GETDEL") {
+        if (tokens.size() < 2) {
+            response = "ERROR: GETDEL requires a key\n";
+        } else {
+            auto previous = store_.batch([&] {
+                auto old = store_.getdel(tokens[1]);
+                if (old) propagate({"DELETE", tokens[1]});
+                return old;
+            });
+            response = previous ? *previous + "\n" : "NULL\n";
+        }
+    } else if (cmd == "CAS") {
+        // CAS key version value [EX ttl]: replies with the new version, NULL if the key changed
+        size_t ex = std::find(tokens.begin() + std::min<size_t>(3, tokens.size()), tokens.end(), "EX") - tokens.begin();
+
+        if (tokens.size() < 4 || ex == 3) {
+            response = "ERROR: CAS requires a key, a version and a value\n";
+        } else if (ex != tokens.size() && ex + 2 != tokens.size()) {
+            response = "ERROR: invalid EX usage\n";
+        } else {
+            uint64_t expected = std::stoull(tokens[2]);
+            std::optional<int> ttl;
+            if (ex != tokens.size()) ttl = std::stoi(tokens[ex + 1]);
+
+            uint64_t version = store_.batch([&] {
+                uint64_t v = store_.cas(tokens[1], expected, join_value(tokens, 3, ex), ttl);
+                if (v) propagate_state(tokens[1]);
+                return v;
+            });
+            response = version ? std::to_string(version) + "\n" : "NULL\n";
+        }
+    } else if (cmd == "VERSION") {
+        if (tokens.size() < 2) {
+            response = "ERROR: VERSION requires a key\n";
+        } else {
+            response = std::to_string(store_.version(tokens[1])) + "\n";
+        }
+    } else if (cmd == "HSET") {
+        if (tokens.size() < 4 || tokens.size() % 2 != 0) {
+            response = "ERROR: HSET requires a key and field value pairs\n";
+        } else {
+            std::vector<std::pair<std::string, std::string>> fields;
+            for (size_t i = 2; i < tokens.size(); i += 2) {
+                fields.emplace_back(tokens[i], tokens[i + 1]);
+            }
+
+            // applied and queued for the log under one lock, so the log keeps the store's order
+            size_t added = store_.batch([&] {
+                size_t n = store_.hset(tokens[1], fields);
+                propagate(tokens);
+                return n;
+            });
+            response = std::to_string(added) + "\n";
+        }
+    } else if (cmd == "HGET") {
+        if (tokens.size() < 3) {
+            response = "ERROR: HGET requires a key and a field\n";
+        } else {
+            auto value = store_.hget(tokens[1], tokens[2]);
+            response = value ? *value + "\n" : "NULL\n";
+        }
+    } else if (cmd == "HDEL") {
+        if (tokens.size() < 3) {
+            response = "ERROR: HDEL requires a key and at least one field\n";
+        } else {
+            std::vector<std::string> fields(tokens.begin() + 2, tokens.end());
+
+            size_t removed = store_.batch([&] {
+                size_t n = store_.hdel(tokens[1], fields);
+                if (n > 0) propagate(tokens);
+                return n;
+            });
+            response = std::to_string(removed) + "\n";
+        }
+    } else if (cmd == "LPUSH") {
+        if (tokens.size() < 3) {
+            response = "ERROR: LPUSH requires a key and at least one value\n";
+        } else {
+            std::vector<std::string> values(tokens.begin() + 2, tokens.end());
+
+            size_t length = store_.batch([&] {
+                size_t n = store_.lpush(tokens[1], values);
+                propagate(tokens);
+                return n;
+            });
+            response = std::to_string(length) + "\n";
+        }
+    } else if (cmd == "RPOP") {
+        if (tokens.size() < 2) {
+            response = "ERROR: RPOP requires a key\n";
+        } else {
+            auto value = store_.batch([&] {
+                auto popped = store_.rpop(tokens[1]);
+                if (popped) propagate({"RPOP", tokens[1]});
+                return popped;
+            });
+            if (value) {
+                response = *value + "\n";
+            } else {
+                response = "NULL\n";
+            }
+        }
+    } else if (cmd == "LRANGE") {
+        if (tokens.size() < 4) {
+            response = "ERROR: LRANGE requires a key, start and stop\n";
+        } else {
+            response = encode_array(
+                store_.lrange(tokens[1], std::stol(tokens[2]), std::stol(tokens[3]))
+            );
+        }
+    } else if (cmd == "SADD") {
+        if (tokens.size() < 3) {
+            response = "ERROR: SADD requires a key and at least one member\n";
+        } else {
+            std::vector<std::string> members(tokens.begin() + 2, tokens.end());
+
+            size_t added = store_.batch([&] {
+                size_t n = store_.sadd(tokens[1], members);
+                propagate(tokens);
+                return n;
+            });
+            response = std::to_string(added) + "\n";
+        }
+    } else if (cmd == "SISMEMBER") {
+        if (tokens.size() < 3) {
+            response = "ERROR: SISMEMBER requires a key and a member\n";
+        } else {
+            response = store_.sismember(tokens[1], tokens[2]) ? "1\n" : "0\n";
+        }
+    } else if (cmd == "SMEMBERS") {
+        if (tokens.size() < 2) {
+            response = "ERROR: SMEMBERS requires a key\n";
+        } else {
+            response = encode_array(store_.smembers(tokens[1]));
+        }
+    } else if (cmd == "ZADD") {
+        if (tokens.size() < 4 || tokens.size() % 2 != 0) {
+            response = "ERROR: ZADD requires a key and score member pairs\n";
+        } else {
+            std::vector<std::pair<double, std::string>> items;
+            for (size_t i = 2; i < tokens.size(); i += 2) {
+                items.emplace_back(parse_score(tokens[i]), tokens[i + 1]);
+            }
+
+            size_t added = store_.batch([&] {
+                size_t n = store_.zadd(tokens[1], items);
+                propagate(tokens);
+                return n;
+            });
+            response = std::to_string(added) + "\n";
+        }
+    } else if (cmd == "ZSCORE") {
+        if (tokens.size() < 3) {
+            response = "ERROR: ZSCORE requires a key and a member\n";
+        } else {
+            auto score = store_.zscore(tokens[1], tokens[2]);
+            response = score ? format_score(*score) + "\n" : "NULL\n";
+        }
+    } else if (cmd == "ZREM") {
+        if (tokens.size() < 3) {
+            response = "ERROR: ZREM requires a key and at least one member\n";
+        } else {
+            std::vector<std::string> members(tokens.begin() + 2, tokens.end());
+
+            size_t removed = store_.batch([&] {
+                size_t n = store_.zrem(tokens[1], members);
+                if (n > 0) propagate(tokens);
+                return n;
+            });
+            response = std::to_string(removed) + "\n";
+        }
+    } else if (cmd == "ZRANGE" || cmd == "ZRANGEBYSCORE") {
+        if (tokens.size() < 4) {
+            response = "ERROR: " + cmd + " requires a key, min and max\n";
+        } else {
+            bool with_scores = tokens.size() > 4 && tokens[4] == "WITHSCORES";
+            std::vector<ZSetValue::Item> items;
+
+            if (cmd == "ZRANGE") {
+                items = store_.zrange(tokens[1], std::stol(tokens[2]), std::stol(tokens[3]));
+            } else {
+                bool min_ex, max_ex;
+                double min = parse_score_bound(tokens[2], min_ex);
+                double max = parse_score_bound(tokens[3], max_ex);
+                items = store_.zrangebyscore(tokens[1], min, min_ex, max, max_ex);
+            }
+
+            std::vector<std::string> out;
+            out.reserve(items.size() * (with_scores ? 2 : 1));
+            for (auto &item : items) {
+                out.push_back(std::move(item.first));
+                if (with_scores) out.push_back(format_score(item.second));
+            }
+            response = encode_array(out);
+        }
+    } else if (cmd == "SCAN") {
+        response = scan_command(tokens);
+    } else if (cmd == "HOTKEYS") {
+        // HOTKEYS [count]: key, approximate ops/s, key, ... hottest first
+        size_t count = tokens.size() > 1 ? std::stoul(tokens[1]) : 10;
+
+        std::vector<std::string> out;
+        for (auto &item : store_.hotkeys(count)) {
+            out.push_back(std::move(item.key));
+            out.push_back(std::to_string(item.rate));
+        }
+        response = encode_array(out);
+    } else if (cmd == "SLOWLOG") {
+        response = slowlog_command(tokens);
+    } else if (cmd == "LATENCY") {
+        response = latency_command(tokens);
+    } else if (cmd == "PUBLISH") {
+        // PUBLISH channel message...: replies with the number of receivers
+        if (tokens.size() < 3) {
+            return "ERROR: PUBLISH requires a channel and a message\n";
+        }
+        response = std::to_string(pubsub_.publish(tokens[1], join_value(tokens, 2, tokens.size()))) + "\n";
     } else {
         response = "ERROR: unkown command\n";
     }
 
-    send(client_fd, response.c_str(), response.size(), 0);
+    return response;
+}
+
+
+/*
+SCAN <cursor> [MATCH <pattern>] [COUNT <count>]
+replies with an array: the next cursor ("0" when done) followed by the keys.
+when the ordered index is enabled and the pattern is a plain prefix ("user:123:*")
+the keys come from the index in order, and the cursor is the last key prefixed with '>'.
+*/
+std::string TCPServer::scan_command(const std::vector<std::string> &tokens) {
+    if (tokens.size() < 2) {
+        return "ERROR: SCAN requires a cursor\n";
+    }
+
+    std::string cursor = tokens[1];
+    std::string pattern;
+    size_t count = 10;
+
+    for (size_t i = 2; i < tokens.size(); i += 2) {
+        if (i + 1 >= tokens.size()) {
+            return "ERROR: syntax error\n";
+        }
+        if (tokens[i] == "MATCH") {
+            pattern = tokens[i + 1];
+        } else if (tokens[i] == "COUNT") {
+            count = std::stoul(tokens[i + 1]);
+            if (count == 0) count = 1;
+        } else {
+            return "ERROR: syntax error\n";
+        }
+    }
+
+    std::vector<std::string> keys;
+    std::vector<std::string> reply{"0"};
+
+    bool prefix_pattern = !pattern.empty() && pattern.back() == '*' &&
+        pattern.find_first_of("*?[\\") == pattern.size() - 1;
+
+    if (prefix_pattern && store_.has_ordered_index() &&
+        (cursor == "0" || cursor[0] == '>')) {
+
+        std::string after = (cursor == "0") ? "" : cursor.substr(1);
+        bool more = store_.scan_prefix(pattern.substr(0, pattern.size() - 1), after, count, keys);
+
+        if (more && !keys.empty()) {
+            reply[0] = ">" + keys.back();
+        }
+    } else {
+        uint64_t next = store_.scan(std::stoull(cursor), count, keys);
+        reply[0] = std::to_string(next);
+
+        if (!pattern.empty()) {
+            keys.erase(
+                std::remove_if(keys.begin(), keys.end(), [&](const std::string &k) {
+                    return !glob_match(pattern, k);
+                }),
+                keys.end()
+            );
+        }
+    }
+
+    reply.insert(reply.end(),
+        std::make_move_iterator(keys.begin()), std::make_move_iterator(keys.end()));
+    return encode_array(reply);
+}
+
+
+/*
+SLOWLOG GET [count] | LEN | RESET
+GET replies with the newest entries first, one line each:
+"<id> <unix time> <stage breakdown> | <command>"
+*/
+std::string TCPServer::slowlog_command(const std::vector<std::string> &tokens) {
+    std::string sub = tokens.size() > 1 ? tokens[1] : "GET";
+
+    if (sub == "GET") {
+        size_t count = tokens.size() > 2 ? std::stoul(tokens[2]) : 10;
+
+        std::vector<std::string> out;
+        for (const auto &entry : latency_.slowlog(count)) {
+            out.push_back(std::to_string(entry.id) + " " + std::to_string(entry.time) + " " +
+                format_breakdown(entry.trace) + " | " + entry.command);
+        }
+        return encode_array(out);
+    }
+    if (sub == "LEN") {
+        return std::to_string(latency_.slowlog_len()) + "\n";
+    }
+    if (sub == "RESET") {
+        latency_.slowlog_reset();
+        return "OK\n";
+    }
+    return "ERROR: SLOWLOG subcommand must be GET, LEN or RESET\n";
+}
+
+
+/*
+LATENCY [RESET]
+one line per stage: "<stage> count=<n> p50=.. p99=.. p999=.. max=..", then
+the store lock totals: "lock_contended=<n> lock_wait=.."
+*/
+std::string TCPServer::latency_command(const std::vector<std::string> &tokens) {
+    if (tokens.size() > 1) {
+        if (tokens[1] != "RESET") {
+            return "ERROR: LATENCY takes no argument but RESET\n";
+        }
+        latency_.reset();
+        return "OK\n";
+    }
+
+    std::vector<std::string> out;
+    for (size_t i = 0; i < kStageCount; i++) {
+        const auto &h = latency_.histogram(static_cast<Stage>(i));
+
+        out.push_back(std::string(stage_name(static_cast<Stage>(i))) +
+            " count=" + std::to_string(h.count()) +
+            " p50=" + format_us(h.percentile(0.5)) +
+            " p99=" + format_us(h.percentile(0.99)) +
+            " p999=" + format_us(h.percentile(0.999)) +
+            " max=" + format_us(h.max()));
+    }
+
+    auto lock = store_.lock_stats();
+    out.push_back("lock_contended=" + std::to_string(lock.contended) + " lock_wait=" + format_us(lock.wait_ns));
+    return encode_array(out);
+}
+
+
+/*
+SUBSCRIBE channel... / PSUBSCRIBE pattern...
+UNSUBSCRIBE [channel...] / PUNSUBSCRIBE [pattern...] (all of them without arguments)
+one array reply per channel: "subscribe" (or "unsubscribe", ...), the
+channel, and how many channels + patterns the connection is left with.
+messages then arrive as "message" / "pmessage" arrays, see PubSub.
+*/
+std::string TCPServer::pubsub_command(ClientState &client, const std::vector<std::string> &tokens) {
+    const std::string &cmd = tokens[0];
+    bool subscribing = cmd == "SUBSCRIBE" || cmd == "PSUBSCRIBE";
+    bool patterns = cmd[0] == 'P';
+
+    if (client.in_multi) {
+        return "ERROR: " + cmd + " is not allowed in a transaction\n";
+    }
+    if (subscribing && tokens.size() < 2) {
+        return "ERROR: " + cmd + " requires at least one channel\n";
+    }
+
+    if (!client.subscriber) {
+        if (!subscribing) return encode_array({"unsubscribe", "", "0"});
+        client.subscriber = pubsub_.make_subscriber(client.fd);
+    }
+    auto &sub = client.subscriber;
+
+    std::vector<std::string> names(tokens.begin() + 1, tokens.end());
+    if (names.empty()) {
+        auto &current = patterns ? sub->patterns : sub->channels;
+        names.assign(current.begin(), current.end());
+    }
+
+    std::string kind = cmd;
+    std::transform(kind.begin(), kind.end(), kind.begin(), ::tolower);
+
+    std::string response;
+    for (const auto &name : names) {
+        size_t count;
+        if (subscribing) {
+            count = patterns ? pubsub_.psubscribe(sub, name) : pubsub_.subscribe(sub, name);
+        } else {
+            count = patterns ? pubsub_.punsubscribe(sub, name) : pubsub_.unsubscribe(sub, name);
+        }
+        response += encode_array({kind, name, std::to_string(count)});
+    }
+    if (names.empty()) {
+        response = encode_array({kind, "", std::to_string(sub->subscriptions())});
+    }
+    return response;
 }
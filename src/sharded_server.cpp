@@ -0,0 +1,539 @@
+#include "sharded_server.hpp"
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <deque>
+#include <thread>
+#include <chrono>
+#include <unordered_map>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include "kvstore.hpp"
+#include "persistence.hpp"
+#include "replication.hpp"
+#include "node_role.hpp"
+#include "server.hpp"
+#include "protocol.hpp"
+#include "cluster.hpp"
+
+// slots per SPSC queue, anything beyond waits in the sender's overflow list
+static constexpr size_t kQueueCapacity = 4096;
+static constexpr int kMaxEvents = 64;
+
+// epoll data of the two fixed fds, connections count up from kFirstConnId
+static constexpr uint64_t kListenerId = 0;
+static constexpr uint64_t kEventId = 1;
+static constexpr uint64_t kFirstConnId = 2;
+
+
+// a forwarded command, the owner fills in `reply` and sends the same object back
+struct ShardedServer::Message {
+    size_t from;
+    uint64_t conn_id;
+    uint64_t seq;
+    // which key of an MGET this is, 0 otherwise
+    size_t part;
+    std::vector<std::string> tokens;
+    std::string reply;
+    bool is_reply{false};
+};
+
+
+namespace {
+
+// one command of a connection, replies go out in this order
+struct Slot {
+    bool done{false};
+    std::string reply;
+    // MGET: the per key GET replies, merged once all of them arrived
+    bool array{false};
+    std::vector<std::string> parts;
+    size_t remaining{0};
+};
+
+struct Conn {
+    int fd;
+    std::string in;
+    std::string out;
+    std::deque<Slot> slots;
+    // seq of slots.front()
+    uint64_t base_seq{0};
+    uint32_t events{EPOLLIN};
+    // the client stopped sending, close once every reply is out
+    bool closing{false};
+    // has new output, written once per loop iteration
+    bool dirty{false};
+};
+
+}
+
+
+struct ShardedServer::Worker {
+    size_t id;
+    KVStore store;
+    PersistenceManager file;
+    // the replication manager is only there because TCPServer wants one, it never starts
+    std::atomic<bool> replica_running{false};
+    ReplicationManager replica;
+    TCPServer executor;
+
+    int listen_fd{-1};
+    int epoll_fd{-1};
+    int event_fd{-1};
+
+    uint64_t next_conn{kFirstConnId};
+    std::unordered_map<uint64_t, Conn> conns;
+    std::vector<uint64_t> dirty;
+
+    // messages that did not fit in queue(id, to), sent first next time
+    std::vector<std::deque<Message *>> overflow;
+    // workers we pushed to since the last wake up
+    std::vector<bool> notify;
+
+    std::thread thread;
+
+    Worker(size_t id, size_t cores, int port, const std::string &aof)
+        : id(id),
+        file(store, aof),
+        replica(store, replica_running),
+        executor(port, store, file, NodeRole::Leader, replica),
+        overflow(cores),
+        notify(cores, false) {}
+};
+
+
+ShardedServer::ShardedServer(const Options &options, Configure configure) : options_(options) {
+    if (options_.cores == 0) options_.cores = 1;
+    size_t cores = options_.cores;
+
+    for (size_t i = 0; i < cores * cores; i++) {
+        queues_.push_back(std::make_unique<SpscQueue<Message *>>(kQueueCapacity));
+    }
+
+    for (size_t i = 0; i < cores; i++) {
+        std::string aof = options_.aof_prefix + "-" + std::to_string(i) + ".aof";
+        auto worker = std::make_unique<Worker>(i, cores, options_.port, aof);
+        worker->file.set_rewrite_policy(options_.aof_rewrite);
+
+        // only this partition's thread ever touches it
+        worker->store.disable_locking();
+        if (configure) configure(worker->store, i);
+        worker->file.replay(worker->store);
+
+        workers_.push_back(std::move(worker));
+    }
+}
+
+
+ShardedServer::~ShardedServer() {
+    Message *message;
+
+    for (auto &q : queues_) {
+        while (q->try_pop(message)) delete message;
+    }
+    for (auto &w : workers_) {
+        for (auto &pending : w->overflow) {
+            for (Message *m : pending) delete m;
+        }
+    }
+}
+
+
+size_t ShardedServer::owner(const std::string &key) const {
+    return key_hash_slot(key) % options_.cores;
+}
+
+
+static bool set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+
+// every worker binds its own socket to the same port, the kernel balances the accepts
+static int open_listener(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+        perror("SO_REUSEPORT");
+        close(fd);
+        return -1;
+    }
+
+    sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(port);
+
+    if (bind(fd, (sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("bind");
+        close(fd);
+        return -1;
+    }
+
+    if (listen(fd, 128) < 0 || !set_nonblocking(fd)) {
+        perror("listen");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
+void ShardedServer::start(std::atomic<bool> &running) {
+    for (auto &w : workers_) {
+        w->listen_fd = open_listener(options_.port);
+        w->epoll_fd = epoll_create1(0);
+        w->event_fd = eventfd(0, EFD_NONBLOCK);
+
+        if (w->listen_fd < 0 || w->epoll_fd < 0 || w->event_fd < 0) {
+            std::cerr << "failed to set up core " << w->id << "\n";
+            return;
+        }
+
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.u64 = kListenerId;
+        epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->listen_fd, &ev);
+        ev.data.u64 = kEventId;
+        epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->event_fd, &ev);
+    }
+
+    std::cout << "server listening on port " << options_.port
+        << " (" << options_.cores << " cores)" << std::endl;
+
+    for (auto &w : workers_) {
+        Worker *worker = w.get();
+        w->thread = std::thread([this, worker, &running] { run(*worker, running); });
+    }
+
+    for (auto &w : workers_) {
+        w->thread.join();
+    }
+
+    for (auto &w : workers_) {
+        close(w->listen_fd);
+        close(w->epoll_fd);
+        close(w->event_fd);
+    }
+}
+
+
+void ShardedServer::run(Worker &w, std::atomic<bool> &running) {
+    if (options_.pin_threads) {
+        unsigned cpus = std::max(1u, std::thread::hardware_concurrency());
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(w.id % cpus, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+
+    using clock = std::chrono::steady_clock;
+    auto last_tick = clock::now();
+    auto last_save = clock::now();
+
+    epoll_event events[kMaxEvents];
+
+    while (running) {
+        // don't sleep while a peer still has to make room for our messages
+        bool backlog = false;
+        for (auto &pending : w.overflow) {
+            if (!pending.empty()) backlog = true;
+        }
+
+        int n = epoll_wait(w.epoll_fd, events, kMaxEvents, backlog ? 0 : 100);
+
+        for (int i = 0; i < n; i++) {
+            uint64_t id = events[i].data.u64;
+
+            if (id == kListenerId) {
+                accept_clients(w);
+            } else if (id == kEventId) {
+                uint64_t count;
+                while (read(w.event_fd, &count, sizeof(count)) > 0) {}
+            } else {
+                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                    read_client(w, id);
+                }
+                if (events[i].events & EPOLLOUT) {
+                    write_client(w, id);
+                }
+            }
+        }
+
+        drain_inbound(w);
+        flush_outbound(w);
+
+        for (uint64_t id : w.dirty) {
+            write_client(w, id);
+        }
+        w.dirty.clear();
+
+        // what the cleanup and save threads do in the normal mode
+        auto now = clock::now();
+        if (now - last_tick >= std::chrono::seconds(1)) {
+            w.store.tick();
+            last_tick = now;
+        }
+        if (now - last_save >= std::chrono::seconds(1)) {
+            // only the snapshot is taken here, the (throttled) base is written by another thread
+            if (w.file.rewrite_needed()) w.file.save_state_in_background();
+            last_save = now;
+        }
+    }
+
+    while (!w.conns.empty()) {
+        close_client(w, w.conns.begin()->first);
+    }
+    w.file.save_state(false);
+}
+
+
+void ShardedServer::accept_clients(Worker &w) {
+    while (true) {
+        int fd = accept(w.listen_fd, nullptr, nullptr);
+        if (fd < 0) return;
+
+        set_nonblocking(fd);
+
+        uint64_t id = w.next_conn++;
+        Conn conn;
+        conn.fd = fd;
+        w.conns.emplace(id, std::move(conn));
+
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.u64 = id;
+        epoll_ctl(w.epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+    }
+}
+
+
+void ShardedServer::read_client(Worker &w, uint64_t conn_id) {
+    auto it = w.conns.find(conn_id);
+    if (it == w.conns.end()) return;
+
+    char buffer[4096];
+    bool eof = false;
+
+    while (true) {
+        ssize_t bytes = recv(it->second.fd, buffer, sizeof(buffer), 0);
+        if (bytes > 0) {
+            it->second.in.append(buffer, bytes);
+        } else {
+            eof = bytes == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+            break;
+        }
+    }
+
+    // a pipelined batch is cut off the buffer once, not line by line
+    std::string &in = it->second.in;
+    size_t start = 0;
+    size_t pos;
+    while ((pos = in.find('\n', start)) != std::string::npos) {
+        handle_line(w, conn_id, in.substr(start, pos - start));
+        start = pos + 1;
+    }
+    in.erase(0, start);
+
+    if (eof) {
+        it->second.closing = true;
+        if (!it->second.dirty) {
+            it->second.dirty = true;
+            w.dirty.push_back(conn_id);
+        }
+    }
+}
+
+
+void ShardedServer::write_client(Worker &w, uint64_t conn_id) {
+    auto it = w.conns.find(conn_id);
+    if (it == w.conns.end()) return;
+    Conn &conn = it->second;
+    conn.dirty = false;
+
+    while (!conn.out.empty()) {
+        ssize_t sent = send(conn.fd, conn.out.data(), conn.out.size(), MSG_NOSIGNAL);
+        if (sent > 0) {
+            conn.out.erase(0, sent);
+        } else if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else {
+            close_client(w, conn_id);
+            return;
+        }
+    }
+
+    if (conn.closing && conn.out.empty() && conn.slots.empty()) {
+        close_client(w, conn_id);
+        return;
+    }
+
+    uint32_t events = (conn.closing ? 0 : uint32_t(EPOLLIN)) | (conn.out.empty() ? 0 : uint32_t(EPOLLOUT));
+    if (events != conn.events) {
+        epoll_event ev{};
+        ev.events = events;
+        ev.data.u64 = conn_id;
+        epoll_ctl(w.epoll_fd, EPOLL_CTL_MOD, conn.fd, &ev);
+        conn.events = events;
+    }
+}
+
+
+void ShardedServer::close_client(Worker &w, uint64_t conn_id) {
+    auto it = w.conns.find(conn_id);
+    if (it == w.conns.end()) return;
+
+    // replies still on their way for it are dropped in deliver()
+    epoll_ctl(w.epoll_fd, EPOLL_CTL_DEL, it->second.fd, nullptr);
+    close(it->second.fd);
+    w.conns.erase(it);
+}
+
+
+void ShardedServer::handle_line(Worker &w, uint64_t conn_id, const std::string &line) {
+    auto tokens = tokenize(line);
+    if (tokens.empty()) return;
+
+    Conn &conn = w.conns.at(conn_id);
+    uint64_t seq = conn.base_seq + conn.slots.size();
+    Slot &slot = conn.slots.emplace_back();
+
+    const std::string &cmd = tokens[0];
+
+    if (cmd == "MULTI" || cmd == "EXEC" || cmd == "DISCARD" || cmd == "WATCH" ||
+        cmd == "UNWATCH" || cmd == "SCAN" || cmd == "CLUSTER" || cmd == "ASKING" ||
+        cmd == "SUBSCRIBE" || cmd == "UNSUBSCRIBE" || cmd == "PSUBSCRIBE" ||
+        cmd == "PUNSUBSCRIBE" || cmd == "PUBLISH") {
+        deliver(w, conn_id, seq, 0, "ERROR: " + cmd + " is not supported with --cores\n");
+        return;
+    }
+
+    // the keys of an MGET can live on different cores, ask each owner separately
+    if (cmd == "MGET" && tokens.size() > 1) {
+        size_t keys = tokens.size() - 1;
+        slot.array = true;
+        slot.parts.resize(keys);
+        slot.remaining = keys;
+
+        for (size_t i = 0; i < keys; i++) {
+            route(w, conn_id, seq, i, {"GET", tokens[i + 1]});
+        }
+        return;
+    }
+
+    route(w, conn_id, seq, 0, std::move(tokens));
+}
+
+
+void ShardedServer::route(Worker &w, uint64_t conn_id, uint64_t seq, size_t part, std::vector<std::string> tokens) {
+    // commands without a key run wherever they came in
+    bool keyless = tokens.size() < 2 || tokens[0] == "HOTKEYS" ||
+        tokens[0] == "SLOWLOG" || tokens[0] == "LATENCY";
+    size_t to = keyless ? w.id : owner(tokens[1]);
+
+    if (to == w.id) {
+        deliver(w, conn_id, seq, part, w.executor.execute(tokens));
+        return;
+    }
+
+    forward(w, to, new Message{w.id, conn_id, seq, part, std::move(tokens), {}, false});
+}
+
+
+void ShardedServer::forward(Worker &w, size_t to, Message *message) {
+    auto &pending = w.overflow[to];
+
+    // behind older overflow, so messages between two cores stay in order
+    if (!pending.empty() || !queue(w.id, to).try_push(message)) {
+        pending.push_back(message);
+    }
+    w.notify[to] = true;
+}
+
+
+void ShardedServer::flush_outbound(Worker &w) {
+    for (size_t to = 0; to < options_.cores; to++) {
+        auto &pending = w.overflow[to];
+
+        while (!pending.empty() && queue(w.id, to).try_push(pending.front())) {
+            pending.pop_front();
+        }
+
+        if (w.notify[to]) {
+            uint64_t one = 1;
+            ssize_t ignored = write(workers_[to]->event_fd, &one, sizeof(one));
+            (void)ignored;
+            w.notify[to] = false;
+        }
+    }
+}
+
+
+void ShardedServer::drain_inbound(Worker &w) {
+    for (size_t from = 0; from < options_.cores; from++) {
+        if (from == w.id) continue;
+
+        Message *message;
+        while (queue(from, w.id).try_pop(message)) {
+            if (message->is_reply) {
+                deliver(w, message->conn_id, message->seq, message->part, std::move(message->reply));
+                delete message;
+                continue;
+            }
+
+            message->reply = w.executor.execute(message->tokens);
+            message->tokens.clear();
+            message->is_reply = true;
+            forward(w, message->from, message);
+        }
+    }
+}
+
+
+void ShardedServer::deliver(Worker &w, uint64_t conn_id, uint64_t seq, size_t part, std::string reply) {
+    auto it = w.conns.find(conn_id);
+    if (it == w.conns.end()) return;
+    Conn &conn = it->second;
+
+    Slot &slot = conn.slots[seq - conn.base_seq];
+
+    if (slot.array) {
+        if (!reply.empty() && reply.back() == '\n') reply.pop_back();
+        // same as MGET: a key holding another type reads as missing
+        if (reply.rfind("WRONGTYPE", 0) == 0) reply = "NULL";
+
+        slot.parts[part] = std::move(reply);
+        if (--slot.remaining) return;
+
+        slot.reply = encode_array(slot.parts);
+    } else {
+        slot.reply = std::move(reply);
+    }
+    slot.done = true;
+
+    // an earlier command may still be waiting on another core
+    while (!conn.slots.empty() && conn.slots.front().done) {
+        conn.out += conn.slots.front().reply;
+        conn.slots.pop_front();
+        conn.base_seq++;
+    }
+
+    if (!conn.dirty) {
+        conn.dirty = true;
+        w.dirty.push_back(conn_id);
+    }
+}
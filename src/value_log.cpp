@@ -0,0 +1,232 @@
+#include "value_log.hpp"
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <fcntl.h>
+#include <unistd.h>
+
+static constexpr size_t kRecordHeader = 8;
+
+
+Segment::~Segment() {
+    close(fd_);
+}
+
+
+std::string Segment::read(uint64_t offset, uint32_t length) const {
+    std::string out(length, '\0');
+    size_t done = 0;
+
+    while (done < length) {
+        ssize_t n = pread(fd_, out.data() + done, length - done, offset + done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            throw std::runtime_error("failed to read value from " + path_);
+        }
+        done += n;
+    }
+    return out;
+}
+
+
+ValueLog::ValueLog(std::string dir, uint64_t segment_size)
+    : dir_(std::move(dir)),
+    segment_size_(segment_size) {
+
+    std::filesystem::create_directories(dir_);
+
+    // leftovers of a previous run, the AOF replay spills again what is cold
+    for (const auto &file : std::filesystem::directory_iterator(dir_)) {
+        std::string name = file.path().filename().string();
+        if (name.rfind("segment-", 0) == 0) {
+            std::filesystem::remove(file.path());
+        }
+    }
+
+    open_segment();
+}
+
+
+ValueLog::~ValueLog() {
+    for (const auto &[id, info] : segments_) {
+        unlink(info.segment->path().c_str());
+    }
+}
+
+
+void ValueLog::open_segment() {
+    uint32_t id = next_id_++;
+    std::string path = dir_ + "/segment-" + std::to_string(id) + ".dat";
+
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        throw std::runtime_error("failed to create " + path + ": " + std::strerror(errno));
+    }
+
+    segments_[id].segment = std::make_shared<const Segment>(id, fd, path);
+    active_id_ = id;
+    active_fd_ = fd;
+    active_size_ = 0;
+}
+
+
+SpilledValue ValueLog::append(const std::string &key, std::string_view bytes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    if (active_size_ >= segment_size_) {
+        open_segment();
+    }
+
+    uint32_t header[2] = {
+        static_cast<uint32_t>(key.size()),
+        static_cast<uint32_t>(bytes.size())
+    };
+
+    std::string record;
+    record.reserve(kRecordHeader + key.size() + bytes.size());
+    record.append(reinterpret_cast<const char *>(header), kRecordHeader);
+    record.append(key);
+    record.append(bytes);
+
+    size_t done = 0;
+    while (done < record.size()) {
+        ssize_t n = pwrite(active_fd_, record.data() + done, record.size() - done, active_size_ + done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            throw std::runtime_error("failed to write to the value log: " + std::string(std::strerror(errno)));
+        }
+        done += n;
+    }
+
+    SegmentInfo &info = segments_[active_id_];
+    info.written += bytes.size();
+    info.live += bytes.size();
+
+    SpilledValue value;
+    value.segment = info.segment;
+    value.offset = active_size_ + kRecordHeader + key.size();
+    value.length = header[1];
+
+    active_size_ += record.size();
+    return value;
+}
+
+
+void ValueLog::release(const SpilledValue &value) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    auto it = segments_.find(value.segment->id());
+    if (it != segments_.end()) {
+        it->second.live -= value.length;
+    }
+}
+
+
+std::vector<std::shared_ptr<const Segment>> ValueLog::compaction_candidates(double live_ratio) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<std::shared_ptr<const Segment>> out;
+
+    for (const auto &[id, info] : segments_) {
+        if (id != active_id_ && info.live < info.written * live_ratio) {
+            out.push_back(info.segment);
+        }
+    }
+    return out;
+}
+
+
+std::vector<ValueLog::Record> ValueLog::records(const Segment &segment, uint64_t &offset, size_t max_bytes) const {
+    std::vector<Record> out;
+
+    uint64_t size = std::filesystem::file_size(segment.path());
+    if (offset + kRecordHeader > size) return out;
+
+    std::string data = segment.read(offset, static_cast<uint32_t>(std::min<uint64_t>(max_bytes, size - offset)));
+
+    size_t pos = 0;
+    while (pos + kRecordHeader <= data.size()) {
+        uint32_t header[2];
+        std::memcpy(header, data.data() + pos, kRecordHeader);
+        size_t record_size = kRecordHeader + header[0] + header[1];
+
+        if (pos + record_size > data.size()) {
+            // a record larger than the chunk is read on its own
+            if (pos == 0 && offset + record_size <= size) {
+                data = segment.read(offset, static_cast<uint32_t>(record_size));
+                continue;
+            }
+            break;
+        }
+
+        Record record;
+        record.key.assign(data, pos + kRecordHeader, header[0]);
+        record.offset = offset + pos + kRecordHeader + header[0];
+        record.value.assign(data, pos + kRecordHeader + header[0], header[1]);
+
+        pos += record_size;
+        out.push_back(std::move(record));
+    }
+
+    offset += pos;
+    return out;
+}
+
+
+void ValueLog::retire(const std::shared_ptr<const Segment> &segment) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    if (segments_.erase(segment->id())) {
+        unlink(segment->path().c_str());
+    }
+}
+
+
+uint64_t ValueLog::disk_bytes() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    uint64_t total = 0;
+    for (const auto &[id, info] : segments_) total += info.written;
+    return total;
+}
+
+
+uint64_t ValueLog::live_bytes() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    uint64_t total = 0;
+    for (const auto &[id, info] : segments_) total += info.live;
+    return total;
+}
+
+
+bool ValueCache::get(const SpilledValue &value, std::string &out) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    auto it = index_.find({value.segment->id(), value.offset});
+    if (it == index_.end()) {
+        return false;
+    }
+
+    lru_.splice(lru_.begin(), lru_, it->second);
+    out = it->second->second;
+    return true;
+}
+
+
+void ValueCache::put(const SpilledValue &value, const std::string &bytes) {
+    if (bytes.size() > capacity_) return;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    Key key{value.segment->id(), value.offset};
+
+    if (index_.count(key)) return;
+
+    lru_.emplace_front(key, bytes);
+    index_[key] = lru_.begin();
+    size_ += bytes.size();
+
+    while (size_ > capacity_) {
+        size_ -= lru_.back().second.size();
+        index_.erase(lru_.back().first);
+        lru_.pop_back();
+    }
+}
@@ -0,0 +1,132 @@
+/*
+values written through the C API are byte strings: whatever goes in has to
+come back out of the AOF after a close and reopen, including empty values,
+line breaks, quotes and values that look like protocol keywords. writes
+are made with kvstore_set, kvstore_write_batch and compressed, and one
+value tries to smuggle a DELETE of another key into the log.
+
+    ./c_api_reopen [dir]
+*/
+#include "kvstore_c.h"
+#include <cstdio>
+#include <filesystem>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+static size_t failures = 0;
+
+
+static void expect(kvstore_t *kv, const std::string &key, const std::string *expected, const char *when) {
+    std::vector<char> buf(1 << 16);
+    size_t len = 0;
+    int status = kvstore_get(kv, key.data(), key.size(), buf.data(), buf.size(), &len);
+
+    if (!expected) {
+        if (status != KVSTORE_NOT_FOUND) {
+            std::fprintf(stderr, "%s: key %zu should be gone, got status %d\n", when, key.size(), status);
+            failures++;
+        }
+        return;
+    }
+
+    if (status != KVSTORE_OK || std::string(buf.data(), len) != *expected) {
+        std::fprintf(stderr, "%s: value of a %zu byte key differs (status %d, length %zu, expected %zu)\n",
+                     when, key.size(), status, len, expected->size());
+        failures++;
+    }
+}
+
+
+int main(int argc, char *argv[]) {
+    std::filesystem::path dir = argc > 1
+        ? std::filesystem::path(argv[1])
+        : std::filesystem::temp_directory_path() / ("kvstore_c_reopen." + std::to_string(getpid()));
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir);
+    std::string aof = (dir / "data.aof").string();
+
+    kvstore_options_t options{};
+    options.aof_path = aof.c_str();
+    options.compress_threshold = 256;
+
+    std::string big(4096, 'x');
+    big[100] = '\n';
+    big[2000] = '"';
+
+    const std::vector<std::string> values = {
+        "", "EX", "ex", "MULTI", "EXEC", "DELETE b", "line1\nDELETE b", "\r\n",
+        "\n", "trailing\r", "two words", "\"", "\\", "back\\slash\"quote",
+        std::string("nul\0byte", 8), big
+    };
+
+    std::vector<std::string> keys;
+    for (size_t i = 0; i < values.size(); i++) {
+        keys.push_back("k" + std::to_string(i));
+    }
+    // keys are byte strings too
+    keys.push_back("");
+    keys.push_back("key with\nline break");
+    keys.push_back("EX");
+
+    kvstore_t *kv = nullptr;
+    if (kvstore_open(&options, &kv) != KVSTORE_OK) {
+        std::fprintf(stderr, "failed to open %s\n", aof.c_str());
+        return 1;
+    }
+
+    std::string b = "still here";
+    kvstore_set(kv, "b", 1, b.data(), b.size(), 0);
+
+    for (size_t i = 0; i < keys.size(); i++) {
+        const std::string &value = values[i % values.size()];
+        if (kvstore_set(kv, keys[i].data(), keys[i].size(), value.data(), value.size(), i % 2 ? 1000 : 0) != KVSTORE_OK) {
+            std::fprintf(stderr, "kvstore_set of value %zu failed\n", i);
+            failures++;
+        }
+    }
+
+    // the same values again, through one batch (a MULTI/EXEC block in the log)
+    std::vector<std::string> batch_keys;
+    std::vector<kvstore_op_t> ops;
+    for (size_t i = 0; i < values.size(); i++) {
+        batch_keys.push_back("batch:" + std::to_string(i));
+    }
+    for (size_t i = 0; i < values.size(); i++) {
+        kvstore_op_t op{};
+        op.type = KVSTORE_OP_SET;
+        op.key = batch_keys[i].data();
+        op.key_len = batch_keys[i].size();
+        op.value = values[i].data();
+        op.value_len = values[i].size();
+        ops.push_back(op);
+    }
+    if (kvstore_write_batch(kv, ops.data(), ops.size()) != KVSTORE_OK) {
+        std::fprintf(stderr, "kvstore_write_batch failed\n");
+        failures++;
+    }
+
+    std::string gone = "k0";
+    kvstore_del(kv, gone.data(), gone.size());
+    kvstore_close(kv);
+
+    if (kvstore_open(&options, &kv) != KVSTORE_OK) {
+        std::fprintf(stderr, "failed to reopen %s\n", aof.c_str());
+        return 1;
+    }
+
+    expect(kv, "b", &b, "after reopen");
+    expect(kv, gone, nullptr, "after reopen");
+    for (size_t i = 1; i < keys.size(); i++) {
+        expect(kv, keys[i], &values[i % values.size()], "after reopen");
+    }
+    for (size_t i = 0; i < values.size(); i++) {
+        expect(kv, batch_keys[i], &values[i], "after reopen (batch)");
+    }
+
+    kvstore_close(kv);
+    std::filesystem::remove_all(dir);
+
+    std::printf("c api reopen: %zu failures\n", failures);
+    return failures ? 1 : 0;
+}
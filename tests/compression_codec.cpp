@@ -0,0 +1,251 @@
+/*
+the value codec (compression.cpp) and what happens to compressed values in
+the AOF:
+- anything compressed decompresses back to the same bytes, with and without
+  a dictionary, for data with no repeats, long and overlapping matches and
+  matches reaching the full 64 KB back
+- corrupt input never reads or writes out of bounds: truncated data, a
+  wrong size or dictionary is rejected, flipped bytes either are rejected or
+  decode to exactly raw_size bytes
+- replaying a SETZ record the store can't take (unknown dictionary, corrupt
+  bytes) stops the replay with a ReplayError instead of dropping the key
+
+    ./compression_codec [dir]
+*/
+#include "compression.hpp"
+#include "command_log.hpp"
+#include "persistence.hpp"
+#include "protocol.hpp"
+#include "kvstore.hpp"
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+static size_t failures = 0;
+
+
+static void fail(const std::string &what) {
+    if (failures < 20) std::fprintf(stderr, "%s\n", what.c_str());
+    failures++;
+}
+
+
+static std::string random_bytes(std::mt19937 &rng, size_t n, int alphabet = 256) {
+    std::string s(n, '\0');
+    for (char &c : s) c = char(rng() % alphabet);
+    return s;
+}
+
+
+static std::vector<std::string> inputs(std::mt19937 &rng) {
+    std::vector<std::string> all = {
+        "", "a", "abcd", std::string(12, 'x'), std::string(13, 'x'), std::string(17, 'y'),
+        // one long overlapping match, lengths past the 15 and 255 + 15 escapes
+        std::string(300, 'z'), std::string(100000, 'q'),
+        "{\"id\":1,\"name\":\"alice\",\"tags\":[\"a\",\"b\"]}"
+    };
+
+    // no repeats at all, and few symbols (lots of short matches)
+    for (size_t n : {1, 5, 16, 100, 4096, 70000}) {
+        all.push_back(random_bytes(rng, n));
+        all.push_back(random_bytes(rng, n, 4));
+    }
+
+    // the same block again just under and just past 64 KB later
+    std::string block = random_bytes(rng, 1000);
+    for (size_t gap : {65535 - 1000, 65536 - 1000, 70000 - 1000}) {
+        all.push_back(block + random_bytes(rng, gap) + block);
+    }
+
+    // period of a few bytes, matches overlap their own output
+    std::string periodic;
+    while (periodic.size() < 5000) periodic += "abc";
+    all.push_back(periodic);
+    return all;
+}
+
+
+static void round_trips(std::mt19937 &rng) {
+    std::string small_dict = "{\"id\":,\"name\":\"\",\"tags\":[\"a\",\"b\"]}";
+    // longer than the 64 KB window, only its end is used
+    std::string big_dict = random_bytes(rng, 80000, 16);
+
+    for (const auto &input : inputs(rng)) {
+        for (std::string_view d : {std::string_view(), std::string_view(small_dict), std::string_view(big_dict)}) {
+            std::string packed = lz_compress(input, d);
+
+            try {
+                if (lz_decompress(packed, input.size(), d) != input) {
+                    fail("round trip changed a " + std::to_string(input.size()) + " byte value");
+                }
+            } catch (const std::invalid_argument &) {
+                fail("round trip of a " + std::to_string(input.size()) + " byte value threw");
+            }
+        }
+    }
+
+    // a value made of the dictionary's tail compresses to almost nothing
+    std::string tail = big_dict.substr(big_dict.size() - 3000);
+    std::string packed = lz_compress(tail, big_dict);
+    if (packed.size() > 100 || lz_decompress(packed, tail.size(), big_dict) != tail) {
+        fail("dictionary matches did not work");
+    }
+}
+
+
+// true if decoding was rejected, also fails if it produced the wrong size
+static bool rejected(std::string_view packed, size_t raw_size, std::string_view dict = {}) {
+    try {
+        std::string out = lz_decompress(packed, raw_size, dict);
+        if (out.size() != raw_size) fail("corrupt input decoded to the wrong size");
+        return false;
+    } catch (const std::invalid_argument &) {
+        return true;
+    }
+}
+
+
+static void corrupt_input(std::mt19937 &rng) {
+    std::string dict = "shared dictionary content, shared dictionary content";
+    std::vector<std::string> values = {
+        std::string(1000, 'a'),
+        "shared dictionary content " + random_bytes(rng, 200, 8),
+        random_bytes(rng, 3000, 4),
+        random_bytes(rng, 500)
+    };
+
+    for (const auto &value : values) {
+        std::string packed = lz_compress(value, dict);
+
+        // cut off anywhere: always noticed
+        for (size_t n = 0; n < packed.size(); n++) {
+            if (!rejected(std::string_view(packed).substr(0, n), value.size(), dict)) {
+                fail("truncated to " + std::to_string(n) + " of " + std::to_string(packed.size()) + " bytes, not rejected");
+            }
+        }
+
+        // a raw_size that does not match
+        for (size_t size : {value.size() - 1, value.size() + 1, size_t(0), value.size() * 2}) {
+            if (size != value.size() && !rejected(packed, size, dict)) {
+                fail("wrong raw size " + std::to_string(size) + " not rejected");
+            }
+        }
+
+        // decoded without the dictionary its matches point before the start
+        if (value.compare(0, 6, "shared") == 0 && !rejected(packed, value.size())) {
+            fail("missing dictionary not rejected");
+        }
+
+        // flipped bytes and garbage: rejected or the right size, never out of bounds
+        for (int i = 0; i < 2000; i++) {
+            std::string broken = packed;
+            for (int flips = 1 + rng() % 3; flips > 0; flips--) {
+                broken[rng() % broken.size()] = char(rng());
+            }
+            rejected(broken, value.size(), dict);
+        }
+        for (int i = 0; i < 200; i++) {
+            rejected(random_bytes(rng, rng() % 64), rng() % 200, dict);
+        }
+    }
+}
+
+
+// replays `lines` as a single file AOF, returns the error if the replay stopped
+static std::string replay(const std::filesystem::path &dir, KVStore &store, const std::string &lines) {
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir);
+    std::string aof = (dir / "data.aof").string();
+    std::ofstream(aof) << lines;
+
+    PersistenceManager file(store, aof);
+    try {
+        file.replay(store);
+    } catch (const ReplayError &e) {
+        return e.what();
+    }
+    return {};
+}
+
+
+static void replay_stops(const std::filesystem::path &dir) {
+    std::string dictionary = "a dictionary the writer had " + std::string(200, 'd');
+    std::string value = "a dictionary the writer had, and then some value " + std::string(300, 'v');
+
+    KVStore writer;
+    writer.enable_compression(64, dictionary);
+    auto packed = writer.compress(value);
+    if (!packed || packed->dictionary_id == 0) {
+        fail("test value did not compress with the dictionary");
+        return;
+    }
+
+    std::string before = encode_command({"SET", "before", "1"});
+    std::string setz = encode_command(compressed_set_args("packed", *packed, std::nullopt));
+    std::string after = encode_command({"SET", "after", "1"});
+
+    // with the same dictionary it replays fine
+    {
+        KVStore store;
+        store.enable_compression(64, dictionary);
+        std::string error = replay(dir, store, before + setz + after);
+        if (!error.empty() || store.get("packed") != std::optional<std::string>(value) || !store.get("after")) {
+            fail("SETZ with the right dictionary did not replay: " + error);
+        }
+    }
+
+    // without it (or with another one) the replay stops at the record
+    for (const std::string &other : {std::string(), std::string("some other dictionary")}) {
+        KVStore store;
+        store.enable_compression(64, other);
+        std::string error = replay(dir, store, before + setz + after);
+
+        if (error.empty()) {
+            fail("SETZ with an unknown dictionary was replayed without an error");
+        } else if (error.find("dictionary") == std::string::npos) {
+            fail("unexpected error: " + error);
+        }
+        if (!store.get("before") || store.get("after")) {
+            fail("the replay did not stop right at the SETZ record");
+        }
+    }
+
+    // corrupt compressed bytes stop it too
+    {
+        CompressedValue broken = *packed;
+        broken.raw_size += 1;
+        std::string line = encode_command(compressed_set_args("packed", broken, std::nullopt));
+
+        KVStore store;
+        store.enable_compression(64, dictionary);
+        if (replay(dir, store, before + line + after).empty() || store.get("after")) {
+            fail("a corrupt SETZ record did not stop the replay");
+        }
+
+        KVStore malformed;
+        if (replay(dir, malformed, before + "SETZ packed 10 0 !!!notbase64\n" + after).empty()) {
+            fail("a malformed SETZ record did not stop the replay");
+        }
+    }
+}
+
+
+int main(int argc, char *argv[]) {
+    std::filesystem::path dir = argc > 1
+        ? std::filesystem::path(argv[1])
+        : std::filesystem::temp_directory_path() / ("kvstore_codec." + std::to_string(getpid()));
+
+    std::mt19937 rng(11);
+    round_trips(rng);
+    corrupt_input(rng);
+    replay_stops(dir);
+    std::filesystem::remove_all(dir);
+
+    std::printf("compression codec: %zu failures\n", failures);
+    return failures ? 1 : 0;
+}
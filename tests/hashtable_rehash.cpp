@@ -0,0 +1,230 @@
+/*
+HashTable resizes incrementally, so for a while every key lives in one of
+two bucket arrays. this checks inserts, erases and lookups against
+std::unordered_map while resizes (both ways) are in progress, and that a
+scan() returns every key present for the whole scan when the table grows
+or shrinks between two of its calls.
+
+    ./hashtable_rehash
+*/
+#include "hashtable.hpp"
+#include <cstdio>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+static size_t failures = 0;
+
+
+static void fail(const char *what, const std::string &key) {
+    if (failures < 20) std::fprintf(stderr, "%s: %s\n", what, key.c_str());
+    failures++;
+}
+
+
+// every key of `expected` is found with its value, and nothing else is in the table
+static void check_contents(const HashTable<int> &table, const std::unordered_map<std::string, int> &expected, const char *when) {
+    if (table.size() != expected.size()) {
+        fail(when, "size differs");
+    }
+    for (const auto &[key, value] : expected) {
+        const int *found = table.find(key);
+        if (!found || *found != value) fail(when, key);
+    }
+
+    size_t visited = 0;
+    table.for_each([&](const std::string &key, const int &) {
+        visited++;
+        if (!expected.count(key)) fail(when, key);
+    });
+    if (visited != expected.size()) fail(when, "for_each count differs");
+}
+
+
+// random inserts, erases and lookups, checked op by op while resizes come and go
+static void random_ops() {
+    HashTable<int> table;
+    std::unordered_map<std::string, int> expected;
+    std::mt19937 rng(1);
+    size_t ops_while_rehashing = 0;
+
+    // grow to about 40k keys, then shrink back down, twice
+    for (int round = 0; round < 2; round++) {
+        for (int phase = 0; phase < 2; phase++) {
+            bool growing = phase == 0;
+
+            for (int i = 0; i < 60000; i++) {
+                std::string key = "k" + std::to_string(rng() % 50000);
+                bool insert = growing ? rng() % 4 != 0 : rng() % 4 == 0;
+                if (table.rehashing()) ops_while_rehashing++;
+
+                if (insert) {
+                    int value = int(rng());
+                    *table.try_emplace(key).first = value;
+                    expected[key] = value;
+                } else if (table.erase(key) != (expected.erase(key) == 1)) {
+                    fail("erase result differs", key);
+                }
+
+                const int *found = table.find(key);
+                auto it = expected.find(key);
+                if ((found == nullptr) != (it == expected.end()) || (found && *found != it->second)) {
+                    fail("lookup after write differs", key);
+                }
+            }
+            check_contents(table, expected, growing ? "after growing" : "after shrinking");
+        }
+    }
+
+    if (ops_while_rehashing == 0) {
+        fail("random ops", "no operation ran during a resize");
+    }
+}
+
+
+/*
+stops in the middle of a grow, with keys from before it partly moved and
+keys added since in the new array only, then in the middle of a shrink.
+*/
+static void lookup_both_tables() {
+    HashTable<int> table;
+    std::unordered_map<std::string, int> expected;
+    int n = 0;
+
+    // the insert that starts a resize moves one bucket, the next ones one each
+    while (!table.rehashing()) {
+        std::string key = "grow" + std::to_string(n);
+        *table.try_emplace(key).first = n;
+        expected[key] = n++;
+    }
+    for (int i = 0; i < 3; i++) {
+        std::string key = "grow" + std::to_string(n);
+        *table.try_emplace(key).first = n;
+        expected[key] = n++;
+    }
+    if (!table.rehashing()) fail("grow", "resize finished too early to test");
+    check_contents(table, expected, "in the middle of a grow");
+
+    // erase during the grow, from either array
+    for (int i = 0; i < n; i += 3) {
+        std::string key = "grow" + std::to_string(i);
+        if (!table.erase(key)) fail("erase during grow", key);
+        expected.erase(key);
+    }
+    check_contents(table, expected, "after erasing during a grow");
+
+    while (table.rehash_step(100)) {}
+
+    // make it big, then erase until a shrink starts
+    for (int i = 0; i < 5000; i++) {
+        std::string key = "many" + std::to_string(i);
+        *table.try_emplace(key).first = i;
+        expected[key] = i;
+    }
+    while (table.rehash_step(100)) {}
+
+    for (int i = 0; i < 5000 && !table.rehashing(); i++) {
+        std::string key = "many" + std::to_string(i);
+        table.erase(key);
+        expected.erase(key);
+    }
+    if (!table.rehashing()) fail("shrink", "no shrink started");
+    check_contents(table, expected, "in the middle of a shrink");
+
+    // inserts land in the smaller array while the rest is still in the big one
+    for (int i = 0; i < 3; i++) {
+        std::string key = "late" + std::to_string(i);
+        *table.try_emplace(key).first = i;
+        expected[key] = i;
+    }
+    check_contents(table, expected, "after inserting during a shrink");
+}
+
+
+/*
+a full scan where `between` changes the table before every call. `stable`
+keys are there from start to end and must all be returned.
+*/
+template <typename F>
+static void scan_while(const char *name, HashTable<int> &table, const std::unordered_set<std::string> &stable, F &&between) {
+    std::unordered_set<std::string> seen;
+    uint64_t cursor = 0;
+    size_t calls = 0, calls_while_rehashing = 0;
+
+    do {
+        between(calls);
+        if (table.rehashing()) calls_while_rehashing++;
+        cursor = table.scan(cursor, [&](const std::string &key, const int &) { seen.insert(key); });
+        calls++;
+    } while (cursor);
+
+    for (const auto &key : stable) {
+        if (!seen.count(key)) fail(name, key);
+    }
+    if (calls_while_rehashing == 0) fail(name, "no scan call ran during a resize");
+}
+
+
+static void scan_during_resize() {
+    std::unordered_set<std::string> stable;
+    for (int i = 0; i < 1000; i++) stable.insert("stable" + std::to_string(i));
+
+    // the table doubles several times while the scan runs
+    {
+        HashTable<int> table;
+        for (const auto &key : stable) table.try_emplace(key);
+
+        int added = 0;
+        scan_while("scan while growing", table, stable, [&](size_t) {
+            // capped, or the scan would never catch up with the growth
+            for (int i = 0; i < 40 && added < 30000; i++) table.try_emplace("new" + std::to_string(added++));
+        });
+    }
+
+    // lots of keys go away while the scan runs, the table halves several times
+    {
+        HashTable<int> table;
+        for (const auto &key : stable) table.try_emplace(key);
+        for (int i = 0; i < 60000; i++) table.try_emplace("gone" + std::to_string(i));
+        while (table.rehash_step(100)) {}
+
+        int erased = 0;
+        scan_while("scan while shrinking", table, stable, [&](size_t) {
+            for (int i = 0; i < 400 && erased < 60000; i++) table.erase("gone" + std::to_string(erased++));
+        });
+    }
+
+    // grows and shrinks, with rehash steps of different sizes in between
+    {
+        HashTable<int> table;
+        for (const auto &key : stable) table.try_emplace(key);
+
+        std::mt19937 rng(3);
+        std::vector<std::string> churn;
+        scan_while("scan while growing and shrinking", table, stable, [&](size_t call) {
+            bool grow = (call / 50) % 2 == 0;
+            for (int i = 0; i < 200; i++) {
+                if (grow) {
+                    churn.push_back("churn" + std::to_string(rng()));
+                    table.try_emplace(churn.back());
+                } else if (!churn.empty()) {
+                    table.erase(churn.back());
+                    churn.pop_back();
+                }
+            }
+            table.rehash_step(rng() % 8);
+        });
+    }
+}
+
+
+int main() {
+    random_ops();
+    lookup_both_tables();
+    scan_during_resize();
+
+    std::printf("hashtable rehash: %zu failures\n", failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,79 @@
+/*
+keyspace notifications: every write that creates, changes or removes a key
+sends its event, a collection losing its last element sends "del" as
+well, and writes that change nothing send nothing.
+
+    ./keyspace_events
+*/
+#include "kvstore.hpp"
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+static size_t failures = 0;
+
+
+int main() {
+    KVStore store;
+    std::vector<std::string> events;
+
+    store.set_event_listener([&](const char *event, const std::string &key) {
+        events.push_back(std::string(event) + " " + key);
+    });
+
+    auto expect = [&](const char *what, std::function<void()> write, std::vector<std::string> expected) {
+        events.clear();
+        write();
+        if (events != expected) {
+            std::string got;
+            for (const auto &e : events) got += "[" + e + "] ";
+            std::fprintf(stderr, "%s: got %s\n", what, got.empty() ? "no events" : got.c_str());
+            failures++;
+        }
+    };
+
+    // strings
+    expect("SET", [&] { store.set("s", "v"); }, {"set s"});
+    expect("INCRBY", [&] { store.incrby("n", 1); }, {"incrby n"});
+    expect("APPEND", [&] { store.append("s", "w"); }, {"append s"});
+    expect("GETSET", [&] { store.getset("s", "x"); }, {"set s"});
+    expect("CAS", [&] { store.cas("c", 0, "v"); }, {"set c"});
+    expect("GETDEL", [&] { store.getdel("c"); }, {"del c"});
+    expect("DEL", [&] { store.del("s"); }, {"del s"});
+    expect("DEL of a missing key", [&] { store.del("s"); }, {});
+
+    // hashes
+    expect("HSET new", [&] { store.hset("h", {{"a", "1"}, {"b", "2"}}); }, {"hset h"});
+    expect("HSET overwrite", [&] { store.hset("h", {{"a", "3"}}); }, {"hset h"});
+    expect("HDEL", [&] { store.hdel("h", {"a"}); }, {"hdel h"});
+    expect("HDEL of a missing field", [&] { store.hdel("h", {"zz"}); }, {});
+    expect("HDEL of the last field", [&] { store.hdel("h", {"b"}); }, {"hdel h", "del h"});
+
+    // lists
+    expect("LPUSH", [&] { store.lpush("l", {"a", "b"}); }, {"lpush l"});
+    expect("RPOP", [&] { store.rpop("l"); }, {"rpop l"});
+    expect("RPOP of the last element", [&] { store.rpop("l"); }, {"rpop l", "del l"});
+    expect("RPOP of a missing key", [&] { store.rpop("l"); }, {});
+
+    // sets
+    expect("SADD", [&] { store.sadd("set", {"a"}); }, {"sadd set"});
+    expect("SADD of a member already there", [&] { store.sadd("set", {"a"}); }, {});
+
+    // sorted sets
+    expect("ZADD", [&] { store.zadd("z", {{1, "a"}, {2, "b"}}); }, {"zadd z"});
+    expect("ZADD score update", [&] { store.zadd("z", {{5, "a"}}); }, {"zadd z"});
+    expect("ZREM", [&] { store.zrem("z", {"a"}); }, {"zrem z"});
+    expect("ZREM of a missing member", [&] { store.zrem("z", {"a"}); }, {});
+    expect("ZREM of the last member", [&] { store.zrem("z", {"b"}); }, {"zrem z", "del z"});
+
+    // expiry, noticed by the next access
+    store.set("t", "v", 1);
+    std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+    expect("expired on access", [&] { store.get("t"); }, {"expired t"});
+
+    std::printf("keyspace events: %zu failures\n", failures);
+    return failures ? 1 : 0;
+}
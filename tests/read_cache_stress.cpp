@@ -0,0 +1,122 @@
+/*
+readers and writers hammering the same keys through the lock free read
+path (ReadCache + epoch reclamation).
+
+writers overwrite and delete a small set of keys with "<key>:<generation>"
+values, generations only go up. every reader checks that what it gets is a
+well formed value of the key it asked for and that, per key, it never sees
+an older generation than it saw before: a hit must never return a value
+that was already replaced, nor memory that was freed.
+
+    ./read_cache_stress [seconds] [readers] [writers]
+*/
+#include "kvstore.hpp"
+#include "epoch.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+static constexpr size_t kKeys = 64;
+
+
+static std::string key_name(size_t k) {
+    return "key:" + std::to_string(k);
+}
+
+
+int main(int argc, char *argv[]) {
+    double seconds = argc > 1 ? std::atof(argv[1]) : 2.0;
+    size_t readers = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 6;
+    size_t writers = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 2;
+
+    KVStore store;
+    // small enough that the CLOCK eviction and its bucket rebuilds keep running
+    store.enable_read_cache(4096);
+
+    std::atomic<bool> stop{false};
+    std::atomic<uint64_t> generation{1};
+    std::atomic<size_t> failures{0};
+    std::atomic<uint64_t> reads{0}, hits{0};
+
+    auto fail = [&](const char *what, const std::string &key, const std::string &value) {
+        if (failures.fetch_add(1) < 10) {
+            std::fprintf(stderr, "%s: %s = \"%s\"\n", what, key.c_str(), value.c_str());
+        }
+    };
+
+    std::vector<std::thread> threads;
+
+    for (size_t w = 0; w < writers; w++) {
+        threads.emplace_back([&, w] {
+            uint64_t n = w;
+            while (!stop.load(std::memory_order_relaxed)) {
+                size_t k = (n++ * 7919) % kKeys;
+                std::string key = key_name(k);
+
+                // generations are handed out and written under the store lock, so they grow per key
+                store.batch([&] {
+                    if (n % 16 == 0) {
+                        store.del(key);
+                    } else {
+                        store.set(key, key + ":" + std::to_string(generation.fetch_add(1)));
+                    }
+                });
+            }
+        });
+    }
+
+    for (size_t r = 0; r < readers; r++) {
+        threads.emplace_back([&, r] {
+            std::vector<uint64_t> seen(kKeys, 0);
+            uint64_t n = r, local_reads = 0, local_hits = 0;
+
+            while (!stop.load(std::memory_order_relaxed)) {
+                size_t k = n++ % kKeys;
+                std::string key = key_name(k);
+
+                std::string value;
+                bool found = store.view(key, [&](std::string_view v) { value.assign(v); });
+                local_reads++;
+                if (!found) continue;
+                local_hits++;
+
+                size_t colon = value.rfind(':');
+                if (colon == std::string::npos || value.compare(0, colon, key) != 0) {
+                    fail("value of another key or garbage", key, value);
+                    continue;
+                }
+
+                uint64_t gen = std::strtoull(value.c_str() + colon + 1, nullptr, 10);
+                if (gen < seen[k]) {
+                    fail("older value after a newer one", key, value);
+                }
+                seen[k] = gen;
+            }
+            reads += local_reads;
+            hits += local_hits;
+        });
+    }
+
+    // what the store's cleanup thread does, so retired nodes really get freed meanwhile
+    threads.emplace_back([&] {
+        while (!stop.load(std::memory_order_relaxed)) {
+            EpochDomain::global().reclaim();
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    });
+
+    std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+    stop = true;
+    for (auto &t : threads) t.join();
+
+    std::printf("%llu reads (%llu hits), %llu writes, %zu failures\n",
+        static_cast<unsigned long long>(reads.load()),
+        static_cast<unsigned long long>(hits.load()),
+        static_cast<unsigned long long>(generation.load() - 1),
+        failures.load());
+    return failures ? 1 : 0;
+}
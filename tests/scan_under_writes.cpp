@@ -0,0 +1,133 @@
+/*
+SCAN's guarantee, checked while other threads keep writing: every key
+present for the whole scan is returned. the writers add and delete enough
+keys to grow and shrink the keyspace table under the cursor, and keep
+overwriting the keys that stay. the prefix scan over the ordered index
+(SCAN with MATCH prefix*) is checked the same way, and must also return
+its keys in order and only keys with the prefix.
+
+    ./scan_under_writes [rounds]
+*/
+#include "kvstore.hpp"
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+static constexpr int kStable = 2000;
+static constexpr int kWriters = 3;
+static constexpr int kChurn = 8000;
+
+static size_t failures = 0;
+
+
+static void fail(const char *what, const std::string &key) {
+    if (failures < 20) std::fprintf(stderr, "%s: %s\n", what, key.c_str());
+    failures++;
+}
+
+
+// user:0 .. user:1999 are never deleted, every other key comes and goes
+static void write_until(KVStore &store, std::atomic<bool> &stop, unsigned seed) {
+    std::mt19937 rng(seed);
+    std::vector<std::string> mine;
+
+    for (bool grow = true; !stop; grow = !grow) {
+        /*
+        fill up, then delete it all: the table swings between ~2k and ~26k
+        keys, so it doubles and halves a few times under every scan
+        */
+        for (int i = 0; i < kChurn && !stop; i++) {
+            if (grow) {
+                mine.push_back((i % 2 ? "user:tmp:" : "other:") + std::to_string(rng()));
+                store.set(mine.back(), "x");
+            } else if (!mine.empty()) {
+                store.del(mine.back());
+                mine.pop_back();
+            }
+
+            // the keys that stay get written too, they must not go missing for that
+            std::string key = "user:" + std::to_string(rng() % kStable);
+            if (i % 4 == 0) {
+                store.set(key, "rewritten");
+            } else if (i % 4 == 1) {
+                store.append(key, "+");
+            }
+        }
+    }
+}
+
+
+static void full_scan(KVStore &store, size_t count) {
+    std::unordered_set<std::string> seen;
+    uint64_t cursor = 0;
+
+    do {
+        std::vector<std::string> keys;
+        cursor = store.scan(cursor, count, keys);
+        seen.insert(keys.begin(), keys.end());
+    } while (cursor);
+
+    for (int i = 0; i < kStable; i++) {
+        std::string key = "user:" + std::to_string(i);
+        if (!seen.count(key)) fail("SCAN missed", key);
+    }
+}
+
+
+// pages through prefix "user:" the way SCAN 0 MATCH user:* does
+static void prefix_scan(KVStore &store, size_t count) {
+    std::unordered_set<std::string> seen;
+    std::string after;
+    bool more = true;
+
+    while (more) {
+        std::vector<std::string> keys;
+        more = store.scan_prefix("user:", after, count, keys);
+
+        for (const auto &key : keys) {
+            if (key.compare(0, 5, "user:") != 0) fail("prefix scan returned", key);
+            if (!after.empty() && key <= after) fail("prefix scan out of order", key);
+            after = key;
+            seen.insert(key);
+        }
+    }
+
+    for (int i = 0; i < kStable; i++) {
+        std::string key = "user:" + std::to_string(i);
+        if (!seen.count(key)) fail("prefix scan missed", key);
+    }
+}
+
+
+int main(int argc, char *argv[]) {
+    int rounds = argc > 1 ? std::atoi(argv[1]) : 20;
+
+    KVStore store;
+    store.enable_ordered_index();
+    for (int i = 0; i < kStable; i++) {
+        store.set("user:" + std::to_string(i), "v");
+    }
+
+    std::atomic<bool> stop{false};
+    std::vector<std::thread> writers;
+    for (int t = 0; t < kWriters; t++) {
+        writers.emplace_back(write_until, std::ref(store), std::ref(stop), 100 + t);
+    }
+
+    for (int round = 0; round < rounds; round++) {
+        // small counts mean many calls, with many writes between them
+        full_scan(store, round % 2 ? 10 : 1);
+        prefix_scan(store, round % 2 ? 10 : 1);
+    }
+
+    stop = true;
+    for (auto &t : writers) t.join();
+
+    std::printf("scan under writes: %zu failures\n", failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,154 @@
+/*
+the AOF rewrite copies the store in chunks while writes go on between
+them (begin_snapshot / read_snapshot). whatever happens in between, the
+copy has to be the store as it was when the snapshot began: every key
+once, with its old value, and none of the keys created since. this runs
+all kinds of writes between the chunks, enough of them to grow and
+shrink the table mid-snapshot.
+
+    ./snapshot_consistency
+*/
+#include "kvstore.hpp"
+#include "command_log.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+static size_t failures = 0;
+
+
+// the store as encoded lines, one entry per key
+static std::map<std::string, std::string> encode(const std::vector<KVStore::SnapshotItem> &items) {
+    std::map<std::string, std::string> lines;
+
+    for (const auto &item : items) {
+        std::string out;
+        encode_snapshot_item(item, out);
+        if (!lines.emplace(item.key, out).second) {
+            std::fprintf(stderr, "%s was handed out twice\n", item.key.c_str());
+            failures++;
+        }
+    }
+    return lines;
+}
+
+
+static void fill(KVStore &store, size_t keys) {
+    for (size_t i = 0; i < keys; i++) {
+        std::string key = "key:" + std::to_string(i);
+
+        switch (i % 6) {
+            case 0: store.set(key, "value " + std::to_string(i)); break;
+            case 1: store.set(key, std::to_string(i)); break;
+            case 2: store.hset(key, {{"a", "1"}, {"b", "2"}}); break;
+            case 3: store.lpush(key, {"x", "y"}); break;
+            case 4: store.sadd(key, {"m1", "m2"}); break;
+            case 5: store.zadd(key, {{1.5, "z1"}, {2.5, "z2"}}); break;
+        }
+    }
+}
+
+
+// one random write to one of the keys, existing or not
+static void write_something(KVStore &store, std::mt19937 &rng, size_t keys) {
+    std::string key = "key:" + std::to_string(rng() % (keys * 2));
+
+    try {
+        switch (rng() % 12) {
+            case 0: store.set(key, "changed"); break;
+            case 1: store.del(key); break;
+            case 2: store.incrby(key, 5); break;
+            case 3: store.append(key, "+"); break;
+            case 4: store.hset(key, {{"c", "3"}}); break;
+            case 5: store.hdel(key, {"a", "b", "c"}); break;
+            case 6: store.lpush(key, {"w"}); break;
+            case 7: store.rpop(key); break;
+            case 8: store.sadd(key, {"m3"}); break;
+            case 9: store.zrem(key, {"z1", "z2"}); break;
+            case 10: store.getdel(key); break;
+            case 11: store.set("new:" + std::to_string(rng()), "created"); break;
+        }
+    } catch (const std::exception &) {
+        // a write against a key of another type, nothing changed
+    }
+}
+
+
+static void check(const char *name, size_t keys, size_t chunk, size_t writes_per_chunk,
+                  void (*between)(KVStore &, std::mt19937 &, size_t)) {
+    KVStore store;
+    fill(store, keys);
+
+    std::vector<std::string> all;
+    uint64_t cursor = 0;
+    do {
+        cursor = store.scan(cursor, 100, all);
+    } while (cursor);
+
+    std::vector<KVStore::SnapshotItem> before;
+    for (const auto &key : all) {
+        if (auto item = store.snapshot_key(key)) before.push_back(std::move(*item));
+    }
+    auto expected = encode(before);
+
+    std::mt19937 rng(7);
+    std::vector<KVStore::SnapshotItem> items;
+
+    store.begin_snapshot();
+    while (store.read_snapshot(chunk, items)) {
+        for (size_t i = 0; i < writes_per_chunk; i++) between(store, rng, keys);
+    }
+
+    auto got = encode(items);
+    size_t missing = 0, changed = 0, extra = 0;
+
+    for (const auto &[key, line] : expected) {
+        auto it = got.find(key);
+        if (it == got.end()) {
+            missing++;
+        } else if (it->second != line) {
+            changed++;
+        }
+    }
+    for (const auto &[key, line] : got) {
+        if (!expected.count(key)) extra++;
+    }
+
+    if (missing || changed || extra) {
+        std::fprintf(stderr, "%s: %zu keys missing, %zu with a later value, %zu created after the start\n",
+                     name, missing, changed, extra);
+        failures++;
+    }
+
+    // the snapshot is over, writes no longer save anything
+    if (store.read_snapshot(chunk, items)) {
+        std::fprintf(stderr, "%s: the snapshot did not end\n", name);
+        failures++;
+    }
+}
+
+
+// lots of new keys: the table grows (and rehashes) while the cursor walks it
+static void grow(KVStore &store, std::mt19937 &rng, size_t) {
+    store.set("grow:" + std::to_string(rng()), "created");
+}
+
+
+// most keys go away: the table shrinks under the cursor
+static void shrink(KVStore &store, std::mt19937 &rng, size_t keys) {
+    store.del("key:" + std::to_string(rng() % keys));
+}
+
+
+int main() {
+    check("mixed writes", 5000, 16, 8, write_something);
+    check("mixed writes, one key per chunk", 500, 1, 3, write_something);
+    check("grow", 2000, 8, 64, grow);
+    check("shrink", 20000, 32, 64, shrink);
+
+    std::printf("snapshot consistency: %zu failures\n", failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,59 @@
+/*
+the version WATCH compares (KVStore::watch_version): any write to the key
+between WATCH and EXEC changes it, including a delete, a key created and
+deleted again, a key deleted and created again, and expiry. writes to other
+keys leave it alone.
+
+    ./watch_versions
+*/
+#include "kvstore.hpp"
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <thread>
+
+static size_t failures = 0;
+
+
+int main() {
+    KVStore store;
+
+    // watches `key`, runs the writes, then checks whether EXEC would abort
+    auto expect = [&](const char *what, const std::string &key, std::function<void()> writes, bool changed) {
+        uint64_t watched = store.watch_version(key);
+        writes();
+        if ((store.watch_version(key) != watched) != changed) {
+            std::fprintf(stderr, "%s: %s\n", what, changed ? "change not seen" : "seen as changed");
+            failures++;
+        }
+    };
+
+    expect("SET of a missing key", "a", [&] { store.set("a", "1"); }, true);
+    expect("overwrite", "a", [&] { store.set("a", "2"); }, true);
+    expect("DEL", "a", [&] { store.del("a"); }, true);
+    expect("created and deleted again", "a", [&] { store.set("a", "1"); store.del("a"); }, true);
+
+    store.set("b", "1");
+    expect("deleted and created again", "b", [&] { store.del("b"); store.set("b", "1"); }, true);
+    expect("INCRBY", "n", [&] { store.incrby("n", 1); store.incrby("n", -1); }, true);
+    expect("HSET then HDEL of the last field", "h", [&] { store.hset("h", {{"f", "v"}}); store.hdel("h", {"f"}); }, true);
+
+    // writes elsewhere, reads and deletes of missing keys are not changes
+    expect("writes to another key", "b", [&] { store.set("other", "x"); store.del("other"); store.set("other", "y"); }, false);
+    expect("reads", "b", [&] { store.get("b"); store.version("b"); }, false);
+    expect("DEL of a missing key", "gone", [&] { store.del("gone"); }, false);
+
+    // expiry counts too, noticed by the next access or not
+    store.set("t", "v", 1);
+    expect("expiry", "t", [&] { std::this_thread::sleep_for(std::chrono::milliseconds(1100)); }, true);
+    store.set("t", "v", 1);
+    expect("expiry and a new SET", "t", [&] {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+        store.get("t");
+        store.set("t", "v");
+    }, true);
+
+    std::printf("watch versions: %zu failures\n", failures);
+    return failures ? 1 : 0;
+}